@@ -0,0 +1,566 @@
+#include <ctype.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "aead.h"
+
+#define ROTL32(v, n) ((v) << (n) | (v) >> (32 - (n)))
+
+static uint32_t load32(const unsigned char *p)
+{
+    return (uint32_t)p[0] | (uint32_t)p[1] << 8 | (uint32_t)p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+static void store32(unsigned char *p, uint32_t v)
+{
+    p[0] = (unsigned char)v;
+    p[1] = (unsigned char)(v >> 8);
+    p[2] = (unsigned char)(v >> 16);
+    p[3] = (unsigned char)(v >> 24);
+}
+
+static void store64(unsigned char *p, uint64_t v)
+{
+    store32(p, (uint32_t)v);
+    store32(p + 4, (uint32_t)(v >> 32));
+}
+
+#define QUARTER_ROUND(x, a, b, c, d)                  \
+    do                                                \
+    {                                                 \
+        x[a] += x[b], x[d] = ROTL32(x[d] ^ x[a], 16); \
+        x[c] += x[d], x[b] = ROTL32(x[b] ^ x[c], 12); \
+        x[a] += x[b], x[d] = ROTL32(x[d] ^ x[a], 8);  \
+        x[c] += x[d], x[b] = ROTL32(x[b] ^ x[c], 7);  \
+    } while (0)
+
+/* The next 64 bytes of keystream, the block counter moves on by one */
+static void chacha_block(AeadChaCha *chacha)
+{
+    uint32_t x[16];
+
+    memcpy(x, chacha->state, sizeof(x));
+    for (int i = 0; i < 10; i++)
+    {
+        QUARTER_ROUND(x, 0, 4, 8, 12);
+        QUARTER_ROUND(x, 1, 5, 9, 13);
+        QUARTER_ROUND(x, 2, 6, 10, 14);
+        QUARTER_ROUND(x, 3, 7, 11, 15);
+        QUARTER_ROUND(x, 0, 5, 10, 15);
+        QUARTER_ROUND(x, 1, 6, 11, 12);
+        QUARTER_ROUND(x, 2, 7, 8, 13);
+        QUARTER_ROUND(x, 3, 4, 9, 14);
+    }
+    for (int i = 0; i < 16; i++)
+    {
+        store32(chacha->block + 4 * i, x[i] + chacha->state[i]);
+    }
+    chacha->state[12]++;
+    chacha->used = 0;
+}
+
+static void chacha_init(AeadChaCha *chacha, const unsigned char *key, const unsigned char *nonce, uint32_t counter)
+{
+    static const unsigned char sigma[16] = "expand 32-byte k";
+
+    for (int i = 0; i < 4; i++)
+    {
+        chacha->state[i] = load32(sigma + 4 * i);
+    }
+    for (int i = 0; i < 8; i++)
+    {
+        chacha->state[4 + i] = load32(key + 4 * i);
+    }
+    chacha->state[12] = counter;
+    for (int i = 0; i < 3; i++)
+    {
+        chacha->state[13 + i] = load32(nonce + 4 * i);
+    }
+    chacha->used = sizeof(chacha->block); // No keystream until the first byte is needed
+}
+
+/* XOR n bytes with the keystream, in place */
+static void chacha_xor(AeadChaCha *chacha, unsigned char *p, size_t n)
+{
+    while (n > 0)
+    {
+        if (chacha->used == sizeof(chacha->block))
+        {
+            chacha_block(chacha);
+        }
+        size_t take = sizeof(chacha->block) - chacha->used < n ? sizeof(chacha->block) - chacha->used : n;
+        for (size_t i = 0; i < take; i++)
+        {
+            p[i] ^= chacha->block[chacha->used + i];
+        }
+        chacha->used += take;
+        p += take;
+        n -= take;
+    }
+}
+
+/* Poly1305 with the key r | s in 26-bit limbs */
+static void poly_init(AeadPoly *poly, const unsigned char *key)
+{
+    poly->r[0] = load32(key) & 0x3FFFFFF;
+    poly->r[1] = (load32(key + 3) >> 2) & 0x3FFFF03;
+    poly->r[2] = (load32(key + 6) >> 4) & 0x3FFC0FF;
+    poly->r[3] = (load32(key + 9) >> 6) & 0x3F03FFF;
+    poly->r[4] = (load32(key + 12) >> 8) & 0x00FFFFF;
+    memset(poly->h, 0, sizeof(poly->h));
+    for (int i = 0; i < 4; i++)
+    {
+        poly->pad[i] = load32(key + 16 + 4 * i);
+    }
+    poly->have = 0;
+}
+
+/* h = (h + m) * r mod 2^130 - 5 for one 16-byte block m */
+static void poly_block(AeadPoly *poly, const unsigned char *m)
+{
+    const uint32_t *r = poly->r;
+    uint32_t *h = poly->h;
+    uint32_t s1 = r[1] * 5, s2 = r[2] * 5, s3 = r[3] * 5, s4 = r[4] * 5;
+
+    h[0] += load32(m) & 0x3FFFFFF;
+    h[1] += (load32(m + 3) >> 2) & 0x3FFFFFF;
+    h[2] += (load32(m + 6) >> 4) & 0x3FFFFFF;
+    h[3] += (load32(m + 9) >> 6) & 0x3FFFFFF;
+    h[4] += (load32(m + 12) >> 8) | 1u << 24;
+
+    uint64_t d0 = (uint64_t)h[0] * r[0] + (uint64_t)h[1] * s4 + (uint64_t)h[2] * s3 + (uint64_t)h[3] * s2 + (uint64_t)h[4] * s1;
+    uint64_t d1 = (uint64_t)h[0] * r[1] + (uint64_t)h[1] * r[0] + (uint64_t)h[2] * s4 + (uint64_t)h[3] * s3 + (uint64_t)h[4] * s2;
+    uint64_t d2 = (uint64_t)h[0] * r[2] + (uint64_t)h[1] * r[1] + (uint64_t)h[2] * r[0] + (uint64_t)h[3] * s4 + (uint64_t)h[4] * s3;
+    uint64_t d3 = (uint64_t)h[0] * r[3] + (uint64_t)h[1] * r[2] + (uint64_t)h[2] * r[1] + (uint64_t)h[3] * r[0] + (uint64_t)h[4] * s4;
+    uint64_t d4 = (uint64_t)h[0] * r[4] + (uint64_t)h[1] * r[3] + (uint64_t)h[2] * r[2] + (uint64_t)h[3] * r[1] + (uint64_t)h[4] * r[0];
+
+    d1 += d0 >> 26;
+    d2 += d1 >> 26;
+    d3 += d2 >> 26;
+    d4 += d3 >> 26;
+    h[0] = (uint32_t)d0 & 0x3FFFFFF;
+    h[1] = (uint32_t)d1 & 0x3FFFFFF;
+    h[2] = (uint32_t)d2 & 0x3FFFFFF;
+    h[3] = (uint32_t)d3 & 0x3FFFFFF;
+    h[4] = (uint32_t)d4 & 0x3FFFFFF;
+    h[0] += (uint32_t)(d4 >> 26) * 5;
+    h[1] += h[0] >> 26;
+    h[0] &= 0x3FFFFFF;
+}
+
+static void poly_update(AeadPoly *poly, const unsigned char *p, size_t n)
+{
+    if (poly->have > 0)
+    {
+        size_t take = 16 - poly->have < n ? 16 - poly->have : n;
+        memcpy(poly->buf + poly->have, p, take);
+        poly->have += take;
+        p += take;
+        n -= take;
+        if (poly->have < 16)
+        {
+            return;
+        }
+        poly_block(poly, poly->buf);
+        poly->have = 0;
+    }
+    for (; n >= 16; n -= 16, p += 16)
+    {
+        poly_block(poly, p);
+    }
+    memcpy(poly->buf, p, n);
+    poly->have = n;
+}
+
+/* Zero padding up to the next 16-byte boundary, as the AEAD construction puts after the AAD and the ciphertext */
+static void poly_pad(AeadPoly *poly)
+{
+    if (poly->have > 0)
+    {
+        memset(poly->buf + poly->have, 0, 16 - poly->have);
+        poly_block(poly, poly->buf);
+        poly->have = 0;
+    }
+}
+
+/* The tag, (h mod 2^130 - 5) + s, of a message that ended on a block boundary */
+static void poly_finish(AeadPoly *poly, unsigned char *tag)
+{
+    uint32_t *h = poly->h, g[5], c;
+
+    c = h[1] >> 26, h[1] &= 0x3FFFFFF, h[2] += c;
+    c = h[2] >> 26, h[2] &= 0x3FFFFFF, h[3] += c;
+    c = h[3] >> 26, h[3] &= 0x3FFFFFF, h[4] += c;
+    c = h[4] >> 26, h[4] &= 0x3FFFFFF, h[0] += c * 5;
+    c = h[0] >> 26, h[0] &= 0x3FFFFFF, h[1] += c;
+
+    // g = h - p, taken instead of h when it does not go negative
+    g[0] = h[0] + 5, c = g[0] >> 26, g[0] &= 0x3FFFFFF;
+    g[1] = h[1] + c, c = g[1] >> 26, g[1] &= 0x3FFFFFF;
+    g[2] = h[2] + c, c = g[2] >> 26, g[2] &= 0x3FFFFFF;
+    g[3] = h[3] + c, c = g[3] >> 26, g[3] &= 0x3FFFFFF;
+    g[4] = h[4] + c - (1u << 26);
+    uint32_t mask = (g[4] >> 31) - 1;
+    for (int i = 0; i < 5; i++)
+    {
+        h[i] = (h[i] & ~mask) | (g[i] & mask);
+    }
+
+    uint32_t w[4] = {h[0] | h[1] << 26, h[1] >> 6 | h[2] << 20, h[2] >> 12 | h[3] << 14, h[3] >> 18 | h[4] << 8};
+    uint64_t f = 0;
+    for (int i = 0; i < 4; i++)
+    {
+        f = (uint64_t)w[i] + poly->pad[i] + (f >> 32);
+        store32(tag + 4 * i, (uint32_t)f);
+    }
+}
+
+/* Keystream and MAC of one message: the MAC key is block 0, the data is encrypted from block 1 on */
+static void message_begin(AeadChaCha *chacha, AeadPoly *poly, const unsigned char *key, const unsigned char *nonce,
+                          const unsigned char *aad, size_t aad_len)
+{
+    chacha_init(chacha, key, nonce, 0);
+    chacha_block(chacha);
+    poly_init(poly, chacha->block);
+    chacha->used = sizeof(chacha->block); // The rest of block 0 is not used
+    poly_update(poly, aad, aad_len);
+    poly_pad(poly);
+}
+
+static void message_tag(AeadPoly *poly, size_t aad_len, uint64_t n, unsigned char *tag)
+{
+    unsigned char lengths[16];
+
+    poly_pad(poly);
+    store64(lengths, aad_len);
+    store64(lengths + 8, n);
+    poly_update(poly, lengths, sizeof(lengths));
+    poly_finish(poly, tag);
+}
+
+/* Tags compared in constant time */
+static int tags_equal(const unsigned char *a, const unsigned char *b)
+{
+    unsigned char diff = 0;
+    for (int i = 0; i < AEAD_TAG_SIZE; i++)
+    {
+        diff |= a[i] ^ b[i];
+    }
+    return diff == 0;
+}
+
+void aead_seal(const unsigned char *key, const unsigned char *nonce, const unsigned char *aad, size_t aad_len,
+               const char *in, size_t n, char *out, unsigned char *tag)
+{
+    AeadChaCha chacha;
+    AeadPoly poly;
+
+    message_begin(&chacha, &poly, key, nonce, aad, aad_len);
+    memmove(out, in, n);
+    chacha_xor(&chacha, (unsigned char *)out, n);
+    poly_update(&poly, (const unsigned char *)out, n);
+    message_tag(&poly, aad_len, n, tag);
+}
+
+Status aead_open(const unsigned char *key, const unsigned char *nonce, const unsigned char *aad, size_t aad_len,
+                 const char *in, size_t n, char *out, const unsigned char *tag)
+{
+    AeadChaCha chacha;
+    AeadPoly poly;
+    unsigned char expected[AEAD_TAG_SIZE];
+
+    message_begin(&chacha, &poly, key, nonce, aad, aad_len);
+    poly_update(&poly, (const unsigned char *)in, n);
+    message_tag(&poly, aad_len, n, expected);
+    if (!tags_equal(expected, tag))
+    {
+        return e_failure;
+    }
+    memmove(out, in, n);
+    chacha_xor(&chacha, (unsigned char *)out, n);
+    return e_success;
+}
+
+uint64_t aead_sealed_size(uint64_t plain_size)
+{
+    uint64_t segments = plain_size == 0 ? 1 : (plain_size - 1) / AEAD_SEGMENT_SIZE + 1;
+    return AEAD_NONCE_SIZE + plain_size + segments * AEAD_TAG_SIZE;
+}
+
+Status aead_plain_size(uint64_t sealed_size, uint64_t *plain_size)
+{
+    if (sealed_size < AEAD_NONCE_SIZE + AEAD_TAG_SIZE)
+    {
+        return e_failure;
+    }
+    uint64_t body = sealed_size - AEAD_NONCE_SIZE;
+    uint64_t segments = (body - 1) / (AEAD_SEGMENT_SIZE + AEAD_TAG_SIZE) + 1;
+    if (body < segments * AEAD_TAG_SIZE)
+    {
+        return e_failure;
+    }
+    *plain_size = body - segments * AEAD_TAG_SIZE;
+    return aead_sealed_size(*plain_size) == sealed_size ? e_success : e_failure;
+}
+
+/* Nonce of the current segment and its AAD byte, then the keystream and MAC under them */
+static void segment_begin(AeadStream *stream)
+{
+    unsigned char nonce[AEAD_NONCE_SIZE];
+    uint64_t counter = stream->segment;
+    unsigned carry = 0;
+
+    memcpy(nonce, stream->nonce, sizeof(nonce));
+    for (int i = AEAD_NONCE_SIZE - 1; i >= AEAD_NONCE_SIZE - 8; i--, counter >>= 8)
+    {
+        unsigned sum = nonce[i] + (unsigned)(counter & 0xFF) + carry; // Big endian addition
+        nonce[i] = (unsigned char)sum;
+        carry = sum >> 8;
+    }
+    stream->body_size = stream->plain_left < AEAD_SEGMENT_SIZE ? (size_t)stream->plain_left : AEAD_SEGMENT_SIZE;
+    stream->plain_left -= stream->body_size;
+    stream->last = stream->plain_left == 0;
+    stream->body_done = 0;
+    stream->tag_done = 0;
+    stream->in_segment = 1;
+
+    unsigned char aad = (unsigned char)stream->last;
+    message_begin(&stream->chacha, &stream->poly, stream->key, nonce, &aad, 1);
+}
+
+/* The tag of the current segment is through: move on to the next one */
+static void segment_end(AeadStream *stream)
+{
+    stream->in_segment = 0;
+    stream->done = stream->last;
+    stream->segment++;
+}
+
+static void stream_init(AeadStream *stream, const unsigned char *key, uint64_t plain_size)
+{
+    memset(stream, 0, sizeof(*stream));
+    memcpy(stream->key, key, AEAD_KEY_SIZE);
+    stream->plain_left = plain_size;
+}
+
+void aead_seal_init(AeadStream *stream, const unsigned char *key, const unsigned char *nonce, uint64_t plain_size)
+{
+    stream_init(stream, key, plain_size);
+    memcpy(stream->nonce, nonce, AEAD_NONCE_SIZE);
+}
+
+/*
+ * Function: aead_seal_read
+ * --------------------------
+ * Writes the next n bytes of the sealed payload to out: nonce, ciphertext
+ * and tags in turn. Plaintext is pulled from source straight into out and
+ * encrypted there, a tag is computed when the last byte of its segment
+ * went out.
+ *
+ * Returns:
+ * -----------
+ *   - Status: e_success, or e_failure if the source fails or n runs past
+ *             the end of the sealed payload.
+ */
+Status aead_seal_read(AeadStream *stream, char *out, size_t n, aead_source_fn source, void *ctx)
+{
+    while (n > 0)
+    {
+        size_t take;
+        if (stream->done)
+        {
+            return e_failure;
+        }
+        if (stream->nonce_done < AEAD_NONCE_SIZE)
+        {
+            take = AEAD_NONCE_SIZE - stream->nonce_done < n ? AEAD_NONCE_SIZE - stream->nonce_done : n;
+            memcpy(out, stream->nonce + stream->nonce_done, take);
+            stream->nonce_done += take;
+        }
+        else if (!stream->in_segment)
+        {
+            segment_begin(stream);
+            continue;
+        }
+        else if (stream->body_done < stream->body_size)
+        {
+            take = stream->body_size - stream->body_done < n ? stream->body_size - stream->body_done : n;
+            if (source(ctx, out, take) == e_failure)
+            {
+                return e_failure;
+            }
+            chacha_xor(&stream->chacha, (unsigned char *)out, take);
+            poly_update(&stream->poly, (const unsigned char *)out, take);
+            stream->body_done += take;
+            if (stream->body_done == stream->body_size)
+            {
+                message_tag(&stream->poly, 1, stream->body_size, stream->tag);
+            }
+        }
+        else
+        {
+            if (stream->body_size == 0 && stream->tag_done == 0)
+            {
+                message_tag(&stream->poly, 1, 0, stream->tag); // Empty secret, the tag covers the AAD only
+            }
+            take = AEAD_TAG_SIZE - stream->tag_done < n ? AEAD_TAG_SIZE - stream->tag_done : n;
+            memcpy(out, stream->tag + stream->tag_done, take);
+            stream->tag_done += take;
+            if (stream->tag_done == AEAD_TAG_SIZE)
+            {
+                segment_end(stream);
+            }
+        }
+        out += take;
+        n -= take;
+    }
+    return e_success;
+}
+
+void aead_open_init(AeadStream *stream, const unsigned char *key, uint64_t plain_size, char *segment_buf, aead_sink_fn sink, void *ctx)
+{
+    stream_init(stream, key, plain_size);
+    stream->segment_buf = segment_buf;
+    stream->sink = sink;
+    stream->ctx = ctx;
+}
+
+/*
+ * Function: aead_open_feed
+ * --------------------------
+ * Collects the next n bytes of the sealed payload. Ciphertext is kept in
+ * the segment buffer and run through the MAC as it comes, and once the
+ * tag of the segment is in and matches, the segment is decrypted in place
+ * and passed to the sink.
+ *
+ * Returns:
+ * -----------
+ *   - Status: e_success, or e_failure on a tag mismatch, data past the
+ *             last tag, or when the sink fails.
+ */
+Status aead_open_feed(AeadStream *stream, const char *data, size_t n)
+{
+    while (n > 0)
+    {
+        size_t take;
+        if (stream->done)
+        {
+            return e_failure;
+        }
+        if (stream->nonce_done < AEAD_NONCE_SIZE)
+        {
+            take = AEAD_NONCE_SIZE - stream->nonce_done < n ? AEAD_NONCE_SIZE - stream->nonce_done : n;
+            memcpy(stream->nonce + stream->nonce_done, data, take);
+            stream->nonce_done += take;
+        }
+        else if (!stream->in_segment)
+        {
+            segment_begin(stream);
+            continue;
+        }
+        else if (stream->body_done < stream->body_size)
+        {
+            take = stream->body_size - stream->body_done < n ? stream->body_size - stream->body_done : n;
+            memcpy(stream->segment_buf + stream->body_done, data, take);
+            poly_update(&stream->poly, (const unsigned char *)data, take);
+            stream->body_done += take;
+        }
+        else
+        {
+            take = AEAD_TAG_SIZE - stream->tag_done < n ? AEAD_TAG_SIZE - stream->tag_done : n;
+            memcpy(stream->tag + stream->tag_done, data, take);
+            stream->tag_done += take;
+            if (stream->tag_done == AEAD_TAG_SIZE)
+            {
+                unsigned char expected[AEAD_TAG_SIZE];
+                message_tag(&stream->poly, 1, stream->body_size, expected);
+                if (!tags_equal(expected, stream->tag))
+                {
+                    stream->forged = 1;
+                    return e_failure;
+                }
+                chacha_xor(&stream->chacha, (unsigned char *)stream->segment_buf, stream->body_size);
+                if (stream->sink(stream->ctx, stream->segment_buf, stream->body_size) == e_failure)
+                {
+                    return e_failure;
+                }
+                segment_end(stream);
+            }
+        }
+        data += take;
+        n -= take;
+    }
+    return e_success;
+}
+
+Status aead_open_finish(const AeadStream *stream)
+{
+    return stream->done ? e_success : e_failure;
+}
+
+static int hex_value(int c)
+{
+    return isdigit(c) ? c - '0' : tolower(c) - 'a' + 10;
+}
+
+/* 64 hex digits, optionally followed by white space */
+static Status parse_hex_key(const char *text, size_t n, unsigned char *key)
+{
+    while (n > 0 && isspace((unsigned char)text[n - 1]))
+    {
+        n--;
+    }
+    if (n != AEAD_KEY_SIZE * 2)
+    {
+        return e_failure;
+    }
+    for (size_t i = 0; i < n; i++)
+    {
+        if (!isxdigit((unsigned char)text[i]))
+        {
+            return e_failure;
+        }
+    }
+    for (size_t i = 0; i < AEAD_KEY_SIZE; i++)
+    {
+        key[i] = (unsigned char)(hex_value((unsigned char)text[2 * i]) << 4 | hex_value((unsigned char)text[2 * i + 1]));
+    }
+    return e_success;
+}
+
+Status aead_read_key(const char *key_file, unsigned char *key)
+{
+    char text[AEAD_KEY_SIZE * 2 + 3];
+    size_t n;
+
+    if (key_file == NULL)
+    {
+        const char *env = getenv(AEAD_KEY_ENV);
+        return env != NULL ? parse_hex_key(env, strlen(env), key) : e_failure;
+    }
+    FILE *fptr = fopen(key_file, "r");
+    if (fptr == NULL)
+    {
+        return e_failure;
+    }
+    n = fread(text, 1, sizeof(text), fptr);
+    fclose(fptr);
+    if (n == AEAD_KEY_SIZE) // Raw key bytes
+    {
+        memcpy(key, text, AEAD_KEY_SIZE);
+        return e_success;
+    }
+    return parse_hex_key(text, n, key);
+}
+
+Status aead_random_nonce(unsigned char *nonce)
+{
+    FILE *fptr = fopen("/dev/urandom", "r");
+    if (fptr == NULL)
+    {
+        return e_failure;
+    }
+    size_t n = fread(nonce, 1, AEAD_NONCE_SIZE, fptr);
+    fclose(fptr);
+    return n == AEAD_NONCE_SIZE ? e_success : e_failure;
+}
@@ -0,0 +1,115 @@
+#ifndef AEAD_H
+#define AEAD_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "types.h"
+
+/*
+ * Payload encryption (--encrypt)
+ * ------------------------------
+ * ChaCha20-Poly1305 (RFC 8439) over the secret in segments of
+ * AEAD_SEGMENT_SIZE bytes, so an encoder seals and a decoder opens the
+ * payload as it streams through the embed and extract pipelines. The
+ * sealed payload is
+ *
+ *   nonce (12) | segment 0 | tag 0 (16) | segment 1 | tag 1 | ...
+ *
+ * Every segment holds AEAD_SEGMENT_SIZE bytes of ciphertext but the last,
+ * which may be shorter (or empty, for an empty secret). Segment i is
+ * sealed under the nonce with i added into its last 8 bytes, and its
+ * associated data is one byte, 1 for the last segment and 0 for the
+ * others, so reordered, dropped or truncated segments fail to open.
+ * Plaintext is only passed on once the tag of its segment matched.
+ *
+ * The sealed size is a function of the secret's size (aead_sealed_size),
+ * which is how an encoder knows the payload size before it reads the
+ * secret. Nothing here allocates and, apart from aead_read_key and
+ * aead_random_nonce, nothing does I/O.
+ */
+
+#define AEAD_KEY_SIZE 32
+#define AEAD_NONCE_SIZE 12
+#define AEAD_TAG_SIZE 16
+#define AEAD_SEGMENT_SIZE (64 * 1024) // Plaintext bytes per segment
+#define AEAD_KEY_ENV "LSB_STEG_AEAD_KEY" // Environment variable holding the key as 64 hex digits
+
+/* Running ChaCha20 keystream */
+typedef struct
+{
+    uint32_t state[16];
+    unsigned char block[64]; // Keystream block being used
+    size_t used;             // Bytes of block already used
+} AeadChaCha;
+
+/* Running Poly1305 MAC */
+typedef struct
+{
+    uint32_t r[5], h[5], pad[4];
+    unsigned char buf[16]; // Bytes of an incomplete block
+    size_t have;
+} AeadPoly;
+
+/* Source of the plaintext for aead_seal_read, fails when it cannot deliver exactly n bytes */
+typedef Status (*aead_source_fn)(void *ctx, char *data, size_t n);
+
+/* Receives the authenticated plaintext of aead_open_feed */
+typedef Status (*aead_sink_fn)(void *ctx, const char *data, size_t n);
+
+/* Sealing or opening state of one payload */
+typedef struct _AeadStream
+{
+    unsigned char key[AEAD_KEY_SIZE];
+    unsigned char nonce[AEAD_NONCE_SIZE];
+    size_t nonce_done;      // Nonce bytes handed out or collected
+    uint64_t plain_left;    // Plaintext bytes of the segments not started yet
+    uint64_t segment;       // Index of the current segment
+    size_t body_size;       // Ciphertext bytes of the current segment
+    size_t body_done;       // of which were handed out or collected
+    size_t tag_done;        // Tag bytes of the current segment handed out or collected
+    int in_segment;         // A segment is open: keystream and MAC are set up
+    int last;               // The current segment is the last one
+    int done;               // The last tag is through
+    int forged;             // Opening only: a tag did not match
+    unsigned char tag[AEAD_TAG_SIZE];
+    AeadChaCha chacha;
+    AeadPoly poly;
+    char *segment_buf;      // Opening only: AEAD_SEGMENT_SIZE bytes of ciphertext, decrypted once its tag matched
+    aead_sink_fn sink;
+    void *ctx;
+} AeadStream;
+
+/* Embedded size of a secret of plain_size bytes */
+uint64_t aead_sealed_size(uint64_t plain_size);
+
+/* Size of the secret inside a sealed payload, e_failure if no secret seals to sealed_size bytes */
+Status aead_plain_size(uint64_t sealed_size, uint64_t *plain_size);
+
+/* Start sealing plain_size bytes under key and nonce */
+void aead_seal_init(AeadStream *stream, const unsigned char *key, const unsigned char *nonce, uint64_t plain_size);
+
+/* Produce the next n bytes of the sealed payload, pulling the plaintext they need from source */
+Status aead_seal_read(AeadStream *stream, char *out, size_t n, aead_source_fn source, void *ctx);
+
+/* Start opening a payload that seals plain_size bytes, over a caller buffer of AEAD_SEGMENT_SIZE bytes */
+void aead_open_init(AeadStream *stream, const unsigned char *key, uint64_t plain_size, char *segment_buf, aead_sink_fn sink, void *ctx);
+
+/* Open the next n bytes of the sealed payload, e_failure if a tag does not match or the sink fails */
+Status aead_open_feed(AeadStream *stream, const char *data, size_t n);
+
+/* End of the sealed payload, e_failure if it stopped before its last tag */
+Status aead_open_finish(const AeadStream *stream);
+
+/* Read a key from key_file (32 bytes, or 64 hex digits) or, when key_file is NULL, from AEAD_KEY_ENV */
+Status aead_read_key(const char *key_file, unsigned char *key);
+
+/* Fill nonce with AEAD_NONCE_SIZE random bytes */
+Status aead_random_nonce(unsigned char *nonce);
+
+/* Seal or open one message in memory: RFC 8439 AEAD_CHACHA20_POLY1305 */
+void aead_seal(const unsigned char *key, const unsigned char *nonce, const unsigned char *aad, size_t aad_len,
+               const char *in, size_t n, char *out, unsigned char *tag);
+Status aead_open(const unsigned char *key, const unsigned char *nonce, const unsigned char *aad, size_t aad_len,
+                 const char *in, size_t n, char *out, const unsigned char *tag);
+
+#endif
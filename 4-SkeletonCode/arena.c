@@ -0,0 +1,40 @@
+#include "arena.h"
+
+void arena_init(Arena *arena, char *mem, size_t size)
+{
+    arena->base = mem;
+    arena->size = size;
+    arena->used = 0;
+    arena->kept = 0;
+}
+
+/*
+ * Function: arena_alloc
+ * -----------------------
+ * Returns the next n bytes of the arena, rounded up to ARENA_ALIGN.
+ *
+ * Returns:
+ * -----------
+ *   - void *: The allocation, or NULL if fewer than n bytes are left.
+ */
+void *arena_alloc(Arena *arena, size_t n)
+{
+    size_t rounded = ARENA_ROUND(n);
+    if (rounded < n || arena->size - arena->used < rounded)
+    {
+        return NULL;
+    }
+    void *p = arena->base + arena->used;
+    arena->used += rounded;
+    return p;
+}
+
+void arena_keep(Arena *arena)
+{
+    arena->kept = arena->used;
+}
+
+void arena_reset(Arena *arena)
+{
+    arena->used = arena->kept;
+}
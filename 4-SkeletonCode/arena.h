@@ -0,0 +1,38 @@
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <stddef.h>
+
+/*
+ * Bump allocator over caller supplied memory
+ * ------------------------------------------
+ * An encode or decode context carves its block buffers out of an arena
+ * once, marks them as kept, and hands out per-job allocations (file names)
+ * that arena_reset() drops again. Nothing is ever malloc()ed, so the
+ * footprint of a context is the size of its arena, fixed at init time.
+ */
+
+#define ARENA_ALIGN 16 // Every allocation starts on this boundary
+#define ARENA_ROUND(n) (((n) + ARENA_ALIGN - 1) / ARENA_ALIGN * ARENA_ALIGN)
+
+typedef struct _Arena
+{
+    char *base;
+    size_t size;
+    size_t used;
+    size_t kept; // arena_reset() goes back to here
+} Arena;
+
+/* Use size bytes at mem (aligned to ARENA_ALIGN) as the arena */
+void arena_init(Arena *arena, char *mem, size_t size);
+
+/* n bytes from the arena, NULL if it is exhausted */
+void *arena_alloc(Arena *arena, size_t n);
+
+/* Keep everything allocated so far across arena_reset() */
+void arena_keep(Arena *arena);
+
+/* Drop every allocation made since arena_keep() */
+void arena_reset(Arena *arena);
+
+#endif
@@ -0,0 +1,328 @@
+#include <stdio.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "batch.h"
+#include "common.h"
+#include "decode.h"
+#include "encode.h"
+#include "parallel.h"
+
+/*
+ * Function: parse_job
+ * ---------------------
+ * Splits a manifest line into an argument vector for
+ * read_and_validate_encode_args / read_and_validate_decode_args.
+ *
+ * Returns:
+ * -----------
+ *   - int: 1 if the line holds a job, 0 for blank and comment lines,
+ *          -1 if the line is malformed.
+ */
+static int parse_job(BatchJob *job)
+{
+    char *save = NULL;
+    char *op = strtok_r(job->line, " \t\r\n", &save);
+
+    if (op == NULL || op[0] == '#')
+    {
+        return 0;
+    }
+    if (strcmp(op, "e") == 0 || strcmp(op, "-e") == 0)
+    {
+        job->argv[1] = "-e";
+    }
+    else if (strcmp(op, "d") == 0 || strcmp(op, "-d") == 0)
+    {
+        job->argv[1] = "-d";
+    }
+    else
+    {
+        return -1;
+    }
+
+    job->argv[0] = "lsb_steg";
+    job->argc = 2;
+    char *tok;
+    while ((tok = strtok_r(NULL, " \t\r\n", &save)) != NULL)
+    {
+        if (job->argc == BATCH_MAX_ARGS + 2)
+        {
+            return -1;
+        }
+        job->argv[job->argc++] = tok;
+    }
+    return 1;
+}
+
+/*
+ * Function: batch_read_manifest
+ * -------------------------------
+ * Reads every job of the manifest into an array.
+ *
+ * Returns:
+ * -----------
+ *   - Status: e_success with *jobs / *njobs filled in,
+ *             e_failure on a malformed line or allocation failure.
+ */
+Status batch_read_manifest(FILE *fptr, BatchJob **jobs, size_t *njobs)
+{
+    char *line = NULL;
+    size_t line_cap = 0, cap = 0;
+    int lineno = 0;
+
+    *jobs = NULL;
+    *njobs = 0;
+    while (getline(&line, &line_cap, fptr) != -1)
+    {
+        lineno++;
+        if (*njobs == cap)
+        {
+            cap = cap ? cap * 2 : 64;
+            BatchJob *grown = realloc(*jobs, cap * sizeof(**jobs));
+            if (grown == NULL)
+            {
+                printf("ERROR: Unable to allocate the batch job list\n");
+                free(line);
+                return e_failure;
+            }
+            *jobs = grown;
+        }
+
+        BatchJob *job = &(*jobs)[*njobs];
+        job->line = strdup(line);
+        job->lineno = lineno;
+        job->status = e_failure;
+        int kind = job->line ? parse_job(job) : -1;
+        if (kind < 0)
+        {
+            printf("ERROR: Invalid manifest line %d: %s", lineno, line);
+            free(job->line);
+            free(line);
+            return e_failure;
+        }
+        if (kind == 0)
+        {
+            free(job->line);
+            continue;
+        }
+        (*njobs)++;
+    }
+    free(line);
+    return e_success;
+}
+
+void batch_free_jobs(BatchJob *jobs, size_t njobs)
+{
+    for (size_t i = 0; i < njobs; i++)
+    {
+        free(jobs[i].line);
+    }
+    free(jobs);
+}
+
+/*
+ * Function: batch_worker_init
+ * -----------------------------
+ * Allocates the encoder and decoder arenas of one worker in one block and
+ * sets up its EncodeInfo and DecodeInfo over them. Called once per worker
+ * thread, the contexts are then reused for all of its jobs.
+ *
+ * Returns:
+ * -----------
+ *   - Status: e_success, or e_failure if the arenas cannot be allocated.
+ */
+Status batch_worker_init(BatchWorker *worker)
+{
+    size_t encode_size = ENCODE_ARENA_SIZE(MAX_SECRET_BUF_SIZE);
+    size_t decode_size = DECODE_ARENA_SIZE(MAX_DECODE_BUF_SIZE);
+
+    worker->arena = aligned_alloc(ARENA_ALIGN, encode_size + decode_size); // Both sizes are multiples of ARENA_ALIGN
+    if (worker->arena == NULL)
+    {
+        printf("ERROR: Unable to allocate the worker buffers\n");
+        return e_failure;
+    }
+    if (encode_info_init(&worker->encInfo, worker->arena, encode_size, MAX_SECRET_BUF_SIZE) == e_failure ||
+        decode_info_init(&worker->decInfo, worker->arena + encode_size, decode_size, MAX_DECODE_BUF_SIZE) == e_failure)
+    {
+        batch_worker_free(worker);
+        return e_failure;
+    }
+    return e_success;
+}
+
+void batch_worker_free(BatchWorker *worker)
+{
+    free(worker->arena);
+    worker->arena = NULL;
+}
+
+/* Jobs of a manifest, claimed one at a time by the pool threads */
+typedef struct
+{
+    BatchJob *jobs;
+    size_t njobs;
+    _Atomic size_t next; // First job not claimed yet
+} BatchQueue;
+
+/*
+ * Function: run_job
+ * -------------------
+ * Runs one job on a worker's contexts. read_and_validate_encode_args and
+ * read_and_validate_decode_args reset them for every job. Jobs cannot use
+ * stdin or stdout, which every pool thread would share.
+ */
+static Status run_job(BatchWorker *worker, BatchJob *job)
+{
+    Status status = e_failure;
+
+    for (int i = 2; i < job->argc; i++)
+    {
+        if (strcmp(job->argv[i], "-") == 0)
+        {
+            printf("ERROR: Batch jobs need named files, they cannot use stdin/stdout\n");
+            return e_failure;
+        }
+    }
+    if (check_operation_type(job->argv[1]) == e_encode)
+    {
+        if (read_and_validate_encode_args(job->argc, job->argv, &worker->encInfo) == e_success)
+        {
+            status = do_encoding(&worker->encInfo);
+        }
+        close_files(&worker->encInfo);
+    }
+    else
+    {
+        if (read_and_validate_decode_args(job->argc, job->argv, &worker->decInfo) == e_success)
+        {
+            if (worker->decInfo.magic_string == NULL)
+            {
+                worker->decInfo.magic_string = MAGIC_STRING; // No prompt in batch mode unless -s was given
+            }
+            status = do_decoding(&worker->decInfo);
+        }
+        close_files_for_decode(&worker->decInfo);
+    }
+    return status;
+}
+
+/*
+ * Function: batch_worker
+ * ------------------------
+ * parallel_task_fn of one pool thread: sets up one BatchWorker and runs
+ * the jobs it claims off the queue on it until none are left. The range
+ * is one element per thread and only decides how many threads start.
+ */
+static void batch_worker(void *arg, size_t begin, size_t end)
+{
+    BatchQueue *queue = arg;
+    BatchWorker worker;
+    size_t i;
+
+    (void)begin;
+    (void)end;
+    if (batch_worker_init(&worker) == e_failure)
+    {
+        return; // The other threads take the jobs, or they keep their e_failure status
+    }
+    while ((i = atomic_fetch_add(&queue->next, 1)) < queue->njobs)
+    {
+        queue->jobs[i].status = run_job(&worker, &queue->jobs[i]);
+    }
+    batch_worker_free(&worker);
+}
+
+/*
+ * Function: do_batch
+ * --------------------
+ * Runs all jobs of a manifest on a pool of -j N threads (1 by default)
+ * and prints one summary line plus one line per failed job.
+ *
+ * Parameters:
+ * --------------
+ *   - int argc, char *argv[]: Command line, argv[1] is "-b".
+ *
+ * Returns:
+ * -----------
+ *   - Status: e_success if every job succeeded, e_failure otherwise.
+ */
+Status do_batch(int argc, char *argv[])
+{
+    const char *manifest = NULL;
+    int nthreads = 1;
+    Status parsed = e_success; // Of -j, read by parse_jobs()
+
+    for (int i = 2; i < argc; i++)
+    {
+        if (parse_jobs(argc, argv, &i, &nthreads, &parsed))
+        {
+            if (parsed == e_failure)
+            {
+                return e_failure;
+            }
+        }
+        else if (manifest == NULL)
+        {
+            manifest = argv[i];
+        }
+        else
+        {
+            printf(BATCH_USAGE);
+            return e_failure;
+        }
+    }
+    if (manifest == NULL)
+    {
+        printf(BATCH_USAGE);
+        return e_failure;
+    }
+
+    FILE *fptr = strcmp(manifest, "-") == 0 ? stdin : fopen(manifest, "r");
+    if (fptr == NULL)
+    {
+        perror("fopen");
+        fprintf(stderr, "ERROR: Unable to open file %s\n", manifest);
+        return e_failure;
+    }
+    BatchJob *jobs;
+    size_t njobs;
+    Status status = batch_read_manifest(fptr, &jobs, &njobs);
+    if (fptr != stdin)
+    {
+        fclose(fptr);
+    }
+
+    if (status == e_success)
+    {
+        struct timespec start, stop;
+        stego_verbose = 0; // Only errors and the summary from here on
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        BatchQueue queue = {jobs, njobs, 0};
+        size_t nworkers = njobs < (size_t)nthreads ? njobs : (size_t)nthreads;
+        parallel_for(nworkers, 1, (int)nworkers, batch_worker, &queue); // One call per pool thread, never fails
+        clock_gettime(CLOCK_MONOTONIC, &stop);
+
+        size_t failed = 0;
+        for (size_t i = 0; i < njobs; i++)
+        {
+            if (jobs[i].status == e_failure)
+            {
+                printf("FAILED: manifest line %d\n", jobs[i].lineno);
+                failed++;
+            }
+        }
+        double elapsed = (stop.tv_sec - start.tv_sec) + (stop.tv_nsec - start.tv_nsec) / 1e9;
+        printf("INFO: Batch done: %zu jobs, %zu succeeded, %zu failed in %.3f s (%.1f jobs/s)\n",
+               njobs, njobs - failed, failed, elapsed, elapsed > 0 ? njobs / elapsed : 0.0);
+        if (failed > 0)
+        {
+            status = e_failure;
+        }
+    }
+
+    batch_free_jobs(jobs, njobs);
+    return status;
+}
@@ -0,0 +1,68 @@
+#ifndef BATCH_H
+#define BATCH_H
+
+#include <stdio.h>
+#include "types.h"
+#include "encode.h"
+#include "decode.h"
+
+/*
+ * Batch mode
+ * ----------
+ * Runs many encode/decode jobs in one process. Every line of the manifest
+ * (a file, or stdin for "-") is one job, written like the command line
+ * without the program name:
+ *
+ *     e beautiful.bmp secret.txt stego1.bmp
+ *     d stego1.bmp decoded1
+ *     # comments and blank lines are ignored
+ *
+ * With -j N jobs run concurrently and in no particular order, so a job must
+ * not depend on the output of another job of the same manifest.
+ * Jobs cannot read or write stdin/stdout ("-").
+ * Decode jobs never prompt: they check the signature given with -s, or the
+ * compiled-in MAGIC_STRING.
+ * Per stage INFO output is suppressed and one summary is printed at the end.
+ */
+
+#define BATCH_USAGE "Batch:    ./lsb_steg -b <manifest file | -> [-j N]\n"
+#define BATCH_MAX_ARGS 16 // Arguments per manifest line
+
+/* One manifest line turned into an argument vector */
+typedef struct
+{
+    char *line;                    // Copy of the manifest line, argv points into it
+    int lineno;                    // Line number for the summary
+    int argc;
+    char *argv[BATCH_MAX_ARGS + 2]; // Program name, operation, arguments
+    Status status;
+} BatchJob;
+
+/*
+ * Contexts of one batch or spool worker. The arenas are more than a
+ * megabyte, too much for the stack of a thread with default attributes,
+ * so they are allocated once when the worker starts.
+ */
+typedef struct
+{
+    EncodeInfo encInfo;
+    DecodeInfo decInfo;
+    char *arena; // ENCODE_ARENA_SIZE(MAX_SECRET_BUF_SIZE) + DECODE_ARENA_SIZE(MAX_DECODE_BUF_SIZE) bytes
+} BatchWorker;
+
+/* Allocate the arenas of a worker and set up its contexts over them */
+Status batch_worker_init(BatchWorker *worker);
+
+/* Free the arenas of batch_worker_init */
+void batch_worker_free(BatchWorker *worker);
+
+/* Read every job of a manifest, e_failure on a malformed line */
+Status batch_read_manifest(FILE *fptr, BatchJob **jobs, size_t *njobs);
+
+/* Free the jobs batch_read_manifest returned */
+void batch_free_jobs(BatchJob *jobs, size_t njobs);
+
+/* Read the manifest and run all its jobs on a thread pool */
+Status do_batch(int argc, char *argv[]);
+
+#endif
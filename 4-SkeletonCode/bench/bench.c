@@ -0,0 +1,514 @@
+/*
+ * lsb_bench
+ * ---------
+ * Throughput benchmark of the LSB kernels and of whole encode / decode
+ * runs, for tracking regressions in CI. Build it from 4-SkeletonCode with
+ *
+ *     gcc -O2 -pthread -I. -o lsb_bench bench/bench.c aead.c arena.c batch.c bmp.c common.c \
+ *         cover_index.c crc32c.c decode.c encode.c filelist.c lsb.c lz.c mmap_io.c parallel.c \
+ *         pipeline.c probe.c quality.c scatter.c shard.c spool.c stats.c stego.c stego_header.c
+ *
+ * That is every source but test_encode.c, which has the tool's main().
+ * Keep the list in step with fuzz/fuzz_decode.c when a file is added.
+ * Then run
+ *
+ *     ./lsb_bench [--quick] [--max-cover SIZE] [--reps N] [--dir DIR]
+ *
+ * Every result is one JSON object on its own line (JSON Lines) on stdout:
+ *
+ *     {"suite":"kernel","kernel":"avx2","op":"encode","bits":1,"bytes":1048576,
+ *      "seconds":0.000213,"mb_s":4922.1,"ns_per_byte":0.203}
+ *     {"suite":"e2e","mode":"stdio","op":"encode","cover_bytes":1047606,
+ *      "payload_bytes":1024,"bytes":1047606,"seconds":0.0012,"mb_s":873.8,"ns_per_byte":1.144}
+ *
+ * Rates are bytes / seconds in MB (10^6 bytes) per second and nanoseconds
+ * per byte, "bytes" tells which count they refer to: payload bytes for the
+ * kernels, the cover size for an encode (the whole image is written) and
+ * the payload size for a decode. The best of --reps runs is reported.
+ *
+ * Synthetic 24-bit covers from 1 MB up to --max-cover (default 256M, 4G is
+ * accepted) are written to DIR (default $TMPDIR or /tmp), each with
+ * payloads of 1 B, 1 KB, 1 MB and its full capacity.
+ *
+ * Every cover and payload also checks the stdio encode and decode with
+ * their output on a pipe, as in ./lsb_steg -e cover.bmp payload.bin - |
+ * cmp - stego.bmp. A pipe takes 64 KB at a time, so the kernel copy of
+ * the cover tail (sendfile) comes back short over and over:
+ *
+ *     {"suite":"check","mode":"pipe","op":"encode","cover_bytes":1047606,"payload_bytes":1024,"ok":true}
+ *
+ * A payload too large for one 1 MB cover is also sharded over two and put
+ * back together, with every directory of the command lines named with a
+ * dot as in --shard-decode ./res.d/restored out.d:
+ *
+ *     {"suite":"check","mode":"shard","op":"roundtrip","cover_bytes":1047606,"payload_bytes":130944,"ok":true}
+ *
+ * The exit status is 1 if any check failed.
+ */
+#define _FILE_OFFSET_BITS 64
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "common.h"
+#include "encode.h"
+#include "decode.h"
+#include "lsb.h"
+#include "parallel.h"
+#include "shard.h"
+#include "stego_header.h"
+
+#define KERNEL_BYTES (1024 * 1024) // Payload bytes per kernel call
+#define COVER_WIDTH 1024           // Pixels per row of the synthetic covers, rows need no padding
+#define WRITE_BLOCK (1024 * 1024)
+
+static double min_seconds = 0.25; // Kernel loops run at least this long
+static int reps = 3;
+static int failed_checks;
+static uint64_t rng_state = 0x9E3779B97F4A7C15ull;
+
+/* Wall clock in seconds */
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/* xorshift64, the data only has to defeat compression-like shortcuts */
+static void fill_random(char *buf, size_t n)
+{
+    for (size_t i = 0; i < n; i++)
+    {
+        rng_state ^= rng_state << 13;
+        rng_state ^= rng_state >> 7;
+        rng_state ^= rng_state << 17;
+        buf[i] = (char)rng_state;
+    }
+}
+
+/* Print one result line */
+static void report(const char *fields, uint64_t bytes, double seconds)
+{
+    printf("{%s,\"bytes\":%llu,\"seconds\":%.9f,\"mb_s\":%.3f,\"ns_per_byte\":%.4f}\n", fields,
+           (unsigned long long)bytes, seconds, bytes / seconds / 1e6, seconds * 1e9 / bytes);
+    fflush(stdout);
+}
+
+/*
+ * Function: bench_kernel
+ * ------------------------
+ * Times one kernel over a KERNEL_BYTES payload until min_seconds have
+ * passed and reports the time of a single call.
+ */
+static void bench_kernel(const char *kernel, const char *op, int bits, char *data, char *image)
+{
+    long iterations = 0;
+    double start = now(), elapsed;
+    char fields[128];
+
+    do
+    {
+        if (strcmp(op, "encode_byte") == 0) // The original one byte at a time functions
+        {
+            for (size_t i = 0; i < KERNEL_BYTES; i++)
+            {
+                encode_byte_to_lsb(data[i], image + i * 8);
+            }
+        }
+        else if (strcmp(op, "decode_byte") == 0)
+        {
+            for (size_t i = 0; i < KERNEL_BYTES; i++)
+            {
+                decode_lsb_to_byte(data + i, image + i * 8);
+            }
+        }
+        else if (strcmp(op, "encode") == 0)
+        {
+            encode_bytes_to_lsb_bits(data, KERNEL_BYTES, image, bits);
+        }
+        else
+        {
+            decode_lsb_bits_to_bytes(data, KERNEL_BYTES, image, bits);
+        }
+        iterations++;
+    } while ((elapsed = now() - start) < min_seconds);
+
+    snprintf(fields, sizeof(fields), "\"suite\":\"kernel\",\"kernel\":\"%s\",\"op\":\"%s\",\"bits\":%d", kernel, op, bits);
+    report(fields, KERNEL_BYTES, elapsed / iterations);
+}
+
+/* Kernel suite: every built-in kernel at 1 bit, the single byte functions, and k > 1 */
+static void bench_kernels(void)
+{
+    static const char *kernels[] = {"scalar", "sse2", "avx2", "neon"};
+    const char *native = lsb_kernel_name();
+    char *data = malloc(KERNEL_BYTES);
+    char *image = malloc((size_t)KERNEL_BYTES * 8);
+
+    if (data == NULL || image == NULL)
+    {
+        printf("ERROR: Unable to allocate the kernel buffers\n");
+        exit(1);
+    }
+    fill_random(data, KERNEL_BYTES);
+    fill_random(image, (size_t)KERNEL_BYTES * 8);
+
+    bench_kernel("byte", "encode_byte", 1, data, image);
+    bench_kernel("byte", "decode_byte", 1, data, image);
+    for (size_t i = 0; i < sizeof(kernels) / sizeof(kernels[0]); i++)
+    {
+        if (lsb_select_kernel(kernels[i]) == e_success)
+        {
+            bench_kernel(kernels[i], "encode", 1, data, image);
+            bench_kernel(kernels[i], "decode", 1, data, image);
+        }
+    }
+    lsb_select_kernel(native);
+    for (int bits = 2; bits <= LSB_MAX_BITS; bits++)
+    {
+        bench_kernel("grouped", "encode", bits, data, image);
+        bench_kernel("grouped", "decode", bits, data, image);
+    }
+    free(data);
+    free(image);
+}
+
+/* Write head and then n random bytes to fname */
+static Status write_random_file(const char *fname, const char *head, size_t head_len, uint64_t n)
+{
+    static char block[WRITE_BLOCK];
+    FILE *fptr = fopen(fname, "w");
+    Status status = e_success;
+
+    if (fptr == NULL || (head_len > 0 && fwrite(head, 1, head_len, fptr) != head_len))
+    {
+        status = e_failure;
+    }
+    while (status == e_success && n > 0)
+    {
+        size_t length = n < WRITE_BLOCK ? (size_t)n : WRITE_BLOCK;
+        fill_random(block, length);
+        if (fwrite(block, 1, length, fptr) != length)
+        {
+            status = e_failure;
+        }
+        n -= length;
+    }
+    if (fptr != NULL && fclose(fptr) != 0)
+    {
+        status = e_failure;
+    }
+    if (status == e_failure)
+    {
+        printf("ERROR: Unable to write %s\n", fname);
+    }
+    return status;
+}
+
+/* Store v little endian in 4 bytes */
+static void put_le32(char *p, uint32_t v)
+{
+    for (int i = 0; i < 4; i++)
+    {
+        p[i] = (char)(v >> (8 * i));
+    }
+}
+
+/* Write a 24-bit BI_RGB cover of about size bytes, returns its pixel array size */
+static uint64_t write_cover(const char *fname, uint64_t size)
+{
+    char header[BMP_HEADER_SIZE] = {'B', 'M'};
+    uint32_t height = (uint32_t)(size / (COVER_WIDTH * 3));
+    uint64_t pixel_bytes = (uint64_t)height * COVER_WIDTH * 3;
+
+    put_le32(header + 2, (uint32_t)(BMP_HEADER_SIZE + pixel_bytes)); // Wraps above 4 GB like other tools do
+    put_le32(header + 10, BMP_HEADER_SIZE);
+    put_le32(header + 14, 40);
+    put_le32(header + 18, COVER_WIDTH);
+    put_le32(header + 22, height);
+    header[26] = 1;  // Planes
+    header[28] = 24; // Bits per pixel
+    if (write_random_file(fname, header, sizeof(header), pixel_bytes) == e_failure)
+    {
+        return 0;
+    }
+    return pixel_bytes;
+}
+
+/*
+ * Function: run_job
+ * -------------------
+ * Runs one command line through the same calls test_encode.c makes and
+ * returns the wall time, or a negative value if the job failed.
+ */
+static double run_job(int argc, char *argv[], EncodeInfo *encInfo, DecodeInfo *decInfo)
+{
+    double start = now();
+    Status status;
+
+    if (strcmp(argv[1], "-e") == 0)
+    {
+        status = read_and_validate_encode_args(argc, argv, encInfo);
+        if (status == e_success)
+        {
+            status = do_encoding(encInfo);
+        }
+        close_files(encInfo);
+    }
+    else
+    {
+        status = read_and_validate_decode_args(argc, argv, decInfo);
+        if (status == e_success)
+        {
+            status = do_decoding(decInfo);
+        }
+        close_files_for_decode(decInfo);
+    }
+    return status == e_success ? now() - start : -1;
+}
+
+/* Best of reps runs of one job, reported as an e2e result */
+static void bench_job(int argc, char *argv[], const char *mode, uint64_t cover_bytes, uint64_t payload_bytes,
+                      EncodeInfo *encInfo, DecodeInfo *decInfo)
+{
+    double best = -1;
+    char fields[192];
+    int encode = strcmp(argv[1], "-e") == 0;
+
+    for (int r = 0; r < reps; r++)
+    {
+        double seconds = run_job(argc, argv, encInfo, decInfo);
+        if (seconds < 0)
+        {
+            printf("ERROR: %s %s failed on a %llu byte cover\n", mode, encode ? "encode" : "decode", (unsigned long long)cover_bytes);
+            return;
+        }
+        if (best < 0 || seconds < best)
+        {
+            best = seconds;
+        }
+    }
+    snprintf(fields, sizeof(fields), "\"suite\":\"e2e\",\"mode\":\"%s\",\"op\":\"%s\",\"cover_bytes\":%llu,\"payload_bytes\":%llu",
+             mode, encode ? "encode" : "decode", (unsigned long long)cover_bytes, (unsigned long long)payload_bytes);
+    report(fields, encode ? cover_bytes : (payload_bytes ? payload_bytes : 1), best);
+}
+
+/*
+ * Function: check_pipe
+ * ----------------------
+ * Runs one command line whose output is "-" with stdout on a pipe into
+ * cmp against expected, and reports whether the bytes were the same.
+ */
+static void check_pipe(int argc, char *argv[], const char *expected, uint64_t cover_bytes, uint64_t payload_bytes,
+                       EncodeInfo *encInfo, DecodeInfo *decInfo)
+{
+    char command[64];
+    int saved, same = 0;
+    FILE *pipe;
+
+    snprintf(command, sizeof(command), "cmp -s - %s", expected);
+    fflush(stdout);
+    if ((saved = dup(STDOUT_FILENO)) < 0 || (pipe = popen(command, "w")) == NULL)
+    {
+        perror("popen");
+        exit(1);
+    }
+    if (dup2(fileno(pipe), STDOUT_FILENO) >= 0)
+    {
+        double seconds = run_job(argc, argv, encInfo, decInfo);
+        fflush(stdout);
+        dup2(saved, STDOUT_FILENO); // cmp sees the end of the data once pclose() closes the last write end
+        same = seconds >= 0;
+    }
+    close(saved);
+    same = pclose(pipe) == 0 && same;
+    failed_checks += !same;
+    printf("{\"suite\":\"check\",\"mode\":\"pipe\",\"op\":\"%s\",\"cover_bytes\":%llu,\"payload_bytes\":%llu,\"ok\":%s}\n",
+           strcmp(argv[1], "-e") == 0 ? "encode" : "decode", (unsigned long long)cover_bytes, (unsigned long long)payload_bytes,
+           same ? "true" : "false");
+    fflush(stdout);
+}
+
+/* Largest payload a cover with pixel_bytes of pixel array holds at 1 bit per byte */
+static uint64_t full_capacity(uint64_t pixel_bytes)
+{
+    StegoHeader hdr;
+    uint64_t room = pixel_bytes / 8 - strlen(MAGIC_STRING);
+
+    stego_header_init(&hdr, DEFAULT_STREAM_EXTN, room, 1, 0);
+    return room - stego_header_size(&hdr);
+}
+
+/* End-to-end suite: every cover size, payload size and mode */
+static void bench_e2e(uint64_t max_cover)
+{
+    static EncodeInfo encInfo;
+    static DecodeInfo decInfo;
+    _Alignas(ARENA_ALIGN) static char encode_arena[ENCODE_ARENA_SIZE(MAX_SECRET_BUF_SIZE)];
+    _Alignas(ARENA_ALIGN) static char decode_arena[DECODE_ARENA_SIZE(MAX_DECODE_BUF_SIZE)];
+    char jobs[16];
+    long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+
+    if (encode_info_init(&encInfo, encode_arena, sizeof(encode_arena), MAX_SECRET_BUF_SIZE) == e_failure ||
+        decode_info_init(&decInfo, decode_arena, sizeof(decode_arena), MAX_DECODE_BUF_SIZE) == e_failure)
+    {
+        exit(1);
+    }
+    snprintf(jobs, sizeof(jobs), "%ld", ncpu > 1 ? (ncpu < PARALLEL_MAX_THREADS ? ncpu : PARALLEL_MAX_THREADS) : 2);
+
+    for (uint64_t cover = 1ull << 20; cover <= max_cover; cover <<= 4)
+    {
+        uint64_t pixel_bytes = write_cover("cover.bmp", cover);
+        uint64_t payloads[] = {1, 1024, 1024 * 1024, full_capacity(pixel_bytes)};
+        uint64_t cover_bytes = BMP_HEADER_SIZE + pixel_bytes;
+
+        if (pixel_bytes == 0)
+        {
+            return;
+        }
+        for (size_t p = 0; p < sizeof(payloads) / sizeof(payloads[0]); p++)
+        {
+            if (payloads[p] > payloads[3] || (p < 3 && payloads[p] == payloads[3]))
+            {
+                continue; // Does not fit, or the same as full capacity
+            }
+            if (write_random_file("payload.bin", NULL, 0, payloads[p]) == e_failure)
+            {
+                return;
+            }
+            char *encode_stdio[] = {"lsb_bench", "-e", "cover.bmp", "payload.bin", "stego.bmp"};
+            char *encode_mmap[] = {"lsb_bench", "-e", "-m", "cover.bmp", "payload.bin", "stego.bmp"};
+            char *encode_jobs[] = {"lsb_bench", "-e", "-j", jobs, "cover.bmp", "payload.bin", "stego.bmp"};
+            char *encode_in_place[] = {"lsb_bench", "-e", "-i", "cover.bmp", "payload.bin", "stego.bmp"};
+            char *decode_stdio[] = {"lsb_bench", "-d", "-a", "stego.bmp", "out"};
+            char *decode_mmap[] = {"lsb_bench", "-d", "-m", "-a", "stego.bmp", "out"};
+            char *decode_jobs[] = {"lsb_bench", "-d", "-j", jobs, "-a", "stego.bmp", "out"};
+            char *encode_pipe[] = {"lsb_bench", "-e", "cover.bmp", "payload.bin", "-"};
+            char *decode_pipe[] = {"lsb_bench", "-d", "-a", "stego.bmp", "-"};
+
+            bench_job(5, encode_stdio, "stdio", cover_bytes, payloads[p], &encInfo, &decInfo);
+            bench_job(6, encode_mmap, "mmap", cover_bytes, payloads[p], &encInfo, &decInfo);
+            bench_job(7, encode_jobs, "jobs", cover_bytes, payloads[p], &encInfo, &decInfo);
+            bench_job(6, encode_in_place, "in-place", cover_bytes, payloads[p], &encInfo, &decInfo);
+            bench_job(5, decode_stdio, "stdio", cover_bytes, payloads[p], &encInfo, &decInfo);
+            bench_job(6, decode_mmap, "mmap", cover_bytes, payloads[p], &encInfo, &decInfo);
+            bench_job(7, decode_jobs, "jobs", cover_bytes, payloads[p], &encInfo, &decInfo);
+            run_job(5, encode_stdio, &encInfo, &decInfo); // stego.bmp from the stdio encode is the reference of the checks
+            check_pipe(5, encode_pipe, "stego.bmp", cover_bytes, payloads[p], &encInfo, &decInfo);
+            check_pipe(5, decode_pipe, "payload.bin", cover_bytes, payloads[p], &encInfo, &decInfo);
+        }
+        remove("payload.bin");
+        remove("stego.bmp");
+        remove("out.bin");
+        remove("cover.bmp");
+    }
+}
+
+/*
+ * Function: check_shard
+ * -----------------------
+ * Shards a payload over two 1 MB covers and decodes it again into a
+ * directory with a dot in its name, and reports whether the restored
+ * file is the payload.
+ */
+static void check_shard(void)
+{
+    uint64_t pixel_bytes = write_cover("cover.d/a.bmp", 1ull << 20);
+    uint64_t payload_bytes = pixel_bytes / 8; // More than one cover holds
+    int same = 0;
+
+    if (pixel_bytes > 0 && write_cover("cover.d/b.bmp", 1ull << 20) == pixel_bytes &&
+        write_random_file("payload.bin", NULL, 0, payload_bytes) == e_success)
+    {
+        char *encode[] = {"lsb_bench", "--shard-encode", "-o", "out.d", "payload.bin", "cover.d"};
+        char *decode[] = {"lsb_bench", "--shard-decode", "-s", MAGIC_STRING, "./res.d/restored", "out.d"};
+
+        same = do_shard_encode(6, encode) == e_success && do_shard_decode(6, decode) == e_success &&
+               system("cmp -s payload.bin res.d/restored.bin") == 0;
+    }
+    failed_checks += !same;
+    printf("{\"suite\":\"check\",\"mode\":\"shard\",\"op\":\"roundtrip\",\"cover_bytes\":%llu,\"payload_bytes\":%llu,\"ok\":%s}\n",
+           (unsigned long long)(BMP_HEADER_SIZE + pixel_bytes), (unsigned long long)payload_bytes, same ? "true" : "false");
+    fflush(stdout);
+}
+
+/* Parse 4096, 64K, 256M or 4G */
+static uint64_t parse_size(const char *arg)
+{
+    char *end;
+    uint64_t size = strtoull(arg, &end, 10);
+
+    switch (*end)
+    {
+    case 'G': size <<= 10; // Fall through
+    case 'M': size <<= 10; // Fall through
+    case 'K': size <<= 10; end++; break;
+    }
+    return *end == '\0' ? size : 0;
+}
+
+int main(int argc, char *argv[])
+{
+    uint64_t max_cover = 256ull << 20;
+    const char *dir = getenv("TMPDIR") ? getenv("TMPDIR") : "/tmp";
+    char tmpl[4096];
+
+    for (int i = 1; i < argc; i++)
+    {
+        if (strcmp(argv[i], "--quick") == 0)
+        {
+            min_seconds = 0.02;
+            reps = 1;
+            max_cover = 16ull << 20;
+        }
+        else if (strcmp(argv[i], "--max-cover") == 0 && i + 1 < argc && (max_cover = parse_size(argv[++i])) >= (1ull << 20))
+        {
+        }
+        else if (strcmp(argv[i], "--reps") == 0 && i + 1 < argc && (reps = atoi(argv[++i])) > 0)
+        {
+        }
+        else if (strcmp(argv[i], "--dir") == 0 && i + 1 < argc)
+        {
+            dir = argv[++i];
+        }
+        else
+        {
+            printf("Usage: ./lsb_bench [--quick] [--max-cover SIZE (1M .. 4G)] [--reps N] [--dir DIR]\n");
+            return 1;
+        }
+    }
+    stego_verbose = 0;
+    signal(SIGPIPE, SIG_IGN); // A check whose cmp stops early fails instead of killing the run
+
+    printf("{\"suite\":\"info\",\"kernel\":\"%s\",\"cpus\":%ld,\"max_cover\":%llu,\"reps\":%d}\n",
+           lsb_kernel_name(), sysconf(_SC_NPROCESSORS_ONLN), (unsigned long long)max_cover, reps);
+    bench_kernels();
+
+    // Work in a private directory so the decoder's output naming never meets a dot in the path
+    snprintf(tmpl, sizeof(tmpl), "%s/lsb_bench_XXXXXX", dir);
+    if (mkdtemp(tmpl) == NULL || chdir(tmpl) != 0)
+    {
+        perror("mkdtemp");
+        return 1;
+    }
+    bench_e2e(max_cover);
+    if (mkdir("cover.d", 0700) != 0 || mkdir("out.d", 0700) != 0 || mkdir("res.d", 0700) != 0)
+    {
+        perror("mkdir");
+        return 1;
+    }
+    check_shard();
+    if (system("rm -rf cover.d out.d res.d payload.bin") != 0)
+    {
+        perror("rm");
+    }
+    if (chdir("/") != 0 || rmdir(tmpl) != 0)
+    {
+        perror("rmdir");
+    }
+    return failed_checks > 0;
+}
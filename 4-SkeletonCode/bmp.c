@@ -0,0 +1,78 @@
+#include <string.h>
+#include "bmp.h"
+
+#define BI_RGB 0
+#define BI_BITFIELDS 3
+
+static uint16_t get_le16(const char *in)
+{
+    const unsigned char *p = (const unsigned char *)in;
+    return (uint16_t)(p[0] | p[1] << 8);
+}
+
+static uint32_t get_le32(const char *in)
+{
+    const unsigned char *p = (const unsigned char *)in;
+    return (uint32_t)p[0] | (uint32_t)p[1] << 8 | (uint32_t)p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+/*
+ * Function: bmp_parse
+ * ---------------------
+ * Parses the BITMAPFILEHEADER and the BITMAPINFOHEADER (or the first 40
+ * bytes of a V4/V5 header) into a descriptor.
+ *
+ * Parameters:
+ * --------------
+ *   - const char *data: Start of the image.
+ *   - size_t len: Bytes available at data, at least BMP_HEADER_SIZE.
+ *   - BmpInfo *bmp: Filled with the descriptor on success.
+ *
+ * Returns:
+ * -----------
+ *   - Status: e_success for a supported image,
+ *             e_failure if it is not a BMP file, uses an unsupported
+ *             header, bit depth or compression, or its pixel offset does
+ *             not leave room for the headers.
+ */
+Status bmp_parse(const char *data, size_t len, BmpInfo *bmp)
+{
+    memset(bmp, 0, sizeof(*bmp));
+    if (data == NULL || len < BMP_HEADER_SIZE || data[0] != 'B' || data[1] != 'M')
+    {
+        return e_failure;
+    }
+
+    bmp->file_size = get_le32(data + 2);
+    bmp->pixel_offset = get_le32(data + 10);
+    bmp->header_size = get_le32(data + 14);
+    int32_t width = (int32_t)get_le32(data + 18);
+    int32_t height = (int32_t)get_le32(data + 22);
+    bmp->bpp = get_le16(data + 28);
+    bmp->compression = get_le32(data + 30);
+
+    // BITMAPINFOHEADER, V4 and V5 share the first 40 bytes; OS/2 core headers are not supported
+    if (bmp->header_size < 40 || bmp->header_size > BMP_V5_HEADER_SIZE || width <= 0 || height == 0 ||
+        height == INT32_MIN)
+    {
+        return e_failure;
+    }
+    // Callers subtract BMP_HEADER_SIZE from pixel_offset, so it must cover at least the parsed fields
+    if (bmp->pixel_offset < BMP_HEADER_SIZE || bmp->pixel_offset < 14 + (uint64_t)bmp->header_size ||
+        bmp->pixel_offset > BMP_MAX_HEADER)
+    {
+        return e_failure;
+    }
+    if (!(bmp->bpp == 24 && bmp->compression == BI_RGB) &&
+        !(bmp->bpp == 32 && (bmp->compression == BI_RGB || bmp->compression == BI_BITFIELDS)))
+    {
+        return e_failure; // Palettes and compressed pixels would not survive changing arbitrary bits
+    }
+
+    bmp->width = (uint32_t)width;
+    bmp->top_down = height < 0;
+    bmp->height = (uint32_t)(height < 0 ? -height : height);
+    bmp->stride = ((uint64_t)bmp->width * bmp->bpp + 31) / 32 * 4;
+    bmp->pixel_bytes = bmp->stride * bmp->height;
+    return e_success;
+}
@@ -0,0 +1,40 @@
+#ifndef BMP_H
+#define BMP_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "types.h"
+
+/*
+ * BMP image descriptor
+ * --------------------
+ * Parsed once from the file and info headers and reused for capacity,
+ * header copy and embedding. Hidden data starts at pixel_offset (bfOffBits),
+ * which is 54 for the plain 40 byte BITMAPINFOHEADER the tool was written
+ * for, so stego images made by older versions decode unchanged. Accepted
+ * images are uncompressed 24 bpp, or 32 bpp (BI_RGB or BI_BITFIELDS), with
+ * a BITMAPINFOHEADER, V4 or V5 header, bottom-up or top-down.
+ */
+
+#define BMP_HEADER_SIZE 54     // File header + BITMAPINFOHEADER, holds every field parsed
+#define BMP_MAX_HEADER 4096    // Largest pixel_offset accepted (headers, masks, palette, gap)
+#define BMP_V5_HEADER_SIZE 124 // Largest biSize accepted: BITMAPV5HEADER
+
+typedef struct _BmpInfo
+{
+    uint64_t file_size;    // bfSize as stored, may be 0
+    uint32_t pixel_offset; // bfOffBits: start of the pixel array
+    uint32_t header_size;  // biSize: 40, 108 (V4) or 124 (V5)
+    uint32_t width;
+    uint32_t height;       // Number of rows, always positive
+    int top_down;          // Height was stored negative: first row is the top one
+    uint16_t bpp;          // 24 or 32
+    uint32_t compression;  // BI_RGB (0) or BI_BITFIELDS (3)
+    uint64_t stride;       // Bytes per row including the padding to 4 bytes
+    uint64_t pixel_bytes;  // stride * height: bytes available for hiding data
+} BmpInfo;
+
+/* Parse the first BMP_HEADER_SIZE (or more) bytes of an image */
+Status bmp_parse(const char *data, size_t len, BmpInfo *bmp);
+
+#endif
@@ -0,0 +1,79 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "common.h"
+#include "parallel.h"
+
+/* Print the INFO progress lines of every stage */
+int stego_verbose = 1;
+
+/* 
+ * Function:
+ * ------------
+ *           check_operation_type
+ *           it  Determines the operation type based on the command line argument
+ * Parameters:
+ * -------------
+ *           command line argument as input for encode '-e' and for decode '-d'
+ * Returns:
+ * ------------
+ *          returns e_encode for '-e', e_decode for '-d', e_batch for '-b',
+ *          e_probe for '-p' / '--probe', e_shard_encode / e_shard_decode for
+ *          '--shard-encode' / '--shard-decode', e_spool for '--spool',
+ *          e_index for '--index-build', and e_unsupported for invalid input
+ */
+OperationType check_operation_type(char *argv)
+{
+    // Compare the input argument with the expected operation types
+    if (strcmp(argv, "-e") == 0)
+    {
+        return e_encode;// Return e_encode for encoding operation
+    }
+    else if (strcmp(argv, "-d") == 0)
+    {
+        return e_decode;// Return e_decode for decoding operation
+    }
+    else if (strcmp(argv, "-b") == 0)
+    {
+        return e_batch;// Return e_batch for batch mode
+    }
+    else if (strcmp(argv, "-p") == 0 || strcmp(argv, "--probe") == 0)
+    {
+        return e_probe;// Return e_probe for probe mode
+    }
+    else if (strcmp(argv, "--shard-encode") == 0)
+    {
+        return e_shard_encode;// Return e_shard_encode for sharded encoding
+    }
+    else if (strcmp(argv, "--shard-decode") == 0)
+    {
+        return e_shard_decode;// Return e_shard_decode for reassembling shards
+    }
+    else if (strcmp(argv, "--spool") == 0)
+    {
+        return e_spool;// Return e_spool for the spool service
+    }
+    else if (strcmp(argv, "--index-build") == 0)
+    {
+        return e_index;// Return e_index for building a cover index
+    }
+    else
+    {
+        return e_unsupported;// Return e_unsupported for invalid input
+    }
+}
+
+/* Parses -j N, returns 0 if argv[*i] is not -j */
+int parse_jobs(int argc, char *argv[], int *i, int *nthreads, Status *status)
+{
+    if (strcmp(argv[*i], "-j") != 0 && strcmp(argv[*i], "--jobs") != 0)
+    {
+        return 0;
+    }
+    if (*i + 1 == argc || (*nthreads = atoi(argv[++*i])) < 1 || *nthreads > PARALLEL_MAX_THREADS)
+    {
+        printf("ERROR: -j expects a thread count between 1 and %d\n", PARALLEL_MAX_THREADS);
+        *status = e_failure;
+    }
+    return 1;
+}
@@ -1,7 +1,19 @@
 #ifndef COMMON_H
 #define COMMON_H
+#include "types.h"
 
 /* Magic string to identify whether stegged or not */
 #define MAGIC_STRING "#*"
+#define MAX_MAGIC_STRING 16 // Longest signature accepted by -s / the prompt
+
+/* Progress output. Cleared by batch mode so only errors and the summary are printed */
+extern int stego_verbose;
+#define LOG_INFO(...) do { if (stego_verbose) printf(__VA_ARGS__); } while (0)
+
+/* Check operation type */
+OperationType check_operation_type(char *argv);
+
+/* Parse -j N at argv[*i], moving *i past N; 0 if it is not -j, *status is e_failure on a bad N */
+int parse_jobs(int argc, char *argv[], int *i, int *nthreads, Status *status);
 
 #endif
@@ -0,0 +1,474 @@
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include "cover_index.h"
+#include "bmp.h"
+#include "common.h"
+#include "filelist.h"
+#include "mmap_io.h"
+
+/* One cover of the index, decoded */
+typedef struct
+{
+    char *path; // Owned copy, NUL terminated
+    uint64_t pixel_bytes;
+    uint64_t file_size;
+    int64_t mtime_sec;
+    uint32_t mtime_nsec;
+    uint32_t pixel_offset;
+    uint16_t bpp;
+} CoverEntry;
+
+/* Growable array of entries */
+typedef struct
+{
+    CoverEntry *entries;
+    size_t count;
+    size_t cap;
+} CoverList;
+
+static void put_be(unsigned char *p, uint64_t value, int n)
+{
+    for (int i = n - 1; i >= 0; i--, value >>= 8)
+    {
+        p[i] = (unsigned char)value;
+    }
+}
+
+static uint64_t get_be(const unsigned char *p, int n)
+{
+    uint64_t value = 0;
+    for (int i = 0; i < n; i++)
+    {
+        value = value << 8 | p[i];
+    }
+    return value;
+}
+
+/*
+ * Function: check_index
+ * -----------------------
+ * Validates a mapped index: the magic, the record table and every path
+ * must lie inside the file, so lookups can trust the offsets.
+ *
+ * Returns:
+ * -----------
+ *   - Status: e_success with the number of records in *count,
+ *             e_failure if the file is not a cover index.
+ */
+static Status check_index(const MappedFile *map, size_t *count)
+{
+    const unsigned char *data = (const unsigned char *)map->data;
+
+    if (map->size < COVER_INDEX_HEADER || memcmp(data, COVER_INDEX_MAGIC, strlen(COVER_INDEX_MAGIC)) != 0)
+    {
+        return e_failure;
+    }
+    uint64_t n = get_be(data + 8, 4);
+    if (n > (map->size - COVER_INDEX_HEADER) / COVER_INDEX_RECORD)
+    {
+        return e_failure;
+    }
+    size_t strings = COVER_INDEX_HEADER + n * COVER_INDEX_RECORD;
+    for (size_t i = 0; i < n; i++)
+    {
+        const unsigned char *record = data + COVER_INDEX_HEADER + i * COVER_INDEX_RECORD;
+        uint64_t offset = get_be(record + 32, 4), length = get_be(record + 36, 2);
+        if (length == 0 || offset + length > map->size - strings)
+        {
+            return e_failure;
+        }
+    }
+    *count = n;
+    return e_success;
+}
+
+/* Record i of a checked index */
+static void read_record(const MappedFile *map, size_t count, size_t i, CoverEntry *entry, const char **path, size_t *path_len)
+{
+    const unsigned char *record = (const unsigned char *)map->data + COVER_INDEX_HEADER + i * COVER_INDEX_RECORD;
+
+    entry->pixel_bytes = get_be(record, 8);
+    entry->file_size = get_be(record + 8, 8);
+    entry->mtime_sec = (int64_t)get_be(record + 16, 8);
+    entry->mtime_nsec = (uint32_t)get_be(record + 24, 4);
+    entry->pixel_offset = (uint32_t)get_be(record + 28, 4);
+    entry->bpp = (uint16_t)get_be(record + 38, 2);
+    *path = map->data + COVER_INDEX_HEADER + count * COVER_INDEX_RECORD + get_be(record + 32, 4);
+    *path_len = get_be(record + 36, 2);
+}
+
+/* The entry still describes the file on disk */
+static int entry_current(const CoverEntry *entry, const struct stat *st)
+{
+    return (uint64_t)st->st_size == entry->file_size && (int64_t)st->st_mtim.tv_sec == entry->mtime_sec &&
+           (uint32_t)st->st_mtim.tv_nsec == entry->mtime_nsec;
+}
+
+static Status list_push(CoverList *list, const CoverEntry *entry)
+{
+    if (list->count == list->cap)
+    {
+        size_t grown_cap = list->cap ? list->cap * 2 : 64;
+        CoverEntry *grown = realloc(list->entries, grown_cap * sizeof(*grown));
+        if (grown == NULL)
+        {
+            printf("ERROR: Unable to allocate the cover index\n");
+            return e_failure;
+        }
+        list->entries = grown;
+        list->cap = grown_cap;
+    }
+    list->entries[list->count++] = *entry;
+    return e_success;
+}
+
+static void list_free(CoverList *list)
+{
+    for (size_t i = 0; i < list->count; i++)
+    {
+        free(list->entries[i].path);
+    }
+    free(list->entries);
+}
+
+static int by_path(const void *a, const void *b)
+{
+    return strcmp(((const CoverEntry *)a)->path, ((const CoverEntry *)b)->path);
+}
+
+static int by_name(const void *a, const void *b)
+{
+    return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+static int by_capacity(const void *a, const void *b)
+{
+    const CoverEntry *x = a, *y = b;
+    if (x->pixel_bytes != y->pixel_bytes)
+    {
+        return x->pixel_bytes < y->pixel_bytes ? -1 : 1;
+    }
+    return strcmp(x->path, y->path);
+}
+
+/*
+ * Function: load_index
+ * ----------------------
+ * Reads the records of an existing index, sorted by path. A missing index
+ * is an empty one.
+ *
+ * Returns:
+ * -----------
+ *   - Status: e_success, or e_failure if the file exists but is not a
+ *             cover index (it is then left alone).
+ */
+static Status load_index(const char *fname, CoverList *old)
+{
+    struct stat st;
+    MappedFile map;
+    size_t count;
+
+    if (stat(fname, &st) != 0 && errno == ENOENT)
+    {
+        return e_success;
+    }
+    if (map_file_read(fname, &map) == e_failure)
+    {
+        return e_failure;
+    }
+    Status status = check_index(&map, &count);
+    if (status == e_failure)
+    {
+        printf("ERROR: %s exists and is not a cover index\n", fname);
+    }
+    for (size_t i = 0; status == e_success && i < count; i++)
+    {
+        CoverEntry entry;
+        const char *path;
+        size_t path_len;
+        read_record(&map, count, i, &entry, &path, &path_len);
+        if ((entry.path = strndup(path, path_len)) == NULL || list_push(old, &entry) == e_failure)
+        {
+            free(entry.path);
+            status = e_failure;
+        }
+    }
+    unmap_file(&map);
+    qsort(old->entries, old->count, sizeof(*old->entries), by_path);
+    return status;
+}
+
+/*
+ * Function: read_cover
+ * ----------------------
+ * Fills in an entry from the header of a cover, reading BMP_HEADER_SIZE
+ * bytes of it.
+ *
+ * Returns:
+ * -----------
+ *   - Status: e_success, or e_failure if it is not a supported BMP.
+ */
+static Status read_cover(const char *fname, const struct stat *st, CoverEntry *entry)
+{
+    char header[BMP_HEADER_SIZE];
+    BmpInfo bmp;
+    FILE *fptr = fopen(fname, "r");
+
+    if (fptr == NULL)
+    {
+        return e_failure;
+    }
+    size_t got = fread(header, 1, sizeof(header), fptr);
+    fclose(fptr);
+    if (bmp_parse(header, got, &bmp) == e_failure)
+    {
+        return e_failure;
+    }
+    entry->pixel_bytes = bmp.pixel_bytes;
+    entry->file_size = (uint64_t)st->st_size;
+    entry->mtime_sec = (int64_t)st->st_mtim.tv_sec;
+    entry->mtime_nsec = (uint32_t)st->st_mtim.tv_nsec;
+    entry->pixel_offset = bmp.pixel_offset;
+    entry->bpp = bmp.bpp;
+    return e_success;
+}
+
+/*
+ * Function: write_index
+ * -----------------------
+ * Writes the entries, sorted by capacity, to a temporary file that then
+ * replaces the index, so an encode never reads a partial one.
+ */
+static Status write_index(const char *fname, CoverList *list)
+{
+    char temp[COVER_INDEX_MAX_PATH + 8];
+    unsigned char header[COVER_INDEX_HEADER] = {0};
+    uint64_t offset = 0;
+
+    if ((size_t)snprintf(temp, sizeof(temp), "%s.tmp", fname) >= sizeof(temp))
+    {
+        printf("ERROR: Index file name %s is too long\n", fname);
+        return e_failure;
+    }
+    FILE *fptr = fopen(temp, "w");
+    if (fptr == NULL)
+    {
+        perror("fopen");
+        fprintf(stderr, "ERROR: Unable to open file %s\n", temp);
+        return e_failure;
+    }
+
+    qsort(list->entries, list->count, sizeof(*list->entries), by_capacity);
+    memcpy(header, COVER_INDEX_MAGIC, strlen(COVER_INDEX_MAGIC));
+    put_be(header + 8, list->count, 4);
+    int ok = fwrite(header, sizeof(header), 1, fptr) == 1;
+    for (size_t i = 0; ok && i < list->count; i++)
+    {
+        const CoverEntry *entry = &list->entries[i];
+        unsigned char record[COVER_INDEX_RECORD];
+        size_t length = strlen(entry->path);
+        put_be(record, entry->pixel_bytes, 8);
+        put_be(record + 8, entry->file_size, 8);
+        put_be(record + 16, (uint64_t)entry->mtime_sec, 8);
+        put_be(record + 24, entry->mtime_nsec, 4);
+        put_be(record + 28, entry->pixel_offset, 4);
+        put_be(record + 32, offset, 4);
+        put_be(record + 36, length, 2);
+        put_be(record + 38, entry->bpp, 2);
+        ok = fwrite(record, sizeof(record), 1, fptr) == 1;
+        offset += length;
+    }
+    for (size_t i = 0; ok && i < list->count; i++)
+    {
+        ok = fputs(list->entries[i].path, fptr) >= 0;
+    }
+    if (fclose(fptr) != 0 || !ok || offset > UINT32_MAX)
+    {
+        printf("ERROR: Unable to write the cover index %s\n", temp);
+        remove(temp);
+        return e_failure;
+    }
+    if (rename(temp, fname) != 0)
+    {
+        perror("rename");
+        remove(temp);
+        return e_failure;
+    }
+    return e_success;
+}
+
+/*
+ * Function: do_index_build
+ * --------------------------
+ * Builds the cover index, or brings an existing one up to date with the
+ * covers named on the command line: unchanged covers keep their record
+ * without being opened, new and changed ones have their header read,
+ * and covers that are no longer named or gone are dropped.
+ *
+ * Parameters:
+ * --------------
+ *   - int argc, char *argv[]: Command line, argv[1] is "--index-build".
+ *
+ * Returns:
+ * -----------
+ *   - Status: e_success if the index was written, e_failure otherwise.
+ */
+Status do_index_build(int argc, char *argv[])
+{
+    if (argc < 4)
+    {
+        printf(COVER_INDEX_USAGE);
+        return e_failure;
+    }
+
+    const char *index_fname = argv[2];
+    FileList files = {0};
+    CoverList old = {0}, list = {0};
+    size_t unchanged = 0, added = 0, updated = 0, skipped = 0;
+    Status status = e_success;
+
+    for (int i = 3; status == e_success && i < argc; i++)
+    {
+        status = file_list_add(&files, argv[i]);
+    }
+    if (status == e_success)
+    {
+        status = load_index(index_fname, &old);
+    }
+    qsort(files.names, files.count, sizeof(*files.names), by_name);
+
+    for (size_t i = 0; status == e_success && i < files.count; i++)
+    {
+        const char *fname = files.names[i];
+        struct stat st;
+        if (i > 0 && strcmp(fname, files.names[i - 1]) == 0)
+        {
+            continue; // A cover named twice keeps one record
+        }
+        CoverEntry key = {(char *)fname, 0, 0, 0, 0, 0, 0}, entry;
+        const CoverEntry *known = old.count > 0 ? bsearch(&key, old.entries, old.count, sizeof(*old.entries), by_path) : NULL;
+
+        if (strlen(fname) > COVER_INDEX_MAX_PATH || stat(fname, &st) != 0)
+        {
+            printf("SKIPPED: %s: cannot be read\n", fname);
+            skipped++;
+            continue;
+        }
+        if (known != NULL && entry_current(known, &st))
+        {
+            entry = *known;
+            unchanged++;
+        }
+        else if (read_cover(fname, &st, &entry) == e_success)
+        {
+            if (known != NULL)
+            {
+                updated++;
+            }
+            else
+            {
+                added++;
+            }
+        }
+        else
+        {
+            printf("SKIPPED: %s: not a supported BMP image\n", fname);
+            skipped++;
+            continue;
+        }
+        if ((entry.path = strdup(fname)) == NULL || list_push(&list, &entry) == e_failure)
+        {
+            free(entry.path);
+            status = e_failure;
+        }
+    }
+
+    if (status == e_success)
+    {
+        status = write_index(index_fname, &list);
+        if (status == e_success)
+        {
+            printf("INFO: Index %s: %zu covers, %zu added, %zu updated, %zu unchanged, %zu removed, %zu skipped\n",
+                   index_fname, list.count, added, updated, unchanged, old.count - unchanged - updated, skipped);
+        }
+    }
+
+    list_free(&list);
+    list_free(&old);
+    file_list_free(&files);
+    return status;
+}
+
+/*
+ * Function: cover_index_pick
+ * ----------------------------
+ * Binary searches the capacity sorted records for the first cover with at
+ * least pixel_bytes of pixel array, then takes it or, if the file changed
+ * since it was indexed, the next larger one that did not.
+ *
+ * Returns:
+ * -----------
+ *   - Status: e_success with the cover's path in path,
+ *             e_failure if the index is unusable or no cover fits.
+ */
+Status cover_index_pick(const char *index_fname, uint64_t pixel_bytes, char *path, size_t size)
+{
+    MappedFile map;
+    size_t count, low = 0, high;
+
+    if (map_file_read(index_fname, &map) == e_failure)
+    {
+        return e_failure;
+    }
+    if (check_index(&map, &count) == e_failure)
+    {
+        printf("ERROR: %s is not a cover index\n", index_fname);
+        unmap_file(&map);
+        return e_failure;
+    }
+    for (high = count; low < high;)
+    {
+        size_t mid = low + (high - low) / 2;
+        if (get_be((const unsigned char *)map.data + COVER_INDEX_HEADER + mid * COVER_INDEX_RECORD, 8) < pixel_bytes)
+        {
+            low = mid + 1;
+        }
+        else
+        {
+            high = mid;
+        }
+    }
+
+    Status status = e_failure;
+    for (size_t i = low; status == e_failure && i < count; i++)
+    {
+        CoverEntry entry;
+        const char *name;
+        size_t name_len;
+        struct stat st;
+        read_record(&map, count, i, &entry, &name, &name_len);
+        if (name_len >= size || entry.file_size < entry.pixel_offset + pixel_bytes)
+        {
+            continue; // A truncated pixel array cannot hold it either
+        }
+        memcpy(path, name, name_len);
+        path[name_len] = '\0';
+        if (stat(path, &st) == 0 && entry_current(&entry, &st))
+        {
+            status = e_success;
+        }
+        else
+        {
+            LOG_INFO("INFO: Skipping %s, it changed since %s was built\n", path, index_fname);
+        }
+    }
+    if (status == e_failure)
+    {
+        printf("ERROR: No up to date cover in %s has %llu bytes of pixel array\n", index_fname, (unsigned long long)pixel_bytes);
+    }
+    unmap_file(&map);
+    return status;
+}
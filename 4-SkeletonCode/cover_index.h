@@ -0,0 +1,50 @@
+#ifndef COVER_INDEX_H
+#define COVER_INDEX_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "types.h"
+
+/*
+ * Cover index
+ * -----------
+ * Lets an encode pick a cover out of a large library without opening the
+ * candidates. --index-build reads only the BMP headers of the covers
+ * named on the command line (directories are scanned for .bmp files) and
+ * writes one record per supported cover, sorted by capacity:
+ *
+ *     ./lsb_steg --index-build covers.idx covers/
+ *     ./lsb_steg -e --cover-index covers.idx secret.txt stego.bmp
+ *
+ * The encode works out the pixel bytes its header and payload need and
+ * binary searches the index for the smallest cover that holds them. That
+ * cover is checked against its record (size and mtime) before it is
+ * used, stale ones are skipped. Building again over the same library
+ * reuses the records of unchanged covers, reads the headers of new and
+ * changed ones and drops covers that are gone. Paths are stored as given,
+ * relative ones resolve against the working directory of the encode.
+ *
+ * The index file, all numbers big endian:
+ *
+ *     "LSBCIDX1" | count (4) | reserved (4)
+ *     count records of COVER_INDEX_RECORD bytes:
+ *         pixel bytes (8) | file size (8) | mtime seconds (8) | mtime nanoseconds (4)
+ *         | pixel offset (4) | path offset (4) | path length (2) | bpp (2)
+ *     the paths, not terminated, path offsets count from the first one
+ *
+ * Pixel bytes is the capacity in bits at one payload bit per byte.
+ */
+
+#define COVER_INDEX_USAGE "Index:    ./lsb_steg --index-build <index file> <.bmp file | directory>...\n"
+#define COVER_INDEX_MAGIC "LSBCIDX1"
+#define COVER_INDEX_HEADER 16
+#define COVER_INDEX_RECORD 40
+#define COVER_INDEX_MAX_PATH 4096
+
+/* Build or update the index named on the command line */
+Status do_index_build(int argc, char *argv[]);
+
+/* Copy to path (size bytes) the smallest up to date cover of the index with at least pixel_bytes of pixel array */
+Status cover_index_pick(const char *index_fname, uint64_t pixel_bytes, char *path, size_t size);
+
+#endif
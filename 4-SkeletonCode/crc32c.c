@@ -0,0 +1,183 @@
+#include <pthread.h>
+#include "crc32c.h"
+
+#if defined(__x86_64__)
+#include <nmmintrin.h>
+#define CRC32C_X86 1
+#elif defined(__aarch64__) && defined(__linux__)
+#include <arm_acle.h>
+#include <sys/auxv.h>
+#include <asm/hwcap.h>
+#define CRC32C_ARM 1
+#endif
+
+#define CRC32C_POLY 0x82F63B78u // Reflected Castagnoli polynomial
+
+typedef uint32_t (*crc32c_fn)(uint32_t crc, const unsigned char *p, size_t n);
+
+static pthread_once_t kernel_once = PTHREAD_ONCE_INIT;
+static uint32_t table[8][256]; // Slicing-by-8 tables, filled in by select_kernel
+static crc32c_fn kernel;
+static const char *kernel_name;
+
+/*
+ * Function: crc32c_scalar
+ * -------------------------
+ * Slicing-by-8: 8 input bytes per step through 8 table lookups, bytes one
+ * at a time before and after.
+ */
+static uint32_t crc32c_scalar(uint32_t crc, const unsigned char *p, size_t n)
+{
+    for (; n >= 8; n -= 8, p += 8)
+    {
+        uint32_t lo = crc ^ ((uint32_t)p[0] | (uint32_t)p[1] << 8 | (uint32_t)p[2] << 16 | (uint32_t)p[3] << 24);
+        crc = table[7][lo & 0xFF] ^ table[6][(lo >> 8) & 0xFF] ^ table[5][(lo >> 16) & 0xFF] ^ table[4][lo >> 24] ^
+              table[3][p[4]] ^ table[2][p[5]] ^ table[1][p[6]] ^ table[0][p[7]];
+    }
+    while (n-- > 0)
+    {
+        crc = table[0][(crc ^ *p++) & 0xFF] ^ (crc >> 8);
+    }
+    return crc;
+}
+
+#ifdef CRC32C_X86
+/* SSE4.2 crc32 instruction, 8 bytes per step */
+__attribute__((target("sse4.2")))
+static uint32_t crc32c_sse42(uint32_t crc, const unsigned char *p, size_t n)
+{
+    uint64_t c = crc;
+    for (; n > 0 && ((uintptr_t)p & 7) != 0; n--)
+    {
+        c = _mm_crc32_u8((uint32_t)c, *p++);
+    }
+    for (; n >= 8; n -= 8, p += 8)
+    {
+        c = _mm_crc32_u64(c, *(const uint64_t *)p);
+    }
+    for (; n > 0; n--)
+    {
+        c = _mm_crc32_u8((uint32_t)c, *p++);
+    }
+    return (uint32_t)c;
+}
+#endif
+
+#ifdef CRC32C_ARM
+/* ARMv8 CRC extension, 8 bytes per step */
+__attribute__((target("+crc")))
+static uint32_t crc32c_armv8(uint32_t crc, const unsigned char *p, size_t n)
+{
+    for (; n > 0 && ((uintptr_t)p & 7) != 0; n--)
+    {
+        crc = __crc32cb(crc, *p++);
+    }
+    for (; n >= 8; n -= 8, p += 8)
+    {
+        crc = __crc32cd(crc, *(const uint64_t *)p);
+    }
+    for (; n > 0; n--)
+    {
+        crc = __crc32cb(crc, *p++);
+    }
+    return crc;
+}
+#endif
+
+/*
+ * Function: select_kernel
+ * -------------------------
+ * Picks the CRC instructions when the CPU has them and builds the tables
+ * of the portable loop otherwise. Like select_kernels in lsb.c it runs
+ * once, through pthread_once(), so no thread sees half built tables.
+ */
+static void select_kernel(void)
+{
+#if defined(CRC32C_X86)
+    if (__builtin_cpu_supports("sse4.2"))
+    {
+        kernel_name = "sse4.2";
+        kernel = crc32c_sse42;
+        return;
+    }
+#elif defined(CRC32C_ARM)
+    if (getauxval(AT_HWCAP) & HWCAP_CRC32)
+    {
+        kernel_name = "armv8";
+        kernel = crc32c_armv8;
+        return;
+    }
+#endif
+    for (uint32_t i = 0; i < 256; i++)
+    {
+        uint32_t crc = i;
+        for (int j = 0; j < 8; j++)
+        {
+            crc = crc & 1 ? (crc >> 1) ^ CRC32C_POLY : crc >> 1;
+        }
+        table[0][i] = crc;
+    }
+    for (uint32_t i = 0; i < 256; i++)
+    {
+        for (int k = 1; k < 8; k++)
+        {
+            table[k][i] = table[0][table[k - 1][i] & 0xFF] ^ (table[k - 1][i] >> 8);
+        }
+    }
+    kernel_name = "scalar";
+    kernel = crc32c_scalar;
+}
+
+uint32_t crc32c(uint32_t crc, const void *data, size_t n)
+{
+    pthread_once(&kernel_once, select_kernel);
+    return ~kernel(~crc, data, n);
+}
+
+/* a * b modulo the polynomial, both reflected (bit 31 is x^0) */
+static uint32_t multiply(uint32_t a, uint32_t b)
+{
+    uint32_t product = 0;
+
+    for (uint32_t m = 1u << 31; m != 0; m >>= 1)
+    {
+        if (a & m)
+        {
+            product ^= b;
+        }
+        b = b & 1 ? (b >> 1) ^ CRC32C_POLY : b >> 1;
+    }
+    return product;
+}
+
+/*
+ * Function: crc32c_shift
+ * ------------------------
+ * Multiplies crc by x^(8n) modulo the polynomial, squaring x^8 once per
+ * bit of n, so the cost grows with log n and not with n.
+ */
+uint32_t crc32c_shift(uint32_t crc, uint64_t n)
+{
+    uint32_t power = 1u << 23; // x^8
+
+    for (; n != 0; n >>= 1)
+    {
+        if (n & 1)
+        {
+            crc = multiply(power, crc);
+        }
+        power = multiply(power, power);
+    }
+    return crc;
+}
+
+uint32_t crc32c_combine(uint32_t crc1, uint32_t crc2, uint64_t len2)
+{
+    return crc32c_shift(crc1, len2) ^ crc2;
+}
+
+const char *crc32c_kernel_name(void)
+{
+    pthread_once(&kernel_once, select_kernel);
+    return kernel_name;
+}
@@ -0,0 +1,34 @@
+#ifndef CRC32C_H
+#define CRC32C_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * CRC32C
+ * ------
+ * The Castagnoli CRC (iSCSI, ext4, SSE4.2 crc32 instruction), used as the
+ * payload checksum of STEGO_FLAG_CRC. The CPU's CRC instructions are used
+ * when it has them (SSE4.2 on x86, the ARMv8 CRC extension), a table
+ * driven slicing-by-8 loop otherwise.
+ *
+ * crc32c() continues a running CRC like zlib's crc32(): start from 0 and
+ * feed the data in pieces of any size. Parts of a buffer checksummed
+ * independently (on several threads) are put back together with
+ * crc32c_combine(), or with crc32c_shift() when many parts are folded
+ * into one word: the CRC of A | B is crc32c_shift(crc(A), |B|) ^ crc(B).
+ */
+
+/* Continue the CRC crc (0 to start) over n more bytes */
+uint32_t crc32c(uint32_t crc, const void *data, size_t n);
+
+/* CRC of A | B from crc1 = crc(A), crc2 = crc(B) and len2 = |B| */
+uint32_t crc32c_combine(uint32_t crc1, uint32_t crc2, uint64_t len2);
+
+/* Share of crc(A) in the CRC of A followed by n more bytes */
+uint32_t crc32c_shift(uint32_t crc, uint64_t n);
+
+/* Name of the implementation selected for this CPU ("sse4.2", "armv8", "scalar") */
+const char *crc32c_kernel_name(void);
+
+#endif
@@ -1,8 +1,84 @@
+#define _FILE_OFFSET_BITS 64 // Images larger than 2 GB on 32-bit hosts
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <sys/stat.h>
+#include "common.h"
 #include "decode.h"
+#include "stego.h"
+#include "stego_header.h"
+#include "lsb.h"
+#include "crc32c.h"
+#include "mmap_io.h"
+#include "parallel.h"
 #include "types.h"
 
+static Status read_magic_string(DecodeInfo *decInfo, char *magic_string);
+static Status read_header_from_file(void *ctx, char *data, size_t n);
+static void set_output_extension(DecodeInfo *decInfo, const char *file_exten);
+static Status finish_decompression(DecodeInfo *decInfo, const LzStream *lz);
+
+/*
+ * Function: decode_info_init
+ * ----------------------------
+ * Sets up a decoder context whose block buffers and output file name live
+ * in caller supplied memory, so decoding never allocates and the footprint
+ * only depends on chunk_size. The context is reused for any number of jobs.
+ *
+ * Parameters:
+ * ---------------
+ *   - DecodeInfo *decInfo: The context to set up.
+ *   - char *mem: At least DECODE_ARENA_SIZE(chunk_size) bytes, aligned to ARENA_ALIGN.
+ *   - size_t size: Size of mem.
+ *   - size_t chunk_size: Payload bytes per block, at least 1.
+ *
+ * Returns:
+ * --------------
+ *   - Status: e_success, or e_failure if mem is too small for chunk_size.
+ */
+Status decode_info_init(DecodeInfo *decInfo, char *mem, size_t size, size_t chunk_size)
+{
+    memset(decInfo, 0, sizeof(*decInfo));
+    arena_init(&decInfo->arena, mem, size);
+    if (chunk_size == 0 || chunk_size > SIZE_MAX / 8 / PIPELINE_DEPTH ||
+        (decInfo->data = arena_alloc(&decInfo->arena, chunk_size * PIPELINE_DEPTH)) == NULL ||
+        (decInfo->image_data = arena_alloc(&decInfo->arena, chunk_size * 8 * PIPELINE_DEPTH)) == NULL ||
+        (decInfo->lz_frame = arena_alloc(&decInfo->arena, LZ_FRAME_SIZE)) == NULL ||
+        (decInfo->lz_block = arena_alloc(&decInfo->arena, LZ_BLOCK_SIZE)) == NULL ||
+        (decInfo->aead_segment = arena_alloc(&decInfo->arena, AEAD_SEGMENT_SIZE)) == NULL ||
+        decInfo->arena.size - decInfo->arena.used < ARENA_ROUND(MAX_OUTPUT_FNAME + STEGO_MAX_EXTN + 1))
+    {
+        printf("ERROR: Decoder memory of %zu bytes is too small for blocks of %zu bytes\n", size, chunk_size);
+        return e_failure;
+    }
+    arena_keep(&decInfo->arena); // The output file name is allocated per job
+    decInfo->chunk_size = chunk_size;
+    decode_info_reset(decInfo);
+    return e_success;
+}
+
+/*
+ * Function: decode_info_reset
+ * -----------------------------
+ * Clears the per-job state of a context set up by decode_info_init and
+ * restores the option defaults, keeping the buffers.
+ */
+void decode_info_reset(DecodeInfo *decInfo)
+{
+    DecodeInfo kept = *decInfo;
+
+    memset(decInfo, 0, sizeof(*decInfo));
+    decInfo->arena = kept.arena;
+    decInfo->chunk_size = kept.chunk_size;
+    decInfo->image_data = kept.image_data;
+    decInfo->data = kept.data;
+    decInfo->lz_frame = kept.lz_frame;
+    decInfo->lz_block = kept.lz_block;
+    decInfo->aead_segment = kept.aead_segment;
+    arena_reset(&decInfo->arena);
+    decInfo->nthreads = 1;
+}
+
 /**
  *
  * Function : 
@@ -34,39 +110,189 @@ Status read_and_validate_decode_args(int argc, char *argv[], DecodeInfo *decInfo
 
 Status read_and_validate_decode_args(int argc, char *argv[], DecodeInfo *decInfo)
 {
-    if (argc < 3 || argc > 4) // Check if the argument count is correct (either 3 or 4)
+    char *args[2]; // Positional arguments: stego image, output file
+    int nargs = 0;
+    Status parsed = e_success; // Of -j, read by parse_jobs()
+
+    decode_info_reset(decInfo); // Context set up once by decode_info_init
+
+    // Separate the options from the positional arguments
+    for (int i = 2; i < argc; i++)
+    {
+        if (strcmp(argv[i], "-m") == 0 || strcmp(argv[i], "--mmap") == 0)
+        {
+            decInfo->use_mmap = 1;
+        }
+        else if (strcmp(argv[i], "-s") == 0 || strcmp(argv[i], "--magic") == 0)
+        {
+            // Expected signature given on the command line, no prompt
+            if (i + 1 == argc || strlen(argv[i + 1]) == 0 || strlen(argv[i + 1]) > MAX_MAGIC_STRING)
+            {
+                printf("ERROR: -s expects a magic string of 1 to %d characters\n", MAX_MAGIC_STRING);
+                return e_failure;
+            }
+            decInfo->magic_string = argv[++i];
+        }
+        else if (strcmp(argv[i], "-a") == 0 || strcmp(argv[i], "--auto") == 0)
+        {
+            decInfo->magic_string = MAGIC_STRING; // Check against the compiled-in signature
+        }
+        else if (parse_jobs(argc, argv, &i, &decInfo->nthreads, &parsed))
+        {
+            if (parsed == e_failure)
+            {
+                return e_failure;
+            }
+            decInfo->use_mmap = 1; // Parallel extraction works on the mapped files
+        }
+        else if (strcmp(argv[i], "-k") == 0 || strcmp(argv[i], "--key") == 0)
+        {
+            // A scattered payload is gathered from the mapped image
+            if (i + 1 == argc || argv[i + 1][0] == '\0')
+            {
+                printf("ERROR: -k expects a key\n");
+                return e_failure;
+            }
+            decInfo->key = argv[++i];
+            decInfo->use_mmap = 1;
+        }
+        else if (strcmp(argv[i], "--key-file") == 0)
+        {
+            // Key of a sealed payload, instead of the environment
+            if (i + 1 == argc)
+            {
+                printf("ERROR: --key-file expects a file name\n");
+                return e_failure;
+            }
+            decInfo->key_file = argv[++i];
+        }
+        else if (strcmp(argv[i], "--stats") == 0)
+        {
+            decInfo->show_stats = 1;
+        }
+        else if (strcmp(argv[i], "--verify") == 0)
+        {
+            decInfo->verify_only = 1;
+        }
+        else if (strcmp(argv[i], "--range") == 0)
+        {
+            // Byte range of the payload, checked against its size once the header is read
+            char *end;
+            if (i + 1 == argc || argv[i + 1][0] == '-' || (decInfo->range_offset = strtoull(argv[i + 1], &end, 10), *end != ':') ||
+                end[1] == '\0' || end[1] == '-' || (decInfo->range_len = strtoull(end + 1, &end, 10), *end != '\0'))
+            {
+                printf("ERROR: --range expects offset:len in bytes\n");
+                return e_failure;
+            }
+            i++;
+            decInfo->has_range = 1;
+        }
+        else if (argv[i][0] == '-' && argv[i][1] != '\0')
+        {
+            printf("ERROR: Unknown option %s\n", argv[i]);
+            printf(DECODE_USAGE);
+            return e_failure;
+        }
+        else if (nargs < 2)
+        {
+            args[nargs++] = argv[i];
+        }
+        else
+        {
+            printf(DECODE_USAGE);
+            return e_failure;
+        }
+    }
+
+    if (nargs < 1) // Check if the argument count is correct (stego image and optional output file)
     {
-        printf("Decoding: ./lsb_steg -d <.bmp file> [output file]\n");
+        printf(DECODE_USAGE);
         return e_failure;
     }
 
-    // Validate source image file (should end with .bmp)
-    char *str = strstr(argv[2], ".bmp");
-    if (str != NULL && strcmp(str, ".bmp") == 0)
+    // Validate source image file (should end with .bmp, "-" reads it from stdin)
+    char *str = strstr(args[0], ".bmp");
+    if (strcmp(args[0], "-") == 0 || (str != NULL && strcmp(str, ".bmp") == 0))
     {
-        decInfo->stego_image_fname1 = argv[2]; // Store the name of the stego image
+        decInfo->stego_image_fname1 = args[0]; // Store the name of the stego image
     }
     else
     {
-        printf("Decoding: ./lsb_steg -d <.bmp file> [output file]\n");
+        printf(DECODE_USAGE);
         return e_failure;
     }
 
-    // Handle optional output file name
-    if (argc == 4)
+    // Handle optional output file name, stored with room for the decoded extension
+    const char *output_fname = nargs == 2 ? args[1] : "output"; // Default name without extension
+    size_t length = strlen(output_fname);
+    if (length > MAX_OUTPUT_FNAME || (decInfo->output_fname = arena_alloc(&decInfo->arena, length + STEGO_MAX_EXTN + 1)) == NULL)
     {
-        strcpy(decInfo->output_fname, argv[3]); // Store the name as provided, without extension manipulation
+        printf("ERROR: Output file name is longer than %d characters\n", MAX_OUTPUT_FNAME);
+        return e_failure;
     }
-    else
+    memcpy(decInfo->output_fname, output_fname, length + 1); // Store the name as provided, without extension manipulation
+    if (nargs < 2)
     {
-        strcpy(decInfo->output_fname, "output"); // Default name without extension
-        printf("No output file provided. Using default: %s\n", decInfo->output_fname);
+        LOG_INFO("No output file provided. Using default: %s\n", decInfo->output_fname);
     }
 
-    printf("Output file name: %s\n", decInfo->output_fname);
+    if (strcmp(decInfo->stego_image_fname1, "-") == 0 && decInfo->magic_string == NULL)
+    {
+        printf("ERROR: Decoding from stdin needs -a or -s <magic>, the prompt would read the image\n");
+        return e_failure;
+    }
+    if (decInfo->use_mmap && (strcmp(decInfo->stego_image_fname1, "-") == 0 || strcmp(decInfo->output_fname, "-") == 0))
+    {
+        printf("ERROR: -m, -j and -k need named files, they cannot be used with stdin/stdout\n");
+        return e_failure;
+    }
+    if (decInfo->verify_only && decInfo->has_range)
+    {
+        printf("ERROR: --verify checks the whole payload and cannot be combined with --range\n");
+        return e_failure;
+    }
+    if (strcmp(decInfo->output_fname, "-") == 0 && !decInfo->verify_only)
+    {
+        stego_verbose = 0; // stdout carries the secret, progress lines would corrupt it
+    }
+
+    LOG_INFO("Output file name: %s\n", decInfo->output_fname);
     return e_success;
 }
 
+/* Checks --range against the decoded header */
+static Status check_range(DecodeInfo *decInfo)
+{
+    if (decInfo->header.flags & STEGO_FLAG_LZ)
+    {
+        printf("ERROR: --range cannot be used on the compressed payload of %s\n", decInfo->stego_image_fname1);
+        return e_failure;
+    }
+    if (decInfo->header.flags & STEGO_FLAG_KEYED)
+    {
+        printf("ERROR: --range cannot be used on the scattered payload of %s\n", decInfo->stego_image_fname1);
+        return e_failure;
+    }
+    if (decInfo->header.flags & STEGO_FLAG_AEAD)
+    {
+        printf("ERROR: --range cannot be used on the encrypted payload of %s\n", decInfo->stego_image_fname1);
+        return e_failure;
+    }
+    if (decInfo->range_offset > decInfo->header.payload_size || decInfo->range_len > decInfo->header.payload_size - decInfo->range_offset)
+    {
+        printf("ERROR: Range %llu:%llu is outside the %llu byte payload of %s\n", (unsigned long long)decInfo->range_offset,
+               (unsigned long long)decInfo->range_len, (unsigned long long)decInfo->header.payload_size, decInfo->stego_image_fname1);
+        return e_failure;
+    }
+    return e_success;
+}
+
+/* Counters for this job, NULL (nothing is timed) without --stats */
+static StegoStats *decode_stats(DecodeInfo *decInfo)
+{
+    return decInfo->show_stats ? &decInfo->stats : NULL;
+}
+
 /* 
  * Function: do_decoding
  * ----------------------
@@ -91,37 +317,315 @@ Status read_and_validate_decode_args(int argc, char *argv[], DecodeInfo *decInfo
 
 Status do_decoding(DecodeInfo *decInfo)
 {
-    printf("INFO: ## Decoding Procedure Started ##\n");
-    if (open_files_for_decode(decInfo) == e_failure) // Open files needed for decoding
+    if (decInfo->use_mmap)
+    {
+        return do_decoding_mmap(decInfo);
+    }
+    StegoStats *stats = decode_stats(decInfo);
+
+    LOG_INFO("INFO: ## Decoding Procedure Started ##\n");
+    if (STATS_STAGE(stats, STEGO_STAGE_OPEN, open_files_for_decode(decInfo)) == e_failure) // Open files needed for decoding
     {
         return e_failure;
     }
 
-    if (decode_magic_string(decInfo) == e_failure)
+    if (STATS_STAGE(stats, STEGO_STAGE_MAGIC, decode_magic_string(decInfo)) == e_failure)
     {
         return e_failure;
     }
 
-    if (decode_file_extn_size(decInfo) == e_failure)
+    if (STATS_STAGE(stats, STEGO_STAGE_HEADER, decode_file_extn_size(decInfo)) == e_failure)
     {
         return e_failure;
     }
-    if (decode_secret_file_extn(decInfo) == e_failure)
+    if (STATS_STAGE(stats, STEGO_STAGE_HEADER, decode_secret_file_extn(decInfo)) == e_failure)
     {
         return e_failure;
     }
-    if (decode_secret_file_size(decInfo) == e_failure)
+    if (STATS_STAGE(stats, STEGO_STAGE_HEADER, decode_secret_file_size(decInfo)) == e_failure)
     {
         return e_failure;
     }
-    if (decode_secret_file_data(decInfo) == e_failure)
+    if (STATS_STAGE(stats, STEGO_STAGE_EXTRACT, decode_secret_file_data(decInfo)) == e_failure)
+    {
+        return e_failure;
+    }
+    LOG_INFO("INFO: ## Decoding Done Successfully ##\n");
+    return e_success;
+}
+
+/*
+ * Running check of a STEGO_FLAG_CRC payload whose embedded bytes are
+ * decoded front to back: the payload, then its CRC trailer.
+ */
+typedef struct
+{
+    uint64_t payload_left;        // Payload bytes not seen yet
+    uint32_t crc;                 // CRC32C of the payload bytes seen so far
+    char trailer[STEGO_CRC_SIZE]; // The trailer, once decoded
+    size_t trailer_len;
+} PayloadCheck;
+
+static void check_init(PayloadCheck *check, uint64_t payload_size)
+{
+    memset(check, 0, sizeof(*check));
+    check->payload_left = payload_size;
+}
+
+/* Takes the next n decoded bytes, returns how many of them are payload; the rest is the trailer */
+static size_t check_block(PayloadCheck *check, const char *data, size_t n)
+{
+    size_t payload = check->payload_left < n ? (size_t)check->payload_left : n;
+
+    check->crc = crc32c(check->crc, data, payload);
+    check->payload_left -= payload;
+    memcpy(check->trailer + check->trailer_len, data + payload, n - payload);
+    check->trailer_len += n - payload;
+    return payload;
+}
+
+/* Compares the CRC of the payload with its trailer */
+static Status check_finish(DecodeInfo *decInfo, const PayloadCheck *check)
+{
+    if (check->payload_left != 0 || check->trailer_len != STEGO_CRC_SIZE || stego_header_unpack_crc(check->trailer) != check->crc)
     {
+        printf("ERROR: %s: %s\n", decInfo->stego_image_fname1, stego_strerror(STEGO_ERR_CHECKSUM));
         return e_failure;
     }
-    printf("INFO: ## Decoding Done Successfully ##\n");
     return e_success;
 }
 
+/* Result line of --verify, printed even when quiet */
+static void report_verified(DecodeInfo *decInfo)
+{
+    printf("%s: payload of %llu bytes matches its checksum\n", decInfo->stego_image_fname1,
+           (unsigned long long)decInfo->header.payload_size);
+}
+
+static void report_unverified(DecodeInfo *decInfo, StegoError err)
+{
+    if (err == STEGO_ERR_NO_CHECKSUM)
+    {
+        printf("ERROR: %s carries no checksum, encode it with --checksum to make it verifiable\n", decInfo->stego_image_fname1);
+    }
+    else
+    {
+        printf("ERROR: %s: %s\n", decInfo->stego_image_fname1, stego_strerror(err));
+    }
+}
+
+/* Where decompress_mapped writes, output.size bytes in total */
+typedef struct
+{
+    char *out;
+    size_t used, size;
+} MappedSink;
+
+/* lz_sink_fn copying decompressed data into the output mapping */
+static Status write_mapped(void *ctx, const char *data, size_t n)
+{
+    MappedSink *sink = ctx;
+    if (n > sink->size - sink->used)
+    {
+        return e_failure; // More data than the header's raw size
+    }
+    memcpy(sink->out + sink->used, data, n);
+    sink->used += n;
+    return e_success;
+}
+
+/*
+ * Function: decompress_mapped
+ * -----------------------------
+ * Extracts a compressed (STEGO_FLAG_LZ) payload from the mapped stego
+ * image block by block and decompresses it into the output mapping. The
+ * frames have to be decoded in order, so this runs on one thread. A CRC
+ * trailer is decoded with the last block and checked in the same pass.
+ *
+ * Returns:
+ * -----------
+ *   - Status: e_success if the payload decompressed to exactly
+ *             output->size bytes, e_failure otherwise.
+ */
+static Status decompress_mapped(DecodeInfo *decInfo, const char *image, MappedFile *output)
+{
+    MappedSink sink = {output->data, 0, output->size};
+    LzStream lz;
+    PayloadCheck check;
+    int checked = (decInfo->header.flags & STEGO_FLAG_CRC) != 0;
+    int bits = decInfo->header.bits;
+    size_t size = decInfo->chunk_size - decInfo->chunk_size % bits; // Every block starts on an image byte boundary
+    uint64_t total = stego_header_stream_size(&decInfo->header);
+
+    lz_stream_init(&lz, decInfo->lz_frame, decInfo->lz_block, write_mapped, &sink);
+    check_init(&check, decInfo->file_size);
+    for (uint64_t done = 0; done < total;)
+    {
+        size_t n = total - done < size ? (size_t)(total - done) : size;
+        decode_lsb_bits_to_bytes(decInfo->data, n, image, bits);
+        image += lsb_image_bytes(n, bits);
+        done += n;
+        if (checked)
+        {
+            n = check_block(&check, decInfo->data, n);
+        }
+        if (lz_stream_feed(&lz, decInfo->data, n) == e_failure)
+        {
+            printf("ERROR: Corrupt compressed payload in %s\n", decInfo->stego_image_fname1);
+            return e_failure;
+        }
+    }
+    if (checked && check_finish(decInfo, &check) == e_failure)
+    {
+        return e_failure;
+    }
+    return finish_decompression(decInfo, &lz);
+}
+
+/*
+ * Function: do_decoding_mmap
+ * ----------------------------
+ * Memory mapped variant of do_decoding. The stego image is mapped
+ * read-only, the header fields are decoded in place and the secret data
+ * is extracted from the mapping straight into the mapped output file,
+ * split across decInfo->nthreads workers when -j is given.
+ *
+ * Parameters:
+ * ---------------------
+ *   - DecodeInfo *decInfo: A pointer to a DecodeInfo structure containing
+ *     information about the stego image and output file.
+ *
+ * Returns:
+ * --------------
+ *   - Status: e_success if all decoding operations were successful,
+ *             e_failure if any step fails.
+ */
+Status do_decoding_mmap(DecodeInfo *decInfo)
+{
+    MappedFile stego, output;
+    Status status = e_failure;
+    char magic_string[MAX_MAGIC_STRING + 1];
+    StegoError err;
+    StegoStats *stats = decode_stats(decInfo);
+    size_t offset;
+
+    LOG_INFO("INFO: ## Decoding Procedure Started ##\n");
+    if (STATS_STAGE(stats, STEGO_STAGE_OPEN, map_file_read(decInfo->stego_image_fname1, &stego)) == e_failure)
+    {
+        return e_failure;
+    }
+    LOG_INFO("INFO: Opening required files\n");
+    LOG_INFO("INFO: Mapped %s\n", decInfo->stego_image_fname1);
+
+    if (read_magic_string(decInfo, magic_string) == e_failure)
+    {
+        goto out;
+    }
+
+    // Magic string and version 1 or 2 header, decoded straight from the mapping
+    StegoOptions opts = {magic_string, 0, 0, decInfo->nthreads, stats, NULL, decInfo->key, 0};
+    if (stego_decode_header(stego.data, stego.size, &opts, &decInfo->header, &offset, &err) == e_failure)
+    {
+        if (err == STEGO_ERR_MAGIC)
+        {
+            printf("The decoded magic string does not match the input magic string.\n");
+        }
+        else
+        {
+            printf("ERROR: %s: %s\n", decInfo->stego_image_fname1, stego_strerror(err));
+        }
+        goto out;
+    }
+    if ((decInfo->header.flags & STEGO_FLAG_KEYED) && decInfo->key == NULL)
+    {
+        printf("ERROR: The payload of %s is scattered with a key, decode it with -k\n", decInfo->stego_image_fname1);
+        goto out;
+    }
+    if (decInfo->verify_only)
+    {
+        // Every payload byte is decoded and checksummed, none is kept
+        if (stego_verify(stego.data, stego.size, &opts, NULL, &err) == e_failure)
+        {
+            report_unverified(decInfo, err);
+            goto out;
+        }
+        report_verified(decInfo);
+        status = e_success;
+        goto out;
+    }
+    if (decInfo->header.flags & STEGO_FLAG_SHARD)
+    {
+        printf("ERROR: %s holds one shard of a larger payload, decode it with --shard-decode\n", decInfo->stego_image_fname1);
+        goto out;
+    }
+    if (decInfo->header.flags & STEGO_FLAG_AEAD)
+    {
+        printf("ERROR: The payload of %s is encrypted, it is opened through a stream and cannot be decoded with -m, -j or -k\n",
+               decInfo->stego_image_fname1);
+        goto out;
+    }
+    LOG_INFO("INFO: Decoding Magic String Signature\n");
+    LOG_INFO("INFO: Done\n");
+    decInfo->length = decInfo->header.extn_size;
+    decInfo->file_size = decInfo->header.payload_size;
+    set_output_extension(decInfo, decInfo->header.extn);
+    LOG_INFO("INFO: Decoding %s File Size\n", decInfo->output_fname);
+    LOG_INFO("INFO: Done\n");
+
+    if (decInfo->has_range && check_range(decInfo) == e_failure)
+    {
+        goto out;
+    }
+    size_t output_size = decInfo->has_range ? decInfo->range_len : decInfo->header.raw_size;
+    if (STATS_STAGE(stats, STEGO_STAGE_OPEN, map_file_write(decInfo->output_fname, output_size, &output)) == e_failure)
+    {
+        goto out;
+    }
+    LOG_INFO("INFO: Mapped %s\n", decInfo->output_fname);
+    Status extracted;
+    if (decInfo->has_range)
+    {
+        // Only the image bytes of the range are touched, the aligned part on decInfo->nthreads workers
+        extracted = stego_decode_range(stego.data, stego.size, &opts, decInfo->range_offset, output.size, output.data, NULL, &err);
+        if (extracted == e_failure)
+        {
+            printf("ERROR: %s\n", stego_strerror(err));
+        }
+    }
+    else if (decInfo->header.flags & STEGO_FLAG_LZ)
+    {
+        // The compressed stream is decoded in one pass, straight into the output mapping, errors are printed as they are found
+        extracted = STATS_STAGE(stats, STEGO_STAGE_EXTRACT, decompress_mapped(decInfo, stego.data + offset, &output));
+        stats_add_bytes(stats, STEGO_STAGE_EXTRACT, lsb_image_bytes(decInfo->file_size, decInfo->header.bits), output.size);
+    }
+    else
+    {
+        // Secret data is extracted on decInfo->nthreads workers
+        extracted = stego_decode(stego.data, stego.size, &opts, output.data, output.size, NULL, &err);
+        if (extracted == e_failure)
+        {
+            printf("ERROR: %s\n", stego_strerror(err));
+        }
+    }
+    unmap_file(&output);
+    if (extracted == e_failure)
+    {
+        // Damaged or incomplete, it must not stay under the output name
+        if (remove(decInfo->output_fname) != 0)
+        {
+            perror("remove");
+        }
+        goto out;
+    }
+    LOG_INFO("INFO: Decoding %s File Data\n", decInfo->output_fname);
+    LOG_INFO("INFO: Done\n");
+    LOG_INFO("INFO: ## Decoding Done Successfully ##\n");
+    status = e_success;
+out:
+    unmap_file(&stego);
+    return status;
+}
+
 /* 
  * Function: open_files_for_decode
  * ---------------------------------
@@ -143,18 +647,95 @@ Status do_decoding(DecodeInfo *decInfo)
  */
 Status open_files_for_decode(DecodeInfo *decInfo)
 {
-    decInfo->fptr_stego_image = fopen(decInfo->stego_image_fname1, "r"); // Open the stego image file in read mode
+    char header[BMP_MAX_HEADER];
+    // Open the stego image file in read mode, "-" is stdin
+    decInfo->fptr_stego_image = strcmp(decInfo->stego_image_fname1, "-") == 0 ? stdin : fopen(decInfo->stego_image_fname1, "r");
     if (decInfo->fptr_stego_image == NULL)
     {
         printf("ERROR : unable to open the stego image\n");
         return e_failure;
     }
-    fseek(decInfo->fptr_stego_image, 54, SEEK_SET); // Skip BMP header
-    printf("INFO: Opening required files\n");
-    printf("INFO: Opened %s\n", decInfo->stego_image_fname1);
+    if (fread(header, BMP_HEADER_SIZE, 1, decInfo->fptr_stego_image) != 1) // Skip BMP header by reading it, so pipes work too
+    {
+        printf("ERROR : unable to read the BMP header of the stego image\n");
+        return e_failure;
+    }
+    if (bmp_parse(header, BMP_HEADER_SIZE, &decInfo->bmp) == e_failure)
+    {
+        printf("ERROR : %s is not a supported BMP image\n", decInfo->stego_image_fname1);
+        return e_failure;
+    }
+    size_t rest = decInfo->bmp.pixel_offset - BMP_HEADER_SIZE; // Rest of a V4/V5 header, masks, gap
+    if (fread(header + BMP_HEADER_SIZE, 1, rest, decInfo->fptr_stego_image) != rest)
+    {
+        printf("ERROR : unable to read the BMP header of the stego image\n");
+        return e_failure;
+    }
+    LOG_INFO("INFO: Opening required files\n");
+    LOG_INFO("INFO: Opened %s\n", decInfo->stego_image_fname1);
+    return e_success;
+}
+
+/*
+ * Function: read_magic_string
+ * -----------------------------
+ * Gets the magic string the stego image is expected to carry, either from
+ * decInfo->magic_string or by prompting for it.
+ *
+ * Parameters:
+ * --------------
+ *   - DecodeInfo *decInfo: Decoding information, may carry the signature.
+ *   - char *magic_string: Buffer of MAX_MAGIC_STRING + 1 bytes for the string.
+ *
+ * Returns:
+ * -----------
+ *   - Status: e_success if a string was read, e_failure on end of input.
+ */
+static Status read_magic_string(DecodeInfo *decInfo, char *magic_string)
+{
+    if (decInfo->magic_string != NULL)
+    {
+        snprintf(magic_string, MAX_MAGIC_STRING + 1, "%s", decInfo->magic_string);
+        return e_success;
+    }
+    // On stdout the prompt would land in front of a secret written there
+    fprintf(strcmp(decInfo->output_fname, "-") == 0 ? stderr : stdout, "Enter the magic string to decode:\n");
+    if (scanf("%16s", magic_string) != 1)
+    {
+        printf("ERROR: No magic string given\n");
+        return e_failure;
+    }
     return e_success;
 }
 
+/*
+ * Function: close_files_for_decode
+ * ----------------------------------
+ * Closes the stego image and the output file. Safe to call after a failed
+ * or partial decode, and required before the DecodeInfo is reused.
+ *
+ * Parameters:
+ * --------------------
+ *   - DecodeInfo *decInfo: A pointer to a DecodeInfo structure.
+ */
+void close_files_for_decode(DecodeInfo *decInfo)
+{
+    if (decInfo->fptr_stego_image != NULL && decInfo->fptr_stego_image != stdin)
+    {
+        fclose(decInfo->fptr_stego_image);
+    }
+    decInfo->fptr_stego_image = NULL;
+    if (decInfo->fptr_output_file == stdout)
+    {
+        fflush(stdout);
+    }
+    else if (decInfo->fptr_output_file != NULL)
+    {
+        fclose(decInfo->fptr_output_file);
+    }
+    decInfo->fptr_output_file = NULL;
+}
+
 /* 
  * Function: decode_magic_string
  * -------------------------------
@@ -178,30 +759,31 @@ Status open_files_for_decode(DecodeInfo *decInfo)
 
 Status decode_magic_string(DecodeInfo *decInfo)
 {
-    char magic_string[3];         // Buffer for the magic string to be decoded
-    char image_buffer[8] = {0};   // Buffer to hold image data
-    char decoded_magic_string[3]; // Buffer for the decoded magic string
+    char magic_string[MAX_MAGIC_STRING + 1];          // Buffer for the magic string to be decoded
+    char image_buffer[MAX_MAGIC_STRING * 8];           // Buffer to hold image data
+    char decoded_magic_string[MAX_MAGIC_STRING + 1];  // Buffer for the decoded magic string
 
-    printf("Enter the magic string to decode:\n");
-    scanf("%s", magic_string);
+    if (read_magic_string(decInfo, magic_string) == e_failure)
+    {
+        return e_failure;
+    }
 
-    // Decode the magic string from the stego image
-    for (int i = 0; i < strlen(magic_string); i++)
+    // Decode the magic string from the stego image with a single read
+    size_t length = strlen(magic_string);
+    if (fread(image_buffer, sizeof(char), length * 8, decInfo->fptr_stego_image) != length * 8)
     {
-        if (fread(image_buffer, sizeof(char), 8, decInfo->fptr_stego_image) != 8)
-        {
-            printf("ERROR : Unable to read 8 bytes from the stego image\n");
-            return e_failure;
-        }
-        decode_lsb_to_byte(&decoded_magic_string[i], image_buffer); // Decode each byte
+        printf("ERROR : Unable to read %zu bytes from the stego image\n", length * 8);
+        return e_failure;
     }
+    decode_lsb_to_bytes(decoded_magic_string, length, image_buffer);
 
-    decoded_magic_string[strlen(magic_string)] = '\0'; // Null-terminate the decoded string
+    decoded_magic_string[length] = '\0'; // Null-terminate the decoded string
 
     if (strcmp(magic_string, decoded_magic_string) == 0) // Check if the decoded magic string matches the input
     {
-        printf("INFO: Decoding Magic String Signature\n");
-        printf("INFO: Done\n");
+        decInfo->magic_length = length;
+        LOG_INFO("INFO: Decoding Magic String Signature\n");
+        LOG_INFO("INFO: Done\n");
         return e_success;
     }
     else
@@ -257,17 +839,34 @@ Status decode_lsb_to_byte(char *data, char *image_buffer)
  */
 Status decode_lsb_to_int(int *data, char *image_buffer)
 {
-    *data = 0; // Initialize the decoded integer to zero
-    for (int i = 0; i < 32; i++)
-    {
-        int lsb = image_buffer[i] & 1; // Extract the least significant bit
-        *data = (*data << 1) | lsb;    // Shift and store the LSB
-    }
+    unsigned char bytes[4]; // The integer is stored most significant byte first
+    decode_lsb_to_bytes((char *)bytes, sizeof(bytes), image_buffer);
+    *data = (int)((unsigned int)bytes[0] << 24 | (unsigned int)bytes[1] << 16 | (unsigned int)bytes[2] << 8 | bytes[3]);
     return e_success;
 }
 
 
 
+/*
+ * Function: read_header_from_file
+ * ---------------------------------
+ * header_read_fn decoding the next n header bytes from the stego image
+ * stream, 8 image bytes per header byte.
+ */
+static Status read_header_from_file(void *ctx, char *data, size_t n)
+{
+    DecodeInfo *decInfo = ctx;
+    char image_buffer[STEGO_MAX_HEADER * 8]; // Header fields are read one at a time, never more than this
+
+    if (n > STEGO_MAX_HEADER || fread(image_buffer, sizeof(char), n * 8, decInfo->fptr_stego_image) != n * 8)
+    {
+        printf("ERROR: Unable to read %zu bytes from Stego image\n", n * 8);
+        return e_failure;
+    }
+    decode_lsb_to_bytes(data, n, image_buffer);
+    return e_success;
+}
+
 /*
  * Function: decode_file_extn_size
  * ---------------------------------
@@ -287,29 +886,93 @@ Status decode_lsb_to_int(int *data, char *image_buffer)
  */
 Status decode_file_extn_size(DecodeInfo *decInfo)
 {
-    char image_buffer[32] = {0}; // Buffer to hold 32 bytes of image data
-    int extn_size = 0;           // Variable to store the decoded extension size
-
-    // Read 32 bytes from the stego image
-    if (fread(image_buffer, sizeof(char), 32, decInfo->fptr_stego_image) != 32)
+    // Decode the version marker (if any) and the extension size
+    if (stego_header_read_extn_size(&decInfo->header, read_header_from_file, decInfo) == e_failure)
     {
-        printf("ERROR: Unable to read 32 bytes from Stego image\n");
+        printf("ERROR: Invalid or unsupported stego header in %s\n", decInfo->stego_image_fname1);
+        return e_failure;
+    }
+    if (decInfo->header.flags & STEGO_FLAG_KEYED)
+    {
+        printf("ERROR: The payload of %s is scattered with a key, decode it with -k\n", decInfo->stego_image_fname1);
+        return e_failure;
+    }
+    if (decInfo->verify_only && !(decInfo->header.flags & STEGO_FLAG_CRC))
+    {
+        report_unverified(decInfo, STEGO_ERR_NO_CHECKSUM);
+        return e_failure;
+    }
+    if ((decInfo->header.flags & STEGO_FLAG_SHARD) && !decInfo->verify_only) // A shard checks on its own
+    {
+        printf("ERROR: %s holds one shard of a larger payload, decode it with --shard-decode\n", decInfo->stego_image_fname1);
+        return e_failure;
+    }
+    if ((decInfo->header.flags & STEGO_FLAG_AEAD) && !decInfo->verify_only && aead_read_key(decInfo->key_file, decInfo->aead_key) == e_failure)
+    {
+        if (decInfo->key_file != NULL)
+        {
+            printf("ERROR: %s does not hold a key of %d bytes or %d hex digits\n", decInfo->key_file, AEAD_KEY_SIZE, AEAD_KEY_SIZE * 2);
+        }
+        else
+        {
+            printf("ERROR: The payload of %s is encrypted, give its key with --key-file or in $%s\n", decInfo->stego_image_fname1, AEAD_KEY_ENV);
+        }
         return e_failure;
     }
-    decode_lsb_to_int(&extn_size, image_buffer); // Decode the extension size
 
-    decInfo->length = extn_size; // Store the decoded size in DecodeInfo structure
+    decInfo->length = decInfo->header.extn_size; // Store the decoded size in DecodeInfo structure
     return e_success;
 }
 
 
+/*
+ * Function: output_name_stem
+ * ----------------------------
+ * Length of an output file name without its extension, which starts at
+ * the first dot of the last path component, so dots in directory names
+ * are kept.
+ */
+size_t output_name_stem(const char *fname)
+{
+    const char *base = strrchr(fname, '/');
+    base = base != NULL ? base + 1 : fname;
+    const char *dot = strchr(base, '.');
+    return dot != NULL ? (size_t)(dot - fname) : strlen(fname);
+}
+
+/*
+ * Function: set_output_extension
+ * --------------------------------
+ * Stores the decoded extension and replaces the extension of the output
+ * file name with it.
+ *
+ * Parameters:
+ * --------------
+ *   - DecodeInfo *decInfo: Decoding information holding the output file name.
+ *   - const char *file_exten: The decoded extension, including the dot.
+ */
+static void set_output_extension(DecodeInfo *decInfo, const char *file_exten)
+{
+    snprintf(decInfo->extension, sizeof(decInfo->extension), "%s", file_exten); // Store the extension in the DecodeInfo structure
+    if (strcmp(decInfo->output_fname, "-") == 0)
+    {
+        return; // Writing to stdout, there is no name to extend
+    }
+
+    // Update the output file name with the decoded extension
+    char *dot = decInfo->output_fname + output_name_stem(decInfo->output_fname);
+    snprintf(dot, STEGO_MAX_EXTN + 1, "%s", file_exten); // Replace the existing extension, the name was allocated with room for it
+    LOG_INFO("Output file with decoded extension: %s\n", decInfo->output_fname);
+}
+
 /* 
  * Function: decode_secret_file_extn
  * ------------------------------------
  * This function decodes the secret file extension from the stego image.
  * It reads the specified number of bytes from the image, decodes them 
- * into a string representing the file extension, and prepares to create 
- * an output file with that extension.
+ * into a string representing the file extension and gives the output
+ * file name that extension. The output file is created by
+ * decode_secret_file_size, once the payload size has been checked.
  *
  * Parameters:
  * --------------------
@@ -318,48 +981,19 @@ Status decode_file_extn_size(DecodeInfo *decInfo)
  *
  * Returns:
  * ---------------
- *   - Status: e_success if the file extension is successfully decoded and
- *             the output file is created,
- *             e_failure if there is an error reading from the image or 
- *             opening the output file.
+ *   - Status: e_success if the file extension is successfully decoded,
+ *             e_failure if there is an error reading from the image or
+ *             the extension holds a '/'.
  */
 Status decode_secret_file_extn(DecodeInfo *decInfo)
 {
-    int size = decInfo->length; // Get the size of the extension to decode
-    char file_exten[20] = {0};  // Buffer for the decoded file extension
-    char image_buffer[8] = {0}; // Buffer to hold image data
-
-    // Read the extension from the stego image
-    for (int i = 0; i < size; i++)
-    {
-        if (fread(image_buffer, sizeof(char), 8, decInfo->fptr_stego_image) != 8)
-        {
-            printf("ERROR: Unable to read 8 bytes from the stego image\n");
-            return e_failure;
-        }
-        decode_lsb_to_byte(&file_exten[i], image_buffer);// Decode each byte of the extension
-    }
-    file_exten[size] = '\0';// Null-terminate the decoded extension
-    strcpy(decInfo->extension, file_exten); // Store the extension in the DecodeInfo structure
-
-    // Update the output file name with the decoded extension
-    char *dot = strchr(decInfo->output_fname, '.'); // Find the last dot in the output file name
-    if (dot != NULL)
+    // Read the extension from the stego image, its size was checked by decode_file_extn_size
+    if (stego_header_read_extn(&decInfo->header, read_header_from_file, decInfo) == e_failure)
     {
-        *dot = '\0'; // Remove the existing extension
-    }
-    strcat(decInfo->output_fname, file_exten); // Append the decoded extension
-    printf("Output file with decoded extension: %s\n", decInfo->output_fname);
-
-    decInfo->fptr_output_file = fopen(decInfo->output_fname, "w"); // Open the output file for writing
-    if (decInfo->fptr_output_file == NULL)
-    {
-        printf("ERROR: Unable to open the output file\n");
+        printf("ERROR: Invalid or unsupported stego header in %s\n", decInfo->stego_image_fname1);
         return e_failure;
     }
-
-    printf("INFO: Opened %s\n", decInfo->output_fname); // For the output file
-    printf("INFO: Done. Opened all required files\n");
+    set_output_extension(decInfo, decInfo->header.extn);
     return e_success;
 }
 
@@ -367,7 +1001,12 @@ Status decode_secret_file_extn(DecodeInfo *decInfo)
 /* 
  * Function: decode_secret_file_size
  * -----------------------------------
- * Reads the size of the secret file from the stego image.
+ * Reads the size of the secret file from the stego image and checks it
+ * against the pixel array and the file (stego_check_payload) before the
+ * output file is created, so a corrupt size is turned down without
+ * reading or writing anything more. --range and the size of an encrypted
+ * payload are checked here too: an existing output file is only
+ * truncated once the decode can start.
  *
  * Parameters:
  * --------------
@@ -376,38 +1015,317 @@ Status decode_secret_file_extn(DecodeInfo *decInfo)
  *
  * Returns:
  * ------------
- *   - Status: e_success if the secret file size was read successfully,
- *             e_failure if reading fails.
+ *   - Status: e_success if the secret file size was read successfully
+ *             and the output file is open,
+ *             e_failure if reading fails, the size does not fit the
+ *             image, --range does not fit the payload or the output
+ *             file cannot be opened.
  *
  * This function is critical for knowing how many bytes need to be extracted
  * from the stego image for the secret file.
  */
 Status decode_secret_file_size(DecodeInfo *decInfo)
 {
-    char image_buffer[32] = {0}; // Buffer to hold 32 bytes of image data
-    int size = 0; // Variable to store the decoded file size
+    // Read 32 (version 1) or 64 (version 2) bits of size from the stego image
+    if (stego_header_read_size(&decInfo->header, read_header_from_file, decInfo) == e_failure)
+    {
+        printf("ERROR: Invalid secret file size in %s\n", decInfo->stego_image_fname1);
+        return e_failure;
+    }
+    decInfo->file_size = decInfo->header.payload_size; // Store the decoded size in the DecodeInfo structure
+
+    // The image size is known unless it comes through a pipe
+    struct stat st;
+    uint64_t image_len = fstat(fileno(decInfo->fptr_stego_image), &st) == 0 && S_ISREG(st.st_mode) ? (uint64_t)st.st_size : UINT64_MAX;
+    uint64_t payload_offset = decInfo->bmp.pixel_offset + (decInfo->magic_length + stego_header_size(&decInfo->header)) * 8;
+    StegoError err;
+    if (stego_check_payload(&decInfo->bmp, &decInfo->header, payload_offset, image_len, &err) == e_failure)
+    {
+        printf("ERROR: %s: %s\n", decInfo->stego_image_fname1, stego_strerror(err));
+        return e_failure;
+    }
+    uint64_t plain_size;
+    if ((decInfo->header.flags & STEGO_FLAG_AEAD) && aead_plain_size(decInfo->file_size, &plain_size) == e_failure)
+    {
+        printf("ERROR: Invalid encrypted payload size in %s\n", decInfo->stego_image_fname1);
+        return e_failure;
+    }
+    if (decInfo->has_range && check_range(decInfo) == e_failure)
+    {
+        return e_failure;
+    }
+    LOG_INFO("INFO: Decoding %s File Size\n", decInfo->output_fname); // Reference to the output file
+    LOG_INFO("INFO: Done\n");
+    if (decInfo->verify_only)
+    {
+        return e_success; // Nothing is written
+    }
+
+    // Open the output file for writing, "-" is stdout
+    decInfo->fptr_output_file = strcmp(decInfo->output_fname, "-") == 0 ? stdout : fopen(decInfo->output_fname, "w");
+    if (decInfo->fptr_output_file == NULL)
+    {
+        printf("ERROR: Unable to open the output file\n");
+        return e_failure;
+    }
+    LOG_INFO("INFO: Opened %s\n", decInfo->output_fname); // For the output file
+    LOG_INFO("INFO: Done. Opened all required files\n");
+    return e_success;
+}
+
+
+
+/*
+ * State of the extract pipeline, remaining is used by the read stage,
+ * check by the compute stage and lz and aead by the write stage only
+ */
+typedef struct
+{
+    DecodeInfo *decInfo;
+    uint64_t remaining; // Embedded bytes whose image bytes were not read yet
+    LzStream lz;        // Decompressor of a STEGO_FLAG_LZ payload
+    size_t skip;        // Leading decoded bytes before a --range that does not start on an image byte
+    int checked;        // The CRC trailer is read and checked, never with --range
+    PayloadCheck check;
+    AeadStream *aead;   // Opener of a STEGO_FLAG_AEAD payload, NULL otherwise
+} ExtractStream;
 
-    // Read 32 bytes from the stego image
-    if (fread(image_buffer, sizeof(char), 32, decInfo->fptr_stego_image) != 32)
+/* lz_sink_fn writing decompressed data to the output file */
+static Status write_output_file(void *ctx, const char *data, size_t n)
+{
+    DecodeInfo *decInfo = ctx;
+    if (fwrite(data, sizeof(char), n, decInfo->fptr_output_file) != n)
     {
-        printf("ERROR: Unable to read 32 bytes from Stego image\n");
+        printf("ERROR: Unable to write to output file\n");
         return e_failure;
     }
+    return e_success;
+}
 
-    decode_lsb_to_int(&size, image_buffer);// Decode the file size
-    decInfo->file_size = size; // Store the decoded size in the DecodeInfo structure
-    printf("INFO: Decoding %s File Size\n", decInfo->output_fname); // Reference to the output file
-    printf("INFO: Done\n");
+/* Read stage of the extract pipeline: the stego image bytes of the next block */
+static Status read_stego_block(void *ctx, PipelineBlock *block)
+{
+    ExtractStream *stream = ctx;
+    DecodeInfo *decInfo = stream->decInfo;
+    int bits = decInfo->header.bits; // Payload bits per image byte, from the header flags
+    size_t size = decInfo->chunk_size - decInfo->chunk_size % bits; // Every block starts on an image byte boundary
+
+    block->data_len = stream->remaining < size ? (size_t)stream->remaining : size;
+    block->image_len = lsb_image_bytes(block->data_len, bits);
+    if (fread(block->image, sizeof(char), block->image_len, decInfo->fptr_stego_image) != block->image_len)
+    {
+        printf("ERROR: Unable to read %zu bytes from stego image\n", block->image_len);
+        return e_failure;
+    }
+    stream->remaining -= block->data_len;
+    block->last = stream->remaining == 0;
     return e_success;
 }
 
+/* Compute stage of the extract pipeline */
+static Status extract_stego_block(void *ctx, PipelineBlock *block)
+{
+    ExtractStream *stream = ctx;
+    if (decode_lsb_bits_to_bytes(block->data, block->data_len, block->image, stream->decInfo->header.bits) != e_success) // Decode the whole block
+    {
+        printf("ERROR: Decoding from LSB failed\n");
+        return e_failure;
+    }
+    if (stream->checked)
+    {
+        block->data_len = check_block(&stream->check, block->data, block->data_len); // The trailer is not written
+    }
+    return e_success;
+}
+
+/* Passes payload bytes on: decompressed when they are lz.h frames, written as they are otherwise */
+static Status write_plain(void *ctx, const char *data, size_t n)
+{
+    ExtractStream *stream = ctx;
+    if (stream->decInfo->header.flags & STEGO_FLAG_LZ)
+    {
+        // Decompress on the way out, whole frames are written as they complete
+        if (lz_stream_feed(&stream->lz, data, n) == e_failure)
+        {
+            printf("ERROR: Corrupt compressed payload in %s\n", stream->decInfo->stego_image_fname1);
+            return e_failure;
+        }
+        return e_success;
+    }
+    return write_output_file(stream->decInfo, data, n);
+}
+
+/* Write stage of the extract pipeline */
+static Status write_output_block(void *ctx, PipelineBlock *block)
+{
+    ExtractStream *stream = ctx;
+    if (stream->decInfo->verify_only)
+    {
+        return e_success;
+    }
+    if (stream->skip > 0)
+    {
+        size_t skip = stream->skip; // Only ever in the first block, which holds at least that many bytes
+        stream->skip = 0;
+        return write_output_file(stream->decInfo, block->data + skip, block->data_len - skip);
+    }
+    if (stream->aead != NULL)
+    {
+        // Segments are passed on once their tag matched
+        if (aead_open_feed(stream->aead, block->data, block->data_len) == e_failure)
+        {
+            if (stream->aead->forged) // The sink prints its own errors
+            {
+                printf("ERROR: The payload of %s does not authenticate, the key is wrong or the image is damaged\n",
+                       stream->decInfo->stego_image_fname1);
+            }
+            return e_failure;
+        }
+        return e_success;
+    }
+    return write_plain(stream, block->data, block->data_len); // Write the decoded block to the output file
+}
+
+/* Closes and deletes the output file of a failed extraction, stdout cannot be taken back */
+static void discard_output(DecodeInfo *decInfo)
+{
+    if (decInfo->fptr_output_file == NULL || decInfo->fptr_output_file == stdout)
+    {
+        return;
+    }
+    fclose(decInfo->fptr_output_file);
+    decInfo->fptr_output_file = NULL;
+    if (remove(decInfo->output_fname) != 0)
+    {
+        perror("remove");
+    }
+}
 
+/* Checks that a compressed payload ended on a frame boundary at the recorded size */
+static Status finish_decompression(DecodeInfo *decInfo, const LzStream *lz)
+{
+    if (lz_stream_finish(lz) == e_failure || lz->produced != decInfo->header.raw_size)
+    {
+        printf("ERROR: Compressed payload in %s decodes to %llu bytes, the header says %llu\n", decInfo->stego_image_fname1,
+               (unsigned long long)lz->produced, (unsigned long long)decInfo->header.raw_size);
+        return e_failure;
+    }
+    return e_success;
+}
+
+/*
+ * Function: seek_to_range
+ * -------------------------
+ * Moves the stego image stream from the start of the payload to the image
+ * byte that holds the first byte of --range. Payload bytes are at fixed
+ * places, so a seekable image is positioned with one fseeko(); a pipe is
+ * read past the skipped bytes block by block. With k bits per image byte
+ * the stream stops at the group of k payload bytes the range starts in,
+ * and the write stage drops the bytes of that group before the range.
+ *
+ * Returns:
+ * -----------
+ *   - Status: e_success with stream->remaining and stream->skip set,
+ *             e_failure if the image ends early. The range was checked
+ *             by decode_secret_file_size.
+ */
+static Status seek_to_range(DecodeInfo *decInfo, ExtractStream *stream)
+{
+    int bits = decInfo->header.bits;
+    uint64_t start = decInfo->range_offset - decInfo->range_offset % bits;
+    uint64_t skip = start / bits * 8;
+
+    stream->remaining = decInfo->range_offset + decInfo->range_len - start;
+    stream->skip = (size_t)(decInfo->range_offset - start);
+    if (fseeko(decInfo->fptr_stego_image, (off_t)skip, SEEK_CUR) == 0)
+    {
+        return e_success;
+    }
+    while (skip > 0)
+    {
+        size_t n = skip < decInfo->chunk_size * 8 ? (size_t)skip : decInfo->chunk_size * 8;
+        if (fread(decInfo->image_data, 1, n, decInfo->fptr_stego_image) != n)
+        {
+            printf("ERROR: Unable to read %zu bytes from stego image\n", n);
+            return e_failure;
+        }
+        skip -= n;
+    }
+    return e_success;
+}
+
+/* Runs the extract pipeline of decode_secret_file_data and the checks at the end of the payload */
+static Status extract_payload(DecodeInfo *decInfo)
+{
+    ExtractStream stream = {decInfo, stego_header_stream_size(&decInfo->header), {0}, 0, 0, {0}, NULL};
+    PipelineBlock blocks[PIPELINE_DEPTH];
+    AeadStream aead;
+    uint64_t plain_size;
+
+    lz_stream_init(&stream.lz, decInfo->lz_frame, decInfo->lz_block, write_output_file, decInfo);
+    if (decInfo->header.flags & STEGO_FLAG_AEAD)
+    {
+        aead_plain_size(decInfo->file_size, &plain_size); // Checked by decode_secret_file_size
+        aead_open_init(&aead, decInfo->aead_key, plain_size, decInfo->aead_segment, write_plain, &stream);
+        stream.aead = &aead;
+    }
+    check_init(&stream.check, decInfo->file_size);
+    if (decInfo->has_range)
+    {
+        if (seek_to_range(decInfo, &stream) == e_failure)
+        {
+            return e_failure;
+        }
+    }
+    else
+    {
+        stream.checked = (decInfo->header.flags & STEGO_FLAG_CRC) != 0;
+    }
+
+    for (int i = 0; i < PIPELINE_DEPTH; i++)
+    {
+        blocks[i].image = decInfo->image_data + i * decInfo->chunk_size * 8; // One block of image data per stage
+        blocks[i].data = decInfo->data + i * decInfo->chunk_size;            // and its decoded bytes
+        blocks[i].head = 0;
+    }
+    if (pipeline_run(blocks, stream.remaining >= (uint64_t)PIPELINE_MIN_BLOCKS * decInfo->chunk_size,
+                     read_stego_block, extract_stego_block, write_output_block, &stream) == e_failure)
+    {
+        return e_failure;
+    }
+    if (stream.checked && check_finish(decInfo, &stream.check) == e_failure)
+    {
+        return e_failure;
+    }
+    if (decInfo->verify_only)
+    {
+        report_verified(decInfo);
+        return e_success;
+    }
+    if (stream.aead != NULL && aead_open_finish(stream.aead) == e_failure)
+    {
+        printf("ERROR: The encrypted payload of %s ends before its last segment\n", decInfo->stego_image_fname1);
+        return e_failure;
+    }
+    if ((decInfo->header.flags & STEGO_FLAG_LZ) && finish_decompression(decInfo, &stream.lz) == e_failure)
+    {
+        return e_failure;
+    }
+    return e_success;
+}
 
 /*
  * Function: decode_secret_file_data
  * -----------------------------------
  * Extracts the actual secret data from the stego image and writes it to
- * the output file.
+ * the output file. Payloads of PIPELINE_MIN_BLOCKS blocks or more are
+ * read, decoded and written on a three-stage pipeline. A compressed (-z)
+ * payload is decompressed frame by frame in the write stage. With --range
+ * only the image bytes of that slice of the payload are read. A payload with
+ * a CRC trailer is checked as it is decoded, --verify stops there. An
+ * encrypted payload is opened segment by segment in the write stage, ahead
+ * of the decompressor. When any of it fails, the output file already
+ * written is deleted.
  *
  * Parameters:
  *-----------------
@@ -426,29 +1344,12 @@ Status decode_secret_file_size(DecodeInfo *decInfo)
  */
 Status decode_secret_file_data(DecodeInfo *decInfo)
 {
-    rewind(decInfo->fptr_output_file);// Reset the output file pointer to the beginning
-
-    char buffer[8]; // Buffer to hold 8 bytes of image data
-    char ch;// Variable to hold each decoded character
-    for (int i = 0; i < decInfo->file_size; i++)// Read the secret file data from the stego image
+    if (extract_payload(decInfo) == e_failure)
     {
-        if (fread(buffer, sizeof(char), 8, decInfo->fptr_stego_image) != 8)
-        {
-            printf("ERROR: Unable to read 8 bytes from stego image\n");
-            return e_failure;
-        }
-        if (decode_lsb_to_byte(&ch, buffer) != e_success)// Decode each character
-        {
-            printf("ERROR: Decoding from LSB failed\n");
-            return e_failure;
-        }
-        if (fwrite(&ch, sizeof(char), 1, decInfo->fptr_output_file) != 1) // Write the decoded character to the output file
-        {
-            printf("ERROR: Unable to write to output file\n");
-            return e_failure;
-        }
+        discard_output(decInfo); // Damaged or cut short, it must not stay under the output name
+        return e_failure;
     }
-    printf("INFO: Decoding %s File Data\n", decInfo->output_fname);
-    printf("INFO: Done\n");
+    LOG_INFO("INFO: Decoding %s File Data\n", decInfo->output_fname);
+    LOG_INFO("INFO: Done\n");
     return e_success;
 }
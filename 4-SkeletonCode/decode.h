@@ -2,28 +2,91 @@
 #define DECODE_H
 
 #include "types.h"
+#include "arena.h"
+#include "aead.h"
+#include "bmp.h"
+#include "lz.h"
+#include "pipeline.h"
+#include "stats.h"
+#include "stego_header.h"
+
+#define MAX_DECODE_BUF_SIZE 1024 // Default payload bytes extracted per block in decode_secret_file_data
+#define MAX_OUTPUT_FNAME 4096   // Longest output file name accepted
+
+/* Arena bytes a DecodeInfo working in blocks of chunk payload bytes needs (one block per pipeline stage) */
+#define DECODE_ARENA_SIZE(chunk) (ARENA_ROUND((chunk) * PIPELINE_DEPTH) + ARENA_ROUND((chunk) * 8 * PIPELINE_DEPTH) + \
+                                  ARENA_ROUND(LZ_FRAME_SIZE) + ARENA_ROUND(LZ_BLOCK_SIZE) + ARENA_ROUND(AEAD_SEGMENT_SIZE) + \
+                                  ARENA_ROUND(MAX_OUTPUT_FNAME + STEGO_MAX_EXTN + 1))
 
 typedef struct _DecodeInfo
 {
     FILE *fptr_stego_image;
     char *stego_image_fname1;
-    int file_size;
+    uint64_t file_size;
 
     char extension[5];
     int length;
 
-    char output_fname[20];
+    char *output_fname; // In the arena, with room for the decoded extension
     FILE *fptr_output_file;
+
+    /* Options */
+    int use_mmap; // Map the stego image and extract straight from the mapping
+    int nthreads; // Worker threads for the payload region (mapped mode only)
+    const char *magic_string; // Expected signature, prompted for when NULL
+    const char *key; // Key of a scattered payload (-k)
+    const char *key_file; // Key of a sealed payload (--key-file), NULL reads AEAD_KEY_ENV
+    unsigned char aead_key[AEAD_KEY_SIZE];
+    int verify_only; // Check the payload against its CRC, write no output (--verify)
+    int show_stats; // Time every stage and print the counters as JSON on stderr (--stats)
+    int has_range; // Extract only payload bytes [range_offset, range_offset + range_len) (--range)
+    uint64_t range_offset;
+    uint64_t range_len;
+    StegoStats stats; // Per-stage counters, only filled in with show_stats
+
+    /* Parsed BMP headers of the stego image */
+    BmpInfo bmp;
+
+    /* Decoded header, version 1 or 2 */
+    size_t magic_length; // Of the magic string found, the header follows it
+    StegoHeader header;
+
+    /* Buffers, carved out of caller memory by decode_info_init and kept across jobs */
+    Arena arena;
+    size_t chunk_size; // Payload bytes per block
+    char *image_data;  // PIPELINE_DEPTH blocks of chunk_size * 8 stego image bytes
+    char *data;        // PIPELINE_DEPTH blocks of chunk_size decoded bytes
+    char *lz_frame;    // LZ_FRAME_SIZE bytes: compressed frame being collected
+    char *lz_block;    // LZ_BLOCK_SIZE bytes: the frame decompressed
+    char *aead_segment; // AEAD_SEGMENT_SIZE bytes: sealed segment waiting for its tag
 } DecodeInfo;
+
+#define DECODE_USAGE "Decoding: ./lsb_steg -d [-m] [-j N] [-k <key>] [-a | -s <magic>] [--key-file <file>] [--range offset:len] [--verify] [--stats] <.bmp file | -> [output file | -]\n"
+
+/* Set up a context over mem (DECODE_ARENA_SIZE(chunk_size) bytes), once before the first job */
+Status decode_info_init(DecodeInfo *decInfo, char *mem, size_t size, size_t chunk_size);
+
+/* Clear everything but the buffers, done by read_and_validate_decode_args for every job */
+void decode_info_reset(DecodeInfo *decInfo);
+
+/* Length of an output file name up to the extension the decoded one replaces */
+size_t output_name_stem(const char *fname);
+
 /* perform validation for decoding */
 Status read_and_validate_decode_args(int argc, char *argv[], DecodeInfo *decInfo);
 
 /* Perform decoding */
 Status do_decoding(DecodeInfo *decInfo);
 
+/* Perform decoding on a memory mapped stego image */
+Status do_decoding_mmap(DecodeInfo *decInfo);
+
 /* Open files for decoding */
 Status open_files_for_decode(DecodeInfo *decInfo);
 
+/* Close the files opened while decoding */
+void close_files_for_decode(DecodeInfo *decInfo);
+
 /* Decode magic string to confirm stego file */
 Status decode_magic_string(DecodeInfo *decInfo);
 
@@ -1,42 +1,193 @@
+#define _GNU_SOURCE // copy_file_range()
+#define _FILE_OFFSET_BITS 64 // Images larger than 2 GB on 32-bit hosts
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <errno.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <sys/ioctl.h>
+#include <sys/sendfile.h>
+#include <linux/fs.h> // FICLONE
+#endif
+#include "common.h"
 #include "encode.h"
+#include "stego.h"
+#include "stego_header.h"
+#include "lsb.h"
+#include "crc32c.h"
+#include "quality.h"
+#include "mmap_io.h"
+#include "parallel.h"
 #include "types.h"
 
-#define MAGIC_STRING "#*" // Magic string used as an identifier for encoded data
-#define MAX_SECRET_BUF_SIZE 1024
 /* Function Definitions */
 
 /* Get image size
  * Input: Image file ptr
- * Output: width * height * bytes per pixel (3 in our case)
- * Description: In BMP Image, width is stored in offset 18,
- * and height after that. size is 4 bytes
+ * Output: Size of the pixel array (stride * height), 0 if the image is not
+ * a BMP file bmp_parse() accepts
+ * Description: The file and info headers are read from offset 0 and
+ * parsed with bmp_parse()
  */
 
 // Get image size
-uint get_image_size_for_bmp(FILE *fptr_image)
+uint64_t get_image_size_for_bmp(FILE *fptr_image)
 {
-    uint width, height;
-    // Seek to 18th byte
-    fseek(fptr_image, 18, SEEK_SET); // Go to width field
+    char header[BMP_HEADER_SIZE];
+    BmpInfo bmp;
 
-    fread(&width, sizeof(int), 1, fptr_image);  // Read width
-    fread(&height, sizeof(int), 1, fptr_image); // Read height
-
-    return width * height * 3; // Return image size (width * height * 3 bytes)
+    fseek(fptr_image, 0, SEEK_SET); // Go to the file header
+    if (fread(header, sizeof(header), 1, fptr_image) != 1 || bmp_parse(header, sizeof(header), &bmp) == e_failure)
+    {
+        return 0;
+    }
+    return bmp.pixel_bytes; // Bytes of pixel data, row padding included, in 64 bits so it cannot wrap
 }
 
-// Get image size
-uint get_file_size(FILE *fptr)
+// Get file size
+uint64_t get_file_size(FILE *fptr)
 {
-    uint size;
-    fseek(fptr, 0, SEEK_END); // Seek to the end of the file
-    size = ftell(fptr);       // Get the size (position of file pointer)
+    uint64_t size;
+    fseeko(fptr, 0, SEEK_END); // Seek to the end of the file
+    size = ftello(fptr);       // Get the size (position of file pointer), 64-bit offsets
     rewind(fptr);             // Rewind the file pointer to the beginning
     return size;
 }
 
+/*
+ * Function: encode_info_init
+ * ----------------------------
+ * Sets up an encoder context whose block buffers live in caller supplied
+ * memory, so encoding never allocates and the footprint only depends on
+ * chunk_size. The context is reused for any number of jobs.
+ *
+ * Parameters:
+ * ---------------
+ *   - EncodeInfo *encInfo: The context to set up.
+ *   - char *mem: At least ENCODE_ARENA_SIZE(chunk_size) bytes, aligned to ARENA_ALIGN.
+ *   - size_t size: Size of mem.
+ *   - size_t chunk_size: Secret bytes per block, at least MIN_SECRET_BUF_SIZE.
+ *
+ * Returns:
+ * --------------
+ *   - Status: e_success, or e_failure if mem is too small for chunk_size.
+ */
+Status encode_info_init(EncodeInfo *encInfo, char *mem, size_t size, size_t chunk_size)
+{
+    memset(encInfo, 0, sizeof(*encInfo));
+    arena_init(&encInfo->arena, mem, size);
+    if (chunk_size < MIN_SECRET_BUF_SIZE || chunk_size > SIZE_MAX / 8 / PIPELINE_DEPTH ||
+        (encInfo->secret_data = arena_alloc(&encInfo->arena, chunk_size * PIPELINE_DEPTH)) == NULL ||
+        (encInfo->image_data = arena_alloc(&encInfo->arena, chunk_size * 8 * PIPELINE_DEPTH)) == NULL ||
+        (encInfo->bmp_header = arena_alloc(&encInfo->arena, BMP_MAX_HEADER)) == NULL ||
+        (encInfo->lz_block = arena_alloc(&encInfo->arena, LZ_BLOCK_SIZE)) == NULL ||
+        (encInfo->lz_frame = arena_alloc(&encInfo->arena, LZ_FRAME_SIZE)) == NULL ||
+        (encInfo->lz_table = arena_alloc(&encInfo->arena, LZ_TABLE_SIZE)) == NULL ||
+        (encInfo->index_cover_fname = arena_alloc(&encInfo->arena, COVER_INDEX_MAX_PATH + 1)) == NULL ||
+        (encInfo->copy_buffer = arena_alloc(&encInfo->arena, COPY_BUF_SIZE)) == NULL)
+    {
+        printf("ERROR: Encoder memory of %zu bytes is too small for blocks of %zu bytes\n", size, chunk_size);
+        return e_failure;
+    }
+    arena_keep(&encInfo->arena);
+    encInfo->chunk_size = chunk_size;
+    encode_info_reset(encInfo);
+    return e_success;
+}
+
+/*
+ * Function: encode_info_reset
+ * -----------------------------
+ * Clears the per-job state of a context set up by encode_info_init and
+ * restores the option defaults, keeping the buffers.
+ */
+void encode_info_reset(EncodeInfo *encInfo)
+{
+    EncodeInfo kept = *encInfo;
+
+    memset(encInfo, 0, sizeof(*encInfo));
+    encInfo->arena = kept.arena;
+    encInfo->chunk_size = kept.chunk_size;
+    encInfo->image_data = kept.image_data;
+    encInfo->secret_data = kept.secret_data;
+    encInfo->bmp_header = kept.bmp_header;
+    encInfo->lz_block = kept.lz_block;
+    encInfo->lz_frame = kept.lz_frame;
+    encInfo->lz_table = kept.lz_table;
+    encInfo->index_cover_fname = kept.index_cover_fname;
+    encInfo->copy_buffer = kept.copy_buffer;
+    arena_reset(&encInfo->arena);
+    encInfo->nthreads = 1;
+    encInfo->bits = 1;
+}
+
+/*
+ * Function: pick_indexed_cover
+ * ------------------------------
+ * Works out the pixel array bytes the header and payload will take, from
+ * the secret's size and the options, and picks the smallest cover of the
+ * --cover-index index that has them. The secret is not opened. With -z it
+ * is assumed not to compress, so every frame is stored.
+ *
+ * Returns:
+ * -----------
+ *   - Status: e_success with the cover in index_cover_fname,
+ *             e_failure if the size is unknown or no cover fits.
+ */
+static Status pick_indexed_cover(EncodeInfo *encInfo)
+{
+    uint64_t size = encInfo->size_secret_file;
+    struct stat st;
+    StegoHeader hdr;
+
+    if (strcmp(encInfo->secret_fname, "-") == 0 ? !encInfo->secret_size_given : stat(encInfo->secret_fname, &st) != 0)
+    {
+        printf("ERROR: --cover-index needs the size of the secret: a named file or --secret-size\n");
+        return e_failure;
+    }
+    if (strcmp(encInfo->secret_fname, "-") != 0)
+    {
+        size = (uint64_t)st.st_size;
+    }
+    uint64_t payload_size = encInfo->compress ? size + (size + LZ_BLOCK_SIZE - 1) / LZ_BLOCK_SIZE * 4 : size;
+    if (encInfo->encrypt)
+    {
+        payload_size = aead_sealed_size(payload_size);
+    }
+    if (stego_header_init(&hdr, encInfo->secret_extn, payload_size, encInfo->bits, encInfo->force_v2) == e_failure)
+    {
+        printf("ERROR: Unable to describe %s in the stego header\n", encInfo->secret_fname);
+        return e_failure;
+    }
+    if (encInfo->compress)
+    {
+        stego_header_set_lz(&hdr, size);
+    }
+    if (encInfo->encrypt)
+    {
+        stego_header_set_aead(&hdr);
+    }
+    if (encInfo->checksum)
+    {
+        stego_header_set_crc(&hdr);
+    }
+    if (encInfo->key != NULL)
+    {
+        stego_header_set_keyed(&hdr);
+    }
+
+    uint64_t needed = stego_cover_bytes(&hdr, MAGIC_STRING);
+    if (cover_index_pick(encInfo->cover_index, needed, encInfo->index_cover_fname, COVER_INDEX_MAX_PATH + 1) == e_failure)
+    {
+        return e_failure;
+    }
+    LOG_INFO("INFO: Picked %s from %s, the payload needs %llu bytes of pixel array\n", encInfo->index_cover_fname, encInfo->cover_index,
+             (unsigned long long)needed);
+    return e_success;
+}
+
 /**
  * Funtion: brief Reads and validates command line arguments for encoding.
  *
@@ -62,18 +213,158 @@ uint get_file_size(FILE *fptr)
  */
 Status read_and_validate_encode_args(int argc, char *argv[], EncodeInfo *encInfo)
 {
+    char *args[3]; // Positional arguments: source image, secret file, stego image
+    int nargs = 0;
+    Status parsed = e_success; // Of -j, read by parse_jobs()
+
+    encode_info_reset(encInfo); // Context set up once by encode_info_init
+
+    // Separate the options from the positional arguments
+    for (int i = 2; i < argc; i++)
+    {
+        if (strcmp(argv[i], "-m") == 0 || strcmp(argv[i], "--mmap") == 0)
+        {
+            encInfo->use_mmap = 1;
+        }
+        else if (strcmp(argv[i], "-i") == 0 || strcmp(argv[i], "--in-place") == 0)
+        {
+            encInfo->in_place = 1;
+        }
+        else if (parse_jobs(argc, argv, &i, &encInfo->nthreads, &parsed))
+        {
+            if (parsed == e_failure)
+            {
+                return e_failure;
+            }
+            encInfo->use_mmap = 1; // Parallel embedding works on the mapped files
+        }
+        else if (strcmp(argv[i], "-k") == 0 || strcmp(argv[i], "--key") == 0)
+        {
+            // Keyed scattering needs the whole pixel array, so it works on the mapped files
+            if (i + 1 == argc || argv[i + 1][0] == '\0')
+            {
+                printf("ERROR: -k expects a key\n");
+                return e_failure;
+            }
+            encInfo->key = argv[++i];
+            encInfo->use_mmap = 1;
+        }
+        else if (strcmp(argv[i], "-x") == 0 || strcmp(argv[i], "--extn") == 0)
+        {
+            // Extension to record for the secret, e.g. when it comes from stdin
+            if (i + 1 == argc || argv[i + 1][0] != '.' || strlen(argv[i + 1]) > MAX_FILE_SUFFIX)
+            {
+                printf("ERROR: -x expects an extension like .txt of at most %d characters\n", MAX_FILE_SUFFIX);
+                return e_failure;
+            }
+            encInfo->secret_extn = argv[++i];
+        }
+        else if (strcmp(argv[i], "--secret-size") == 0)
+        {
+            // Size of a streamed secret, so it does not have to be buffered
+            char *end;
+            if (i + 1 == argc || argv[i + 1][0] == '-' || (encInfo->size_secret_file = strtoull(argv[i + 1], &end, 10), *end != '\0'))
+            {
+                printf("ERROR: --secret-size expects a size in bytes\n");
+                return e_failure;
+            }
+            i++;
+            encInfo->secret_size_given = 1;
+        }
+        else if (strcmp(argv[i], "--bits") == 0)
+        {
+            // Payload bits per cover byte, recorded in the version 2 header flags
+            if (i + 1 == argc || (encInfo->bits = atoi(argv[++i])) < 1 || encInfo->bits > LSB_MAX_BITS)
+            {
+                printf("ERROR: --bits expects a number between 1 and %d\n", LSB_MAX_BITS);
+                return e_failure;
+            }
+        }
+        else if (strcmp(argv[i], "--v2") == 0)
+        {
+            encInfo->force_v2 = 1;
+        }
+        else if (strcmp(argv[i], "--checksum") == 0)
+        {
+            encInfo->checksum = 1;
+        }
+        else if (strcmp(argv[i], "-z") == 0 || strcmp(argv[i], "--compress") == 0)
+        {
+            encInfo->compress = 1;
+        }
+        else if (strcmp(argv[i], "--encrypt") == 0)
+        {
+            encInfo->encrypt = 1;
+        }
+        else if (strcmp(argv[i], "--key-file") == 0)
+        {
+            // Key of --encrypt, instead of the environment
+            if (i + 1 == argc)
+            {
+                printf("ERROR: --key-file expects a file name\n");
+                return e_failure;
+            }
+            encInfo->key_file = argv[++i];
+            encInfo->encrypt = 1;
+        }
+        else if (strcmp(argv[i], "--cover-index") == 0)
+        {
+            // The cover is picked from an index built with --index-build
+            if (i + 1 == argc)
+            {
+                printf("ERROR: --cover-index expects an index file\n");
+                return e_failure;
+            }
+            encInfo->cover_index = argv[++i];
+        }
+        else if (strcmp(argv[i], "--stats") == 0)
+        {
+            encInfo->show_stats = 1;
+        }
+        else if (argv[i][0] == '-' && argv[i][1] != '\0')
+        {
+            printf("ERROR: Unknown option %s\n", argv[i]);
+            printf(ENCODE_USAGE);
+            return e_failure;
+        }
+        else if (nargs < 3)
+        {
+            args[nargs++] = argv[i];
+        }
+        else
+        {
+            printf(ENCODE_USAGE);
+            return e_failure;
+        }
+    }
+
+    // With --cover-index the positional arguments start at the secret, the cover is picked once its size is known
+    if (encInfo->cover_index != NULL && nargs >= 1 && nargs <= 2)
+    {
+        args[2] = args[1];
+        args[1] = args[0];
+        args[0] = encInfo->index_cover_fname;
+        encInfo->index_cover_fname[0] = '\0';
+        nargs++;
+    }
+    else if (encInfo->cover_index != NULL)
+    {
+        printf(ENCODE_USAGE);
+        return e_failure;
+    }
+
     // Validate argument count
-    if (argc < 4 || argc > 5)
+    if (nargs < 2)
     {
-        printf("Encoding: ./lsb_steg -e <.bmp file> <.txt file> [output file]\n");
+        printf(ENCODE_USAGE);
         return e_failure;
     }
 
-    // Validate source image file (argv[2])
-    char *str = strstr(argv[2], ".bmp");
-    if (str != NULL && strcmp(str, ".bmp") == 0)
+    // Validate source image file ("-" reads it from stdin)
+    char *str = strstr(args[0], ".bmp");
+    if (encInfo->cover_index != NULL || strcmp(args[0], "-") == 0 || (str != NULL && strcmp(str, ".bmp") == 0))
     {
-        encInfo->src_image_fname = argv[2];
+        encInfo->src_image_fname = args[0];
     }
     else
     {
@@ -81,40 +372,117 @@ Status read_and_validate_encode_args(int argc, char *argv[], EncodeInfo *encInfo
         return e_failure;
     }
 
-    // Check if the secret file (argv[3]) has a dot in its name
-    if (strchr(argv[3], '.') != NULL)
+    // Check if the secret file has a dot in its name ("-" reads it from stdin)
+    if (strcmp(args[1], "-") == 0)
+    {
+        encInfo->secret_fname = args[1];
+        if (encInfo->secret_extn == NULL)
+        {
+            encInfo->secret_extn = DEFAULT_STREAM_EXTN;
+        }
+    }
+    else if (strchr(args[1], '.') != NULL)
     {
-        encInfo->secret_fname = argv[3];
+        encInfo->secret_fname = args[1];
+        if (encInfo->secret_extn == NULL)
+        {
+            encInfo->secret_extn = strchr(args[1], '.');
+        }
+        if (strlen(encInfo->secret_extn) > MAX_FILE_SUFFIX)
+        {
+            printf("ERROR: Secret file extension %s is longer than %d characters, use -x\n", encInfo->secret_extn, MAX_FILE_SUFFIX);
+            return e_failure;
+        }
     }
     else
     {
-        printf("Encoding: ./lsb_steg -e <.bmp file> <.txt file> [output file]\n");
+        printf(ENCODE_USAGE);
         return e_failure;
     }
 
     // Validate and store the stego image file if provided (default is used if not provided)
-    if (argc == 5)
+    if (nargs == 3)
     {
-        char *str1 = strstr(argv[4], ".bmp");
-        if (str1 != NULL && strcmp(str1, ".bmp") == 0)
+        char *str1 = strstr(args[2], ".bmp");
+        if (strcmp(args[2], "-") == 0 || (str1 != NULL && strcmp(str1, ".bmp") == 0))
         {
-            encInfo->stego_image_fname = argv[4];
+            encInfo->stego_image_fname = args[2];
         }
         else
         {
-            printf("Encoding: ./lsb_steg -e <.bmp file> <.txt file> [output file]\n");
+            printf(ENCODE_USAGE);
             return e_failure;
         }
     }
     else
     {
         encInfo->stego_image_fname = "stego_img.bmp";
-        printf("No stego image file provided. Using default: %s\n", encInfo->stego_image_fname);
+        LOG_INFO("No stego image file provided. Using default: %s\n", encInfo->stego_image_fname);
+    }
+
+    if (strcmp(encInfo->src_image_fname, "-") == 0 && strcmp(encInfo->secret_fname, "-") == 0)
+    {
+        printf("ERROR: The source image and the secret file cannot both be read from stdin\n");
+        return e_failure;
+    }
+    if (encInfo->use_mmap && (strcmp(encInfo->src_image_fname, "-") == 0 || strcmp(encInfo->secret_fname, "-") == 0 || strcmp(encInfo->stego_image_fname, "-") == 0))
+    {
+        printf("ERROR: -m, -j and -k need named files, they cannot be used with stdin/stdout\n");
+        return e_failure;
+    }
+    if (encInfo->compress && encInfo->use_mmap)
+    {
+        printf("ERROR: -z compresses the secret through a stream and cannot be combined with -m, -j or -k\n");
+        return e_failure;
+    }
+    if (encInfo->encrypt && encInfo->use_mmap)
+    {
+        printf("ERROR: --encrypt seals the secret through a stream and cannot be combined with -m, -j or -k\n");
+        return e_failure;
+    }
+    if (encInfo->encrypt && aead_read_key(encInfo->key_file, encInfo->aead_key) == e_failure)
+    {
+        if (encInfo->key_file != NULL)
+        {
+            printf("ERROR: %s does not hold a key of %d bytes or %d hex digits\n", encInfo->key_file, AEAD_KEY_SIZE, AEAD_KEY_SIZE * 2);
+        }
+        else
+        {
+            printf("ERROR: --encrypt needs --key-file or a key of %d hex digits in $%s\n", AEAD_KEY_SIZE * 2, AEAD_KEY_ENV);
+        }
+        return e_failure;
+    }
+    if (encInfo->in_place && (encInfo->use_mmap || strcmp(encInfo->src_image_fname, "-") == 0 || strcmp(encInfo->stego_image_fname, "-") == 0))
+    {
+        printf("ERROR: -i needs a named cover and output image and cannot be combined with -m, -j or -k\n");
+        return e_failure;
+    }
+    if (strcmp(encInfo->stego_image_fname, "-") == 0)
+    {
+        stego_verbose = 0; // stdout carries the stego image, progress lines would corrupt it
+    }
+    if (encInfo->cover_index != NULL && pick_indexed_cover(encInfo) == e_failure)
+    {
+        return e_failure;
     }
 
     return e_success;
 }
 
+/*
+ * Function: open_stream
+ * -----------------------
+ * fopen() that maps the file name "-" to stdin or stdout.
+ */
+static FILE *open_stream(const char *fname, const char *mode)
+{
+    if (strcmp(fname, "-") == 0)
+    {
+        return mode[0] == 'r' ? stdin : stdout;
+    }
+    return fopen(fname, mode);
+}
+
 /* 
  * Function: open_files
  * ----------------------
@@ -134,7 +502,7 @@ Status read_and_validate_encode_args(int argc, char *argv[], EncodeInfo *encInfo
 Status open_files(EncodeInfo *encInfo)
 {
     // Src Image file
-    encInfo->fptr_src_image = fopen(encInfo->src_image_fname, "r");
+    encInfo->fptr_src_image = open_stream(encInfo->src_image_fname, "r");
     // Do Error handling
     if (encInfo->fptr_src_image == NULL)
     {
@@ -145,7 +513,7 @@ Status open_files(EncodeInfo *encInfo)
     }
 
     // Secret file
-    encInfo->fptr_secret = fopen(encInfo->secret_fname, "r");
+    encInfo->fptr_secret = open_stream(encInfo->secret_fname, "r");
     // Do Error handling
     if (encInfo->fptr_secret == NULL)
     {
@@ -156,7 +524,7 @@ Status open_files(EncodeInfo *encInfo)
     }
 
     // Stego Image file
-    encInfo->fptr_stego_image = fopen(encInfo->stego_image_fname, "w");
+    encInfo->fptr_stego_image = open_stream(encInfo->stego_image_fname, "w");
     // Do Error handling
     if (encInfo->fptr_stego_image == NULL)
     {
@@ -165,92 +533,443 @@ Status open_files(EncodeInfo *encInfo)
 
         return e_failure;
     }
-    // No failure return e_success
-    printf("INFO: Opening required files\n");
-    printf("INFO: Opened %s\n", encInfo->src_image_fname);
-    printf("INFO: Opened %s\n", encInfo->secret_fname);
-    printf("INFO: Opened %s\n", encInfo->stego_image_fname);
-    printf("INFO: Done\n");
+    // No failure return e_success
+    LOG_INFO("INFO: Opening required files\n");
+    LOG_INFO("INFO: Opened %s\n", encInfo->src_image_fname);
+    LOG_INFO("INFO: Opened %s\n", encInfo->secret_fname);
+    LOG_INFO("INFO: Opened %s\n", encInfo->stego_image_fname);
+    LOG_INFO("INFO: Done\n");
+    return e_success;
+}
+
+
+/*
+ * Function: close_files
+ * -----------------------
+ * Closes every file opened by open_files. Safe to call after a failed or
+ * partial encode, and required before the EncodeInfo is reused.
+ *
+ * Parameters:
+ * ---------------
+ *   - EncodeInfo *encInfo: Structure containing file information.
+ */
+void close_files(EncodeInfo *encInfo)
+{
+    FILE **files[] = {&encInfo->fptr_src_image, &encInfo->fptr_secret, &encInfo->fptr_stego_image};
+
+    for (size_t i = 0; i < sizeof(files) / sizeof(files[0]); i++)
+    {
+        if (*files[i] == stdout)
+        {
+            fflush(stdout);
+        }
+        else if (*files[i] != NULL && *files[i] != stdin)
+        {
+            fclose(*files[i]);
+        }
+        *files[i] = NULL;
+    }
+}
+
+/* Counters for this job, NULL (nothing is timed) without --stats */
+static StegoStats *encode_stats(EncodeInfo *encInfo)
+{
+    return encInfo->show_stats ? &encInfo->stats : NULL;
+}
+
+/* 
+ * Function: do_encoding
+ * -----------------------
+ * Executes the encoding process by opening files, checking capacity, 
+ * and encoding data into the stego image.
+ *
+ * Parameters:
+ * ---------------
+ *   - EncodeInfo *encInfo: Structure containing encoding information.
+ *
+ * Returns:
+ * --------------
+ *   - Status: e_success if encoding is successful,
+ *             e_failure if an error occurs. */
+Status do_encoding(EncodeInfo *encInfo)
+{
+    if (encInfo->use_mmap)
+    {
+        return do_encoding_mmap(encInfo);
+    }
+    if (encInfo->in_place)
+    {
+        return do_encoding_in_place(encInfo);
+    }
+
+    StegoStats *stats = encode_stats(encInfo);
+
+    // Open the required files
+    if (STATS_STAGE(stats, STEGO_STAGE_OPEN, open_files(encInfo)) == e_failure)
+    {
+        return e_failure;
+    }
+    LOG_INFO("INFO: ## Encoding Procedure Started ##\n");
+
+    // Check if the image has enough capacity to hold the secret data
+    if (STATS_STAGE(stats, STEGO_STAGE_CAPACITY, check_capacity(encInfo)) == e_failure)
+    {
+        return e_failure;
+    }
+
+    // Copy BMP header
+    if (STATS_STAGE(stats, STEGO_STAGE_COPY_HEADER, copy_bmp_header(encInfo->bmp_header, encInfo->bmp.pixel_offset, encInfo->fptr_stego_image)) == e_failure)
+    {
+        return e_failure;
+    }
+
+    // Encode magic string, extension size, extension, file size and file data in one sweep
+    if (STATS_STAGE(stats, STEGO_STAGE_EMBED, encode_header_and_data(encInfo)) == e_failure)
+    {
+        return e_failure;
+    }
+
+    // Copy remaining image data to the stego image
+    if (STATS_STAGE(stats, STEGO_STAGE_COPY_TAIL, copy_remaining_img_data(encInfo->fptr_src_image, encInfo->fptr_stego_image, encInfo->copy_buffer)) == e_failure)
+    {
+        return e_failure;
+    }
+    LOG_INFO("INFO: ## Encoding Done Successfully ##\n");
+    return e_success;
+}
+
+
+/* Whether fname names the file open as map, map_file_write() would truncate it under its mapping */
+static int is_mapped_file(const char *fname, const MappedFile *map)
+{
+    struct stat st_name, st_map;
+    return stat(fname, &st_name) == 0 && fstat(map->fd, &st_map) == 0 &&
+           st_name.st_dev == st_map.st_dev && st_name.st_ino == st_map.st_ino;
+}
+
+/*
+ * Function: do_encoding_mmap
+ * ----------------------------
+ * Memory mapped variant of do_encoding. The source image and the secret
+ * file are mapped read-only, the stego image is created at its final size
+ * and mapped read-write. The header is parsed in place, the cover is copied
+ * once into the output mapping and the magic string, extension, size and
+ * secret data are embedded straight into the mapped pixel array, without
+ * any stdio buffers or seeks. With -j the payload region is split across
+ * encInfo->nthreads workers, with -k it is scattered with the key. An
+ * output that is the cover or the secret itself is refused.
+ *
+ * Parameters:
+ * ---------------
+ *   - EncodeInfo *encInfo: Structure containing encoding information.
+ *
+ * Returns:
+ * --------------
+ *   - Status: e_success if encoding is successful,
+ *             e_failure if an error occurs.
+ */
+Status do_encoding_mmap(EncodeInfo *encInfo)
+{
+    MappedFile src, secret, stego;
+    Status status = e_failure;
+    StegoError err;
+    StegoStats *stats = encode_stats(encInfo);
+
+    if (STATS_STAGE(stats, STEGO_STAGE_OPEN, map_file_read(encInfo->src_image_fname, &src)) == e_failure)
+    {
+        return e_failure;
+    }
+    if (STATS_STAGE(stats, STEGO_STAGE_OPEN, map_file_read(encInfo->secret_fname, &secret)) == e_failure)
+    {
+        unmap_file(&src);
+        return e_failure;
+    }
+    if (is_mapped_file(encInfo->stego_image_fname, &src) || is_mapped_file(encInfo->stego_image_fname, &secret))
+    {
+        printf("ERROR: -m cannot write %s over the file it reads, name another output or patch the cover with -i\n",
+               encInfo->stego_image_fname);
+        goto out;
+    }
+    LOG_INFO("INFO: Opening required files\n");
+    LOG_INFO("INFO: Mapped %s\n", encInfo->src_image_fname);
+    LOG_INFO("INFO: Mapped %s\n", encInfo->secret_fname);
+    LOG_INFO("INFO: ## Encoding Procedure Started ##\n");
+
+    // Parse width and height straight out of the mapped header before the output is created
+    StegoOptions opts = {MAGIC_STRING, encInfo->bits, encInfo->force_v2, encInfo->nthreads, stats, NULL, encInfo->key, encInfo->checksum};
+    if (stego_check_capacity(src.data, src.size, secret.size, encInfo->secret_extn, &opts, &encInfo->header, &err) == e_failure)
+    {
+        if (err == STEGO_ERR_CAPACITY)
+        {
+            printf("ERROR: %s does not have the capacity to handle %s\n", encInfo->src_image_fname, encInfo->secret_fname);
+        }
+        else
+        {
+            printf("ERROR: %s: %s\n", encInfo->src_image_fname, stego_strerror(err));
+        }
+        goto out;
+    }
+    LOG_INFO("INFO: Checking for %s capacity to handle %s\n", encInfo->src_image_fname, encInfo->secret_fname);
+    LOG_INFO("INFO: Done. Found OK\n");
+
+    if (STATS_STAGE(stats, STEGO_STAGE_OPEN, map_file_write(encInfo->stego_image_fname, src.size, &stego)) == e_failure)
+    {
+        goto out;
+    }
+    LOG_INFO("INFO: Mapped %s\n", encInfo->stego_image_fname);
+
+    // Header and payload are embedded straight into the mapped pixel array, on encInfo->nthreads workers
+    status = stego_encode(src.data, src.size, secret.data, secret.size, encInfo->secret_extn, &opts, stego.data, stego.size, &err);
+    unmap_file(&stego);
+    if (status == e_failure)
+    {
+        printf("ERROR: %s\n", stego_strerror(err));
+        goto out;
+    }
+    LOG_INFO("INFO: Encoding %s File Data\n", encInfo->secret_fname);
+    LOG_INFO("INFO: Done\n");
+    LOG_INFO("INFO: ## Encoding Done Successfully ##\n");
+out:
+    unmap_file(&secret);
+    unmap_file(&src);
+    return status;
+}
+
+/*
+ * Function: clone_cover
+ * -----------------------
+ * Makes the stego image a full copy of the cover. On copy-on-write file
+ * systems (btrfs, XFS) FICLONE shares the cover's extents, so nothing is
+ * written; elsewhere copy_remaining_img_data() copies the file inside the
+ * kernel where it can.
+ *
+ * Returns:
+ * -----------
+ *   - Status: e_success if the stego image now equals the cover,
+ *             e_failure otherwise.
+ */
+static Status clone_cover(EncodeInfo *encInfo)
+{
+#ifdef FICLONE
+    if (ioctl(fileno(encInfo->fptr_stego_image), FICLONE, fileno(encInfo->fptr_src_image)) == 0)
+    {
+        LOG_INFO("INFO: Cloned %s to %s\n", encInfo->src_image_fname, encInfo->stego_image_fname);
+        return e_success;
+    }
+#endif
+    FILE *cover = fopen(encInfo->src_image_fname, "r"); // Own handle, fptr_src_image is already at the pixel array
+    if (cover == NULL)
+    {
+        perror("fopen");
+        printf("ERROR: Unable to open file %s\n", encInfo->src_image_fname);
+        return e_failure;
+    }
+    Status status = copy_remaining_img_data(cover, encInfo->fptr_stego_image, encInfo->copy_buffer);
+    fclose(cover);
+    return status;
+}
+
+/*
+ * Function: do_encoding_in_place
+ * --------------------------------
+ * In-place variant of do_encoding (-i). The stego image starts out as a
+ * clone of the cover, or is the cover itself when both names refer to the
+ * same file, and only the (magic + header) * 8 + payload image bytes that
+ * carry hidden data are rewritten. The rest of the image is never read or
+ * written from user space.
+ *
+ * Patching the cover itself cannot be undone: if encoding fails part way,
+ * the cover is left with a partial payload.
+ *
+ * Parameters:
+ * ---------------
+ *   - EncodeInfo *encInfo: Structure containing encoding information.
+ *
+ * Returns:
+ * --------------
+ *   - Status: e_success if encoding is successful,
+ *             e_failure if an error occurs.
+ */
+Status do_encoding_in_place(EncodeInfo *encInfo)
+{
+    struct stat st_src, st_dest;
+    StegoStats *stats = encode_stats(encInfo);
+
+    stats_begin(stats);
+    encInfo->fptr_src_image = fopen(encInfo->src_image_fname, "r");
+    encInfo->fptr_secret = open_stream(encInfo->secret_fname, "r");
+    stats_end(stats, STEGO_STAGE_OPEN, e_success);
+    if (encInfo->fptr_src_image == NULL || encInfo->fptr_secret == NULL)
+    {
+        perror("fopen");
+        fprintf(stderr, "ERROR: Unable to open file %s\n", encInfo->fptr_src_image == NULL ? encInfo->src_image_fname : encInfo->secret_fname);
+        return e_failure;
+    }
+    LOG_INFO("INFO: Opening required files\n");
+    LOG_INFO("INFO: ## Encoding Procedure Started ##\n");
+
+    // Leaves fptr_src_image at the pixel array, the header pixels are read from there
+    if (STATS_STAGE(stats, STEGO_STAGE_CAPACITY, check_capacity(encInfo)) == e_failure)
+    {
+        return e_failure;
+    }
+
+    int same_file = stat(encInfo->stego_image_fname, &st_dest) == 0 && fstat(fileno(encInfo->fptr_src_image), &st_src) == 0 &&
+                    st_src.st_dev == st_dest.st_dev && st_src.st_ino == st_dest.st_ino;
+    // The cover is patched through a second handle, every block is read before it is written back
+    stats_begin(stats);
+    encInfo->fptr_stego_image = fopen(encInfo->stego_image_fname, same_file ? "r+" : "w+");
+    stats_end(stats, STEGO_STAGE_OPEN, e_success);
+    if (encInfo->fptr_stego_image == NULL)
+    {
+        perror("fopen");
+        fprintf(stderr, "ERROR: Unable to open file %s\n", encInfo->stego_image_fname);
+        return e_failure;
+    }
+    if (!same_file && STATS_STAGE(stats, STEGO_STAGE_CLONE, clone_cover(encInfo)) == e_failure)
+    {
+        return e_failure;
+    }
+    if (fseeko(encInfo->fptr_stego_image, encInfo->bmp.pixel_offset, SEEK_SET) != 0)
+    {
+        printf("ERROR: Unable to seek to the pixel array of %s\n", encInfo->stego_image_fname);
+        return e_failure;
+    }
+
+    // Only the header and payload region goes through user space
+    stats_begin(stats);
+    if (encode_header_and_data(encInfo) == e_failure)
+    {
+        return stats_end(stats, STEGO_STAGE_EMBED, e_failure);
+    }
+    if (stats_end(stats, STEGO_STAGE_EMBED, fflush(encInfo->fptr_stego_image) == 0 ? e_success : e_failure) == e_failure)
+    {
+        printf("ERROR: Unable to write encoded data to stego image\n");
+        return e_failure;
+    }
+    LOG_INFO("INFO: ## Encoding Done Successfully ##\n");
     return e_success;
 }
 
-
-/* 
- * Function: do_encoding
- * -----------------------
- * Executes the encoding process by opening files, checking capacity, 
- * and encoding data into the stego image.
+/*
+ * Function: get_secret_size
+ * ---------------------------
+ * Works out the size of the secret file without consuming it. A size given
+ * with --secret-size is used as is. A seekable secret is measured with
+ * one seek to its end. Otherwise (a pipe on stdin) the secret is copied to
+ * a temporary file block by block and fptr_secret is replaced by it, so
+ * memory use does not grow with the size of the secret.
  *
  * Parameters:
- * ---------------
+ * -----------
  *   - EncodeInfo *encInfo: Structure containing encoding information.
  *
  * Returns:
- * --------------
- *   - Status: e_success if encoding is successful,
- *             e_failure if an error occurs. */
-Status do_encoding(EncodeInfo *encInfo)
+ * ---------
+ *   - Status: e_success with encInfo->size_secret_file set,
+ *             e_failure if the secret cannot be read.
+ */
+static Status get_secret_size(EncodeInfo *encInfo)
 {
+    FILE *secret = encInfo->fptr_secret;
 
-    // Open the required files
-    if (open_files(encInfo) == e_failure)
+    if (encInfo->secret_size_given)
     {
-        return e_failure;
+        return e_success;
     }
-    printf("INFO: ## Encoding Procedure Started ##\n");
-
-    // Check if the image has enough capacity to hold the secret data
-    if (check_capacity(encInfo) == e_failure)
+    if (fseeko(secret, 0, SEEK_END) == 0)
     {
-        return e_failure;
+        encInfo->size_secret_file = ftello(secret); // One seek to the end and one back, the size is never measured again
+        rewind(secret);
+        return e_success;
     }
 
-    // Copy BMP header
-    if (copy_bmp_header(encInfo->fptr_src_image, encInfo->fptr_stego_image) == e_failure)
+    FILE *spill = tmpfile();
+    uint64_t size = 0;
+    size_t n;
+    if (spill == NULL)
     {
+        perror("tmpfile");
         return e_failure;
     }
-
-    // Encode magic string
-    if (encode_magic_string(MAGIC_STRING, encInfo) == e_failure)
+    while ((n = fread(encInfo->image_data, 1, encInfo->chunk_size * 8, secret)) > 0) // image_data is free until the header is written
     {
-        return e_failure;
+        if (fwrite(encInfo->image_data, 1, n, spill) != n)
+        {
+            break;
+        }
+        size += n;
     }
-
-    // Encode secret file extension size
-    if (encode_secret_extn_size(encInfo->extn_size, encInfo) == e_failure)
+    if (ferror(secret) || ferror(spill) || fflush(spill) != 0)
     {
+        printf("ERROR: Unable to buffer the secret file from stdin\n");
+        fclose(spill);
         return e_failure;
     }
+    rewind(spill);
+    encInfo->fptr_secret = spill; // Closed by close_files like a named secret
+    encInfo->size_secret_file = size;
+    return e_success;
+}
+
+/*
+ * Function: compress_secret
+ * ---------------------------
+ * Compresses the secret file (-z) into a temporary file of lz.h frames and
+ * replaces fptr_secret by it, the way get_secret_size spills a pipe, so
+ * the compressed size is known before the header is written and memory
+ * use does not grow with the size of the secret.
+ *
+ * Parameters:
+ * -----------
+ *   - EncodeInfo *encInfo: Structure containing encoding information.
+ *   - uint64_t *raw_size: Set to the size of the secret before compression.
+ *
+ * Returns:
+ * ---------
+ *   - Status: e_success with encInfo->size_secret_file set to the compressed size,
+ *             e_failure if the secret cannot be read or the temporary file written.
+ */
+static Status compress_secret(EncodeInfo *encInfo, uint64_t *raw_size)
+{
+    FILE *secret = encInfo->fptr_secret;
+    FILE *spill = tmpfile();
+    uint64_t size = 0, raw = 0;
+    size_t n;
 
-    // Encode secret file extension
-    if (encode_secret_file_extn(encInfo->extn_secret_file, encInfo) == e_failure)
+    if (spill == NULL)
     {
+        perror("tmpfile");
         return e_failure;
     }
-
-    // Encode secret file size
-    if (encode_secret_file_size(encInfo->size_secret_file, encInfo) == e_failure)
+    while ((n = fread(encInfo->lz_block, 1, LZ_BLOCK_SIZE, secret)) > 0)
     {
-        return e_failure;
+        size_t length = lz_compress_frame(encInfo->lz_block, n, encInfo->lz_frame, encInfo->lz_table);
+        if (fwrite(encInfo->lz_frame, 1, length, spill) != length)
+        {
+            break;
+        }
+        raw += n;
+        size += length;
     }
-
-    // Encode secret file data
-    if (encode_secret_file_data(encInfo) == e_failure)
+    if (ferror(secret) || ferror(spill) || fflush(spill) != 0)
     {
+        printf("ERROR: Unable to compress the secret file %s\n", encInfo->secret_fname);
+        fclose(spill);
         return e_failure;
     }
-
-    // Copy remaining image data to the stego image
-    if (copy_remaining_img_data(encInfo->fptr_src_image, encInfo->fptr_stego_image) == e_failure)
+    rewind(spill);
+    if (secret != stdin)
     {
-        return e_failure;
+        fclose(secret);
     }
-    printf("INFO: ## Encoding Done Successfully ##\n");
+    encInfo->fptr_secret = spill; // Closed by close_files like a named secret
+    encInfo->size_secret_file = size;
+    *raw_size = raw;
+    LOG_INFO("INFO: Compressed %s from %llu to %llu bytes\n", encInfo->secret_fname, (unsigned long long)raw, (unsigned long long)size);
     return e_success;
 }
 
-
 /* 
  * Function: check_capacity
  * ---------------------------
@@ -264,38 +983,85 @@ Status do_encoding(EncodeInfo *encInfo)
  * Returns:
  * ---------
  *   - Status: e_success if there is sufficient capacity,
- *             e_failure if capacity is insufficient.
+ *             e_failure if capacity is insufficient, after printing the
+ *             bytes the cover holds and the bytes the secret needs.
  */
 Status check_capacity(EncodeInfo *encInfo)
 {
-    // Get the size of the source image
-    uint image_capacity = get_image_size_for_bmp(encInfo->fptr_src_image);
-    // Get the size of the secret file in bytes
-    uint size_secret_file = get_file_size(encInfo->fptr_secret);
+    // Read the BMP headers once, copy_bmp_header writes them out again so the cover is never rewound
+    if (fread(encInfo->bmp_header, BMP_HEADER_SIZE, 1, encInfo->fptr_src_image) != 1)
+    {
+        printf("ERROR: Unable to read the BMP header from the source image.\n");
+        return e_failure;
+    }
+    if (bmp_parse(encInfo->bmp_header, BMP_HEADER_SIZE, &encInfo->bmp) == e_failure)
+    {
+        printf("ERROR: %s is not a supported BMP image (24 or 32 bits per pixel, uncompressed)\n", encInfo->src_image_fname);
+        return e_failure;
+    }
+    // V4/V5 headers, bit masks and gaps up to the pixel array are copied as they are
+    size_t rest = encInfo->bmp.pixel_offset - BMP_HEADER_SIZE;
+    if (fread(encInfo->bmp_header + BMP_HEADER_SIZE, 1, rest, encInfo->fptr_src_image) != rest)
+    {
+        printf("ERROR: Unable to read the BMP header from the source image.\n");
+        return e_failure;
+    }
+    // Get the size of the pixel array of the source image
+    uint64_t image_capacity = encInfo->bmp.pixel_bytes;
+    encInfo->image_capacity = image_capacity;
+    // Get the size of the secret file in bytes, after compression with -z
+    uint64_t raw_size = 0;
+    if (encInfo->compress ? compress_secret(encInfo, &raw_size) == e_failure : get_secret_size(encInfo) == e_failure)
+    {
+        return e_failure;
+    }
+    uint64_t size_secret_file = encInfo->size_secret_file;
     // Get the length of the magic string in bytes
-    uint magic_string_length = strlen(MAGIC_STRING);
+    uint64_t magic_string_length = strlen(MAGIC_STRING);
     // Get the secret file extension
-    char *file_extension = strchr(encInfo->secret_fname, '.');
+    const char *file_extension = encInfo->secret_extn;
     uint extension_size = 0;
     if (file_extension != NULL)
     {
-        encInfo->size_secret_file = strlen(file_extension);
         extension_size = strlen(file_extension);
         encInfo->extn_size = extension_size;
-        strcpy(encInfo->extn_secret_file, file_extension);
+        snprintf(encInfo->extn_secret_file, sizeof(encInfo->extn_secret_file), "%s", file_extension);
+    }
+    // Pick the header version: 64-bit sizes only when the payload needs them, sealing adds a nonce and a tag per segment
+    uint64_t payload_size = encInfo->encrypt ? aead_sealed_size(size_secret_file) : size_secret_file;
+    if (stego_header_init(&encInfo->header, file_extension, payload_size, encInfo->bits, encInfo->force_v2) == e_failure)
+    {
+        printf("ERROR: Unable to describe %s in the stego header\n", encInfo->secret_fname);
+        return e_failure;
     }
-    // Include BMP header size in calculations
-    unsigned int header_size = 54;
-    // Calculate total size correctly
-    unsigned int total_size = header_size + ((magic_string_length + extension_size + size_secret_file + sizeof(size_secret_file) + sizeof(extension_size)) * 8);
+    if (encInfo->compress)
+    {
+        stego_header_set_lz(&encInfo->header, raw_size);
+    }
+    if (encInfo->encrypt)
+    {
+        stego_header_set_aead(&encInfo->header);
+    }
+    if (encInfo->checksum)
+    {
+        stego_header_set_crc(&encInfo->header);
+    }
+    // Calculate total size correctly, in 64 bits so large covers and payloads do not wrap
+    uint64_t header_bytes = (magic_string_length + stego_header_size(&encInfo->header)) * 8;
+    uint64_t stream_size = stego_header_stream_size(&encInfo->header);
+    uint64_t total_size = header_bytes + lsb_image_bytes(stream_size, encInfo->bits);
     if (image_capacity >= total_size)
     {
-        printf("INFO: Checking for %s capacity to handle %s\n", encInfo->src_image_fname, encInfo->secret_fname);
-        printf("INFO: Done. Found OK\n");
+        LOG_INFO("INFO: Checking for %s capacity to handle %s\n", encInfo->src_image_fname, encInfo->secret_fname);
+        LOG_INFO("INFO: Done. Found OK\n");
         return e_success;
     }
     else
     {
+        // In payload bytes, as shard mode reports it: what fits next to the header against the payload with its overhead
+        uint64_t available = image_capacity > header_bytes ? (image_capacity - header_bytes) * encInfo->bits / 8 : 0;
+        printf("ERROR: %s holds %llu bytes, %s needs %llu\n", encInfo->src_image_fname, (unsigned long long)available,
+               encInfo->secret_fname, (unsigned long long)stream_size);
         return e_failure;
     }
 }
@@ -305,11 +1071,13 @@ Status check_capacity(EncodeInfo *encInfo)
 /*
  * Function: copy_bmp_header
  * ---------------------------
- * Copies the BMP header from the source image to the destination image.
+ * Copies the BMP header of the source image, read by check_capacity, to
+ * the destination image.
  *
  * Parameters:
  * -------------------
- *   - FILE *fptr_src_image: File pointer for the source image.
+ *   - const char *header: Everything before the pixel array of the source image.
+ *   - size_t size: Length of the header, the pixel offset of the image.
  *   - FILE *fptr_dest_image: File pointer for the destination (stego) image.
  *
  * Returns:
@@ -317,120 +1085,15 @@ Status check_capacity(EncodeInfo *encInfo)
  *   - Status: e_success if header copying is successful,
  *             e_failure if an error occurs.
  */
-Status copy_bmp_header(FILE *fptr_src_image, FILE *fptr_dest_image)
+Status copy_bmp_header(const char *header, size_t size, FILE *fptr_dest_image)
 {
-    char buffer[54];         // Buffer to hold the 54-byte BMP header
-    rewind(fptr_src_image);  // Rewind the source image file pointer to the beginning
-    rewind(fptr_dest_image); // Rewind the destination image file pointer to the beginning
-
-    if (fread(buffer, 54, 1, fptr_src_image) != 1) // Read the BMP header into the buffer
-    {
-        printf("ERROR: Unable to read the BMP header from the source image.\n");
-        return e_failure;
-    }
-
-    if (fwrite(buffer, 54, 1, fptr_dest_image) != 1) // Write the header to the destination file
+    if (fwrite(header, size, 1, fptr_dest_image) != 1) // Write the header to the destination file
     {
         printf("ERROR: Unable to write the BMP header from the destination image.\n");
         return e_failure;
     }
-    printf("INFO: Copying Image Header\n");
-    printf("INFO: Done\n");
-    return e_success;
-}
-
-
-/* 
- * Function: encode_magic_string
- * -------------------------------
- * Encodes a predefined magic string into the least significant bits of 
- * the stego image.
- *
- * Parameters:
- * ---------------------
- *   - const char *magic_string: The magic string to be encoded.
- *   - EncodeInfo *encInfo: Structure containing encoding information.
- *
- * Returns:
- * -----------------
- *   - Status: e_success if encoding is successful,
- *             e_failure if an error occurs.
- */
-Status encode_magic_string(const char *magic_string, EncodeInfo *encInfo)
-{
-
-    FILE *src_file = encInfo->fptr_src_image;     // Source image file
-    FILE *stego_file = encInfo->fptr_stego_image; // Destination stego image file
-    char image_buffer[8] = {0};                   // Buffer to hold 8 bytes of image data
-
-    int length = strlen(MAGIC_STRING); // Get the length of the magic string
-    for (int i = 0; i < length; i++)
-    {
-        if (fread(image_buffer, sizeof(char), 8, src_file) != 8) // Read 8 bytes from the source image
-        {
-            return e_failure;
-        }
-
-        char ch = magic_string[i]; // Get the current character from the magic string
-
-        encode_byte_to_lsb(ch, image_buffer); // Encode the character into the LSB of the image buffer
-
-        if (fwrite(image_buffer, sizeof(char), 8, stego_file) != 8) // Write the modified image buffer to the stego image
-        {
-            return e_failure;
-        }
-    }
-    printf("INFO: Encoding Magic String Signature\n");
-    printf("INFO: Done\n");
-    return e_success;
-}
-/**
- * FUNCTION:Status encode_secret_extn_size
- *--------------------------------------------
- *  
- *
- * This function calculates the size of the secret file and updates the 
- * provided EncodeInfo structure to include this size. This information is 
- * crucial for ensuring that the encoding process can accommodate the secret 
- * data without exceeding the available capacity in the cover file.
- *
- * Parameters:
- * ------------
- *
- *   @param file_size The size of the secret file in bytes.
- * @param encInfo A pointer to an EncodeInfo structure that will be updated 
- *                with the secret file size.
- * 
- * Return status:
- * ----------------
- * @return Status An enumerated value indicating the outcome of the operation.
- *                 Possible return values include:
- *                 - SUCCESS: if the secret file size was encoded successfully.
- *                 - FAILURE: if there was an error in processing the size.
- */
-Status encode_secret_extn_size(long file_size, EncodeInfo *encInfo)
-{
-    FILE *src_file = encInfo->fptr_src_image;     // Source image file
-    FILE *stego_file = encInfo->fptr_stego_image; // Destination stego image file
-
-    char image_buffer[32] = {0}; // Buffer to hold 32 bytes of image data
-
-    // Read 32 bytes from the source image file
-    if (fread(image_buffer, sizeof(char), 32, src_file) != 32)
-    {
-        printf("ERROR: Unable to read 32 bytes from source image\n");
-        return e_failure;
-    }
-
-    encode_int_to_lsb(file_size, image_buffer); // Encode the file size into the LSB of the image buffer
-
-    // Write the modified buffer to the stego image file
-    if (fwrite(image_buffer, sizeof(char), 32, stego_file) != 32)
-    {
-        printf("ERROR: Unable to write 32 bytes to stego image\n");
-        return e_failure;
-    }
-
+    LOG_INFO("INFO: Copying Image Header\n");
+    LOG_INFO("INFO: Done\n");
     return e_success;
 }
 
@@ -483,169 +1146,316 @@ Status encode_byte_to_lsb(char data, char *image_buffer)
 
 Status encode_int_to_lsb(int data, char *image_buffer)
 {
-    for (int i = 0; i < 32; i++)
+    // Most significant bit first is the same as the 4 big endian bytes one after another
+    char bytes[4] = {(char)(data >> 24), (char)(data >> 16), (char)(data >> 8), (char)data};
+    return encode_bytes_to_lsb(bytes, sizeof(bytes), image_buffer);
+}
+
+/* State of an embed pipeline, every field is used by one stage only */
+typedef struct
+{
+    EncodeInfo *encInfo;
+    const char *header;   // Magic string and header, embedded into the first block
+    size_t header_length; // Bytes of header
+    uint64_t remaining;   // Bytes not read yet: the payload, then the CRC trailer with --checksum
+    int first;            // The next block read is the first one
+    uint64_t payload_left; // Payload bytes not read yet: the secret, or with --encrypt the secret sealed
+    uint32_t crc;         // CRC32C of the payload bytes read so far
+    size_t trailer_done;  // Trailer bytes already handed out
+    AeadStream *aead;     // Sealing state with --encrypt, NULL without
+    StegoQuality *quality; // Distortion counters with --stats, NULL without
+    uint64_t embedded;    // Pixel array bytes the embed stage has done
+} EmbedStream;
+
+/* aead_source_fn reading the secret */
+static Status read_secret(void *ctx, char *data, size_t n)
+{
+    EncodeInfo *encInfo = ctx;
+    return fread(data, sizeof(char), n, encInfo->fptr_secret) == n ? e_success : e_failure;
+}
+
+/*
+ * Function: read_cover_block
+ * ----------------------------
+ * Read stage of the embed pipeline: the next block of the secret and the
+ * cover bytes it (and, in the first block, the header) goes into. With
+ * --encrypt the block is sealed as it is read, so the embed stage of the
+ * previous block overlaps it.
+ */
+static Status read_cover_block(void *ctx, PipelineBlock *block)
+{
+    EmbedStream *stream = ctx;
+    EncodeInfo *encInfo = stream->encInfo;
+    int bits = encInfo->bits;
+    size_t header_length = stream->first ? stream->header_length : 0;
+    size_t size = encInfo->chunk_size - header_length; // First block shares image_data with the header
+
+    size -= size % bits; // Every block starts on a cover byte boundary
+    block->head = header_length * 8;
+    block->data_len = stream->remaining < size ? (size_t)stream->remaining : size;
+    block->image_len = block->head + lsb_image_bytes(block->data_len, bits);
+
+    size_t from_payload = stream->payload_left < block->data_len ? (size_t)stream->payload_left : block->data_len;
+    Status read = stream->aead != NULL ? aead_seal_read(stream->aead, block->data, from_payload, read_secret, encInfo)
+                                       : read_secret(encInfo, block->data, from_payload); // Read a block of the secret file
+    if (read == e_failure)
+    {
+        printf("ERROR: Unable to read secret file data\n");
+        return e_failure;
+    }
+    stream->payload_left -= from_payload;
+    if (encInfo->checksum)
+    {
+        // Checksummed while the block is hot, the trailer follows the last payload byte in the same stream
+        stream->crc = crc32c(stream->crc, block->data, from_payload);
+        if (from_payload < block->data_len)
+        {
+            char trailer[STEGO_CRC_SIZE];
+            size_t n = block->data_len - from_payload;
+            stego_header_pack_crc(stream->crc, trailer);
+            memcpy(block->data + from_payload, trailer + stream->trailer_done, n);
+            stream->trailer_done += n;
+        }
+    }
+    // Read 8 / bits image bytes for every secret byte in the block
+    if (fread(block->image, sizeof(char), block->image_len, encInfo->fptr_src_image) != block->image_len)
     {
-        image_buffer[i] = (image_buffer[i] & 0xFE);     // Clear the LSB
-        int bit = (data & (1 << (31 - i))) >> (31 - i); // Extract the bit from data
-        image_buffer[i] |= bit;                         // Set the LSB with the extracted bit
+        printf("ERROR: Unable to read %zu bytes from source image\n", block->image_len);
+        return e_failure;
     }
+    stream->remaining -= block->data_len;
+    stream->first = 0;
+    block->last = stream->remaining == 0;
     return e_success;
 }
 
+/*
+ * Function: embed_cover_block
+ * -----------------------------
+ * Compute stage of the embed pipeline. With --stats the block's cover
+ * bytes are compared with their stego bytes as they are embedded
+ * (quality_embed), blocks come through here in order on one thread.
+ */
+static Status embed_cover_block(void *ctx, PipelineBlock *block)
+{
+    EmbedStream *stream = ctx;
+    QualityCounts *counts = stream->quality != NULL ? &stream->quality->total : NULL;
 
+    quality_embed(stream->quality, counts, 1, stream->header, block->head / 8, block->image, stream->embedded); // No-op after the first block
+    quality_embed(stream->quality, counts, stream->encInfo->bits, block->data, block->data_len, block->image + block->head,
+                  stream->embedded + block->head); // Encode the whole block with the vector kernel
+    stream->embedded += block->image_len;
+    return e_success;
+}
 
+/* Write stage of the embed pipeline */
+static Status write_cover_block(void *ctx, PipelineBlock *block)
+{
+    EmbedStream *stream = ctx;
+    if (fwrite(block->image, sizeof(char), block->image_len, stream->encInfo->fptr_stego_image) != block->image_len) // Write the whole modified block to the stego image
+    {
+        printf("ERROR: Unable to write encoded data to stego image\n");
+        return e_failure;
+    }
+    return e_success;
+}
 
 /*
- * Function: encode_secret_file_extn
- * ------------------------------------
- * Encodes the file extension of the secret file into the stego image.
- *
- * Parameters:
- * ---------------
- *
- *   - const char *file_extn: The file extension to be encoded.
- *   - EncodeInfo *encInfo: Structure containing encoding information.
- *
- * Returns:
- * -------------
- *
- *   - Status: e_success if encoding is successful,
- *             e_failure if an error occurs.
+ * Function: embed_stream
+ * ------------------------
+ * Embeds the header and the secret into the cover block by block.
+ * Secrets of PIPELINE_MIN_BLOCKS blocks or more go through the read /
+ * embed / write pipeline, so the next cover block is read and the previous
+ * one written while a block is being embedded. With --checksum the read
+ * stage also runs the CRC over every block it reads and appends the CRC
+ * after the last payload byte, so the secret is read exactly once. With
+ * --encrypt a fresh random nonce is drawn for every image.
  */
-Status encode_secret_file_extn(const char *file_extn, EncodeInfo *encInfo)
+static Status embed_stream(EncodeInfo *encInfo, const char *header, size_t header_length)
 {
-    FILE *src_file = encInfo->fptr_src_image;     // Source image file
-    FILE *stego_file = encInfo->fptr_stego_image; // Destination stego image file
-    char image_buffer[8] = {0};                   // Buffer to hold 8 bytes of image data
-
-    int length = strlen(file_extn);
+    uint64_t size = stego_header_stream_size(&encInfo->header);
+    EmbedStream stream = {encInfo, header, header_length, size, 1, encInfo->header.payload_size, 0, 0, NULL, NULL, 0};
+    PipelineBlock blocks[PIPELINE_DEPTH];
+    AeadStream aead;
 
-    for (int i = 0; i < length; i++)
+    if (encInfo->encrypt)
     {
-        if (fread(image_buffer, sizeof(char), 8, src_file) != 8) // Read 8 bytes from the source image
+        unsigned char nonce[AEAD_NONCE_SIZE];
+        if (aead_random_nonce(nonce) == e_failure)
         {
-            printf("Failed to read 8 bytes from source file\n");
+            printf("ERROR: Unable to draw a random nonce\n");
             return e_failure;
         }
+        aead_seal_init(&aead, encInfo->aead_key, nonce, encInfo->size_secret_file);
+        stream.aead = &aead;
+    }
+    if (encInfo->show_stats)
+    {
+        quality_init(&encInfo->stats.quality, &encInfo->bmp);
+        stream.quality = &encInfo->stats.quality;
+    }
 
-        char ch = file_extn[i];               // Get the current character from the file extension
-        encode_byte_to_lsb(ch, image_buffer); // Encode the character into the LSB of the image buffer
-
-        if (fwrite(image_buffer, sizeof(char), 8, stego_file) != 8) // Write the modified image buffer to the stego image
-        {
-            printf("Failed to write 8 bytes to stego file\n");
-            return e_failure;
-        }
+    for (int i = 0; i < PIPELINE_DEPTH; i++)
+    {
+        blocks[i].image = encInfo->image_data + i * encInfo->chunk_size * 8;
+        blocks[i].data = encInfo->secret_data + i * encInfo->chunk_size;
     }
-    printf("INFO: Encoding %s File Extension\n", encInfo->secret_fname);
-    printf("INFO: Done\n");
-    return e_success;
+    return pipeline_run(blocks, size >= (uint64_t)PIPELINE_MIN_BLOCKS * encInfo->chunk_size,
+                        read_cover_block, embed_cover_block, write_cover_block, &stream);
 }
 
-
-/* 
- * Function: encode_secret_file_size
- * ------------------------------------
- * Encodes the size of the secret file into the stego image.
+/*
+ * Function: encode_header_and_data
+ * -----------------------------------
+ * The magic string and the header chosen by check_capacity are packed into
+ * one byte string with stego_header_pack(), and the first cover block
+ * carries both that header and the start of the payload, so small secrets
+ * take a single fread/fwrite of the cover. Later blocks of chunk_size
+ * payload bytes overlap reading, embedding and writing (see embed_stream).
  *
  * Parameters:
- * -----------------
- *   - long file_size: The size of the secret file to be encoded.
+ * ------------------
  *   - EncodeInfo *encInfo: Structure containing encoding information.
  *
  * Returns:
- *---------------
- *
+ * ------------
  *   - Status: e_success if encoding is successful,
  *             e_failure if an error occurs.
  */
-Status encode_secret_file_size(long file_size, EncodeInfo *encInfo)
+Status encode_header_and_data(EncodeInfo *encInfo)
 {
-    FILE *src_file = encInfo->fptr_src_image;     // Source image file
-    FILE *stego_file = encInfo->fptr_stego_image; // Destination stego image file
-    char image_buffer[32] = {0};                  // Buffer to hold 32 bytes of image data
-
-    // Seek to the end of the secret file to get its size
-    fseek(encInfo->fptr_secret, 0, SEEK_END);
-    file_size = ftell(encInfo->fptr_secret); // Get the size of the secret file
-
-    if (fread(image_buffer, sizeof(char), 32, src_file) != 32) // Read 32 bytes from the source image
-    {
-        printf("ERROR: Unable to read 32 bytes from source image\n");
-        return e_failure;
-    }
+    char header[MAX_MAGIC_STRING + STEGO_MAX_HEADER];
+    size_t header_length = stego_header_pack(&encInfo->header, MAGIC_STRING, header);
 
-    encode_int_to_lsb(file_size, image_buffer); // Encode the file size into the LSB of the image buffer
-
-    if (fwrite(image_buffer, sizeof(char), 32, stego_file) != 32) // Write the modified image buffer to the stego image
+    if (embed_stream(encInfo, header, header_length) == e_failure)
     {
-        printf("ERROR: Unable to write 32 bytes to stego image\n");
         return e_failure;
     }
-    printf("INFO: Encoding %s File Size\n", encInfo->secret_fname);
-    printf("INFO: Done\n");
+    LOG_INFO("INFO: Encoding Magic String Signature\n");
+    LOG_INFO("INFO: Done\n");
+    LOG_INFO("INFO: Encoding %s File Extension\n", encInfo->secret_fname);
+    LOG_INFO("INFO: Done\n");
+    LOG_INFO("INFO: Encoding %s File Size\n", encInfo->secret_fname);
+    LOG_INFO("INFO: Done\n");
+    LOG_INFO("INFO: Encoding %s File Data\n", encInfo->secret_fname);
+    LOG_INFO("INFO: Done\n");
     return e_success;
 }
 
-
-
+#ifdef __linux__
 /*
- * Function: encode_secret_file_size
+ * Function: copy_remaining_in_kernel
  * ------------------------------------
- * Encodes the size of the secret file into the stego image.
- *
- * Parameters:
- * ------------------
- *   - long file_size: The size of the secret file to be encoded.
- *   - EncodeInfo *encInfo: Structure containing encoding information.
+ * Copies everything from the current position of fptr_src to its end into
+ * fptr_dest without passing the bytes through user space, using
+ * copy_file_range() and falling back to sendfile().
  *
  * Returns:
- * ------------
- *   - Status: e_success if encoding is successful,
- *             e_failure if an error occurs.
+ * -----------
+ *   - Status: e_success if the whole tail was copied,
+ *             e_failure otherwise. *can_fallback is set when the kernel
+ *             refused the copy before writing anything (pipes, old kernels,
+ *             cross-filesystem copies), so the buffered copy can take over.
  */
-Status encode_secret_file_data(EncodeInfo *encInfo)
-{
-    FILE *src_file = encInfo->fptr_src_image;     // Source image file
-    FILE *stego_file = encInfo->fptr_stego_image; // Destination stego image file
-    FILE *secret_file = encInfo->fptr_secret;     // Secret file containing the data to be encoded
-    char secret_data;                             // Variable to hold each character of the secret file data
-    char image_buffer[8] = {0};     // Buffer to hold 8 bytes of image data
-    rewind(secret_file);
-    // Get the actual size of the secret file
-    fseek(secret_file, 0, SEEK_END);
-    long size = ftell(secret_file);   // Get the size of the secret file
-    encInfo->size_secret_file = size; // Set the correct file size in EncodeInfo structure
-    rewind(secret_file);
-    // Read and encode the secret file data
-    for (int i = 0; i < size; i++)
-    {
-        if (fread(&secret_data, sizeof(char), 1, secret_file) != 1) // Read a single character from the secret file
-        {
-            printf("ERROR: Unable to read secret file data\n");
-            return e_failure;
+static Status copy_remaining_in_kernel(FILE *fptr_src, FILE *fptr_dest, int *can_fallback)
+{
+    struct stat st, st_dest;
+    int fd_src = fileno(fptr_src);
+    int fd_dest = fileno(fptr_dest);
+
+    *can_fallback = 1;
+    if (fflush(fptr_dest) != 0 || fstat(fd_src, &st) != 0 || !S_ISREG(st.st_mode) || fstat(fd_dest, &st_dest) != 0)
+    {
+        return e_failure;
+    }
+
+    int dest_is_file = S_ISREG(st_dest.st_mode); // Otherwise a pipe or socket (stdout), only sendfile can write it
+    off_t off_src = ftello(fptr_src);   // Logical position, including what stdio has buffered
+    off_t off_dest = dest_is_file ? ftello(fptr_dest) : 0;
+    if (off_src < 0 || off_dest < 0)
+    {
+        return e_failure;
+    }
+
+    const off_t start = off_src; // Falling back is only safe while off_src is still here
+    off_t remaining = st.st_size - off_src;
+    int use_sendfile = !dest_is_file;
+    while (remaining > 0)
+    {
+        ssize_t copied;
+        if (!use_sendfile)
+        {
+            copied = copy_file_range(fd_src, &off_src, fd_dest, &off_dest, remaining, 0);
+            if (copied < 0 && off_src == start && (errno == EXDEV || errno == EINVAL || errno == ENOSYS || errno == EOPNOTSUPP))
+            {
+                use_sendfile = 1; // Nothing copied yet: retry the whole tail with sendfile
+                continue;
+            }
         }
-        // Read 8 bytes from the source image
-        if (fread(image_buffer, sizeof(char), 8, src_file) != 8)
+        else
         {
-            printf("ERROR: Unable to read 8 bytes from source image\n");
-            return e_failure;
+            if (dest_is_file && lseek(fd_dest, off_dest, SEEK_SET) < 0)
+            {
+                return e_failure;
+            }
+            copied = sendfile(fd_dest, fd_src, &off_src, remaining);
+            if (copied > 0)
+            {
+                off_dest += copied;
+            }
         }
 
-        encode_byte_to_lsb(secret_data, image_buffer); // Encode the secret data into the LSB of the image buffer
-
-        if (fwrite(image_buffer, sizeof(char), 8, stego_file) != 8) // Write the modified image buffer to the stego image
+        if (copied <= 0)
         {
-            printf("ERROR: Unable to write encoded data to stego image\n");
+            *can_fallback = off_src == start; // Once bytes went out every error is fatal
             return e_failure;
         }
+        remaining -= copied;
+    }
+
+    // Keep both streams positioned after the copied data
+    fseeko(fptr_src, off_src, SEEK_SET);
+    if (dest_is_file)
+    {
+        fseeko(fptr_dest, off_dest, SEEK_SET);
     }
-    printf("INFO: Encoding %s File Data\n", encInfo->secret_fname);
-    printf("INFO: Done\n");
+    return e_success;
+}
+#endif
 
+/* Files of the buffered tail copy */
+typedef struct
+{
+    FILE *src;
+    FILE *dest;
+    size_t block_size;
+} CopyStream;
+
+/* Read stage of the tail copy, the last block is the one that reaches the end of the source */
+static Status read_tail_block(void *ctx, PipelineBlock *block)
+{
+    CopyStream *stream = ctx;
+    block->image_len = fread(block->image, 1, stream->block_size, stream->src);
+    if (ferror(stream->src))
+    {
+        printf("ERROR : unable to read the remaining data from source image\n");
+        return e_failure;
+    }
+    block->last = block->image_len < stream->block_size;
     return e_success;
 }
 
+/* Write stage of the tail copy */
+static Status write_tail_block(void *ctx, PipelineBlock *block)
+{
+    CopyStream *stream = ctx;
+    if (fwrite(block->image, 1, block->image_len, stream->dest) != block->image_len)
+    {
+        printf("ERROR : unable to write the remaining data to stego image\n");
+        return e_failure;
+    }
+    return e_success;
+}
 
 /* 
  * Function: copy_remaining_img_data
@@ -657,6 +1467,8 @@ Status encode_secret_file_data(EncodeInfo *encInfo)
  * --------------
  *   - FILE *fptr_src: File pointer for the source image.
  *   - FILE *fptr_dest: File pointer for the destination (stego) image.
+ *   - char *buffer: COPY_BUF_SIZE bytes for the copy when the kernel
+ *     cannot do it, the EncodeInfo's copy_buffer.
  *
  * Returns:
  * -----------
@@ -664,21 +1476,36 @@ Status encode_secret_file_data(EncodeInfo *encInfo)
  *             e_failure if an error occurs during writing.
  */
 
-Status copy_remaining_img_data(FILE *fptr_src, FILE *fptr_dest)
+Status copy_remaining_img_data(FILE *fptr_src, FILE *fptr_dest, char *buffer)
 {
-    int ch;// Variable to hold each character read from the source file
+#ifdef __linux__
+    // Let the kernel move the tail directly between the two files when it can
+    int can_fallback;
+    if (copy_remaining_in_kernel(fptr_src, fptr_dest, &can_fallback) == e_success)
+    {
+        LOG_INFO("INFO: Copying Left Over Data\n");
+        LOG_INFO("INFO: Done\n");
+        return e_success;
+    }
+    if (!can_fallback) // Part of the tail was already written, a buffered retry would duplicate it
+    {
+        printf("ERROR : unable to write the remaining data to stego image\n");
+        return e_failure;
+    }
+#endif
 
-    // Loop until the end of the source file
-    while ((ch = fgetc(fptr_src)) != EOF)
+    // Reads of the source overlap writes of the destination, one block of the buffer per stage
+    CopyStream stream = {fptr_src, fptr_dest, COPY_BUF_SIZE / PIPELINE_DEPTH};
+    PipelineBlock blocks[PIPELINE_DEPTH];
+    for (int i = 0; i < PIPELINE_DEPTH; i++)
     {
-        // Write the character to the destination file
-        if (fputc(ch, fptr_dest) == EOF)
-        {
-            printf("ERROR : unable to write the remaining data to stego image\n");
-            return e_failure;
-        }
+        blocks[i].image = buffer + i * stream.block_size;
+    }
+    if (pipeline_run(blocks, 1, read_tail_block, NULL, write_tail_block, &stream) == e_failure)
+    {
+        return e_failure;
     }
-    printf("INFO: Copying Left Over Data\n");
-    printf("INFO: Done\n");
+    LOG_INFO("INFO: Copying Left Over Data\n");
+    LOG_INFO("INFO: Done\n");
     return e_success;
 }
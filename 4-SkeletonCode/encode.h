@@ -1,6 +1,14 @@
 #ifndef ENCODE_H
 #define ENCODE_H
 #include "types.h" // Contains user defined types
+#include "arena.h"
+#include "bmp.h"
+#include "aead.h"
+#include "lz.h"
+#include "pipeline.h"
+#include "stats.h"
+#include "stego.h" // StegoHeader
+#include "cover_index.h"
 
 /* 
  * Structure to store information required for
@@ -9,37 +17,83 @@
  * also stored
  */
 
-#define MAX_SECRET_BUF_SIZE 1024
+#define MAX_SECRET_BUF_SIZE 1024 // Default secret bytes per block
 #define MAX_IMAGE_BUF_SIZE (MAX_SECRET_BUF_SIZE * 8)
+#define MIN_SECRET_BUF_SIZE 64 // The first block also carries the magic string and header
 #define MAX_FILE_SUFFIX 4
+#define COPY_BUF_SIZE (1024 * 1024) // Buffer of the buffered tail copy, large so the tail moves in a few big fread/fwrite calls
+
+/* Arena bytes an EncodeInfo working in blocks of chunk secret bytes needs (one block per pipeline stage) */
+#define ENCODE_ARENA_SIZE(chunk) (ARENA_ROUND((chunk) * PIPELINE_DEPTH) + ARENA_ROUND((chunk) * 8 * PIPELINE_DEPTH) + ARENA_ROUND(BMP_MAX_HEADER) + \
+                                  ARENA_ROUND(LZ_BLOCK_SIZE) + ARENA_ROUND(LZ_FRAME_SIZE) + ARENA_ROUND(LZ_TABLE_SIZE) + \
+                                  ARENA_ROUND(COVER_INDEX_MAX_PATH + 1) + ARENA_ROUND(COPY_BUF_SIZE))
+#define DEFAULT_STREAM_EXTN ".bin" // Extension recorded for a secret read from stdin
+
+#define ENCODE_USAGE "Encoding: ./lsb_steg -e [-m | -i] [-j N] [-k <key>] [-x <.ext>] [-z] [--encrypt] [--key-file <file>] [--bits k] [--v2] [--checksum] [--stats] [--secret-size N] <.bmp file | -> <.txt file | -> [output file | -]\n" \
+                     "          ./lsb_steg -e --cover-index <index file> [options] <.txt file | -> [output file | -]\n"
 
 typedef struct _EncodeInfo
 {
     /* Source Image info */
     char *src_image_fname;
     FILE *fptr_src_image;
-    uint image_capacity;
-    char image_data[MAX_IMAGE_BUF_SIZE];
+    uint64_t image_capacity;
+    const char *cover_index; //Pick the cover from this index (--cover-index) instead of naming it
+    char *index_cover_fname; //COVER_INDEX_MAX_PATH + 1 bytes in the arena: the cover picked from the index
+    char *image_data; // PIPELINE_DEPTH blocks of chunk_size * 8 cover bytes, in the arena
+    char *bmp_header; // BMP_MAX_HEADER bytes: everything before the pixel array, read once so the cover is never rewound
+    BmpInfo bmp; // Parsed from bmp_header by check_capacity
 
     /* Secret File Info */
     char *secret_fname;
     FILE *fptr_secret;
-    char extn_secret_file[MAX_FILE_SUFFIX]; //Buffer to store the file extension of the secret file.
-    char secret_data[MAX_SECRET_BUF_SIZE]; //Buffer to store the data from the secret file.
-    long size_secret_file; //Size of the secret file in bytes.
+    char extn_secret_file[MAX_FILE_SUFFIX + 1]; //Buffer to store the file extension of the secret file.
+    char *secret_data; //PIPELINE_DEPTH blocks of chunk_size bytes of the secret file, in the arena
+    uint64_t size_secret_file; //Size of the secret file in bytes.
     long extn_size;
+    const char *secret_extn; //Extension to record: from the file name, -x, or DEFAULT_STREAM_EXTN
+    int secret_size_given; //size_secret_file was set with --secret-size
+
+    /* Layout of the hidden data */
+    StegoHeader header; //Filled in by check_capacity
+    int force_v2; //Write the 64-bit version 2 header even for small payloads
+    int bits; //Payload bits per cover byte (--bits), 1 .. LSB_MAX_BITS
+    int compress; //Compress the secret before it is embedded (-z)
+    const char *key; //Scatter the payload with this key (-k), NULL for the sequential layout
+    int checksum; //Embed a CRC32C of the payload after it (--checksum)
+    int encrypt; //Seal the secret with ChaCha20-Poly1305 as it is embedded (--encrypt)
+    const char *key_file; //Key of --encrypt (--key-file), NULL reads AEAD_KEY_ENV
+    unsigned char aead_key[AEAD_KEY_SIZE];
 
     /* Stego Image Info */
     char *stego_image_fname;
     FILE *fptr_stego_image;
 
+    /* Options */
+    int use_mmap; // Map the files and embed directly into the mapped pixel array
+    int nthreads; // Worker threads for the payload region (mapped mode only)
+    int in_place; // Clone the cover and rewrite only the pixels that carry the header and payload
+    int show_stats; // Time every stage and print the counters as JSON on stderr (--stats)
+    StegoStats stats; // Per-stage counters, only filled in with show_stats
+
+    /* Buffers, carved out of caller memory by encode_info_init and kept across jobs */
+    Arena arena;
+    size_t chunk_size; // Secret bytes per block
+    char *lz_block; // LZ_BLOCK_SIZE bytes of the secret being compressed
+    char *lz_frame; // LZ_FRAME_SIZE bytes, the compressed frame
+    uint16_t *lz_table; // Match finder state of the compressor
+    char *copy_buffer; // COPY_BUF_SIZE bytes for copy_remaining_img_data
+
 } EncodeInfo;
 
 
 /* Encoding function prototype */
 
-/* Check operation type */
-OperationType check_operation_type(char *argv);
+/* Set up a context over mem (ENCODE_ARENA_SIZE(chunk_size) bytes), once before the first job */
+Status encode_info_init(EncodeInfo *encInfo, char *mem, size_t size, size_t chunk_size);
+
+/* Clear everything but the buffers, done by read_and_validate_encode_args for every job */
+void encode_info_reset(EncodeInfo *encInfo);
 
 /* Read and validate Encode args from argv */
 Status read_and_validate_encode_args(int argc,char *argv[], EncodeInfo *encInfo);
@@ -47,38 +101,32 @@ Status read_and_validate_encode_args(int argc,char *argv[], EncodeInfo *encInfo)
 /* Perform the encoding */
 Status do_encoding(EncodeInfo *encInfo);
 
+/* Perform the encoding on memory mapped files */
+Status do_encoding_mmap(EncodeInfo *encInfo);
+
+/* Perform the encoding on a clone of the cover (or the cover itself), writing only the payload region */
+Status do_encoding_in_place(EncodeInfo *encInfo);
+
 /* Get File pointers for i/p and o/p files */
 Status open_files(EncodeInfo *encInfo);
 
+/* Close the files opened by open_files */
+void close_files(EncodeInfo *encInfo);
+
 /* check capacity */
 Status check_capacity(EncodeInfo *encInfo);
 
 /* Get image size */
-uint get_image_size_for_bmp(FILE *fptr_image);
+uint64_t get_image_size_for_bmp(FILE *fptr_image);
 
 /* Get file size */
-uint get_file_size(FILE *fptr);
-
-/* Copy bmp image header */
-Status copy_bmp_header(FILE *fptr_src_image, FILE *fptr_dest_image);
-
-/* Store Magic String */
-Status encode_magic_string(const char *magic_string, EncodeInfo *encInfo);
-
-//Encode secret file extension size/
-Status encode_secret_extn_size(long file_size, EncodeInfo *encInfo);
-
-/* Encode secret file extenstion */
-Status encode_secret_file_extn(const char *file_extn, EncodeInfo *encInfo);
-
-/* Encode secret file size */
-Status encode_secret_file_size(long file_size, EncodeInfo *encInfo);
+uint64_t get_file_size(FILE *fptr);
 
-/* Encode secret file data*/
-Status encode_secret_file_data(EncodeInfo *encInfo);
+/* Copy bmp image header, read by check_capacity, to the stego image */
+Status copy_bmp_header(const char *header, size_t size, FILE *fptr_dest_image);
 
-/* Encode function, which does the real encoding */
-Status encode_data_to_image(char *data, int size, FILE *fptr_src_image, FILE *fptr_stego_image);
+/* Encode the magic string, header and secret file data in one pass over the cover */
+Status encode_header_and_data(EncodeInfo *encInfo);
 
 /* Encode a byte into LSB of image data array */
 Status encode_byte_to_lsb(char data, char *image_buffer);
@@ -87,7 +135,7 @@ Status encode_byte_to_lsb(char data, char *image_buffer);
 /* Encode a int into LSB of image data array */
 Status encode_int_to_lsb(int data, char *image_buffer);
 
-/* Copy remaining image bytes from src to stego image after encoding */
-Status copy_remaining_img_data(FILE *fptr_src, FILE *fptr_dest);
+/* Copy remaining image bytes from src to stego image after encoding, buffer is COPY_BUF_SIZE bytes */
+Status copy_remaining_img_data(FILE *fptr_src, FILE *fptr_dest, char *buffer);
 
 #endif
@@ -0,0 +1,94 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include "filelist.h"
+
+/*
+ * Function: add_name
+ * --------------------
+ * Appends a copy of fname to the list, growing it as needed.
+ */
+static Status add_name(FileList *list, const char *fname)
+{
+    if (list->count == list->cap)
+    {
+        size_t grown_cap = list->cap ? list->cap * 2 : 64;
+        char **grown = realloc(list->names, grown_cap * sizeof(*grown));
+        if (grown == NULL)
+        {
+            printf("ERROR: Unable to allocate the image list\n");
+            return e_failure;
+        }
+        list->names = grown;
+        list->cap = grown_cap;
+    }
+    if ((list->names[list->count] = strdup(fname)) == NULL)
+    {
+        printf("ERROR: Unable to allocate the image list\n");
+        return e_failure;
+    }
+    list->count++;
+    return e_success;
+}
+
+/*
+ * Function: add_directory
+ * -------------------------
+ * Adds every .bmp file of a directory to the list.
+ */
+static Status add_directory(FileList *list, const char *dname)
+{
+    DIR *dir = opendir(dname);
+    struct dirent *entry;
+    Status status = e_success;
+
+    if (dir == NULL)
+    {
+        perror("opendir");
+        printf("ERROR: Unable to open directory %s\n", dname);
+        return e_failure;
+    }
+    while (status == e_success && (entry = readdir(dir)) != NULL)
+    {
+        char *str = strstr(entry->d_name, ".bmp");
+        if (str == NULL || strcmp(str, ".bmp") != 0)
+        {
+            continue;
+        }
+        size_t length = strlen(dname) + 1 + strlen(entry->d_name) + 1;
+        char *path = malloc(length);
+        if (path == NULL)
+        {
+            status = e_failure;
+            break;
+        }
+        snprintf(path, length, "%s/%s", dname, entry->d_name);
+        status = add_name(list, path);
+        free(path);
+    }
+    closedir(dir);
+    return status;
+}
+
+Status file_list_add(FileList *list, const char *path)
+{
+    struct stat st;
+
+    if (stat(path, &st) == 0 && S_ISDIR(st.st_mode))
+    {
+        return add_directory(list, path);
+    }
+    return add_name(list, path);
+}
+
+void file_list_free(FileList *list)
+{
+    for (size_t i = 0; i < list->count; i++)
+    {
+        free(list->names[i]);
+    }
+    free(list->names);
+    memset(list, 0, sizeof(*list));
+}
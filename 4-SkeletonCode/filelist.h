@@ -0,0 +1,28 @@
+#ifndef FILELIST_H
+#define FILELIST_H
+
+#include <stddef.h>
+#include "types.h"
+
+/*
+ * Image lists
+ * -----------
+ * Probe and shard mode take any mix of .bmp files and directories on the
+ * command line. A directory adds every .bmp file in it (not recursively),
+ * in the order readdir() returns them.
+ */
+
+typedef struct _FileList
+{
+    char **names; // Owned copies of the paths
+    size_t count;
+    size_t cap;
+} FileList;
+
+/* Add a file, or the .bmp files of a directory */
+Status file_list_add(FileList *list, const char *path);
+
+/* Free every name and the list itself */
+void file_list_free(FileList *list);
+
+#endif
@@ -0,0 +1,559 @@
+/*
+ * lsb_fuzz
+ * --------
+ * Fuzz target for the decode path. Every input is taken as a stego image
+ * and run through the command line decode, stdio and mapped (the same
+ * calls test_encode.c makes), and through stego_probe(),
+ * stego_decode_header(), stego_decode(), stego_verify() and
+ * stego_decode_range(). Build it from 4-SkeletonCode for libFuzzer with
+ *
+ *     clang -O1 -g -fsanitize=fuzzer,address -DLSB_LIBFUZZER -pthread -I. -o lsb_fuzz fuzz/fuzz_decode.c \
+ *         aead.c arena.c batch.c bmp.c common.c cover_index.c crc32c.c decode.c encode.c filelist.c \
+ *         lsb.c lz.c mmap_io.c parallel.c pipeline.c probe.c quality.c scatter.c shard.c spool.c \
+ *         stats.c stego.c stego_header.c
+ *
+ * or, with the same files and without -DLSB_LIBFUZZER, as a standalone
+ * tool (gcc -O2 -fsanitize=address ..., or afl-cc):
+ *
+ *     ./lsb_fuzz [--seconds N] [--seed S] [--dump DIR]
+ *     afl-fuzz -i seeds -o findings -- ./lsb_fuzz @@
+ *
+ * Given files it runs each of them once, as AFL does with @@. Without it
+ * mutates seeds of its own for --seconds (default 10): stego images the
+ * encoder writes at 1, 2 and 4 bits, with --v2, -z, --checksum, -k and
+ * --encrypt, into a 24 and a 32 bpp cover. The mutations go mostly to the
+ * BMP headers and the first STEGO_PROBE_SIZE bytes, where the magic
+ * string and the header are: flipped bits, random bytes, header fields
+ * set to edge values (through the LSBs, as the encoder writes them),
+ * bfOffBits and biSize set to the bounds the BMP parser checks, and
+ * truncated images. --dump writes the seeds to DIR, as an AFL corpus.
+ *
+ * fuzz/regress holds inputs that crashed earlier versions, run them
+ * after a change to the parsers with
+ *
+ *     find fuzz/regress -type f -exec ./lsb_fuzz {} +
+ *
+ * The rate is what the hardened parser has to keep up, one JSON line on
+ * stdout at the end:
+ *
+ *     {"suite":"fuzz","target":"decode","execs":52113,"seconds":10.000,"execs_s":5211.3,
+ *      "accepted":3102,"rejected":49011}
+ *
+ * An exec is one input through all the calls above, accepted counts the
+ * inputs the stdio decode extracted. Any header stego_decode_header()
+ * accepts must describe a payload that fits in the input, the target
+ * aborts if one does not.
+ */
+#define _GNU_SOURCE // memfd_create()
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include "common.h"
+#include "encode.h"
+#include "decode.h"
+#include "aead.h"
+#include "lsb.h"
+#include "stego.h"
+#include "stego_header.h"
+
+#define FUZZ_MAX_INPUT (1 << 20) // Larger inputs are cut, the decoder's loops are linear in them
+#define FUZZ_KEY "fuzz-key"
+#define FUZZ_AEAD_KEY "000102030405060708090a0b0c0d0e0f101112131415161718191a1b1c1d1e1f"
+#define FUZZ_MAX_SEEDS 64
+#define FUZZ_RANGE 64 // Payload bytes stego_decode_range() extracts
+
+int LLVMFuzzerInitialize(int *argc, char ***argv);
+int LLVMFuzzerTestOneInput(const unsigned char *data, size_t size);
+
+static DecodeInfo decInfo;
+static int image_fd = -1;       // memfd holding the current input, in.bmp links to it
+static char work_dir[4096];
+static uint64_t accepted, rejected;
+static uint64_t rng_state = 0x9E3779B97F4A7C15ull;
+
+/* xorshift64 */
+static uint64_t next_random(void)
+{
+    rng_state ^= rng_state << 13;
+    rng_state ^= rng_state >> 7;
+    rng_state ^= rng_state << 17;
+    return rng_state;
+}
+
+/* Wall clock in seconds */
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static void remove_work_dir(void)
+{
+    if (remove("in.bmp") != 0 || chdir("/") != 0 || rmdir(work_dir) != 0)
+    {
+        perror("rmdir");
+    }
+}
+
+/*
+ * Function: LLVMFuzzerInitialize
+ * --------------------------------
+ * Works in a private directory (the decoder names its output files
+ * itself) where in.bmp is a link to a memfd, so the command line decode
+ * opens and maps the input without it touching the disk. stdout, where
+ * the tool prints its progress and errors, goes to /dev/null.
+ */
+int LLVMFuzzerInitialize(int *argc, char ***argv)
+{
+    _Alignas(ARENA_ALIGN) static char decode_arena[DECODE_ARENA_SIZE(MAX_DECODE_BUF_SIZE)];
+    const char *dir = getenv("TMPDIR") ? getenv("TMPDIR") : "/tmp";
+    char target[64];
+
+    (void)argc;
+    (void)argv;
+    stego_verbose = 0;
+    setenv(AEAD_KEY_ENV, FUZZ_AEAD_KEY, 1); // Sealed seeds decode, garbage in them is caught by the tags
+    snprintf(work_dir, sizeof(work_dir), "%s/lsb_fuzz_XXXXXX", dir);
+    if (decode_info_init(&decInfo, decode_arena, sizeof(decode_arena), MAX_DECODE_BUF_SIZE) == e_failure ||
+        mkdtemp(work_dir) == NULL || chdir(work_dir) != 0 || (image_fd = memfd_create("lsb_fuzz", 0)) < 0)
+    {
+        perror("lsb_fuzz");
+        exit(1);
+    }
+    snprintf(target, sizeof(target), "/proc/self/fd/%d", image_fd);
+    if (symlink(target, "in.bmp") != 0 || freopen("/dev/null", "w", stdout) == NULL)
+    {
+        perror("lsb_fuzz");
+        exit(1);
+    }
+    atexit(remove_work_dir);
+    return 0;
+}
+
+/* One command line decode of in.bmp, its output file is removed again */
+static Status run_decode(int argc, char *argv[])
+{
+    Status status = read_and_validate_decode_args(argc, argv, &decInfo);
+
+    if (status == e_success)
+    {
+        status = do_decoding(&decInfo);
+    }
+    close_files_for_decode(&decInfo);
+    if (decInfo.output_fname != NULL)
+    {
+        remove(decInfo.output_fname);
+    }
+    return status;
+}
+
+/* The libstego calls, on the input in memory */
+static void run_library(const char *image, size_t len)
+{
+    StegoOptions opts = {NULL, 0, 0, 0, NULL, NULL, FUZZ_KEY, 0};
+    StegoHeader hdr;
+    size_t payload_offset;
+    char range[FUZZ_RANGE];
+
+    stego_probe(image, len < STEGO_PROBE_SIZE ? len : STEGO_PROBE_SIZE, &opts, &hdr, &payload_offset, NULL);
+    if (stego_decode_header(image, len, &opts, &hdr, &payload_offset, NULL) == e_failure)
+    {
+        return;
+    }
+    if (hdr.payload_size > len - payload_offset) // Every payload byte takes two or more image bytes
+    {
+        fprintf(stderr, "lsb_fuzz: accepted a %llu byte payload in a %zu byte image\n",
+                (unsigned long long)hdr.payload_size, len);
+        abort();
+    }
+    char *out = malloc(hdr.payload_size + 1);
+    if (out != NULL)
+    {
+        stego_decode(image, len, &opts, out, hdr.payload_size, NULL, NULL);
+        free(out);
+    }
+    stego_verify(image, len, &opts, NULL, NULL);
+    stego_decode_range(image, len, &opts, hdr.payload_size / 2,
+                       hdr.payload_size / 2 < FUZZ_RANGE ? hdr.payload_size / 2 : FUZZ_RANGE, range, NULL, NULL);
+}
+
+int LLVMFuzzerTestOneInput(const unsigned char *data, size_t size)
+{
+    char *decode_stdio[] = {"lsb_fuzz", "-d", "-a", "in.bmp", "out"};
+    char *decode_mmap[] = {"lsb_fuzz", "-d", "-m", "-k", FUZZ_KEY, "-a", "in.bmp", "out"};
+
+    if (size > FUZZ_MAX_INPUT)
+    {
+        size = FUZZ_MAX_INPUT;
+    }
+    if (ftruncate(image_fd, 0) != 0 || pwrite(image_fd, data, size, 0) != (ssize_t)size)
+    {
+        perror("lsb_fuzz");
+        exit(1);
+    }
+    if (run_decode(5, decode_stdio) == e_success)
+    {
+        accepted++;
+    }
+    else
+    {
+        rejected++;
+    }
+    run_decode(8, decode_mmap);
+    run_library((const char *)data, size);
+    return 0;
+}
+
+#ifndef LSB_LIBFUZZER
+
+typedef struct _Seed
+{
+    char *data;
+    size_t len;
+} Seed;
+
+static Seed seeds[FUZZ_MAX_SEEDS];
+static int nseeds;
+
+static void put_le32(char *p, uint32_t v)
+{
+    for (int i = 0; i < 4; i++)
+    {
+        p[i] = (char)(v >> (8 * i));
+    }
+}
+
+/* Write a BI_RGB cover of width x height pixels at bpp with a random pixel array */
+static Status write_cover(const char *fname, uint32_t width, uint32_t height, int bpp)
+{
+    char header[BMP_HEADER_SIZE] = {'B', 'M'};
+    uint32_t stride = (width * (bpp / 8) + 3) & ~3u;
+    FILE *fptr = fopen(fname, "wb");
+
+    if (fptr == NULL)
+    {
+        return e_failure;
+    }
+    put_le32(header + 2, BMP_HEADER_SIZE + stride * height);
+    put_le32(header + 10, BMP_HEADER_SIZE);
+    put_le32(header + 14, 40);
+    put_le32(header + 18, width);
+    put_le32(header + 22, height);
+    header[26] = 1; // Planes
+    header[28] = (char)bpp;
+    fwrite(header, 1, sizeof(header), fptr);
+    for (uint32_t i = 0; i < stride * height; i++)
+    {
+        fputc((int)(next_random() & 0xFF), fptr);
+    }
+    return fclose(fptr) == 0 ? e_success : e_failure;
+}
+
+/* Read a whole file into a new seed */
+static Status add_seed(const char *fname)
+{
+    FILE *fptr = fopen(fname, "rb");
+    long len;
+
+    if (fptr == NULL || nseeds == FUZZ_MAX_SEEDS || fseek(fptr, 0, SEEK_END) != 0 || (len = ftell(fptr)) <= 0 ||
+        len > FUZZ_MAX_INPUT || fseek(fptr, 0, SEEK_SET) != 0 || (seeds[nseeds].data = malloc(len)) == NULL ||
+        fread(seeds[nseeds].data, 1, len, fptr) != (size_t)len)
+    {
+        if (fptr != NULL)
+        {
+            fclose(fptr);
+        }
+        return e_failure;
+    }
+    fclose(fptr);
+    seeds[nseeds++].len = (size_t)len;
+    return e_success;
+}
+
+/*
+ * Function: make_seeds
+ * ----------------------
+ * Encodes a short text secret with every option set below into a 24 bpp
+ * cover whose rows are padded and a 32 bpp one, through the command line
+ * encode, and keeps the stego images.
+ */
+static Status make_seeds(void)
+{
+    static EncodeInfo encInfo;
+    _Alignas(ARENA_ALIGN) static char encode_arena[ENCODE_ARENA_SIZE(MAX_SECRET_BUF_SIZE)];
+    static const char *options[][4] = {
+        {NULL}, {"--v2"}, {"--bits", "2"}, {"--bits", "4", "--checksum"}, {"-z"}, {"-z", "--checksum"},
+        {"-k", FUZZ_KEY, "--checksum"}, {"--bits", "2", "-k", FUZZ_KEY}, {"--encrypt"}, {"-z", "--encrypt", "--bits", "3"},
+    };
+    static const char *covers[] = {"cover24.bmp", "cover32.bmp"};
+    FILE *fptr = fopen("secret.txt", "w");
+
+    if (encode_info_init(&encInfo, encode_arena, sizeof(encode_arena), MAX_SECRET_BUF_SIZE) == e_failure || fptr == NULL)
+    {
+        return e_failure;
+    }
+    for (int i = 0; i < 40; i++)
+    {
+        fprintf(fptr, "line %d of the secret, repeated so -z has something to find\n", i);
+    }
+    if (fclose(fptr) != 0 || write_cover(covers[0], 301, 60, 24) == e_failure || write_cover(covers[1], 128, 48, 32) == e_failure)
+    {
+        return e_failure;
+    }
+    for (size_t c = 0; c < sizeof(covers) / sizeof(covers[0]); c++)
+    {
+        for (size_t o = 0; o < sizeof(options) / sizeof(options[0]); o++)
+        {
+            char *argv[12] = {"lsb_fuzz", "-e"};
+            int argc = 2;
+            for (int k = 0; k < 4 && options[o][k] != NULL; k++)
+            {
+                argv[argc++] = (char *)options[o][k];
+            }
+            argv[argc++] = (char *)covers[c];
+            argv[argc++] = "secret.txt";
+            argv[argc++] = "seed.bmp";
+            if (read_and_validate_encode_args(argc, argv, &encInfo) == e_success && do_encoding(&encInfo) == e_success)
+            {
+                close_files(&encInfo);
+                add_seed("seed.bmp");
+            }
+            else
+            {
+                close_files(&encInfo);
+            }
+        }
+        add_seed(covers[c]); // And the cover itself, no magic string in it
+        remove(covers[c]);
+    }
+    remove("seed.bmp");
+    remove("secret.txt");
+    return nseeds > 0 ? e_success : e_failure;
+}
+
+/* Write the seeds to dir as seed_NN.bmp */
+static void dump_seeds(const char *dir)
+{
+    char fname[4200];
+
+    for (int i = 0; i < nseeds; i++)
+    {
+        snprintf(fname, sizeof(fname), "%s/seed_%02d.bmp", dir, i);
+        FILE *fptr = fopen(fname, "wb");
+        if (fptr == NULL || fwrite(seeds[i].data, 1, seeds[i].len, fptr) != seeds[i].len)
+        {
+            fprintf(stderr, "lsb_fuzz: Unable to write %s\n", fname);
+        }
+        if (fptr != NULL)
+        {
+            fclose(fptr);
+        }
+    }
+}
+
+/* Offset in the image of the first byte after the BMP headers, or of BMP_HEADER_SIZE if they are broken */
+static size_t pixel_offset(const unsigned char *image, size_t len)
+{
+    size_t offset = len >= 14 ? image[10] | image[11] << 8 | (size_t)image[12] << 16 | (size_t)image[13] << 24 : 0;
+
+    return offset >= BMP_HEADER_SIZE && offset < BMP_MAX_HEADER ? offset : BMP_HEADER_SIZE;
+}
+
+/* A value a size, count or flags field is likely to get wrong */
+static uint64_t edge_value(size_t len)
+{
+    static const uint64_t values[] = {0, 1, 2, 0x7F, 0x80, 0xFF, 0x7FFF, 0xFFFF, 0x7FFFFFFF, 0x80000000, 0xFFFFFFFF,
+                                      0x100000000ull, 1ull << 61, (1ull << 61) + 16, 0x7FFFFFFFFFFFFFFFull, ~0ull};
+    switch (next_random() % 4)
+    {
+    case 0:
+        return len + next_random() % 64 - 32; // About the size of the image
+    case 1:
+        return next_random();
+    default:
+        return values[next_random() % (sizeof(values) / sizeof(values[0]))];
+    }
+}
+
+/* A bfOffBits or biSize value next to a bound bmp_parse() checks, or one that wraps 14 + biSize */
+static uint32_t bmp_edge_value(void)
+{
+    static const uint32_t values[] = {0, 14, 40, 53, BMP_HEADER_SIZE, BMP_HEADER_SIZE + 1, 124, 125,
+                                      BMP_MAX_HEADER, BMP_MAX_HEADER + 1, 0xFFFFFFF2, 0xFFFFFFFF};
+    return values[next_random() % (sizeof(values) / sizeof(values[0]))];
+}
+
+/*
+ * Function: mutate
+ * ------------------
+ * Applies 1 to 4 mutations to image (len bytes, room for FUZZ_MAX_INPUT)
+ * and returns the new length. A field value is written one bit per image
+ * byte, as a version 1 or 2 header at 1 bit is, from a byte position in
+ * the header region.
+ */
+static size_t mutate(unsigned char *image, size_t len)
+{
+    int count = 1 + (int)(next_random() % 4);
+
+    for (int m = 0; m < count && len > 0; m++)
+    {
+        size_t start = pixel_offset(image, len);
+        size_t region = start + STEGO_PROBE_SIZE < len ? start + STEGO_PROBE_SIZE : len;
+        switch (next_random() % 7)
+        {
+        case 0: // Flip a bit of the header region
+        case 1:
+        {
+            size_t at = next_random() % region;
+            image[at] ^= (unsigned char)(1u << (next_random() % 8));
+            break;
+        }
+        case 2: // A random byte anywhere
+            image[next_random() % len] = (unsigned char)next_random();
+            break;
+        case 3: // A BMP header field
+            if (len >= BMP_HEADER_SIZE)
+            {
+                size_t at = 2 + next_random() % (BMP_HEADER_SIZE - 5);
+                put_le32((char *)image + at, (uint32_t)edge_value(len));
+            }
+            break;
+        case 4: // bfOffBits and biSize at their bounds, the decoders read the headers up to pixel_offset
+            if (len >= BMP_HEADER_SIZE)
+            {
+                put_le32((char *)image + 10, bmp_edge_value());
+                if (next_random() % 2)
+                {
+                    put_le32((char *)image + 14, bmp_edge_value());
+                }
+            }
+            break;
+        case 5: // A field of the magic string and header, 1 to 8 bytes through the LSBs
+            if (region > start)
+            {
+                char value[8];
+                uint64_t v = edge_value(len);
+                size_t bytes = 1 + next_random() % 8;
+                size_t at = start + next_random() % ((region - start) / 8 + 1) * 8;
+                for (size_t i = 0; i < bytes; i++)
+                {
+                    value[i] = (char)(v >> (8 * (bytes - 1 - i))); // Header fields are big endian
+                }
+                if (at + bytes * 8 <= len)
+                {
+                    encode_bytes_to_lsb_bits(value, bytes, (char *)image + at, 1);
+                }
+            }
+            break;
+        default: // Cut the image short
+            len = next_random() % len;
+            break;
+        }
+    }
+    return len;
+}
+
+/* Run each file once, e.g. as afl-fuzz runs the target with @@ */
+static int run_files(int nfiles, char *files[])
+{
+    static unsigned char image[FUZZ_MAX_INPUT];
+
+    for (int i = 0; i < nfiles; i++)
+    {
+        FILE *fptr = fopen(files[i], "rb");
+        if (fptr == NULL)
+        {
+            fprintf(stderr, "lsb_fuzz: Unable to open %s\n", files[i]);
+            return 1;
+        }
+        size_t len = fread(image, 1, sizeof(image), fptr);
+        fclose(fptr);
+        LLVMFuzzerTestOneInput(image, len);
+    }
+    return 0;
+}
+
+int main(int argc, char *argv[])
+{
+    static unsigned char image[FUZZ_MAX_INPUT];
+    double seconds = 10, start, elapsed;
+    const char *dump_dir = NULL;
+    uint64_t execs = 0;
+    int files = argc; // First file argument
+    FILE *report;
+
+    for (int i = 1; i < argc; i++)
+    {
+        if (strcmp(argv[i], "--seconds") == 0 && i + 1 < argc && (seconds = atof(argv[++i])) > 0)
+        {
+        }
+        else if (strcmp(argv[i], "--seed") == 0 && i + 1 < argc && (rng_state = strtoull(argv[++i], NULL, 0)) != 0)
+        {
+        }
+        else if (strcmp(argv[i], "--dump") == 0 && i + 1 < argc)
+        {
+            dump_dir = argv[++i];
+        }
+        else if (argv[i][0] == '-')
+        {
+            printf("Usage: ./lsb_fuzz [--seconds N] [--seed S (nonzero)] [--dump DIR]\n"
+                   "       ./lsb_fuzz <file>...\n");
+            return 1;
+        }
+        else
+        {
+            files = i;
+            break;
+        }
+    }
+    // The report goes to the real stdout, the target sends stdout to /dev/null
+    if ((report = fdopen(dup(STDOUT_FILENO), "w")) == NULL)
+    {
+        perror("lsb_fuzz");
+        return 1;
+    }
+    for (int i = files; i < argc; i++)
+    {
+        // The target works in a directory of its own, relative names would no longer resolve
+        if ((argv[i] = realpath(argv[i], NULL)) == NULL)
+        {
+            perror("lsb_fuzz");
+            return 1;
+        }
+    }
+    LLVMFuzzerInitialize(&argc, &argv);
+    if (files < argc)
+    {
+        return run_files(argc - files, argv + files);
+    }
+    if (make_seeds() == e_failure)
+    {
+        fprintf(stderr, "lsb_fuzz: Unable to make the seeds\n");
+        return 1;
+    }
+    if (dump_dir != NULL)
+    {
+        dump_seeds(dump_dir);
+    }
+
+    start = now();
+    do
+    {
+        const Seed *seed = &seeds[next_random() % nseeds];
+        memcpy(image, seed->data, seed->len);
+        LLVMFuzzerTestOneInput(image, mutate(image, seed->len));
+        execs++;
+    } while ((elapsed = now() - start) < seconds);
+
+    fprintf(report, "{\"suite\":\"fuzz\",\"target\":\"decode\",\"execs\":%llu,\"seconds\":%.3f,\"execs_s\":%.1f,"
+            "\"accepted\":%llu,\"rejected\":%llu}\n", (unsigned long long)execs, elapsed, execs / elapsed,
+            (unsigned long long)accepted, (unsigned long long)rejected);
+    fclose(report);
+    return 0;
+}
+
+#endif
@@ -0,0 +1,567 @@
+#include <string.h>
+#include <pthread.h>
+#include "lsb.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define LSB_X86 1
+#elif defined(__aarch64__) || defined(__ARM_NEON)
+#include <arm_neon.h>
+#define LSB_NEON 1
+#endif
+
+/*
+ * Function: encode_bytes_scalar / decode_bytes_scalar
+ * -----------------------------------------------------
+ * Portable one bit per iteration kernels. Used on CPUs without a vector
+ * kernel and for the tail that does not fill a whole vector.
+ */
+static void encode_bytes_scalar(const char *data, size_t n, char *image_buffer)
+{
+    for (size_t i = 0; i < n; i++)
+    {
+        for (int j = 0; j < 8; j++)
+        {
+            char *byte = &image_buffer[i * 8 + j];
+            *byte = (*byte & 0xFE) | ((data[i] >> (7 - j)) & 1); // Replace the LSB with bit (7 - j) of the payload byte
+        }
+    }
+}
+
+static void decode_bytes_scalar(char *data, size_t n, const char *image_buffer)
+{
+    for (size_t i = 0; i < n; i++)
+    {
+        unsigned char ch = 0;
+        for (int j = 0; j < 8; j++)
+        {
+            ch = (ch << 1) | (image_buffer[i * 8 + j] & 1); // Shift in the LSB, most significant bit first
+        }
+        data[i] = ch;
+    }
+}
+
+#ifdef LSB_X86
+/*
+ * Function: encode_bytes_sse2
+ * -----------------------------
+ * Broadcast-and-mask encode: every payload byte is replicated over 8 lanes,
+ * ANDed with 0x80, 0x40 ... 0x01 and compared against the mask, which gives
+ * one 0/1 bit per image byte. 16 payload bytes are handled per iteration.
+ */
+static void encode_bytes_sse2(const char *data, size_t n, char *image_buffer)
+{
+    const __m128i mask = _mm_set_epi8(1, 2, 4, 8, 16, 32, 64, (char)128,
+                                      1, 2, 4, 8, 16, 32, 64, (char)128);
+    const __m128i one = _mm_set1_epi8(1);
+    const __m128i clear = _mm_set1_epi8((char)0xFE);
+    size_t i = 0;
+
+    for (; i + 16 <= n; i += 16)
+    {
+        __m128i src = _mm_loadu_si128((const __m128i *)(data + i));
+        __m128i b[2] = {_mm_unpacklo_epi8(src, src), _mm_unpackhi_epi8(src, src)};
+
+        for (int h = 0; h < 2; h++)
+        {
+            __m128i w[2] = {_mm_unpacklo_epi16(b[h], b[h]), _mm_unpackhi_epi16(b[h], b[h])};
+            for (int q = 0; q < 2; q++)
+            {
+                __m128i rep[2] = {_mm_unpacklo_epi32(w[q], w[q]), _mm_unpackhi_epi32(w[q], w[q])};
+                for (int r = 0; r < 2; r++)
+                {
+                    char *dst = image_buffer + (i + h * 8 + q * 4 + r * 2) * 8;
+                    __m128i bits = _mm_and_si128(_mm_cmpeq_epi8(_mm_and_si128(rep[r], mask), mask), one);
+                    __m128i img = _mm_loadu_si128((const __m128i *)dst);
+                    _mm_storeu_si128((__m128i *)dst, _mm_or_si128(_mm_and_si128(img, clear), bits));
+                }
+            }
+        }
+    }
+    encode_bytes_scalar(data + i, n - i, image_buffer + i * 8);
+}
+
+/*
+ * Function: decode_bytes_sse2
+ * -----------------------------
+ * Movemask gather: the bytes of every 8 byte group are reversed so the
+ * most significant payload bit ends up in the highest lane, the LSB is
+ * shifted into the sign bit and _mm_movemask_epi8 collects 2 payload bytes
+ * per 16 image bytes.
+ */
+static void decode_bytes_sse2(char *data, size_t n, const char *image_buffer)
+{
+    size_t i = 0;
+
+    for (; i + 2 <= n; i += 2)
+    {
+        __m128i v = _mm_loadu_si128((const __m128i *)(image_buffer + i * 8));
+        v = _mm_shufflelo_epi16(v, _MM_SHUFFLE(0, 1, 2, 3));           // Reverse the words of each group
+        v = _mm_shufflehi_epi16(v, _MM_SHUFFLE(0, 1, 2, 3));
+        v = _mm_or_si128(_mm_slli_epi16(v, 8), _mm_srli_epi16(v, 8)); // Swap the bytes inside each word
+        int bits = _mm_movemask_epi8(_mm_slli_epi64(v, 7));
+        data[i] = (char)(bits & 0xFF);
+        data[i + 1] = (char)(bits >> 8);
+    }
+    decode_bytes_scalar(data + i, n - i, image_buffer + i * 8);
+}
+
+/*
+ * Function: encode_bytes_avx2 / decode_bytes_avx2
+ * -------------------------------------------------
+ * Same technique as the SSE2 kernels on 32 image bytes at a time, using
+ * _mm256_shuffle_epi8 for the broadcast and the in-group byte reversal.
+ */
+__attribute__((target("avx2")))
+static void encode_bytes_avx2(const char *data, size_t n, char *image_buffer)
+{
+    const __m256i spread = _mm256_setr_epi8(0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 1, 1, 1, 1,
+                                            2, 2, 2, 2, 2, 2, 2, 2, 3, 3, 3, 3, 3, 3, 3, 3);
+    const __m256i mask = _mm256_setr_epi8((char)128, 64, 32, 16, 8, 4, 2, 1, (char)128, 64, 32, 16, 8, 4, 2, 1,
+                                          (char)128, 64, 32, 16, 8, 4, 2, 1, (char)128, 64, 32, 16, 8, 4, 2, 1);
+    const __m256i one = _mm256_set1_epi8(1);
+    const __m256i clear = _mm256_set1_epi8((char)0xFE);
+    size_t i = 0;
+
+    for (; i + 4 <= n; i += 4)
+    {
+        int word;
+        memcpy(&word, data + i, sizeof(word));
+        char *dst = image_buffer + i * 8;
+        __m256i rep = _mm256_shuffle_epi8(_mm256_set1_epi32(word), spread);
+        __m256i bits = _mm256_and_si256(_mm256_cmpeq_epi8(_mm256_and_si256(rep, mask), mask), one);
+        __m256i img = _mm256_loadu_si256((const __m256i *)dst);
+        _mm256_storeu_si256((__m256i *)dst, _mm256_or_si256(_mm256_and_si256(img, clear), bits));
+    }
+    encode_bytes_scalar(data + i, n - i, image_buffer + i * 8);
+}
+
+__attribute__((target("avx2")))
+static void decode_bytes_avx2(char *data, size_t n, const char *image_buffer)
+{
+    const __m256i reverse = _mm256_setr_epi8(7, 6, 5, 4, 3, 2, 1, 0, 15, 14, 13, 12, 11, 10, 9, 8,
+                                             7, 6, 5, 4, 3, 2, 1, 0, 15, 14, 13, 12, 11, 10, 9, 8);
+    size_t i = 0;
+
+    for (; i + 4 <= n; i += 4)
+    {
+        __m256i v = _mm256_loadu_si256((const __m256i *)(image_buffer + i * 8));
+        v = _mm256_shuffle_epi8(v, reverse);
+        unsigned int bits = (unsigned int)_mm256_movemask_epi8(_mm256_slli_epi64(v, 7));
+        memcpy(data + i, &bits, sizeof(bits)); // Byte k of the mask is payload byte i + k on little endian x86
+    }
+    decode_bytes_scalar(data + i, n - i, image_buffer + i * 8);
+}
+#endif
+
+#ifdef LSB_NEON
+/*
+ * Function: encode_bytes_neon / decode_bytes_neon
+ * -------------------------------------------------
+ * NEON kernels: vtst against the bit masks for encode, and a per-lane
+ * shift followed by a horizontal add of each 8 byte group for decode.
+ */
+static void encode_bytes_neon(const char *data, size_t n, char *image_buffer)
+{
+    const uint8_t mask_bytes[16] = {128, 64, 32, 16, 8, 4, 2, 1, 128, 64, 32, 16, 8, 4, 2, 1};
+    const uint8x16_t mask = vld1q_u8(mask_bytes);
+    const uint8x16_t one = vdupq_n_u8(1);
+    size_t i = 0;
+
+    for (; i + 2 <= n; i += 2)
+    {
+        uint8_t *dst = (uint8_t *)image_buffer + i * 8;
+        uint8x16_t rep = vcombine_u8(vdup_n_u8((uint8_t)data[i]), vdup_n_u8((uint8_t)data[i + 1]));
+        uint8x16_t bits = vandq_u8(vtstq_u8(rep, mask), one);
+        uint8x16_t img = vld1q_u8(dst);
+        vst1q_u8(dst, vorrq_u8(vbicq_u8(img, one), bits));
+    }
+    encode_bytes_scalar(data + i, n - i, image_buffer + i * 8);
+}
+
+static void decode_bytes_neon(char *data, size_t n, const char *image_buffer)
+{
+    const int8_t shift_bytes[16] = {7, 6, 5, 4, 3, 2, 1, 0, 7, 6, 5, 4, 3, 2, 1, 0};
+    const int8x16_t shift = vld1q_s8(shift_bytes);
+    const uint8x16_t one = vdupq_n_u8(1);
+    size_t i = 0;
+
+    for (; i + 2 <= n; i += 2)
+    {
+        uint8x16_t v = vandq_u8(vld1q_u8((const uint8_t *)image_buffer + i * 8), one);
+        v = vshlq_u8(v, shift); // Move each LSB to its bit position in the payload byte
+        data[i] = (char)vaddv_u8(vget_low_u8(v));
+        data[i + 1] = (char)vaddv_u8(vget_high_u8(v));
+    }
+    decode_bytes_scalar(data + i, n - i, image_buffer + i * 8);
+}
+#endif
+
+/*
+ * Function: encode_bits_generic / decode_bits_generic
+ * -----------------------------------------------------
+ * k-LSB through a small bit accumulator, for any bits. Handles the bytes
+ * that do not fill a whole group of the specialized kernels below.
+ */
+static void encode_bits_generic(const char *data, size_t n, char *image_buffer, int bits)
+{
+    const unsigned char mask = (1u << bits) - 1;
+    unsigned char *image = (unsigned char *)image_buffer;
+    uint32_t acc = 0; // Pending payload bits, only the low pending ones matter
+    int pending = 0;
+    for (size_t i = 0; i < n; i++)
+    {
+        acc = acc << 8 | (unsigned char)data[i];
+        pending += 8;
+        while (pending >= bits)
+        {
+            pending -= bits;
+            *image = (*image & ~mask) | ((acc >> pending) & mask);
+            image++;
+        }
+    }
+    if (pending > 0) // Last image byte is only partly used, its unused payload bits are zero
+    {
+        *image = (*image & ~mask) | ((acc << (bits - pending)) & mask);
+    }
+}
+
+static void decode_bits_generic(char *data, size_t n, const char *image_buffer, int bits)
+{
+    const unsigned char mask = (1u << bits) - 1;
+    const unsigned char *image = (const unsigned char *)image_buffer;
+    uint32_t acc = 0;
+    int pending = 0;
+    for (size_t i = 0; i < n; i++)
+    {
+        while (pending < 8)
+        {
+            acc = acc << bits | (*image++ & mask);
+            pending += bits;
+        }
+        pending -= 8;
+        data[i] = (char)(acc >> pending);
+    }
+}
+
+/* 8 image bytes as one big endian word, image byte j in bits 56-8*j .. 63-8*j */
+static inline uint64_t load_image_word(const char *image)
+{
+    uint64_t word;
+    memcpy(&word, image, sizeof(word));
+#if !defined(__BYTE_ORDER__) || __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    word = __builtin_bswap64(word);
+#endif
+    return word;
+}
+
+static inline void store_image_word(char *image, uint64_t word)
+{
+#if !defined(__BYTE_ORDER__) || __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    word = __builtin_bswap64(word);
+#endif
+    memcpy(image, &word, sizeof(word));
+}
+
+/* The low width bits of every stride bit lane, a constant once inlined */
+static inline uint64_t lane_mask(int width, int stride)
+{
+    uint64_t mask = 0;
+    for (int i = 0; i < 64; i += stride)
+    {
+        mask |= ((1ull << width) - 1) << i;
+    }
+    return mask;
+}
+
+/*
+ * Macro: DEFINE_BITS_KERNELS
+ * ----------------------------
+ * Defines encode_bits_K / decode_bits_K for K payload bits per image byte.
+ * K payload bytes are exactly the K low bits of 8 image bytes, so each
+ * group is read as one 8K-bit big endian value whose K-bit fields are
+ * spread to one per byte of a 64-bit image word in three shift-and-mask
+ * steps (halves, quarters, bytes), or gathered back in the reverse order.
+ * Every shift and mask is a compile-time constant. The bytes past the last
+ * whole group go through the generic kernel.
+ */
+#define DEFINE_BITS_KERNELS(K)                                                                 \
+    static void encode_bits_##K(const char *data, size_t n, char *image_buffer)                \
+    {                                                                                          \
+        const unsigned char *src = (const unsigned char *)data;                                \
+        size_t i = 0;                                                                          \
+                                                                                               \
+        for (; i + (K) <= n; i += (K), image_buffer += 8)                                      \
+        {                                                                                      \
+            uint64_t spread = 0;                                                               \
+            for (int b = 0; b < (K); b++)                                                      \
+            {                                                                                  \
+                spread = spread << 8 | src[i + b];                                             \
+            }                                                                                  \
+            spread = (spread | spread << 4 * (8 - (K))) & lane_mask(4 * (K), 32);              \
+            spread = (spread | spread << 2 * (8 - (K))) & lane_mask(2 * (K), 16);              \
+            spread = (spread | spread << (8 - (K))) & lane_mask((K), 8);                       \
+            uint64_t word = load_image_word(image_buffer);                                     \
+            store_image_word(image_buffer, (word & ~lane_mask((K), 8)) | spread);              \
+        }                                                                                      \
+        encode_bits_generic(data + i, n - i, image_buffer, (K));                               \
+    }                                                                                          \
+                                                                                               \
+    static void decode_bits_##K(char *data, size_t n, const char *image_buffer)                \
+    {                                                                                          \
+        size_t i = 0;                                                                          \
+                                                                                               \
+        for (; i + (K) <= n; i += (K), image_buffer += 8)                                      \
+        {                                                                                      \
+            uint64_t group = load_image_word(image_buffer) & lane_mask((K), 8);                \
+            group = (group | group >> (8 - (K))) & lane_mask(2 * (K), 16);                     \
+            group = (group | group >> 2 * (8 - (K))) & lane_mask(4 * (K), 32);                 \
+            group = (group | group >> 4 * (8 - (K))) & lane_mask(8 * (K), 64);                 \
+            for (int b = 0; b < (K); b++)                                                      \
+            {                                                                                  \
+                data[i + b] = (char)(group >> 8 * ((K) - 1 - b));                              \
+            }                                                                                  \
+        }                                                                                      \
+        decode_bits_generic(data + i, n - i, image_buffer, (K));                               \
+    }
+
+DEFINE_BITS_KERNELS(2)
+DEFINE_BITS_KERNELS(3)
+DEFINE_BITS_KERNELS(4)
+
+static pthread_once_t kernel_once = PTHREAD_ONCE_INIT;
+static lsb_encode_fn encode_kernel;
+static lsb_decode_fn decode_kernel;
+static const char *kernel_name;
+
+/* Kernels by bits; the 1 bit entry follows the kernel in use */
+static LsbKernel bits_kernels[LSB_MAX_BITS + 1] = {
+    {NULL, NULL},
+    {NULL, NULL},
+    {encode_bits_2, decode_bits_2},
+    {encode_bits_3, decode_bits_3},
+    {encode_bits_4, decode_bits_4},
+};
+
+static void use_kernel(const char *name, lsb_encode_fn encode, lsb_decode_fn decode)
+{
+    decode_kernel = decode;
+    bits_kernels[1].decode = decode;
+    bits_kernels[1].encode = encode;
+    kernel_name = name;
+    encode_kernel = encode;
+}
+
+/*
+ * Function: select_kernels
+ * --------------------------
+ * Picks the widest kernel the running CPU supports. Runs once, through
+ * pthread_once(), which also makes the kernel pointers it stores visible
+ * to every worker that calls in after it.
+ */
+static void select_kernels(void)
+{
+#if defined(LSB_X86)
+    if (__builtin_cpu_supports("avx2"))
+    {
+        use_kernel("avx2", encode_bytes_avx2, decode_bytes_avx2);
+        return;
+    }
+    use_kernel("sse2", encode_bytes_sse2, decode_bytes_sse2);
+#elif defined(LSB_NEON)
+    use_kernel("neon", encode_bytes_neon, decode_bytes_neon);
+#else
+    use_kernel("scalar", encode_bytes_scalar, decode_bytes_scalar);
+#endif
+}
+
+/*
+ * Function: encode_bytes_to_lsb
+ * -------------------------------
+ * Encodes n payload bytes into the least significant bits of 8 * n image
+ * bytes using the fastest kernel available.
+ *
+ * Parameters:
+ * -------------
+ *   - const char *data: Payload bytes to encode.
+ *   - size_t n: Number of payload bytes.
+ *   - char *image_buffer: Image bytes to modify, at least 8 * n bytes.
+ *
+ * Returns:
+ * -----------
+ *   - Status: e_success after encoding the bytes.
+ */
+Status encode_bytes_to_lsb(const char *data, size_t n, char *image_buffer)
+{
+    pthread_once(&kernel_once, select_kernels);
+    encode_kernel(data, n, image_buffer);
+    return e_success;
+}
+
+/*
+ * Function: decode_lsb_to_bytes
+ * -------------------------------
+ * Decodes n payload bytes from the least significant bits of 8 * n image
+ * bytes using the fastest kernel available.
+ *
+ * Parameters:
+ * -------------
+ *   - char *data: Destination for the decoded bytes, at least n bytes.
+ *   - size_t n: Number of payload bytes.
+ *   - const char *image_buffer: Image bytes holding the payload.
+ *
+ * Returns:
+ * -----------
+ *   - Status: e_success after decoding the bytes.
+ */
+Status decode_lsb_to_bytes(char *data, size_t n, const char *image_buffer)
+{
+    pthread_once(&kernel_once, select_kernels);
+    decode_kernel(data, n, image_buffer);
+    return e_success;
+}
+
+/*
+ * Function: lsb_image_bytes
+ * ---------------------------
+ * Returns the number of image bytes that hold n payload bytes when every
+ * image byte carries bits payload bits.
+ */
+uint64_t lsb_image_bytes(uint64_t n, int bits)
+{
+    return (n * 8 + bits - 1) / bits;
+}
+
+/* The inverse of lsb_image_bytes, worked out without overflow so untrusted header sizes can be checked against it */
+uint64_t lsb_payload_capacity(uint64_t image_bytes, int bits)
+{
+    return image_bytes / 8 * bits + image_bytes % 8 * bits / 8;
+}
+
+/*
+ * Function: encode_bytes_to_lsb_bits
+ * ------------------------------------
+ * Encodes n payload bytes into the bits least significant bits of each
+ * image byte with the kernel lsb_kernel(bits) returns: the vector
+ * kernels for one bit per byte, the grouped ones for wider modes.
+ *
+ * Parameters:
+ * -------------
+ *   - const char *data: Payload bytes to encode.
+ *   - size_t n: Number of payload bytes.
+ *   - char *image_buffer: Image bytes to modify, at least lsb_image_bytes(n, bits).
+ *   - int bits: Payload bits per image byte, 1 .. LSB_MAX_BITS.
+ *
+ * Returns:
+ * -----------
+ *   - Status: e_success after encoding the bytes,
+ *             e_failure if bits is out of range.
+ */
+Status encode_bytes_to_lsb_bits(const char *data, size_t n, char *image_buffer, int bits)
+{
+    const LsbKernel *kernel = lsb_kernel(bits);
+    if (kernel == NULL)
+    {
+        return e_failure;
+    }
+    kernel->encode(data, n, image_buffer);
+    return e_success;
+}
+
+/*
+ * Function: decode_lsb_bits_to_bytes
+ * ------------------------------------
+ * Decodes n payload bytes from the bits least significant bits of each
+ * image byte, the inverse of encode_bytes_to_lsb_bits().
+ *
+ * Parameters:
+ * -------------
+ *   - char *data: Destination for the decoded bytes, at least n bytes.
+ *   - size_t n: Number of payload bytes.
+ *   - const char *image_buffer: Image bytes holding the payload.
+ *   - int bits: Payload bits per image byte, 1 .. LSB_MAX_BITS.
+ *
+ * Returns:
+ * -----------
+ *   - Status: e_success after decoding the bytes,
+ *             e_failure if bits is out of range.
+ */
+Status decode_lsb_bits_to_bytes(char *data, size_t n, const char *image_buffer, int bits)
+{
+    const LsbKernel *kernel = lsb_kernel(bits);
+    if (kernel == NULL)
+    {
+        return e_failure;
+    }
+    kernel->decode(data, n, image_buffer);
+    return e_success;
+}
+
+/*
+ * Function: lsb_kernel
+ * ----------------------
+ * Looks up the kernels for bits payload bits per image byte, selecting
+ * the 1 bit kernel for this CPU on first use. The pointer stays valid and
+ * follows lsb_select_kernel().
+ *
+ * Returns:
+ * -----------
+ *   - const LsbKernel *: The encode / decode pair,
+ *                        NULL if bits is out of range.
+ */
+const LsbKernel *lsb_kernel(int bits)
+{
+    if (bits < 1 || bits > LSB_MAX_BITS)
+    {
+        return NULL;
+    }
+    pthread_once(&kernel_once, select_kernels);
+    return &bits_kernels[bits];
+}
+
+const char *lsb_kernel_name(void)
+{
+    pthread_once(&kernel_once, select_kernels);
+    return kernel_name;
+}
+
+/*
+ * Function: lsb_select_kernel
+ * -----------------------------
+ * Replaces the kernel picked by select_kernels, so the benchmark can
+ * compare the scalar and vector kernels on the same CPU. Not thread safe:
+ * call it before any worker starts.
+ *
+ * Returns:
+ * -----------
+ *   - Status: e_success if the kernel is now in use,
+ *             e_failure if it is not built in or the CPU lacks it.
+ */
+Status lsb_select_kernel(const char *name)
+{
+    pthread_once(&kernel_once, select_kernels); // So a first call later does not undo this one
+    if (strcmp(name, "scalar") == 0)
+    {
+        use_kernel("scalar", encode_bytes_scalar, decode_bytes_scalar);
+    }
+#if defined(LSB_X86)
+    else if (strcmp(name, "sse2") == 0)
+    {
+        use_kernel("sse2", encode_bytes_sse2, decode_bytes_sse2);
+    }
+    else if (strcmp(name, "avx2") == 0 && __builtin_cpu_supports("avx2"))
+    {
+        use_kernel("avx2", encode_bytes_avx2, decode_bytes_avx2);
+    }
+#elif defined(LSB_NEON)
+    else if (strcmp(name, "neon") == 0)
+    {
+        use_kernel("neon", encode_bytes_neon, decode_bytes_neon);
+    }
+#endif
+    else
+    {
+        return e_failure;
+    }
+    return e_success;
+}
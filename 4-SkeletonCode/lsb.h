@@ -0,0 +1,77 @@
+#ifndef LSB_H
+#define LSB_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "types.h"
+
+/*
+ * Bulk LSB kernels
+ * ----------------
+ * Payload byte i always lives in image bytes 8*i .. 8*i+7, most significant
+ * bit first, exactly as encode_byte_to_lsb() / decode_lsb_to_byte() lay it
+ * out. These kernels process a whole run of payload bytes per call and pick
+ * an SSE2/AVX2 (x86) or NEON (ARM) implementation at runtime, with a scalar
+ * fallback. Output is bit-identical to the single byte functions.
+ */
+
+/* Encode n payload bytes into the LSB of 8 * n image bytes */
+Status encode_bytes_to_lsb(const char *data, size_t n, char *image_buffer);
+
+/* Decode n payload bytes from the LSB of 8 * n image bytes */
+Status decode_lsb_to_bytes(char *data, size_t n, const char *image_buffer);
+
+/*
+ * k-LSB mode
+ * ----------
+ * With bits = k (1 .. LSB_MAX_BITS) the payload is treated as one bit
+ * stream, most significant bit first, and every image byte takes the next
+ * k bits in its k low bits. bits = 1 is the layout above. A run of payload
+ * bytes that is continued by a later call must be a multiple of bits bytes
+ * long so the next run starts on an image byte boundary; the last image
+ * byte of a run may be only partly used.
+ */
+#define LSB_MAX_BITS 4
+
+/* Image bytes needed for n payload bytes at bits per image byte (n below 2^61) */
+uint64_t lsb_image_bytes(uint64_t n, int bits);
+
+/* Payload bytes that fit in image_bytes image bytes at bits per image byte, exact for any image_bytes */
+uint64_t lsb_payload_capacity(uint64_t image_bytes, int bits);
+
+/* Encode n payload bytes into the bits low bits of lsb_image_bytes(n, bits) image bytes */
+Status encode_bytes_to_lsb_bits(const char *data, size_t n, char *image_buffer, int bits);
+
+/* Decode n payload bytes from the bits low bits of lsb_image_bytes(n, bits) image bytes */
+Status decode_lsb_bits_to_bytes(char *data, size_t n, const char *image_buffer, int bits);
+
+/*
+ * Per-job kernels
+ * ---------------
+ * lsb_kernel(bits) returns the encode / decode pair specialized for one
+ * bit width, so a job looks it up once and its hot loop calls straight
+ * into a kernel with every shift and mask fixed at compile time. bits = 1
+ * is the vector kernel selected for this CPU, wider modes move one group
+ * of bits payload bytes to 8 image bytes per 64-bit load and store.
+ * Calling a kernel is the same as calling encode_bytes_to_lsb_bits() /
+ * decode_lsb_bits_to_bytes() with its bits.
+ */
+typedef void (*lsb_encode_fn)(const char *data, size_t n, char *image_buffer);
+typedef void (*lsb_decode_fn)(char *data, size_t n, const char *image_buffer);
+
+typedef struct
+{
+    lsb_encode_fn encode;
+    lsb_decode_fn decode;
+} LsbKernel;
+
+/* Kernels for bits payload bits per image byte, NULL if bits is out of range */
+const LsbKernel *lsb_kernel(int bits);
+
+/* Name of the kernel selected for this CPU ("avx2", "sse2", "neon", "scalar") */
+const char *lsb_kernel_name(void);
+
+/* Use the named kernel from now on, e_failure if it is not built in or the CPU lacks it */
+Status lsb_select_kernel(const char *name);
+
+#endif
@@ -0,0 +1,315 @@
+#include <string.h>
+#include "lz.h"
+
+#define LZ_MIN_MATCH 4
+#define LZ_LAST_LITERALS 5 // The last 5 bytes of a block are always literals
+#define LZ_MATCH_LIMIT 12  // and the last match starts at least 12 bytes before its end
+#define LZ_MAX_OFFSET 65535
+
+static uint32_t read32(const unsigned char *p)
+{
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static uint32_t hash32(uint32_t v)
+{
+    return (v * 2654435761u) >> (32 - LZ_HASH_BITS);
+}
+
+/* Writes the 255-run extension of a length that did not fit its 4 token bits */
+static unsigned char *put_length(unsigned char *op, size_t length)
+{
+    for (; length >= 255; length -= 255)
+    {
+        *op++ = 255;
+    }
+    *op++ = (unsigned char)length;
+    return op;
+}
+
+/*
+ * Function: compress_block
+ * --------------------------
+ * LZ4 block compression of n bytes into out. Every position is hashed on
+ * its first 4 bytes, a hit is verified, extended backwards over pending
+ * literals and forwards as far as it matches.
+ *
+ * Returns:
+ * -----------
+ *   - size_t: Compressed length, 0 if it would not fit in cap bytes.
+ */
+static size_t compress_block(const unsigned char *in, size_t n, unsigned char *out, size_t cap, uint16_t *table)
+{
+    const unsigned char *ip = in, *anchor = in, *end = in + n;
+    unsigned char *op = out, *oend = out + cap;
+
+    memset(table, 0, LZ_TABLE_SIZE);
+    if (n > LZ_MATCH_LIMIT)
+    {
+        const unsigned char *match_start_limit = end - LZ_MATCH_LIMIT;
+        const unsigned char *match_end_limit = end - LZ_LAST_LITERALS;
+        for (ip++; ip < match_start_limit;)
+        {
+            uint32_t sequence = read32(ip);
+            uint32_t h = hash32(sequence);
+            const unsigned char *ref = in + table[h];
+            table[h] = (uint16_t)(ip - in);
+            if (read32(ref) != sequence || ip - ref > LZ_MAX_OFFSET)
+            {
+                ip++;
+                continue;
+            }
+            while (ip > anchor && ref > in && ip[-1] == ref[-1])
+            {
+                ip--;
+                ref--;
+            }
+            const unsigned char *match_end = ip + LZ_MIN_MATCH;
+            while (match_end < match_end_limit && *match_end == ref[match_end - ip])
+            {
+                match_end++;
+            }
+            size_t literals = ip - anchor;
+            size_t match = match_end - ip - LZ_MIN_MATCH;
+            if ((size_t)(oend - op) < 1 + literals / 255 + 1 + literals + 2 + match / 255 + 1)
+            {
+                return 0;
+            }
+
+            unsigned char *token = op++;
+            *token = (unsigned char)((literals < 15 ? literals : 15) << 4 | (match < 15 ? match : 15));
+            if (literals >= 15)
+            {
+                op = put_length(op, literals - 15);
+            }
+            memcpy(op, anchor, literals);
+            op += literals;
+            size_t offset = ip - ref;
+            *op++ = (unsigned char)offset;
+            *op++ = (unsigned char)(offset >> 8);
+            if (match >= 15)
+            {
+                op = put_length(op, match - 15);
+            }
+            ip = anchor = match_end;
+        }
+    }
+
+    // The last sequence is literals only
+    size_t literals = end - anchor;
+    if ((size_t)(oend - op) < 1 + literals / 255 + 1 + literals)
+    {
+        return 0;
+    }
+    *op++ = (unsigned char)((literals < 15 ? literals : 15) << 4);
+    if (literals >= 15)
+    {
+        op = put_length(op, literals - 15);
+    }
+    memcpy(op, anchor, literals);
+    op += literals;
+    return op - out;
+}
+
+/*
+ * Function: lz_compress_frame
+ * -----------------------------
+ * Compresses n bytes into one frame, or stores them as they are when
+ * compression would not make them smaller.
+ *
+ * Returns:
+ * -----------
+ *   - size_t: Length of the frame, length word included.
+ */
+size_t lz_compress_frame(const char *in, size_t n, char *out, uint16_t *table)
+{
+    unsigned char *op = (unsigned char *)out;
+    uint32_t word;
+    size_t length = n > 1 ? compress_block((const unsigned char *)in, n, op + 4, n - 1, table) : 0;
+
+    if (length == 0)
+    {
+        memcpy(op + 4, in, n);
+        length = n;
+        word = (uint32_t)n | LZ_FRAME_STORED;
+    }
+    else
+    {
+        word = (uint32_t)length;
+    }
+    op[0] = (unsigned char)(word >> 24);
+    op[1] = (unsigned char)(word >> 16);
+    op[2] = (unsigned char)(word >> 8);
+    op[3] = (unsigned char)word;
+    return 4 + length;
+}
+
+/* Reads a 255-run length extension, false if the input ends inside it */
+static int get_length(const unsigned char **ip, const unsigned char *end, size_t *length)
+{
+    unsigned char b;
+    do
+    {
+        if (*ip == end)
+        {
+            return 0;
+        }
+        b = *(*ip)++;
+        *length += b;
+    } while (b == 255);
+    return 1;
+}
+
+/*
+ * Function: lz_decompress_block
+ * -------------------------------
+ * Decompresses one LZ4 block. Every length and offset is checked against
+ * the input and the output buffer, so a corrupt block fails instead of
+ * reading or writing out of bounds.
+ *
+ * Returns:
+ * -----------
+ *   - Status: e_success, or e_failure if the block is malformed or does
+ *             not fit in cap bytes.
+ */
+Status lz_decompress_block(const char *in, size_t n, char *out, size_t cap, size_t *out_len)
+{
+    const unsigned char *ip = (const unsigned char *)in, *end = ip + n;
+    unsigned char *dst = (unsigned char *)out, *op = dst, *oend = dst + cap;
+
+    while (ip < end)
+    {
+        unsigned token = *ip++;
+        size_t literals = token >> 4;
+        if (literals == 15 && !get_length(&ip, end, &literals))
+        {
+            return e_failure;
+        }
+        if (literals > (size_t)(end - ip) || literals > (size_t)(oend - op))
+        {
+            return e_failure;
+        }
+        memcpy(op, ip, literals);
+        op += literals;
+        ip += literals;
+        if (ip == end)
+        {
+            break; // Last sequence, no match
+        }
+
+        if (end - ip < 2)
+        {
+            return e_failure;
+        }
+        size_t offset = ip[0] | (size_t)ip[1] << 8;
+        ip += 2;
+        size_t match = token & 15;
+        if (match == 15 && !get_length(&ip, end, &match))
+        {
+            return e_failure;
+        }
+        match += LZ_MIN_MATCH;
+        if (offset == 0 || offset > (size_t)(op - dst) || match > (size_t)(oend - op))
+        {
+            return e_failure;
+        }
+        const unsigned char *ref = op - offset;
+        if (offset >= match)
+        {
+            memcpy(op, ref, match);
+        }
+        else
+        {
+            for (size_t i = 0; i < match; i++) // Overlapping copy repeats the last offset bytes
+            {
+                op[i] = ref[i];
+            }
+        }
+        op += match;
+    }
+    *out_len = op - dst;
+    return e_success;
+}
+
+void lz_stream_init(LzStream *stream, char *frame, char *out, lz_sink_fn sink, void *ctx)
+{
+    memset(stream, 0, sizeof(*stream));
+    stream->frame = frame;
+    stream->out = out;
+    stream->need = 4;
+    stream->sink = sink;
+    stream->ctx = ctx;
+}
+
+/*
+ * Function: lz_stream_feed
+ * --------------------------
+ * Collects the next n payload bytes into the current frame. Every frame
+ * that completes is decompressed (or, if stored, passed on as it is) to
+ * the sink.
+ *
+ * Returns:
+ * -----------
+ *   - Status: e_success, or e_failure on a malformed frame or when the
+ *             sink fails.
+ */
+Status lz_stream_feed(LzStream *stream, const char *data, size_t n)
+{
+    const unsigned char *frame = (const unsigned char *)stream->frame;
+
+    while (n > 0)
+    {
+        size_t take = stream->need - stream->have < n ? stream->need - stream->have : n;
+        memcpy(stream->frame + stream->have, data, take);
+        stream->have += take;
+        data += take;
+        n -= take;
+        if (stream->have < stream->need)
+        {
+            break;
+        }
+
+        uint32_t word = (uint32_t)frame[0] << 24 | (uint32_t)frame[1] << 16 | (uint32_t)frame[2] << 8 | frame[3];
+        size_t length = word & ~LZ_FRAME_STORED;
+        if (stream->need == 4)
+        {
+            if (length == 0 || length > LZ_BLOCK_SIZE)
+            {
+                return e_failure;
+            }
+            stream->need += length; // Now collect the data
+            continue;
+        }
+
+        Status status;
+        if (word & LZ_FRAME_STORED)
+        {
+            status = stream->sink(stream->ctx, stream->frame + 4, length);
+            stream->produced += length;
+        }
+        else
+        {
+            size_t out_len;
+            if (lz_decompress_block(stream->frame + 4, length, stream->out, LZ_BLOCK_SIZE, &out_len) == e_failure)
+            {
+                return e_failure;
+            }
+            status = stream->sink(stream->ctx, stream->out, out_len);
+            stream->produced += out_len;
+        }
+        if (status == e_failure)
+        {
+            return e_failure;
+        }
+        stream->have = 0;
+        stream->need = 4;
+    }
+    return e_success;
+}
+
+Status lz_stream_finish(const LzStream *stream)
+{
+    return stream->have == 0 ? e_success : e_failure;
+}
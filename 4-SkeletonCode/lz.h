@@ -0,0 +1,62 @@
+#ifndef LZ_H
+#define LZ_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "types.h"
+
+/*
+ * Payload compression (-z)
+ * ------------------------
+ * A compressed payload is a sequence of frames, each holding up to
+ * LZ_BLOCK_SIZE bytes of the secret:
+ *
+ *   length (4, big endian, top bit set: stored as is) | data (length bytes)
+ *
+ * The data of a frame is one LZ4 block (the LZ4 block format: token,
+ * literals, 16-bit offset, match length) compressed independently of the
+ * other frames, so a decoder never needs more than one frame of history.
+ * A block that does not shrink is stored as is. The compressor is a greedy
+ * single-probe hash matcher tuned for speed, like LZ4 at its fastest level.
+ *
+ * Nothing here allocates: the caller hands in the buffers, sized with the
+ * macros below.
+ */
+
+#define LZ_BLOCK_SIZE (64 * 1024)          // Secret bytes per frame
+#define LZ_FRAME_SIZE (4 + LZ_BLOCK_SIZE)  // Largest frame, length word included
+#define LZ_FRAME_STORED 0x80000000u        // Length flag: the frame is not compressed
+#define LZ_HASH_BITS 12
+#define LZ_TABLE_SIZE ((1u << LZ_HASH_BITS) * sizeof(uint16_t)) // Match finder state of lz_compress_frame
+
+/* Compress n (at most LZ_BLOCK_SIZE) bytes into one frame at out (LZ_FRAME_SIZE bytes), returns its length */
+size_t lz_compress_frame(const char *in, size_t n, char *out, uint16_t *table);
+
+/* Decompress one LZ4 block of n bytes into out (cap bytes), *out_len is set to the decompressed size */
+Status lz_decompress_block(const char *in, size_t n, char *out, size_t cap, size_t *out_len);
+
+/* Receives the decompressed bytes of an LzStream */
+typedef Status (*lz_sink_fn)(void *ctx, const char *data, size_t n);
+
+/* Incremental decoder: frames may be fed in pieces of any size */
+typedef struct _LzStream
+{
+    char *frame;       // LZ_FRAME_SIZE bytes: the frame being collected
+    char *out;         // LZ_BLOCK_SIZE bytes: its decompressed data
+    size_t have;       // Bytes of the current frame collected so far
+    size_t need;       // Length of the current frame, 4 until the length word is in
+    uint64_t produced; // Decompressed bytes passed to the sink
+    lz_sink_fn sink;
+    void *ctx;
+} LzStream;
+
+/* Set up a decoder over caller buffers, decompressed data goes to sink */
+void lz_stream_init(LzStream *stream, char *frame, char *out, lz_sink_fn sink, void *ctx);
+
+/* Decode the next n bytes of the compressed payload */
+Status lz_stream_feed(LzStream *stream, const char *data, size_t n);
+
+/* End of the payload, e_failure if it stopped inside a frame */
+Status lz_stream_finish(const LzStream *stream);
+
+#endif
@@ -0,0 +1,149 @@
+#define _FILE_OFFSET_BITS 64 // Map files larger than 2 GB on 32-bit hosts
+#include <stdio.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "mmap_io.h"
+
+/*
+ * Function: map_file_read
+ * -------------------------
+ * Opens a file and maps its whole content read-only.
+ *
+ * Parameters:
+ * --------------
+ *   - const char *fname: Name of the file to map.
+ *   - MappedFile *map: Filled with the mapping on success.
+ *
+ * Returns:
+ * -----------
+ *   - Status: e_success if the file is mapped,
+ *             e_failure if it cannot be opened or mapped, with errno
+ *             set by the call that failed.
+ */
+Status map_file_read(const char *fname, MappedFile *map)
+{
+    struct stat st;
+    int err;
+
+    map->data = NULL;
+    map->size = 0;
+    map->fd = open(fname, O_RDONLY);
+    if (map->fd < 0)
+    {
+        err = errno;
+        perror("open");
+        fprintf(stderr, "ERROR: Unable to open file %s\n", fname);
+        errno = err;
+        return e_failure;
+    }
+    if (fstat(map->fd, &st) != 0)
+    {
+        err = errno;
+        perror("fstat");
+        unmap_file(map);
+        errno = err;
+        return e_failure;
+    }
+
+    map->size = (size_t)st.st_size;
+    if (map->size == 0) // mmap() refuses empty mappings, an empty file simply has no data
+    {
+        return e_success;
+    }
+
+    void *data = mmap(NULL, map->size, PROT_READ, MAP_PRIVATE, map->fd, 0);
+    if (data == MAP_FAILED)
+    {
+        err = errno;
+        perror("mmap");
+        fprintf(stderr, "ERROR: Unable to map file %s\n", fname);
+        unmap_file(map);
+        errno = err;
+        return e_failure;
+    }
+    madvise(data, map->size, MADV_SEQUENTIAL); // Both encode and decode walk the file front to back
+    map->data = data;
+    return e_success;
+}
+
+/*
+ * Function: map_file_write
+ * --------------------------
+ * Creates or truncates a file, sizes it and maps it read-write so that
+ * stores into the mapping land directly in the file.
+ *
+ * Parameters:
+ * --------------
+ *   - const char *fname: Name of the file to create.
+ *   - size_t size: Final size of the file.
+ *   - MappedFile *map: Filled with the mapping on success.
+ *
+ * Returns:
+ * -----------
+ *   - Status: e_success if the file is created and mapped,
+ *             e_failure otherwise, with errno set by the call that failed.
+ */
+Status map_file_write(const char *fname, size_t size, MappedFile *map)
+{
+    int err;
+
+    map->data = NULL;
+    map->size = size;
+    map->fd = open(fname, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (map->fd < 0)
+    {
+        err = errno;
+        perror("open");
+        fprintf(stderr, "ERROR: Unable to open file %s\n", fname);
+        errno = err;
+        return e_failure;
+    }
+    if (ftruncate(map->fd, (off_t)size) != 0)
+    {
+        err = errno;
+        perror("ftruncate");
+        unmap_file(map);
+        errno = err;
+        return e_failure;
+    }
+    if (size == 0)
+    {
+        return e_success;
+    }
+
+    void *data = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, map->fd, 0);
+    if (data == MAP_FAILED)
+    {
+        err = errno;
+        perror("mmap");
+        fprintf(stderr, "ERROR: Unable to map file %s\n", fname);
+        unmap_file(map);
+        errno = err;
+        return e_failure;
+    }
+    map->data = data;
+    return e_success;
+}
+
+/*
+ * Function: unmap_file
+ * ----------------------
+ * Releases a mapping created by map_file_read() or map_file_write().
+ * Dirty pages of a shared mapping are written back by the kernel.
+ */
+void unmap_file(MappedFile *map)
+{
+    if (map->data != NULL)
+    {
+        munmap(map->data, map->size);
+        map->data = NULL;
+    }
+    if (map->fd >= 0)
+    {
+        close(map->fd);
+        map->fd = -1;
+    }
+}
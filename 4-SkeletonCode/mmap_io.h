@@ -0,0 +1,27 @@
+#ifndef MMAP_IO_H
+#define MMAP_IO_H
+
+#include <stddef.h>
+#include "types.h"
+
+/*
+ * Structure describing a file mapped into memory
+ * by map_file_read() or map_file_write()
+ */
+typedef struct _MappedFile
+{
+    char *data;  // Start of the mapping (NULL for an empty file)
+    size_t size; // Size of the mapping in bytes
+    int fd;      // File descriptor backing the mapping
+} MappedFile;
+
+/* Map an existing file read-only, on failure errno tells why */
+Status map_file_read(const char *fname, MappedFile *map);
+
+/* Create (or truncate) a file of the given size and map it read-write, on failure errno tells why */
+Status map_file_write(const char *fname, size_t size, MappedFile *map);
+
+/* Unmap and close a mapped file */
+void unmap_file(MappedFile *map);
+
+#endif
@@ -0,0 +1,205 @@
+#include <stdint.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include "parallel.h"
+
+/*
+ * Each worker owns a range of chunk indices packed as (begin << 32 | end)
+ * into one atomic word, so the owner taking a chunk from the front and a
+ * thief splitting off the back half are both a single compare-and-swap.
+ */
+typedef struct
+{
+    _Alignas(64) _Atomic uint64_t range; // One cache line per worker to avoid false sharing
+} WorkQueue;
+
+typedef struct
+{
+    WorkQueue queue[PARALLEL_MAX_THREADS];
+    int nworkers;
+    size_t n;
+    size_t grain;
+    parallel_task_fn fn;
+    void *arg;
+} ParallelJob;
+
+typedef struct
+{
+    ParallelJob *job;
+    int id;
+} WorkerArg;
+
+static uint64_t pack_range(uint64_t begin, uint64_t end)
+{
+    return begin << 32 | end;
+}
+
+/*
+ * Function: take_chunk
+ * ----------------------
+ * Takes the first chunk of the worker's own range.
+ *
+ * Returns:
+ * -----------
+ *   - int: 1 and the chunk index in *chunk, or 0 if the range is empty.
+ */
+static int take_chunk(WorkQueue *queue, size_t *chunk)
+{
+    uint64_t range = atomic_load(&queue->range);
+    for (;;)
+    {
+        uint64_t begin = range >> 32, end = range & 0xFFFFFFFFu;
+        if (begin >= end)
+        {
+            return 0;
+        }
+        if (atomic_compare_exchange_weak(&queue->range, &range, pack_range(begin + 1, end)))
+        {
+            *chunk = begin;
+            return 1;
+        }
+    }
+}
+
+/*
+ * Function: steal_chunks
+ * ------------------------
+ * Moves the back half of a victim's range (or its last chunk) into the
+ * thief's empty queue.
+ *
+ * Returns:
+ * -----------
+ *   - int: 1 if work was stolen, 0 if the victim had nothing left.
+ */
+static int steal_chunks(WorkQueue *victim, WorkQueue *thief)
+{
+    uint64_t range = atomic_load(&victim->range);
+    for (;;)
+    {
+        uint64_t begin = range >> 32, end = range & 0xFFFFFFFFu;
+        if (begin >= end)
+        {
+            return 0;
+        }
+        uint64_t mid = begin + (end - begin) / 2;
+        if (atomic_compare_exchange_weak(&victim->range, &range, pack_range(begin, mid)))
+        {
+            atomic_store(&thief->range, pack_range(mid, end));
+            return 1;
+        }
+    }
+}
+
+static void *worker_main(void *p)
+{
+    WorkerArg *worker = p;
+    ParallelJob *job = worker->job;
+    WorkQueue *own = &job->queue[worker->id];
+
+    for (;;)
+    {
+        size_t chunk;
+        while (take_chunk(own, &chunk))
+        {
+            size_t begin = chunk * job->grain;
+            size_t end = begin + job->grain < job->n ? begin + job->grain : job->n;
+            job->fn(job->arg, begin, end);
+        }
+
+        // Own range is done: look for a worker that still has chunks left
+        int stolen = 0;
+        for (int i = 1; i < job->nworkers && !stolen; i++)
+        {
+            stolen = steal_chunks(&job->queue[(worker->id + i) % job->nworkers], own);
+        }
+        if (!stolen)
+        {
+            return NULL;
+        }
+    }
+}
+
+/*
+ * Function: parallel_for
+ * ------------------------
+ * Runs fn over [0, n) in chunks of grain elements on nthreads workers.
+ *
+ * Parameters:
+ * --------------
+ *   - size_t n: Number of elements.
+ *   - size_t grain: Elements per chunk.
+ *   - int nthreads: Number of workers, including the calling thread.
+ *   - parallel_task_fn fn: Function processing one chunk.
+ *   - void *arg: Passed to fn unchanged.
+ *
+ * Returns:
+ * -----------
+ *   - Status: e_success once every chunk was processed. Nothing is
+ *             allocated, and the chunks of a worker that cannot be
+ *             started are stolen by the others, so the call does not
+ *             fail; callers still check it.
+ */
+Status parallel_for(size_t n, size_t grain, int nthreads, parallel_task_fn fn, void *arg)
+{
+    size_t nchunks;
+
+    if (n == 0)
+    {
+        return e_success;
+    }
+    if (grain == 0)
+    {
+        grain = 1;
+    }
+    while ((nchunks = (n + grain - 1) / grain) > 0xFFFFFFFFu) // Chunk indices must fit the packed range
+    {
+        grain *= 2;
+    }
+    if (nthreads > PARALLEL_MAX_THREADS)
+    {
+        nthreads = PARALLEL_MAX_THREADS;
+    }
+    if (nthreads > (int)nchunks)
+    {
+        nthreads = (int)nchunks;
+    }
+    if (nthreads <= 1)
+    {
+        fn(arg, 0, n);
+        return e_success;
+    }
+
+    // In the caller's frame, which outlives every worker: 16 KB, and nested calls (batch jobs running -j) get their own
+    ParallelJob job_slot, *job = &job_slot;
+    job->nworkers = nthreads;
+    job->n = n;
+    job->grain = grain;
+    job->fn = fn;
+    job->arg = arg;
+    for (int i = 0; i < nthreads; i++)
+    {
+        atomic_init(&job->queue[i].range, pack_range(nchunks * i / nthreads, nchunks * (i + 1) / nthreads));
+    }
+
+    pthread_t threads[PARALLEL_MAX_THREADS];
+    WorkerArg workers[PARALLEL_MAX_THREADS];
+    int started = 1;
+    for (int i = 0; i < nthreads; i++)
+    {
+        workers[i].job = job;
+        workers[i].id = i;
+    }
+    for (int i = 1; i < nthreads; i++, started++)
+    {
+        if (pthread_create(&threads[i], NULL, worker_main, &workers[i]) != 0)
+        {
+            break; // The remaining queues are stolen by the workers that did start
+        }
+    }
+    worker_main(&workers[0]);
+    for (int i = 1; i < started; i++)
+    {
+        pthread_join(threads[i], NULL);
+    }
+    return e_success;
+}
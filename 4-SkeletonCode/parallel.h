@@ -0,0 +1,21 @@
+#ifndef PARALLEL_H
+#define PARALLEL_H
+
+#include <stddef.h>
+#include "types.h"
+
+#define PARALLEL_MAX_THREADS 256
+#define PARALLEL_GRAIN (64 * 1024) // Payload bytes handed out per chunk
+
+/* Work on the element range [begin, end) */
+typedef void (*parallel_task_fn)(void *arg, size_t begin, size_t end);
+
+/*
+ * Split [0, n) into chunks of grain elements and run fn over them on
+ * nthreads workers (the calling thread is one of them). Every worker starts
+ * with an equal share of chunks and steals half of another worker's
+ * remaining share once its own is done.
+ */
+Status parallel_for(size_t n, size_t grain, int nthreads, parallel_task_fn fn, void *arg);
+
+#endif
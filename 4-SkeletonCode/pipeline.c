@@ -0,0 +1,195 @@
+#include <pthread.h>
+#include "pipeline.h"
+
+typedef enum
+{
+    SLOT_FREE,    // Ready to be read into
+    SLOT_READ,    // Read, waiting for compute
+    SLOT_COMPUTED // Computed, waiting for write
+} SlotState;
+
+typedef struct
+{
+    PipelineBlock *blocks;
+    SlotState state[PIPELINE_DEPTH];
+    pipeline_stage_fn read;
+    pipeline_stage_fn compute;
+    pipeline_stage_fn write;
+    void *ctx;
+    pthread_mutex_t lock;
+    pthread_cond_t changed;
+    int failed; // A stage failed, every stage stops
+} Pipeline;
+
+/*
+ * Function: wait_for
+ * --------------------
+ * Blocks until a slot reaches a state.
+ *
+ * Returns:
+ * -----------
+ *   - int: 1 once the slot is in that state, 0 if a stage failed meanwhile.
+ */
+static int wait_for(Pipeline *p, int slot, SlotState state)
+{
+    pthread_mutex_lock(&p->lock);
+    while (p->state[slot] != state && !p->failed)
+    {
+        pthread_cond_wait(&p->changed, &p->lock);
+    }
+    int ok = !p->failed;
+    pthread_mutex_unlock(&p->lock);
+    return ok;
+}
+
+static void set_state(Pipeline *p, int slot, SlotState state)
+{
+    pthread_mutex_lock(&p->lock);
+    p->state[slot] = state;
+    pthread_cond_broadcast(&p->changed);
+    pthread_mutex_unlock(&p->lock);
+}
+
+static void set_failed(Pipeline *p)
+{
+    pthread_mutex_lock(&p->lock);
+    p->failed = 1;
+    pthread_cond_broadcast(&p->changed);
+    pthread_mutex_unlock(&p->lock);
+}
+
+static void *reader_main(void *arg)
+{
+    Pipeline *p = arg;
+    for (size_t seq = 0;; seq++)
+    {
+        int slot = seq % PIPELINE_DEPTH;
+        PipelineBlock *block = &p->blocks[slot];
+        if (!wait_for(p, slot, SLOT_FREE))
+        {
+            return NULL;
+        }
+        block->last = 0;
+        if (p->read(p->ctx, block) == e_failure)
+        {
+            set_failed(p);
+            return NULL;
+        }
+        int last = block->last; // The block belongs to the next stage once its state is set
+        set_state(p, slot, SLOT_READ);
+        if (last)
+        {
+            return NULL;
+        }
+    }
+}
+
+static void *writer_main(void *arg)
+{
+    Pipeline *p = arg;
+    for (size_t seq = 0;; seq++)
+    {
+        int slot = seq % PIPELINE_DEPTH;
+        PipelineBlock *block = &p->blocks[slot];
+        if (!wait_for(p, slot, SLOT_COMPUTED))
+        {
+            return NULL;
+        }
+        if (p->write(p->ctx, block) == e_failure)
+        {
+            set_failed(p);
+            return NULL;
+        }
+        int last = block->last;
+        set_state(p, slot, SLOT_FREE);
+        if (last)
+        {
+            return NULL;
+        }
+    }
+}
+
+/*
+ * Function: run_serial
+ * ----------------------
+ * The three stages one after the other on a single buffer.
+ */
+static Status run_serial(PipelineBlock *block, pipeline_stage_fn read, pipeline_stage_fn compute,
+                         pipeline_stage_fn write, void *ctx)
+{
+    do
+    {
+        block->last = 0;
+        if (read(ctx, block) == e_failure ||
+            (compute != NULL && compute(ctx, block) == e_failure) ||
+            write(ctx, block) == e_failure)
+        {
+            return e_failure;
+        }
+    } while (!block->last);
+    return e_success;
+}
+
+/*
+ * Function: pipeline_run
+ * ------------------------
+ * Runs the three stages over the blocks, the read and write stages on their
+ * own threads and the compute stage on the calling thread.
+ *
+ * Parameters:
+ * --------------
+ *   - PipelineBlock blocks[]: PIPELINE_DEPTH blocks pointing at their buffers.
+ *   - int threaded: Overlap the stages; 0 runs them one after the other.
+ *   - pipeline_stage_fn read: Fills a block, sets block->last on the final one.
+ *   - pipeline_stage_fn compute: Transforms a block in place, may be NULL.
+ *   - pipeline_stage_fn write: Writes a block out.
+ *   - void *ctx: Passed to every stage unchanged.
+ *
+ * Returns:
+ * -----------
+ *   - Status: e_success once the last block is written,
+ *             e_failure as soon as any stage fails.
+ */
+Status pipeline_run(PipelineBlock blocks[PIPELINE_DEPTH], int threaded, pipeline_stage_fn read,
+                    pipeline_stage_fn compute, pipeline_stage_fn write, void *ctx)
+{
+    Pipeline p = {blocks, {SLOT_FREE}, read, compute, write, ctx, PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, 0};
+    pthread_t reader, writer;
+
+    if (!threaded || pthread_create(&reader, NULL, reader_main, &p) != 0)
+    {
+        return run_serial(&blocks[0], read, compute, write, ctx);
+    }
+    if (pthread_create(&writer, NULL, writer_main, &p) != 0)
+    {
+        set_failed(&p); // The reader may have consumed input already, so there is no serial retry
+        pthread_join(reader, NULL);
+        return e_failure;
+    }
+
+    for (size_t seq = 0;; seq++)
+    {
+        int slot = seq % PIPELINE_DEPTH;
+        PipelineBlock *block = &blocks[slot];
+        if (!wait_for(&p, slot, SLOT_READ))
+        {
+            break;
+        }
+        if (compute != NULL && compute(ctx, block) == e_failure)
+        {
+            set_failed(&p);
+            break;
+        }
+        int last = block->last;
+        set_state(&p, slot, SLOT_COMPUTED);
+        if (last)
+        {
+            break;
+        }
+    }
+    pthread_join(reader, NULL);
+    pthread_join(writer, NULL);
+    pthread_mutex_destroy(&p.lock);
+    pthread_cond_destroy(&p.changed);
+    return p.failed ? e_failure : e_success;
+}
@@ -0,0 +1,47 @@
+#ifndef PIPELINE_H
+#define PIPELINE_H
+
+#include <stddef.h>
+#include "types.h"
+
+/*
+ * Read / compute / write pipeline
+ * -------------------------------
+ * Block loops (embed, extract, tail copy) are split into three stages that
+ * run concurrently on PIPELINE_DEPTH buffers: a reader thread fills block
+ * n + 2 while the calling thread embeds block n + 1 and a writer thread
+ * writes block n. Blocks go through the stages strictly in order, so the
+ * stage functions can keep their own running state in ctx, touched by that
+ * stage only.
+ *
+ * Linux io_uring would need liburing or raw syscalls, which this tool does
+ * not depend on; plain blocking stdio calls on dedicated threads overlap
+ * the same way.
+ */
+
+#define PIPELINE_DEPTH 3       // Buffers in flight: one per stage
+#define PIPELINE_MIN_BLOCKS 8  // Fewer blocks than this are not worth two threads
+
+typedef struct _PipelineBlock
+{
+    char *image;      // Cover or stego image bytes
+    char *data;       // Payload bytes
+    size_t image_len; // Bytes of image used by this block
+    size_t data_len;  // Bytes of data used by this block
+    size_t head;      // Leading image bytes that are not payload (the stego header of the first block)
+    int last;         // Set by the read stage on the final block
+} PipelineBlock;
+
+/* One stage working on one block */
+typedef Status (*pipeline_stage_fn)(void *ctx, PipelineBlock *block);
+
+/*
+ * Run read, compute (may be NULL) and write over blocks until the read
+ * stage marks one as last. The caller points every block at its buffers.
+ * With threaded = 0, or if the threads cannot be started, the stages run
+ * one after the other on blocks[0].
+ */
+Status pipeline_run(PipelineBlock blocks[PIPELINE_DEPTH], int threaded, pipeline_stage_fn read,
+                    pipeline_stage_fn compute, pipeline_stage_fn write, void *ctx);
+
+#endif
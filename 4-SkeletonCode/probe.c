@@ -0,0 +1,203 @@
+#define _FILE_OFFSET_BITS 64 // Images larger than 2 GB on 32-bit hosts
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "common.h"
+#include "filelist.h"
+#include "probe.h"
+#include "stego.h"
+#include "lsb.h"
+#include "parallel.h"
+
+/* One image to probe and what was found */
+typedef struct
+{
+    const char *fname; // Owned by the FileList
+    StegoHeader header;
+    StegoError err;
+    int read_failed; // The image could not be opened or read
+} ProbeJob;
+
+typedef struct
+{
+    ProbeJob *jobs;
+    const StegoOptions *opts;
+} ProbeTask;
+
+/*
+ * Function: probe_file
+ * ----------------------
+ * Reads the header region of one image with a single pread() and decodes
+ * it. The payload size is checked against the pixel array and the file
+ * size, the payload itself is never read.
+ */
+static void probe_file(ProbeJob *job, const StegoOptions *opts)
+{
+    char buffer[STEGO_PROBE_SIZE];
+    struct stat st;
+    ssize_t length;
+    size_t offset;
+
+    int fd = open(job->fname, O_RDONLY);
+    if (fd < 0 || fstat(fd, &st) != 0 || (length = pread(fd, buffer, sizeof(buffer), 0)) < 0)
+    {
+        job->read_failed = 1;
+        if (fd >= 0)
+        {
+            close(fd);
+        }
+        return;
+    }
+    close(fd);
+
+    if (stego_probe(buffer, (size_t)length, opts, &job->header, &offset, &job->err) == e_success)
+    {
+        BmpInfo bmp;
+        bmp_parse(buffer, (size_t)length, &bmp); // Already validated by stego_probe
+        stego_check_payload(&bmp, &job->header, offset, (uint64_t)st.st_size, &job->err);
+    }
+}
+
+/* parallel_task_fn probing jobs [begin, end) */
+static void probe_files(void *arg, size_t begin, size_t end)
+{
+    ProbeTask *task = arg;
+    for (size_t i = begin; i < end; i++)
+    {
+        probe_file(&task->jobs[i], task->opts);
+    }
+}
+
+/*
+ * Function: do_probe
+ * --------------------
+ * Entry point of probe mode (-p / --probe). Collects the images named on
+ * the command line, probes them and prints one line per image plus a
+ * summary.
+ *
+ * Parameters:
+ * --------------
+ *   - int argc, char *argv[]: The command line, argv[1] is -p.
+ *
+ * Returns:
+ * -----------
+ *   - Status: e_success if every image could be read (whether or not it
+ *             carries a payload), e_failure otherwise.
+ */
+Status do_probe(int argc, char *argv[])
+{
+    FileList files = {0};
+    ProbeJob *jobs = NULL;
+    size_t njobs = 0, found = 0;
+    int nthreads = 1;
+    StegoOptions opts = {MAGIC_STRING, 0, 0, 0, NULL, NULL, NULL, 0};
+    Status status = e_success;
+
+    for (int i = 2; i < argc && status == e_success; i++)
+    {
+        if (parse_jobs(argc, argv, &i, &nthreads, &status))
+        {
+            continue;
+        }
+        if (strcmp(argv[i], "-s") == 0 || strcmp(argv[i], "--magic") == 0)
+        {
+            if (i + 1 == argc || argv[i + 1][0] == '\0' || strlen(argv[i + 1]) > MAX_MAGIC_STRING)
+            {
+                printf("ERROR: -s expects a magic string of 1 to %d characters\n", MAX_MAGIC_STRING);
+                status = e_failure;
+            }
+            else
+            {
+                opts.magic = argv[++i];
+            }
+        }
+        else
+        {
+            status = file_list_add(&files, argv[i]);
+        }
+    }
+    if (status == e_success && files.count == 0)
+    {
+        printf(PROBE_USAGE);
+        status = e_failure;
+    }
+    if (status == e_success && (jobs = calloc(files.count, sizeof(*jobs))) == NULL)
+    {
+        printf("ERROR: Unable to allocate the probe list\n");
+        status = e_failure;
+    }
+    if (status == e_success)
+    {
+        njobs = files.count;
+        for (size_t i = 0; i < njobs; i++)
+        {
+            jobs[i].fname = files.names[i];
+        }
+    }
+
+    if (status == e_success)
+    {
+        ProbeTask task = {jobs, &opts};
+        if (parallel_for(njobs, 16, nthreads, probe_files, &task) == e_failure)
+        {
+            printf("ERROR: Unable to start the probe workers\n");
+            status = e_failure;
+        }
+    }
+    for (size_t i = 0; i < njobs && status == e_success; i++)
+    {
+        ProbeJob *job = &jobs[i];
+        if (job->read_failed)
+        {
+            printf("%s: ERROR: unable to read the image\n", job->fname);
+        }
+        else if (job->err != STEGO_OK)
+        {
+            printf("%s: no payload (%s)\n", job->fname, stego_strerror(job->err));
+        }
+        else
+        {
+            printf("%s: payload %llu bytes, extension %s, header v%d, %d bit(s) per byte", job->fname,
+                   (unsigned long long)job->header.payload_size, job->header.extn, job->header.version, job->header.bits);
+            if (job->header.flags & STEGO_FLAG_SHARD)
+            {
+                printf(", shard %u of %u", job->header.shard.index, job->header.shard.count);
+            }
+            if (job->header.flags & STEGO_FLAG_LZ)
+            {
+                printf(", compressed from %llu bytes", (unsigned long long)job->header.raw_size);
+            }
+            if (job->header.flags & STEGO_FLAG_KEYED)
+            {
+                printf(", keyed");
+            }
+            if (job->header.flags & STEGO_FLAG_AEAD)
+            {
+                printf(", encrypted");
+            }
+            if (job->header.flags & STEGO_FLAG_CRC)
+            {
+                printf(", checksum");
+            }
+            printf("\n");
+            found++;
+        }
+    }
+    if (status == e_success)
+    {
+        LOG_INFO("INFO: Probed %zu images, %zu carry a payload\n", njobs, found);
+    }
+    for (size_t i = 0; i < njobs; i++)
+    {
+        if (jobs[i].read_failed)
+        {
+            status = e_failure;
+        }
+    }
+    free(jobs);
+    file_list_free(&files);
+    return status;
+}
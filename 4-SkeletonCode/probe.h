@@ -0,0 +1,24 @@
+#ifndef PROBE_H
+#define PROBE_H
+
+#include "types.h"
+
+/*
+ * Probe mode
+ * ----------
+ * Tells which images carry a payload without decoding them. Only the first
+ * STEGO_PROBE_SIZE bytes of every image are read and no output file is
+ * created. Directories are scanned for .bmp files (not recursively), and
+ * with -j N the images are probed on N threads. One line is printed per
+ * image, in the order given:
+ *
+ *     stego1.bmp: payload 25 bytes, extension .txt, header v1, 1 bit(s) per byte
+ *     beautiful.bmp: no payload (The decoded magic string does not match ...)
+ */
+
+#define PROBE_USAGE "Probe:    ./lsb_steg -p [-j N] [-s <magic>] <.bmp file | directory>...\n"
+
+/* Probe every image named on the command line */
+Status do_probe(int argc, char *argv[]);
+
+#endif
@@ -0,0 +1,304 @@
+#include <string.h>
+#include <pthread.h>
+#include "quality.h"
+#include "lsb.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#define QUALITY_X86 1
+#endif
+
+#define LN2 0.69314718055994530942
+#define LN10 2.30258509299404568402
+
+typedef void (*samples_fn)(const StegoQuality *q, QualityCounts *counts, const unsigned char *cover,
+                           const unsigned char *stego, size_t n, int phase);
+
+static const char *channel_names[QUALITY_MAX_CHANNELS] = {"blue", "green", "red", "alpha"};
+
+static pthread_once_t kernel_once = PTHREAD_ONCE_INIT;
+static samples_fn samples_kernel;
+
+/* 8 image bytes as a word, the first byte in the low 8 bits */
+static inline uint64_t load_word(const unsigned char *p)
+{
+    uint64_t word;
+    memcpy(&word, p, sizeof(word));
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    word = __builtin_bswap64(word);
+#endif
+    return word;
+}
+
+/*
+ * Function: count_changes
+ * -------------------------
+ * Adds the samples of one word that changed (the nonzero bytes of diff,
+ * cover XOR stego) to their channels' squared error and histogram delta.
+ * All 8 bytes go through the same steps, an unchanged one adds 0: about
+ * half the samples of a payload region change, in no pattern a branch
+ * could predict.
+ */
+static inline void count_changes(QualityCounts *counts, const unsigned char *cover, const unsigned char *stego,
+                                 uint64_t diff, const unsigned char *lanes)
+{
+    for (int k = 0; k < 8; k++)
+    {
+        int c = lanes[k];
+        int changed = (diff >> (k * 8) & 0xFF) != 0;
+        int d = stego[k] - cover[k];
+        counts->changed[c] += changed;
+        counts->squared_error[c] += (uint64_t)(d * d);
+        counts->histogram[c][stego[k]] += changed;
+        counts->histogram[c][cover[k]] -= changed;
+    }
+}
+
+/*
+ * DEFINE_SAMPLES_KERNEL
+ * ---------------------
+ * Compares n visible bytes of one row, the first being channel phase. The
+ * phase of the next word follows from 8 % channels, so the channel masks
+ * never need a division. The last partial word is padded with zero bytes
+ * on both sides, which compare as unchanged.
+ */
+#define DEFINE_SAMPLES_KERNEL(name, attributes)                                                                      \
+    attributes static void name(const StegoQuality *q, QualityCounts *counts, const unsigned char *cover,          \
+                                const unsigned char *stego, size_t n, int phase)                                   \
+    {                                                                                                              \
+        int channels = q->channels;                                                                                \
+        int step = 8 % channels;                                                                                   \
+        for (size_t i = 0; i < n; i += 8)                                                                          \
+        {                                                                                                          \
+            unsigned char a[8] = {0}, b[8] = {0};                                                                  \
+            const unsigned char *pa = cover + i, *pb = stego + i;                                                  \
+            if (n - i < 8)                                                                                         \
+            {                                                                                                      \
+                memcpy(a, pa, n - i);                                                                              \
+                memcpy(b, pb, n - i);                                                                              \
+                pa = a;                                                                                            \
+                pb = b;                                                                                            \
+            }                                                                                                      \
+            uint64_t diff = load_word(pa) ^ load_word(pb);                                                         \
+            if (diff != 0)                                                                                         \
+            {                                                                                                      \
+                for (int c = 0; c < channels; c++)                                                                 \
+                {                                                                                                  \
+                    counts->flipped[c] += __builtin_popcountll(diff & q->masks[phase][c]);                         \
+                }                                                                                                  \
+                count_changes(counts, pa, pb, diff, q->lanes[phase]);                                              \
+            }                                                                                                      \
+            phase += step;                                                                                         \
+            phase -= phase >= channels ? channels : 0;                                                             \
+        }                                                                                                          \
+    }
+
+DEFINE_SAMPLES_KERNEL(samples_generic, )
+
+#ifdef QUALITY_X86
+DEFINE_SAMPLES_KERNEL(samples_popcnt, __attribute__((target("popcnt"))))
+#endif
+
+/* Uses the popcnt instruction when the CPU has it, like select_kernels in lsb.c */
+static void select_kernel(void)
+{
+#ifdef QUALITY_X86
+    if (__builtin_cpu_supports("popcnt"))
+    {
+        samples_kernel = samples_popcnt;
+        return;
+    }
+#endif
+    samples_kernel = samples_generic;
+}
+
+/*
+ * Function: compare
+ * -------------------
+ * Adds the differences between n cover and stego bytes starting at offset
+ * in the pixel array, splitting them into the visible part of every row
+ * and its padding.
+ */
+static void compare(const StegoQuality *q, QualityCounts *counts, const unsigned char *cover, const unsigned char *stego,
+                    size_t n, uint64_t offset)
+{
+    while (n > 0)
+    {
+        uint64_t pos = offset % q->stride;
+        size_t len;
+        if (pos < q->row_bytes)
+        {
+            len = q->row_bytes - pos < n ? (size_t)(q->row_bytes - pos) : n;
+            samples_kernel(q, counts, cover, stego, len, (int)(pos % q->channels));
+        }
+        else
+        {
+            len = q->stride - pos < n ? (size_t)(q->stride - pos) : n;
+            for (size_t i = 0; i < len; i++)
+            {
+                counts->padding_changed += cover[i] != stego[i];
+                counts->padding_flipped += __builtin_popcount(cover[i] ^ stego[i]);
+            }
+        }
+        cover += len;
+        stego += len;
+        offset += len;
+        n -= len;
+    }
+}
+
+/*
+ * Function: quality_init
+ * ------------------------
+ * Works out the channel of every byte of a word for each phase a word can
+ * start in (the channel of its first byte) and zeroes the counters.
+ */
+void quality_init(StegoQuality *q, const BmpInfo *bmp)
+{
+    pthread_once(&kernel_once, select_kernel);
+    memset(q, 0, sizeof(*q));
+    q->channels = bmp->bpp / 8;
+    q->row_bytes = (uint64_t)bmp->width * q->channels;
+    q->stride = bmp->stride;
+    q->pixels = (uint64_t)bmp->width * bmp->height;
+    for (int phase = 0; phase < q->channels; phase++)
+    {
+        for (int k = 0; k < 8; k++)
+        {
+            int c = (phase + k) % q->channels;
+            q->lanes[phase][k] = (unsigned char)c;
+            q->masks[phase][c] |= 0xFFull << (k * 8);
+        }
+    }
+}
+
+/*
+ * Function: quality_embed
+ * -------------------------
+ * Embeds the payload QUALITY_WINDOW image bytes at a time: the cover bytes
+ * of a window are copied aside, embedded over and compared right away,
+ * while both copies are still in L1.
+ */
+void quality_embed(const StegoQuality *q, QualityCounts *counts, int bits, const char *data, size_t n, char *image, uint64_t offset)
+{
+    const LsbKernel *kernel = lsb_kernel(bits);
+    unsigned char cover[QUALITY_WINDOW];
+    size_t step = QUALITY_WINDOW / 8 * bits; // Payload bytes per window, a multiple of bits
+
+    if (counts == NULL)
+    {
+        kernel->encode(data, n, image);
+        return;
+    }
+    for (size_t from = 0; from < n; from += step)
+    {
+        size_t len = n - from < step ? n - from : step;
+        size_t at = from / bits * 8;
+        size_t image_len = lsb_image_bytes(len, bits);
+        memcpy(cover, image + at, image_len);
+        kernel->encode(data + from, len, image + at);
+        compare(q, counts, cover, (const unsigned char *)image + at, image_len, offset + at);
+    }
+}
+
+void quality_merge(StegoQuality *q, const QualityCounts *counts)
+{
+    QualityCounts *total = &q->total;
+
+    for (int c = 0; c < q->channels; c++)
+    {
+        __atomic_fetch_add(&total->changed[c], counts->changed[c], __ATOMIC_RELAXED);
+        __atomic_fetch_add(&total->flipped[c], counts->flipped[c], __ATOMIC_RELAXED);
+        __atomic_fetch_add(&total->squared_error[c], counts->squared_error[c], __ATOMIC_RELAXED);
+        for (int v = 0; v < 256; v++)
+        {
+            if (counts->histogram[c][v] != 0)
+            {
+                __atomic_fetch_add(&total->histogram[c][v], counts->histogram[c][v], __ATOMIC_RELAXED);
+            }
+        }
+    }
+    __atomic_fetch_add(&total->padding_changed, counts->padding_changed, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&total->padding_flipped, counts->padding_flipped, __ATOMIC_RELAXED);
+}
+
+/* log10(x) for x > 0, with ln(m) = 2 atanh((m - 1) / (m + 1)) on the mantissa: the tool links without libm */
+static double log10_of(double x)
+{
+    int exponent = 0;
+    while (x >= 2)
+    {
+        x /= 2;
+        exponent++;
+    }
+    while (x < 1)
+    {
+        x *= 2;
+        exponent--;
+    }
+    double t = (x - 1) / (x + 1), t2 = t * t, term = t, sum = 0;
+    for (int i = 1; i < 40; i += 2)
+    {
+        sum += term / i;
+        term *= t2;
+    }
+    return (2 * sum + exponent * LN2) / LN10;
+}
+
+/* Writes "mse":...,"psnr":... for squared_error over samples, PSNR is null for an unchanged image */
+static void print_error(uint64_t squared_error, uint64_t samples, FILE *out)
+{
+    double mse = samples > 0 ? (double)squared_error / samples : 0;
+
+    fprintf(out, "\"mse\":%.9g,\"psnr\":", mse);
+    if (mse > 0)
+    {
+        fprintf(out, "%.4f", 10 * log10_of(255.0 * 255.0 / mse));
+    }
+    else
+    {
+        fprintf(out, "null");
+    }
+}
+
+/*
+ * Function: quality_print_json
+ * ------------------------------
+ * Writes
+ *
+ *   "quality":{"samples":786432,"changed":4101,"flipped_bits":4101,"mse":0.0052,"psnr":70.96,
+ *    "padding_changed":0,"padding_flipped_bits":0,"channels":[{"channel":"blue","changed":1370,
+ *    "flipped_bits":1370,"mse":0.0052,"psnr":70.93,"histogram_delta":1502},...]}
+ *
+ * histogram_delta is the sum of |stego count - cover count| over the 256
+ * values of the channel.
+ */
+void quality_print_json(const StegoQuality *q, FILE *out)
+{
+    const QualityCounts *t = &q->total;
+    uint64_t changed = 0, flipped = 0, squared_error = 0;
+
+    for (int c = 0; c < q->channels; c++)
+    {
+        changed += t->changed[c];
+        flipped += t->flipped[c];
+        squared_error += t->squared_error[c];
+    }
+    fprintf(out, "\"quality\":{\"samples\":%llu,\"changed\":%llu,\"flipped_bits\":%llu,",
+            (unsigned long long)(q->pixels * q->channels), (unsigned long long)changed, (unsigned long long)flipped);
+    print_error(squared_error, q->pixels * q->channels, out);
+    fprintf(out, ",\"padding_changed\":%llu,\"padding_flipped_bits\":%llu,\"channels\":[",
+            (unsigned long long)t->padding_changed, (unsigned long long)t->padding_flipped);
+    for (int c = 0; c < q->channels; c++)
+    {
+        uint64_t delta = 0;
+        for (int v = 0; v < 256; v++)
+        {
+            delta += (uint64_t)(t->histogram[c][v] < 0 ? -t->histogram[c][v] : t->histogram[c][v]);
+        }
+        fprintf(out, "%s{\"channel\":\"%s\",\"changed\":%llu,\"flipped_bits\":%llu,", c > 0 ? "," : "", channel_names[c],
+                (unsigned long long)t->changed[c], (unsigned long long)t->flipped[c]);
+        print_error(t->squared_error[c], q->pixels, out);
+        fprintf(out, ",\"histogram_delta\":%llu}", (unsigned long long)delta);
+    }
+    fprintf(out, "]}");
+}
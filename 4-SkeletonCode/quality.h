@@ -0,0 +1,71 @@
+#ifndef QUALITY_H
+#define QUALITY_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include "bmp.h"
+
+/*
+ * Distortion metrics
+ * ------------------
+ * With --stats an encode also measures how far the stego image is from
+ * its cover, during the embed itself: every step keeps the cover bytes it
+ * is about to overwrite (QUALITY_WINDOW at a time, so they are still in
+ * L1) and compares them with what the kernel wrote. Nothing is read back
+ * from the files.
+ *
+ * The counters are kept per colour channel (blue, green, red and, with
+ * 32 bpp, the fourth byte) over the visible samples of the pixel array;
+ * the row padding, which hidden data also uses, is counted apart. For
+ * every channel there are the changed samples, the flipped bits, the sum
+ * of squared differences (MSE and PSNR over width * height samples) and
+ * the histogram delta: for every value, stego count minus cover count.
+ * Flipped bits are counted with one masked 64-bit popcount per channel
+ * per 8 image bytes; unchanged words are skipped, and only the changed
+ * samples go through the histogram.
+ */
+
+#define QUALITY_MAX_CHANNELS 4
+#define QUALITY_WINDOW 4096 // Cover bytes kept aside per embed step
+
+/* Counters of every channel, for a whole encode or the part one worker did */
+typedef struct _QualityCounts
+{
+    uint64_t changed[QUALITY_MAX_CHANNELS];       // Samples whose value changed
+    uint64_t flipped[QUALITY_MAX_CHANNELS];       // Bits that differ
+    uint64_t squared_error[QUALITY_MAX_CHANNELS]; // Sum of (stego - cover)^2
+    int64_t histogram[QUALITY_MAX_CHANNELS][256]; // Stego minus cover samples of every value
+    uint64_t padding_changed;                     // Row padding bytes that changed
+    uint64_t padding_flipped;                     // Bits that differ in the row padding
+} QualityCounts;
+
+/* Pixel array layout and the counters of a whole encode */
+typedef struct _StegoQuality
+{
+    int channels;       // Bytes per pixel, 0 until quality_init
+    uint64_t row_bytes; // Visible bytes per row
+    uint64_t stride;    // Bytes per row including the padding
+    uint64_t pixels;    // width * height, the samples per channel
+    unsigned char lanes[QUALITY_MAX_CHANNELS][8];              // [phase][k]: channel of byte k of a word
+    uint64_t masks[QUALITY_MAX_CHANNELS][QUALITY_MAX_CHANNELS]; // [phase][channel]: bytes of a word in the channel
+    QualityCounts total;
+} StegoQuality;
+
+/* Zero the counters and take the layout of the cover's pixel array */
+void quality_init(StegoQuality *q, const BmpInfo *bmp);
+
+/*
+ * Embed n payload bytes into image at bits per byte (as
+ * encode_bytes_to_lsb_bits()) and add every change to counts. offset is
+ * where image starts in the pixel array. counts may be NULL, then this is
+ * just the embed.
+ */
+void quality_embed(const StegoQuality *q, QualityCounts *counts, int bits, const char *data, size_t n, char *image, uint64_t offset);
+
+/* Add the counters of one worker to the total, safe to call from several threads */
+void quality_merge(StegoQuality *q, const QualityCounts *counts);
+
+/* Write the counters as one "quality":{...} member of a JSON object */
+void quality_print_json(const StegoQuality *q, FILE *out);
+
+#endif
@@ -0,0 +1,100 @@
+#include <string.h>
+#include "scatter.h"
+
+static uint64_t mix64(uint64_t z)
+{
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ull;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBull;
+    return z ^ (z >> 31);
+}
+
+/*
+ * Function: scatter_init
+ * ------------------------
+ * Derives the round keys and the block shuffle seed from the key (FNV-1a,
+ * then splitmix64) and sizes the Feistel halves so that
+ * 2^(2 * half_bits) >= blocks.
+ */
+void scatter_init(Scatter *scatter, const char *key, uint64_t tiles)
+{
+    uint64_t seed = 0xCBF29CE484222325ull;
+
+    for (const unsigned char *p = (const unsigned char *)key; *p != '\0'; p++)
+    {
+        seed = (seed ^ *p) * 0x100000001B3ull;
+    }
+    memset(scatter, 0, sizeof(*scatter));
+    for (int r = 0; r < SCATTER_ROUNDS; r++)
+    {
+        seed += 0x9E3779B97F4A7C15ull;
+        scatter->round_key[r] = mix64(seed);
+    }
+    seed += 0x9E3779B97F4A7C15ull;
+    scatter->slot_key = mix64(seed);
+    scatter->blocks = tiles / SCATTER_BLOCK_TILES;
+    scatter->half_bits = 1;
+    while (scatter->half_bits < 32 && (1ull << (2 * scatter->half_bits)) < scatter->blocks)
+    {
+        scatter->half_bits++;
+    }
+    scatter->half_mask = (1ull << scatter->half_bits) - 1;
+}
+
+uint64_t scatter_capacity(const Scatter *scatter)
+{
+    return scatter->blocks * SCATTER_BLOCK_TILES;
+}
+
+/* One pass of the Feistel network over [0, 2^(2 * half_bits)) */
+static uint64_t feistel(const Scatter *scatter, uint64_t x)
+{
+    uint64_t left = x >> scatter->half_bits, right = x & scatter->half_mask;
+
+    for (int r = 0; r < SCATTER_ROUNDS; r++)
+    {
+        uint64_t next = left ^ (mix64(right ^ scatter->round_key[r]) & scatter->half_mask);
+        left = right;
+        right = next;
+    }
+    return left << scatter->half_bits | right;
+}
+
+/*
+ * Function: enter_block
+ * -----------------------
+ * Points the walk at the image block of payload block b. The network
+ * permutes a domain of fewer than 4 * blocks values, so walking the cycle
+ * out of [blocks, domain) takes under 4 steps on average, once per block.
+ */
+static void enter_block(ScatterWalk *walk, uint64_t b)
+{
+    const Scatter *scatter = walk->scatter;
+
+    do
+    {
+        b = feistel(scatter, b);
+    } while (b >= scatter->blocks);
+    uint64_t h = mix64(b ^ scatter->slot_key);
+    walk->base = b * SCATTER_BLOCK_TILES;
+    walk->mul = h | 1; // Odd, so a bijection modulo a power of two
+    walk->add = h >> 32;
+}
+
+void scatter_walk_init(ScatterWalk *walk, const Scatter *scatter, uint64_t t)
+{
+    walk->scatter = scatter;
+    walk->tile = t;
+    walk->base = UINT64_MAX; // No block entered yet
+}
+
+uint64_t scatter_walk_next(ScatterWalk *walk)
+{
+    uint64_t slot = walk->tile % SCATTER_BLOCK_TILES;
+
+    if (slot == 0 || walk->base == UINT64_MAX)
+    {
+        enter_block(walk, walk->tile / SCATTER_BLOCK_TILES);
+    }
+    walk->tile++;
+    return walk->base + ((walk->mul * slot + walk->add) & (SCATTER_BLOCK_TILES - 1));
+}
@@ -0,0 +1,70 @@
+#ifndef SCATTER_H
+#define SCATTER_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Keyed scattering (-k)
+ * ---------------------
+ * Without a key payload byte i sits right after the header, so the whole
+ * payload is one run at the top of the image. With a key the payload
+ * region (every image byte after the header) is cut into tiles of
+ * SCATTER_TILE image bytes, one cache line, and the tiles are grouped into
+ * blocks of SCATTER_BLOCK_TILES, one 4 KiB page. Payload tile t (8 * bits
+ * payload bytes) goes to:
+ *
+ *   image block  pi(t / SCATTER_BLOCK_TILES), a keyed permutation of all
+ *                the blocks of the region (4 round Feistel network with
+ *                cycle walking),
+ *   tile         (a * (t % SCATTER_BLOCK_TILES) + c) % SCATTER_BLOCK_TILES
+ *                of that block, with a odd and c taken from the key and the
+ *                block.
+ *
+ * So the payload lands all over the pixel array, but a walk over the
+ * payload stays inside one page for SCATTER_BLOCK_TILES tiles and pays for
+ * the permutation once per block. Inside a tile the layout is the usual
+ * one, so the bulk kernels embed and extract whole tiles. The tiles of a
+ * trailing partial block are left unused.
+ *
+ * This hides where the payload is, it does not encrypt it. The key itself
+ * is never stored; the header only records that the payload is scattered
+ * (STEGO_FLAG_KEYED).
+ */
+
+#define SCATTER_TILE 64         // Image bytes per tile
+#define SCATTER_BLOCK_TILES 64  // Tiles per block, a power of two
+#define SCATTER_ROUNDS 4
+
+typedef struct _Scatter
+{
+    uint64_t round_key[SCATTER_ROUNDS];
+    uint64_t slot_key;  // Seeds the shuffle inside each block
+    uint64_t blocks;    // Whole blocks in the region, the permutation is of [0, blocks)
+    unsigned half_bits; // Each Feistel half is this many bits wide
+    uint64_t half_mask;
+} Scatter;
+
+/* Position of a walk over consecutive payload tiles */
+typedef struct _ScatterWalk
+{
+    const Scatter *scatter;
+    uint64_t tile;  // Next payload tile
+    uint64_t base;  // First image tile of the current block, UINT64_MAX before the first
+    uint64_t mul;   // Shuffle of the current block
+    uint64_t add;
+} ScatterWalk;
+
+/* Set up the permutation for a key and a region of tiles tiles */
+void scatter_init(Scatter *scatter, const char *key, uint64_t tiles);
+
+/* Payload tiles the region holds: the tiles of its whole blocks */
+uint64_t scatter_capacity(const Scatter *scatter);
+
+/* Start a walk at payload tile t */
+void scatter_walk_init(ScatterWalk *walk, const Scatter *scatter, uint64_t t);
+
+/* Image tile of the next payload tile of the walk */
+uint64_t scatter_walk_next(ScatterWalk *walk);
+
+#endif
@@ -0,0 +1,690 @@
+#define _FILE_OFFSET_BITS 64 // Images larger than 2 GB on 32-bit hosts
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "common.h"
+#include "decode.h"
+#include "encode.h"
+#include "filelist.h"
+#include "lsb.h"
+#include "mmap_io.h"
+#include "parallel.h"
+#include "shard.h"
+#include "stego.h"
+
+/* One cover and the slice of the payload it carries, or one stego image and the slice it holds */
+typedef struct
+{
+    const char *fname; // Cover (encode) or stego image (decode), owned by the FileList
+    char *out_fname;   // Stego image written by encode
+    uint64_t capacity; // Payload bytes the cover can hold
+    StegoHeader header; // Decoded header of a stego image
+    StegoShard shard;
+    uint64_t size;     // Bytes of the payload in this shard
+    StegoError err;
+    const char *failed_fname; // File that could not be opened or mapped, errno of the call in sys_err
+    int sys_err;
+    Status status;
+} ShardJob;
+
+/* What the encode and decode workers share */
+typedef struct
+{
+    ShardJob **jobs;
+    const char *payload; // Whole payload: the secret (encode) or the output mapping (decode)
+    const char *extn;
+    const StegoOptions *opts;
+} ShardTask;
+
+/*
+ * Function: new_payload_id
+ * --------------------------
+ * Tags the shards of one encode so a decoder never mixes them with shards
+ * of another payload: the clock and the process id, mixed with splitmix64.
+ */
+static uint64_t new_payload_id(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_REALTIME, &ts);
+    uint64_t z = ((uint64_t)ts.tv_sec * 1000000000u + ts.tv_nsec) ^ ((uint64_t)getpid() << 32);
+    z += 0x9E3779B97F4A7C15ull;
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ull;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBull;
+    return z ^ (z >> 31);
+}
+
+/*
+ * Function: cover_capacity
+ * --------------------------
+ * Payload bytes a cover can hold next to a shard header, read from the
+ * BMP headers only.
+ */
+static Status cover_capacity(ShardJob *job, const StegoHeader *header, const char *magic)
+{
+    MappedFile cover;
+    BmpInfo bmp;
+
+    if (map_file_read(job->fname, &cover) == e_failure)
+    {
+        return e_failure;
+    }
+    if (bmp_parse(cover.data, cover.size, &bmp) == e_failure)
+    {
+        printf("ERROR: %s is not a supported BMP image\n", job->fname);
+        unmap_file(&cover);
+        return e_failure;
+    }
+    uint64_t pixel = cover.size < bmp.pixel_offset ? 0 : cover.size - bmp.pixel_offset;
+    pixel = pixel < bmp.pixel_bytes ? pixel : bmp.pixel_bytes;
+    uint64_t used = (strlen(magic) + stego_header_size(header)) * 8;
+    job->capacity = pixel > used ? (pixel - used) * header->bits / 8 : 0;
+    if (header->flags & STEGO_FLAG_CRC)
+    {
+        job->capacity = job->capacity > STEGO_CRC_SIZE ? job->capacity - STEGO_CRC_SIZE : 0; // Room for the trailer
+    }
+    unmap_file(&cover);
+    return e_success;
+}
+
+/*
+ * Function: shard_name
+ * ----------------------
+ * Name of the stego image written for a cover: <dir>/<stem>.shard<i>.bmp,
+ * the stem is the cover's file name without a trailing .bmp.
+ */
+static char *shard_name(const char *dir, const char *cover, uint32_t index)
+{
+    const char *base = strrchr(cover, '/') ? strrchr(cover, '/') + 1 : cover;
+    size_t stem = strlen(base);
+    if (stem >= strlen(".bmp") && strcmp(base + stem - strlen(".bmp"), ".bmp") == 0)
+    {
+        stem -= strlen(".bmp"); // Covers named on the command line need not end in .bmp
+    }
+    size_t length = strlen(dir) + 1 + stem + sizeof(".shard4294967295.bmp");
+    char *name = malloc(length);
+
+    if (name != NULL)
+    {
+        snprintf(name, length, "%s/%.*s.shard%u.bmp", dir, (int)stem, base, index);
+    }
+    return name;
+}
+
+/* Record that fname of a job could not be opened or mapped, map_file_read() and map_file_write() leave errno set */
+static void map_failed(ShardJob *job, const char *fname)
+{
+    job->failed_fname = fname;
+    job->sys_err = errno;
+}
+
+/* Print why shard index failed: the libstego error, or the file and the system error */
+static void report_shard(uint32_t index, const ShardJob *job)
+{
+    if (job->err != STEGO_OK || job->failed_fname == NULL)
+    {
+        printf("ERROR: Shard %u (%s): %s\n", index, job->fname, stego_strerror(job->err != STEGO_OK ? job->err : STEGO_ERR_ARGS));
+    }
+    else
+    {
+        printf("ERROR: Shard %u (%s): %s: %s\n", index, job->fname, job->failed_fname, strerror(job->sys_err));
+    }
+}
+
+/* parallel_task_fn encoding shards [begin, end), each from its own cover into its own output */
+static void encode_shards(void *arg, size_t begin, size_t end)
+{
+    ShardTask *task = arg;
+
+    for (size_t i = begin; i < end; i++)
+    {
+        ShardJob *job = task->jobs[i];
+        MappedFile cover, stego;
+        StegoOptions opts = *task->opts;
+
+        opts.shard = &job->shard;
+        job->status = e_failure;
+        job->err = STEGO_OK;
+        if (map_file_read(job->fname, &cover) == e_failure)
+        {
+            map_failed(job, job->fname);
+            continue;
+        }
+        if (map_file_write(job->out_fname, cover.size, &stego) == e_success)
+        {
+            job->status = stego_encode(cover.data, cover.size, task->payload + job->shard.offset, job->size, task->extn,
+                                       &opts, stego.data, stego.size, &job->err);
+            unmap_file(&stego);
+        }
+        else
+        {
+            map_failed(job, job->out_fname);
+        }
+        unmap_file(&cover);
+    }
+}
+
+/*
+ * Function: split_payload
+ * -------------------------
+ * Gives every cover a slice of the payload in proportion to its capacity:
+ * each takes ceil(remaining * capacity / remaining capacity) bytes, which
+ * never exceeds its capacity and always leaves enough room in the covers
+ * after it. Covers that end up with nothing are dropped.
+ *
+ * Returns:
+ * -----------
+ *   - size_t: Number of shards, the first ones of jobs.
+ */
+static size_t split_payload(ShardJob *jobs, size_t njobs, uint64_t payload_size, uint64_t total_capacity, uint64_t payload_id)
+{
+    uint64_t remaining = payload_size, remaining_capacity = total_capacity, offset = 0;
+    size_t nshards = 0;
+
+    for (size_t i = 0; i < njobs && (remaining > 0 || nshards == 0); i++)
+    {
+        ShardJob *job = &jobs[i];
+        uint64_t size = remaining_capacity == 0 ? 0 :
+                        (uint64_t)(((unsigned __int128)remaining * job->capacity + remaining_capacity - 1) / remaining_capacity);
+        remaining_capacity -= job->capacity;
+        if (size == 0 && remaining > 0)
+        {
+            continue; // A full cover
+        }
+        job->size = size;
+        job->shard.offset = offset;
+        job->shard.payload_id = payload_id;
+        jobs[nshards++] = *job;
+        offset += size;
+        remaining -= size;
+    }
+    for (size_t i = 0; i < nshards; i++)
+    {
+        jobs[i].shard.index = (uint32_t)i;
+        jobs[i].shard.count = (uint32_t)nshards;
+    }
+    return nshards;
+}
+
+/*
+ * Function: do_shard_encode
+ * ---------------------------
+ * Entry point of --shard-encode. Maps the secret, sizes every cover from
+ * its BMP headers, splits the secret across them and encodes all shards
+ * concurrently.
+ *
+ * Parameters:
+ * --------------
+ *   - int argc, char *argv[]: The command line, argv[1] is --shard-encode.
+ *
+ * Returns:
+ * -----------
+ *   - Status: e_success if every shard was written, e_failure otherwise.
+ */
+Status do_shard_encode(int argc, char *argv[])
+{
+    FileList covers = {0};
+    const char *secret_fname = NULL, *extn = NULL, *out_dir = ".";
+    int nthreads = 1, bits = 1, checksum = 0;
+    Status status = e_success;
+
+    for (int i = 2; i < argc && status == e_success; i++)
+    {
+        if (parse_jobs(argc, argv, &i, &nthreads, &status))
+        {
+            continue;
+        }
+        if (strcmp(argv[i], "--bits") == 0)
+        {
+            if (i + 1 == argc || (bits = atoi(argv[++i])) < 1 || bits > LSB_MAX_BITS)
+            {
+                printf("ERROR: --bits expects a number between 1 and %d\n", LSB_MAX_BITS);
+                status = e_failure;
+            }
+        }
+        else if (strcmp(argv[i], "--checksum") == 0)
+        {
+            checksum = 1;
+        }
+        else if (strcmp(argv[i], "-x") == 0 || strcmp(argv[i], "--extn") == 0)
+        {
+            if (i + 1 == argc || argv[i + 1][0] != '.' || strlen(argv[i + 1]) > MAX_FILE_SUFFIX)
+            {
+                printf("ERROR: -x expects an extension like .txt of at most %d characters\n", MAX_FILE_SUFFIX);
+                status = e_failure;
+            }
+            else
+            {
+                extn = argv[++i];
+            }
+        }
+        else if (strcmp(argv[i], "-o") == 0)
+        {
+            if (i + 1 == argc)
+            {
+                printf(SHARD_USAGE);
+                status = e_failure;
+            }
+            else
+            {
+                out_dir = argv[++i];
+            }
+        }
+        else if (secret_fname == NULL)
+        {
+            secret_fname = argv[i];
+        }
+        else
+        {
+            status = file_list_add(&covers, argv[i]);
+        }
+    }
+    if (status == e_success && covers.count == 0)
+    {
+        printf(SHARD_USAGE);
+        status = e_failure;
+    }
+    if (status == e_success && extn == NULL)
+    {
+        extn = strchr(secret_fname, '.') != NULL ? strchr(secret_fname, '.') : DEFAULT_STREAM_EXTN;
+        if (strlen(extn) > MAX_FILE_SUFFIX)
+        {
+            printf("ERROR: Secret file extension %s is longer than %d characters, use -x\n", extn, MAX_FILE_SUFFIX);
+            status = e_failure;
+        }
+    }
+    if (status == e_failure)
+    {
+        file_list_free(&covers);
+        return e_failure;
+    }
+
+    MappedFile secret = {NULL, 0, -1};
+    size_t njobs = covers.count, nshards = 0;
+    ShardJob *jobs = calloc(njobs, sizeof(*jobs));
+    ShardJob **order = calloc(njobs, sizeof(*order));
+    StegoOptions opts = {MAGIC_STRING, bits, 1, 1, NULL, NULL, NULL, checksum};
+    uint64_t total_capacity = 0;
+    if (jobs == NULL || order == NULL)
+    {
+        printf("ERROR: Unable to allocate the shard list\n");
+        status = e_failure;
+    }
+    else
+    {
+        status = map_file_read(secret_fname, &secret);
+    }
+
+    // Every cover gets a version 2 header with the shard fields, size them all alike
+    StegoHeader header;
+    StegoShard shard_fields = {0, 1, 0, 0};
+    if (status == e_success && stego_header_init(&header, extn, 0, bits, 1) == e_failure)
+    {
+        status = e_failure;
+    }
+    stego_header_set_shard(&header, &shard_fields);
+    if (checksum)
+    {
+        stego_header_set_crc(&header);
+    }
+    for (size_t i = 0; i < njobs && status == e_success; i++)
+    {
+        jobs[i].fname = covers.names[i];
+        status = cover_capacity(&jobs[i], &header, MAGIC_STRING);
+        total_capacity += jobs[i].capacity;
+    }
+    if (status == e_success && total_capacity < secret.size)
+    {
+        printf("ERROR: The %zu covers hold %llu bytes, %s needs %llu\n", njobs, (unsigned long long)total_capacity,
+               secret_fname, (unsigned long long)secret.size);
+        status = e_failure;
+    }
+
+    if (status == e_success)
+    {
+        nshards = split_payload(jobs, njobs, secret.size, total_capacity, new_payload_id());
+        for (size_t i = 0; i < nshards && status == e_success; i++)
+        {
+            order[i] = &jobs[i];
+            if ((jobs[i].out_fname = shard_name(out_dir, jobs[i].fname, jobs[i].shard.index)) == NULL)
+            {
+                printf("ERROR: Unable to allocate the shard list\n");
+                status = e_failure;
+            }
+        }
+    }
+    if (status == e_success)
+    {
+        ShardTask task = {order, secret.data, extn, &opts};
+        LOG_INFO("INFO: ## Encoding %s in %zu shards ##\n", secret_fname, nshards);
+        if (parallel_for(nshards, 1, nthreads, encode_shards, &task) == e_failure)
+        {
+            printf("ERROR: Unable to start the shard workers\n");
+            status = e_failure;
+        }
+        for (size_t i = 0; i < nshards && status == e_success; i++)
+        {
+            ShardJob *job = &jobs[i];
+            if (job->status == e_failure)
+            {
+                report_shard(job->shard.index, job);
+                status = e_failure;
+            }
+            else
+            {
+                LOG_INFO("INFO: Shard %u: %llu bytes at offset %llu, %s -> %s\n", job->shard.index, (unsigned long long)job->size,
+                         (unsigned long long)job->shard.offset, job->fname, job->out_fname);
+            }
+        }
+    }
+    if (status == e_success)
+    {
+        LOG_INFO("INFO: ## Encoding Done Successfully ##\n");
+    }
+
+    for (size_t i = 0; jobs != NULL && i < njobs; i++)
+    {
+        free(jobs[i].out_fname);
+    }
+    free(order);
+    free(jobs);
+    unmap_file(&secret);
+    file_list_free(&covers);
+    return status;
+}
+
+/* parallel_task_fn reading the header of stego images [begin, end) */
+static void probe_shards(void *arg, size_t begin, size_t end)
+{
+    ShardTask *task = arg;
+
+    for (size_t i = begin; i < end; i++)
+    {
+        ShardJob *job = task->jobs[i];
+        MappedFile stego;
+
+        if ((job->status = map_file_read(job->fname, &stego)) == e_failure)
+        {
+            map_failed(job, job->fname);
+        }
+        else
+        {
+            if (stego_decode_header(stego.data, stego.size, task->opts, &job->header, NULL, &job->err) == e_success &&
+                !(job->header.flags & STEGO_FLAG_SHARD))
+            {
+                job->err = STEGO_ERR_HEADER; // A whole payload, not a shard
+            }
+            unmap_file(&stego);
+        }
+    }
+}
+
+/* parallel_task_fn extracting shards [begin, end) into their place in the output mapping */
+static void decode_shards(void *arg, size_t begin, size_t end)
+{
+    ShardTask *task = arg;
+
+    for (size_t i = begin; i < end; i++)
+    {
+        ShardJob *job = task->jobs[i];
+        MappedFile stego;
+
+        job->err = STEGO_OK;
+        if ((job->status = map_file_read(job->fname, &stego)) == e_failure)
+        {
+            map_failed(job, job->fname);
+        }
+        else
+        {
+            job->status = stego_decode(stego.data, stego.size, task->opts, (char *)task->payload + job->header.shard.offset,
+                                       job->header.payload_size, NULL, &job->err);
+            unmap_file(&stego);
+        }
+    }
+}
+
+/*
+ * Function: order_shards
+ * ------------------------
+ * Puts the shards found among the images in index order and checks that
+ * they make up exactly one payload: one payload id, every index once and
+ * each shard starting where the one before it ends.
+ *
+ * Returns:
+ * -----------
+ *   - Status: e_success with shards[0 .. count) filled in and *total
+ *             set to the payload size, e_failure otherwise.
+ */
+static Status order_shards(ShardJob *jobs, size_t njobs, ShardJob ***shards, uint32_t *count, uint64_t *total)
+{
+    ShardJob *first = NULL;
+
+    for (size_t i = 0; i < njobs; i++)
+    {
+        if (jobs[i].err != STEGO_OK)
+        {
+            LOG_INFO("INFO: Skipping %s: %s\n", jobs[i].fname, jobs[i].err == STEGO_ERR_HEADER ? "no shard" : stego_strerror(jobs[i].err));
+            continue;
+        }
+        if (first == NULL)
+        {
+            first = &jobs[i];
+        }
+        else if (jobs[i].header.shard.payload_id != first->header.shard.payload_id || jobs[i].header.shard.count != first->header.shard.count)
+        {
+            printf("ERROR: %s and %s hold shards of different payloads\n", first->fname, jobs[i].fname);
+            return e_failure;
+        }
+    }
+    if (first == NULL)
+    {
+        printf("ERROR: None of the images holds a shard\n");
+        return e_failure;
+    }
+    *count = first->header.shard.count;
+    if (*count > njobs || (*shards = calloc(*count, sizeof(**shards))) == NULL)
+    {
+        printf("ERROR: The payload has %u shards, only %zu images were given\n", *count, njobs);
+        return e_failure;
+    }
+
+    for (size_t i = 0; i < njobs; i++)
+    {
+        if (jobs[i].err != STEGO_OK)
+        {
+            continue;
+        }
+        uint32_t index = jobs[i].header.shard.index;
+        if ((*shards)[index] != NULL)
+        {
+            printf("ERROR: %s and %s both hold shard %u\n", (*shards)[index]->fname, jobs[i].fname, index);
+            return e_failure;
+        }
+        (*shards)[index] = &jobs[i];
+    }
+    *total = 0;
+    for (uint32_t i = 0; i < *count; i++)
+    {
+        ShardJob *job = (*shards)[i];
+        if (job == NULL)
+        {
+            printf("ERROR: Shard %u of %u is missing\n", i, *count);
+            return e_failure;
+        }
+        if (job->header.shard.offset != *total || job->header.payload_size > UINT64_MAX - *total ||
+            strcmp(job->header.extn, first->header.extn) != 0)
+        {
+            printf("ERROR: Shard %u in %s does not continue shard %u\n", i, job->fname, i - 1);
+            return e_failure;
+        }
+        *total += job->header.payload_size;
+    }
+    if (*total > SIZE_MAX)
+    {
+        printf("ERROR: The payload is too large to map\n");
+        return e_failure;
+    }
+    return e_success;
+}
+
+/*
+ * Function: with_extension
+ * --------------------------
+ * The output name with its extension replaced by the decoded one, the way
+ * the decoder names its output.
+ */
+static char *with_extension(const char *fname, const char *extn)
+{
+    size_t length = output_name_stem(fname); // Dots in directory names are kept
+    char *name = malloc(length + STEGO_MAX_EXTN + 1);
+
+    if (name != NULL)
+    {
+        snprintf(name, length + STEGO_MAX_EXTN + 1, "%.*s%s", (int)length, fname, extn);
+    }
+    return name;
+}
+
+/*
+ * Function: do_shard_decode
+ * ---------------------------
+ * Entry point of --shard-decode. Reads the header of every image
+ * concurrently, orders the shards of the payload and extracts them all
+ * concurrently into one mapped output file.
+ *
+ * Parameters:
+ * --------------
+ *   - int argc, char *argv[]: The command line, argv[1] is --shard-decode.
+ *
+ * Returns:
+ * -----------
+ *   - Status: e_success if the whole payload was written, e_failure otherwise.
+ */
+Status do_shard_decode(int argc, char *argv[])
+{
+    FileList images = {0};
+    const char *output_fname = NULL;
+    int nthreads = 1;
+    StegoOptions opts = {MAGIC_STRING, 0, 0, 1, NULL, NULL, NULL, 0};
+    Status status = e_success;
+
+    for (int i = 2; i < argc && status == e_success; i++)
+    {
+        if (parse_jobs(argc, argv, &i, &nthreads, &status))
+        {
+            continue;
+        }
+        if (strcmp(argv[i], "-s") == 0 || strcmp(argv[i], "--magic") == 0)
+        {
+            if (i + 1 == argc || argv[i + 1][0] == '\0' || strlen(argv[i + 1]) > MAX_MAGIC_STRING)
+            {
+                printf("ERROR: -s expects a magic string of 1 to %d characters\n", MAX_MAGIC_STRING);
+                status = e_failure;
+            }
+            else
+            {
+                opts.magic = argv[++i];
+            }
+        }
+        else if (output_fname == NULL)
+        {
+            output_fname = argv[i];
+        }
+        else
+        {
+            status = file_list_add(&images, argv[i]);
+        }
+    }
+    if (status == e_success && images.count == 0)
+    {
+        printf(SHARD_USAGE);
+        status = e_failure;
+    }
+
+    size_t njobs = images.count;
+    ShardJob *jobs = status == e_success ? calloc(njobs, sizeof(*jobs)) : NULL;
+    ShardJob **order = status == e_success ? calloc(njobs, sizeof(*order)) : NULL;
+    ShardJob **shards = NULL;
+    char *fname = NULL;
+    uint32_t count = 0;
+    uint64_t total = 0;
+    if (status == e_success && (jobs == NULL || order == NULL))
+    {
+        printf("ERROR: Unable to allocate the shard list\n");
+        status = e_failure;
+    }
+    if (status == e_success)
+    {
+        for (size_t i = 0; i < njobs; i++)
+        {
+            jobs[i].fname = images.names[i];
+            order[i] = &jobs[i];
+        }
+        ShardTask task = {order, NULL, NULL, &opts};
+        if (parallel_for(njobs, 1, nthreads, probe_shards, &task) == e_failure)
+        {
+            printf("ERROR: Unable to start the shard workers\n");
+            status = e_failure;
+        }
+        for (size_t i = 0; i < njobs && status == e_success; i++)
+        {
+            if ((status = jobs[i].status) == e_failure)
+            {
+                printf("ERROR: %s: %s\n", jobs[i].fname, strerror(jobs[i].sys_err)); // Shard index not known yet
+            }
+        }
+    }
+    if (status == e_success)
+    {
+        status = order_shards(jobs, njobs, &shards, &count, &total);
+    }
+    if (status == e_success && (fname = with_extension(output_fname, shards[0]->header.extn)) == NULL)
+    {
+        printf("ERROR: Unable to allocate the output file name\n");
+        status = e_failure;
+    }
+
+    if (status == e_success)
+    {
+        MappedFile output;
+        LOG_INFO("INFO: ## Decoding %u shards, %llu bytes ##\n", count, (unsigned long long)total);
+        status = map_file_write(fname, (size_t)total, &output);
+        if (status == e_success)
+        {
+            ShardTask task = {shards, output.data, NULL, &opts};
+            if (parallel_for(count, 1, nthreads, decode_shards, &task) == e_failure)
+            {
+                printf("ERROR: Unable to start the shard workers\n");
+                status = e_failure;
+            }
+            unmap_file(&output);
+            for (uint32_t i = 0; i < count && status == e_success; i++)
+            {
+                if (shards[i]->status == e_failure)
+                {
+                    report_shard(i, shards[i]);
+                    status = e_failure;
+                }
+            }
+            if (status == e_failure && remove(fname) != 0) // The reassembled payload is damaged or has a gap
+            {
+                perror("remove");
+            }
+        }
+    }
+    if (status == e_success)
+    {
+        LOG_INFO("INFO: Wrote %s\n", fname);
+        LOG_INFO("INFO: ## Decoding Done Successfully ##\n");
+    }
+
+    free(fname);
+    free(shards);
+    free(order);
+    free(jobs);
+    file_list_free(&images);
+    return status;
+}
@@ -0,0 +1,36 @@
+#ifndef SHARD_H
+#define SHARD_H
+
+#include "types.h"
+
+/*
+ * Shard mode
+ * ----------
+ * Spreads one payload that is too large for a single cover over several.
+ * The payload is cut into one slice per cover, in proportion to what each
+ * cover can hold, so the covers fill up evenly. Every stego image records
+ * its slice in the STEGO_FLAG_SHARD header fields (index, count, payload
+ * id, offset). Encode writes <stem>.shard<i>.bmp for every cover used into
+ * the -o directory (default "."):
+ *
+ *     ./lsb_steg --shard-encode -j 8 -o out big.tar covers/
+ *     ./lsb_steg --shard-decode -j 8 restored out/
+ *
+ * Decode takes the stego images in any order, directories are scanned for
+ * .bmp files, and images that carry no shard are skipped. All shards of
+ * the payload must be there. With --checksum every shard carries the CRC
+ * of its slice, checked when it is extracted. With -j N the shards are
+ * encoded or extracted N at a time, each straight between memory mapped
+ * files.
+ */
+
+#define SHARD_USAGE "Sharding: ./lsb_steg --shard-encode [-j N] [--bits k] [--checksum] [-x <.ext>] [-o <dir>] <secret file> <.bmp file | directory>...\n" \
+                    "          ./lsb_steg --shard-decode [-j N] [-s <magic>] <output file> <.bmp file | directory>...\n"
+
+/* Split the secret across the covers named on the command line */
+Status do_shard_encode(int argc, char *argv[]);
+
+/* Reassemble a payload from the shards named on the command line */
+Status do_shard_decode(int argc, char *argv[]);
+
+#endif
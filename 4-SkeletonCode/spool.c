@@ -0,0 +1,582 @@
+#include <dirent.h>
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/inotify.h>
+#include <sys/signalfd.h>
+#include "spool.h"
+#include "batch.h"
+#include "common.h"
+#include "decode.h"
+#include "encode.h"
+#include "parallel.h"
+
+#define SPOOL_SUFFIX ".job"
+#define SPOOL_RUNNING ".running" // Appended to a claimed job file
+#define SPOOL_FAILED ".failed"   // Appended to a job file with a failed job
+#define SPOOL_TEMP_NAME (MAX_OUTPUT_FNAME + STEGO_MAX_EXTN + 1)
+
+/* Bounded queue of job file names between the watcher and the workers */
+typedef struct
+{
+    char **names;
+    size_t cap;
+    size_t head;  // Index of the oldest name
+    size_t count; // Names queued
+    int closed;   // No more names will be pushed
+    pthread_mutex_t lock;
+    pthread_cond_t not_empty;
+    pthread_cond_t not_full;
+} SpoolQueue;
+
+/* State shared by the watcher and the workers */
+typedef struct
+{
+    SpoolQueue queue;
+    pthread_mutex_t count_lock;
+    size_t jobs;   // Job lines run
+    size_t failed; // of which failed
+    unsigned long temp_seq; // Makes the temporary output names unique
+} Spool;
+
+/* One worker thread and its contexts, set up before it starts */
+typedef struct
+{
+    Spool *spool;
+    BatchWorker contexts;
+} SpoolWorker;
+
+static Status queue_init(SpoolQueue *queue, size_t cap)
+{
+    memset(queue, 0, sizeof(*queue));
+    queue->names = calloc(cap, sizeof(*queue->names));
+    if (queue->names == NULL)
+    {
+        printf("ERROR: Unable to allocate the spool queue\n");
+        return e_failure;
+    }
+    queue->cap = cap;
+    pthread_mutex_init(&queue->lock, NULL);
+    pthread_cond_init(&queue->not_empty, NULL);
+    pthread_cond_init(&queue->not_full, NULL);
+    return e_success;
+}
+
+static void queue_free(SpoolQueue *queue)
+{
+    for (size_t i = 0; i < queue->count; i++)
+    {
+        free(queue->names[(queue->head + i) % queue->cap]);
+    }
+    free(queue->names);
+    pthread_mutex_destroy(&queue->lock);
+    pthread_cond_destroy(&queue->not_empty);
+    pthread_cond_destroy(&queue->not_full);
+}
+
+/* Queue a copy of name, waiting while the queue is full */
+static void queue_push(SpoolQueue *queue, const char *name)
+{
+    char *copy = strdup(name);
+    if (copy == NULL)
+    {
+        printf("ERROR: Unable to queue %s\n", name);
+        return;
+    }
+    pthread_mutex_lock(&queue->lock);
+    while (queue->count == queue->cap)
+    {
+        pthread_cond_wait(&queue->not_full, &queue->lock);
+    }
+    queue->names[(queue->head + queue->count++) % queue->cap] = copy;
+    pthread_cond_signal(&queue->not_empty);
+    pthread_mutex_unlock(&queue->lock);
+}
+
+/* Next name to run, NULL once the queue is closed and drained */
+static char *queue_pop(SpoolQueue *queue)
+{
+    char *name = NULL;
+
+    pthread_mutex_lock(&queue->lock);
+    while (queue->count == 0 && !queue->closed)
+    {
+        pthread_cond_wait(&queue->not_empty, &queue->lock);
+    }
+    if (queue->count > 0)
+    {
+        name = queue->names[queue->head];
+        queue->head = (queue->head + 1) % queue->cap;
+        queue->count--;
+        pthread_cond_signal(&queue->not_full);
+    }
+    pthread_mutex_unlock(&queue->lock);
+    return name;
+}
+
+static void queue_close(SpoolQueue *queue)
+{
+    pthread_mutex_lock(&queue->lock);
+    queue->closed = 1;
+    pthread_cond_broadcast(&queue->not_empty);
+    pthread_mutex_unlock(&queue->lock);
+}
+
+static int is_job_file(const char *name)
+{
+    size_t length = strlen(name);
+    return length > strlen(SPOOL_SUFFIX) && strcmp(name + length - strlen(SPOOL_SUFFIX), SPOOL_SUFFIX) == 0;
+}
+
+/*
+ * Function: temp_name
+ * ---------------------
+ * Names the temporary file an output is written to: in the directory of
+ * the output, so renaming it into place is atomic, and without a dot, so
+ * a decode can still append the decoded extension.
+ *
+ * Returns:
+ * -----------
+ *   - Status: e_success, or e_failure if the name is too long.
+ */
+static Status temp_name(Spool *spool, const char *output, char *buf)
+{
+    const char *slash = strrchr(output, '/');
+    int dir = slash != NULL ? (int)(slash - output + 1) : 0;
+    unsigned long seq = __atomic_fetch_add(&spool->temp_seq, 1, __ATOMIC_RELAXED);
+    int length = snprintf(buf, MAX_OUTPUT_FNAME + 1, "%.*sspool-tmp-%ld-%lu", dir, output, (long)getpid(), seq);
+
+    if (length < 0 || length > MAX_OUTPUT_FNAME)
+    {
+        printf("ERROR: Output file name %s is too long\n", output);
+        return e_failure;
+    }
+    return e_success;
+}
+
+/* Move a finished output into place, or drop it when its job failed */
+static Status commit_output(Status status, const char *temp, const char *output)
+{
+    if (status == e_failure)
+    {
+        unlink(temp);
+        return e_failure;
+    }
+    if (rename(temp, output) != 0)
+    {
+        perror("rename");
+        printf("ERROR: Unable to move the output into place as %s\n", output);
+        unlink(temp);
+        return e_failure;
+    }
+    return e_success;
+}
+
+/*
+ * Function: run_encode / run_decode
+ * -----------------------------------
+ * Runs one job line on the worker's contexts with the output redirected
+ * to a temporary file, which replaces the named output once the job
+ * succeeded. Jobs cannot use stdin or stdout.
+ */
+static Status run_encode(Spool *spool, BatchJob *job, EncodeInfo *encInfo, char *temp)
+{
+    Status status = e_failure;
+
+    if (read_and_validate_encode_args(job->argc, job->argv, encInfo) == e_success)
+    {
+        char *output = encInfo->stego_image_fname;
+        if (strcmp(encInfo->src_image_fname, "-") == 0 || strcmp(encInfo->secret_fname, "-") == 0 || strcmp(output, "-") == 0)
+        {
+            printf("ERROR: Spool jobs need named files, they cannot use stdin/stdout\n");
+        }
+        else if (temp_name(spool, output, temp) == e_success)
+        {
+            encInfo->stego_image_fname = temp;
+            status = do_encoding(encInfo);
+            close_files(encInfo);
+            return commit_output(status, temp, output);
+        }
+    }
+    close_files(encInfo);
+    return status;
+}
+
+static Status run_decode(Spool *spool, BatchJob *job, DecodeInfo *decInfo, char *temp)
+{
+    Status status = e_failure;
+
+    if (read_and_validate_decode_args(job->argc, job->argv, decInfo) == e_success)
+    {
+        char *output = decInfo->output_fname; // Allocated with room for the decoded extension
+        if (decInfo->magic_string == NULL)
+        {
+            decInfo->magic_string = MAGIC_STRING; // No prompt unless -s was given
+        }
+        if (strcmp(decInfo->stego_image_fname1, "-") == 0 || strcmp(output, "-") == 0)
+        {
+            printf("ERROR: Spool jobs need named files, they cannot use stdin/stdout\n");
+        }
+        else if (decInfo->verify_only)
+        {
+            status = do_decoding(decInfo); // Nothing is written
+        }
+        else if (temp_name(spool, output, temp) == e_success)
+        {
+            decInfo->output_fname = temp;
+            status = do_decoding(decInfo);
+            close_files_for_decode(decInfo);
+            snprintf(output + output_name_stem(output), STEGO_MAX_EXTN + 1, "%s", decInfo->extension);
+            return commit_output(status, temp, output); // temp got the same extension
+        }
+    }
+    close_files_for_decode(decInfo);
+    return status;
+}
+
+/*
+ * Function: run_job_file
+ * ------------------------
+ * Claims a job file by renaming it, runs its jobs in order and deletes it,
+ * or keeps it as <name>.job.failed when a job failed. A file that is gone
+ * was claimed by another worker, or queued twice, and is skipped.
+ */
+static void run_job_file(Spool *spool, const char *name, EncodeInfo *encInfo, DecodeInfo *decInfo, char *temp)
+{
+    char running[MAX_OUTPUT_FNAME + sizeof(SPOOL_RUNNING)];
+    char failed[MAX_OUTPUT_FNAME + sizeof(SPOOL_FAILED)];
+
+    if ((size_t)snprintf(running, sizeof(running), "%s%s", name, SPOOL_RUNNING) >= sizeof(running) ||
+        (size_t)snprintf(failed, sizeof(failed), "%s%s", name, SPOOL_FAILED) >= sizeof(failed))
+    {
+        printf("ERROR: Job file name %s is too long\n", name);
+        return;
+    }
+    if (rename(name, running) != 0)
+    {
+        if (errno != ENOENT)
+        {
+            perror("rename");
+            printf("ERROR: Unable to claim job file %s\n", name);
+        }
+        return;
+    }
+
+    FILE *fptr = fopen(running, "r");
+    BatchJob *jobs = NULL;
+    size_t njobs = 0, nfailed = 0;
+    Status status = fptr != NULL ? batch_read_manifest(fptr, &jobs, &njobs) : e_failure;
+    if (fptr != NULL)
+    {
+        fclose(fptr);
+    }
+
+    for (size_t i = 0; status == e_success && i < njobs; i++)
+    {
+        BatchJob *job = &jobs[i];
+        if (check_operation_type(job->argv[1]) == e_encode)
+        {
+            job->status = run_encode(spool, job, encInfo, temp);
+        }
+        else
+        {
+            job->status = run_decode(spool, job, decInfo, temp);
+        }
+        if (job->status == e_failure)
+        {
+            printf("FAILED: %s line %d\n", name, job->lineno);
+            nfailed++;
+        }
+    }
+    if (status == e_failure)
+    {
+        printf("FAILED: %s could not be read\n", name);
+        nfailed++;
+    }
+
+    if (nfailed == 0)
+    {
+        unlink(running);
+    }
+    else if (rename(running, failed) != 0)
+    {
+        perror("rename");
+    }
+    batch_free_jobs(jobs, njobs);
+
+    pthread_mutex_lock(&spool->count_lock);
+    spool->jobs += status == e_success ? njobs : 1;
+    spool->failed += nfailed;
+    pthread_mutex_unlock(&spool->count_lock);
+}
+
+/*
+ * Function: spool_worker
+ * ------------------------
+ * Worker thread: runs job files off the queue until it is closed and
+ * drained. Its EncodeInfo and DecodeInfo are set up once by do_spool and
+ * reused for all of its jobs.
+ */
+static void *spool_worker(void *arg)
+{
+    SpoolWorker *worker = arg;
+    char temp[SPOOL_TEMP_NAME]; // Temporary output name, with room for the decoded extension
+    char *name;
+
+    while ((name = queue_pop(&worker->spool->queue)) != NULL)
+    {
+        run_job_file(worker->spool, name, &worker->contexts.encInfo, &worker->contexts.decInfo, temp);
+        free(name);
+    }
+    return NULL;
+}
+
+/* Queue every job file already in the spool directory */
+static void scan_spool(Spool *spool)
+{
+    DIR *dir = opendir(".");
+    struct dirent *entry;
+
+    if (dir == NULL)
+    {
+        perror("opendir");
+        return;
+    }
+    while ((entry = readdir(dir)) != NULL)
+    {
+        if (is_job_file(entry->d_name))
+        {
+            queue_push(&spool->queue, entry->d_name);
+        }
+    }
+    closedir(dir);
+}
+
+/*
+ * Function: watch_spool
+ * -----------------------
+ * Queues the job files inotify reports until a signal arrives on sig_fd.
+ * When the kernel's event queue overflowed the directory is scanned
+ * again; a file queued twice is only run once.
+ */
+static void watch_spool(Spool *spool, int watch_fd, int sig_fd)
+{
+    _Alignas(struct inotify_event) char events[64 * (sizeof(struct inotify_event) + 256)];
+    struct pollfd fds[2] = {{watch_fd, POLLIN, 0}, {sig_fd, POLLIN, 0}};
+
+    for (;;)
+    {
+        if (poll(fds, 2, -1) < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            perror("poll");
+            return;
+        }
+        if (fds[1].revents & POLLIN)
+        {
+            struct signalfd_siginfo info;
+            if (read(sig_fd, &info, sizeof(info)) == (ssize_t)sizeof(info))
+            {
+                printf("INFO: Signal %u, finishing the queued jobs\n", info.ssi_signo);
+            }
+            return;
+        }
+        if (!(fds[0].revents & POLLIN))
+        {
+            continue;
+        }
+
+        ssize_t length = read(watch_fd, events, sizeof(events));
+        if (length <= 0)
+        {
+            if (length < 0 && errno == EINTR)
+            {
+                continue;
+            }
+            perror("read");
+            return;
+        }
+        for (char *pos = events; pos < events + length;)
+        {
+            const struct inotify_event *event = (const struct inotify_event *)pos;
+            if (event->mask & IN_Q_OVERFLOW)
+            {
+                scan_spool(spool);
+            }
+            else if (event->len > 0 && is_job_file(event->name))
+            {
+                queue_push(&spool->queue, event->name);
+            }
+            pos += sizeof(*event) + event->len;
+        }
+    }
+}
+
+/*
+ * Function: do_spool
+ * --------------------
+ * Runs the spool service: changes into the spool directory, starts -j N
+ * workers (1 by default) and queues the job files found there and then
+ * the ones inotify reports, until SIGINT or SIGTERM. The queued jobs are
+ * finished before it prints its summary.
+ *
+ * Parameters:
+ * --------------
+ *   - int argc, char *argv[]: Command line, argv[1] is "--spool".
+ *
+ * Returns:
+ * -----------
+ *   - Status: e_success if every job succeeded, e_failure if one failed or
+ *             the service could not start.
+ */
+Status do_spool(int argc, char *argv[])
+{
+    const char *dir = NULL;
+    int nthreads = 1;
+    Status parsed = e_success; // Of -j, read by parse_jobs()
+    long queue_cap = SPOOL_DEFAULT_QUEUE;
+
+    for (int i = 2; i < argc; i++)
+    {
+        if (parse_jobs(argc, argv, &i, &nthreads, &parsed))
+        {
+            if (parsed == e_failure)
+            {
+                return e_failure;
+            }
+        }
+        else if (strcmp(argv[i], "--queue") == 0)
+        {
+            if (i + 1 == argc || (queue_cap = atol(argv[++i])) < 1 || queue_cap > SPOOL_MAX_QUEUE)
+            {
+                printf("ERROR: --queue expects a length between 1 and %d\n", SPOOL_MAX_QUEUE);
+                return e_failure;
+            }
+        }
+        else if (dir == NULL)
+        {
+            dir = argv[i];
+        }
+        else
+        {
+            printf(SPOOL_USAGE);
+            return e_failure;
+        }
+    }
+    if (dir == NULL)
+    {
+        printf(SPOOL_USAGE);
+        return e_failure;
+    }
+    if (chdir(dir) != 0)
+    {
+        perror("chdir");
+        printf("ERROR: Unable to enter the spool directory %s\n", dir);
+        return e_failure;
+    }
+
+    int watch_fd = inotify_init1(IN_CLOEXEC);
+    if (watch_fd < 0 || inotify_add_watch(watch_fd, ".", IN_CLOSE_WRITE | IN_MOVED_TO) < 0)
+    {
+        perror("inotify");
+        printf("ERROR: Unable to watch the spool directory %s\n", dir);
+        if (watch_fd >= 0)
+        {
+            close(watch_fd);
+        }
+        return e_failure;
+    }
+
+    // The signals are read from sig_fd, so they are blocked in every thread, the workers inherit the mask
+    sigset_t signals, old_mask;
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGINT);
+    sigaddset(&signals, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &signals, &old_mask);
+    int sig_fd = signalfd(-1, &signals, SFD_CLOEXEC);
+
+    Spool spool;
+    memset(&spool, 0, sizeof(spool));
+    pthread_t threads[PARALLEL_MAX_THREADS];
+    SpoolWorker *workers = calloc((size_t)nthreads, sizeof(*workers));
+    int started = 0, ready = 0;
+    Status status = sig_fd >= 0 && workers != NULL ? queue_init(&spool.queue, (size_t)queue_cap) : e_failure;
+    if (sig_fd < 0)
+    {
+        perror("signalfd");
+    }
+    else if (workers == NULL)
+    {
+        printf("ERROR: Unable to allocate the spool workers\n");
+    }
+    for (; status == e_success && ready < nthreads; ready++)
+    {
+        workers[ready].spool = &spool;
+        if (batch_worker_init(&workers[ready].contexts) == e_failure)
+        {
+            queue_free(&spool.queue);
+            status = e_failure;
+            break;
+        }
+    }
+    if (status == e_success)
+    {
+        struct timespec start, stop;
+        stego_verbose = 0; // Only errors and the summary from here on
+        pthread_mutex_init(&spool.count_lock, NULL);
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        for (; started < nthreads; started++)
+        {
+            if (pthread_create(&threads[started], NULL, spool_worker, &workers[started]) != 0)
+            {
+                printf("ERROR: Unable to start the spool workers\n");
+                status = e_failure;
+                break;
+            }
+        }
+        if (status == e_success)
+        {
+            printf("INFO: Watching %s with %d workers\n", dir, nthreads);
+            scan_spool(&spool);
+            watch_spool(&spool, watch_fd, sig_fd);
+        }
+        queue_close(&spool.queue);
+        for (int i = 0; i < started; i++)
+        {
+            pthread_join(threads[i], NULL);
+        }
+        clock_gettime(CLOCK_MONOTONIC, &stop);
+
+        double elapsed = (stop.tv_sec - start.tv_sec) + (stop.tv_nsec - start.tv_nsec) / 1e9;
+        printf("INFO: Spool done: %zu jobs, %zu succeeded, %zu failed in %.3f s (%.1f jobs/s)\n",
+               spool.jobs, spool.jobs - spool.failed, spool.failed, elapsed, elapsed > 0 ? spool.jobs / elapsed : 0.0);
+        if (spool.failed > 0)
+        {
+            status = e_failure;
+        }
+        pthread_mutex_destroy(&spool.count_lock);
+        queue_free(&spool.queue);
+    }
+
+    for (int i = 0; i < ready; i++)
+    {
+        batch_worker_free(&workers[i].contexts);
+    }
+    free(workers);
+    if (sig_fd >= 0)
+    {
+        close(sig_fd);
+    }
+    close(watch_fd);
+    pthread_sigmask(SIG_SETMASK, &old_mask, NULL);
+    return status;
+}
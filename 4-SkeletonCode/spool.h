@@ -0,0 +1,41 @@
+#ifndef SPOOL_H
+#define SPOOL_H
+
+#include "types.h"
+
+/*
+ * Spool mode
+ * ----------
+ * A long running service: watches a spool directory with inotify and runs
+ * every job file dropped there on a fixed pool of workers. A job file is
+ * named <name>.job and is a small manifest in the batch format, one job
+ * per line, run in order by one worker; paths in it are relative to the
+ * spool directory:
+ *
+ *     ./lsb_steg --spool spool/ -j 8 &
+ *     echo "e covers/a.bmp in/a.txt out/a.bmp" > spool/a.job.tmp && mv spool/a.job.tmp spool/a.job
+ *
+ * A job file is picked up when it is moved into the directory or closed
+ * after writing, and the files it names must be complete by then. Files
+ * already in the directory at start up are run first. A worker claims a
+ * job by renaming it to <name>.job.running, deletes it once all its jobs
+ * succeeded and otherwise renames it to <name>.job.failed.
+ *
+ * Every output is written to a temporary file next to it and renamed into
+ * place when its job succeeds, so readers never see a partial image or
+ * secret. Files are queued for the workers in a queue of --queue N entries
+ * (default SPOOL_DEFAULT_QUEUE); when it is full the watcher waits, and
+ * the kernel keeps the events. Workers keep their encode and decode
+ * buffers from job to job. Decode jobs never prompt, as in batch mode.
+ * SIGINT or SIGTERM stops the watch, the queued jobs are finished and a
+ * summary is printed.
+ */
+
+#define SPOOL_USAGE "Spool:    ./lsb_steg --spool <directory> [-j N] [--queue N]\n"
+#define SPOOL_DEFAULT_QUEUE 64
+#define SPOOL_MAX_QUEUE 65536
+
+/* Watch the spool directory and run its job files until SIGINT / SIGTERM */
+Status do_spool(int argc, char *argv[]);
+
+#endif
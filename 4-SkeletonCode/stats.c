@@ -0,0 +1,173 @@
+#define _FILE_OFFSET_BITS 64
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include "stats.h"
+
+static const char *stage_names[STEGO_STAGE_COUNT] = {
+    "open", "check_capacity", "copy_bmp_header", "clone_cover", "encode_header_and_data",
+    "copy_remaining_img_data", "decode_magic_string", "decode_header", "decode_secret_file_data",
+};
+
+static pthread_once_t io_once = PTHREAD_ONCE_INIT;
+static int io_fd = -1;          // /proc/self/io, kept open so a sample is a single pread
+static uint64_t own_rchar;      // Bytes and calls the samples themselves added to the counters
+static uint64_t own_syscalls;
+
+/*
+ * Function: read_io
+ * -------------------
+ * Reads rchar, wchar, syscr and syscw from /proc/self/io, leaving out what
+ * earlier samples read. The pread itself is not in the values it returns.
+ * Leaves the counters at 0 if the file is not there.
+ */
+static void read_io(StatsSample *sample)
+{
+    char buffer[512];
+    ssize_t length;
+
+    sample->rchar = sample->wchar = sample->syscalls = 0;
+    if (io_fd < 0 || (length = pread(io_fd, buffer, sizeof(buffer) - 1, 0)) <= 0)
+    {
+        return;
+    }
+    buffer[length] = '\0';
+    for (char *line = buffer, *value; (value = strchr(line, ':')) != NULL; line = value + (*value != '\0'))
+    {
+        uint64_t n = strtoull(value + 1, &value, 10); // value moves to the end of the line
+        if (strncmp(line, "rchar:", 6) == 0)
+        {
+            sample->rchar = n;
+        }
+        else if (strncmp(line, "wchar:", 6) == 0)
+        {
+            sample->wchar = n;
+        }
+        else if (strncmp(line, "syscr:", 6) == 0 || strncmp(line, "syscw:", 6) == 0)
+        {
+            sample->syscalls += n;
+        }
+    }
+    sample->rchar -= __atomic_fetch_add(&own_rchar, (uint64_t)length, __ATOMIC_RELAXED);
+    sample->syscalls -= __atomic_fetch_add(&own_syscalls, 1, __ATOMIC_RELAXED);
+}
+
+/* Opens /proc/self/io once */
+static void open_io(void)
+{
+#ifdef __linux__
+    io_fd = open("/proc/self/io", O_RDONLY | O_CLOEXEC);
+#endif
+}
+
+/* Clock and counters now */
+static void take_sample(StatsSample *sample)
+{
+    struct timespec ts;
+
+    pthread_once(&io_once, open_io);
+    read_io(sample);
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    sample->seconds = ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/* later - earlier, never below 0 (another thread's samples can make it look negative) */
+static uint64_t delta(uint64_t later, uint64_t earlier)
+{
+    return later > earlier ? later - earlier : 0;
+}
+
+void stats_begin(StegoStats *stats)
+{
+    if (stats != NULL)
+    {
+        take_sample(&stats->mark);
+    }
+}
+
+/*
+ * Function: stats_end
+ * ---------------------
+ * Charges the time and I/O since the last stats_begin to stage.
+ *
+ * Returns:
+ * -----------
+ *   - Status: status, so a stage call can be wrapped (see STATS_STAGE).
+ */
+Status stats_end(StegoStats *stats, StegoStage stage, Status status)
+{
+    StatsSample now;
+
+    if (stats == NULL)
+    {
+        return status;
+    }
+    take_sample(&now);
+    StageStats *s = &stats->stage[stage];
+    s->calls++;
+    s->seconds += now.seconds - stats->mark.seconds;
+    s->bytes_read += delta(now.rchar, stats->mark.rchar);
+    s->bytes_written += delta(now.wchar, stats->mark.wchar);
+    s->syscalls += delta(now.syscalls, stats->mark.syscalls);
+    return status;
+}
+
+void stats_add_bytes(StegoStats *stats, StegoStage stage, uint64_t read, uint64_t written)
+{
+    if (stats != NULL)
+    {
+        stats->stage[stage].bytes_read += read;
+        stats->stage[stage].bytes_written += written;
+    }
+}
+
+const char *stats_stage_name(StegoStage stage)
+{
+    return stage < STEGO_STAGE_COUNT ? stage_names[stage] : "unknown";
+}
+
+/*
+ * Function: stats_print_json
+ * ----------------------------
+ * Writes one line like
+ *
+ *   {"op":"encode","status":"ok","seconds":0.0021,"stages":[{"stage":"open",
+ *    "calls":1,"seconds":0.0001,"bytes_read":0,"bytes_written":0,"syscalls":0},...]}
+ *
+ * listing the stages that ran, in pipeline order, followed by the
+ * "quality" member (quality_print_json) after an encode.
+ */
+void stats_print_json(const StegoStats *stats, const char *op, Status status, FILE *out)
+{
+    double total = 0;
+    int first = 1;
+
+    for (int i = 0; i < STEGO_STAGE_COUNT; i++)
+    {
+        total += stats->stage[i].seconds;
+    }
+    fprintf(out, "{\"op\":\"%s\",\"status\":\"%s\",\"seconds\":%.9f,\"stages\":[", op, status == e_success ? "ok" : "failed", total);
+    for (int i = 0; i < STEGO_STAGE_COUNT; i++)
+    {
+        const StageStats *s = &stats->stage[i];
+        if (s->calls == 0)
+        {
+            continue;
+        }
+        fprintf(out, "%s{\"stage\":\"%s\",\"calls\":%llu,\"seconds\":%.9f,\"bytes_read\":%llu,\"bytes_written\":%llu,\"syscalls\":%llu}",
+                first ? "" : ",", stage_names[i], (unsigned long long)s->calls, s->seconds,
+                (unsigned long long)s->bytes_read, (unsigned long long)s->bytes_written, (unsigned long long)s->syscalls);
+        first = 0;
+    }
+    fprintf(out, "]");
+    if (stats->quality.channels > 0)
+    {
+        fprintf(out, ",");
+        quality_print_json(&stats->quality, out);
+    }
+    fprintf(out, "}\n");
+    fflush(out);
+}
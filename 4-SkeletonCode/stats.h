@@ -0,0 +1,84 @@
+#ifndef STATS_H
+#define STATS_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include "types.h"
+#include "quality.h"
+
+/*
+ * Per-stage instrumentation
+ * -------------------------
+ * Every stage of an encode or decode can be timed into a StegoStats. Wall
+ * time comes from the monotonic clock. On Linux, bytes and read / write
+ * class system calls (read, write, pread, copy_file_range, sendfile, ...)
+ * come from /proc/self/io, so the stdio paths are measured down to the
+ * tail copy the kernel does. Memory mapped and in-memory work does no such
+ * calls, so those stages add the bytes they touched themselves with
+ * stats_add_bytes().
+ *
+ * The counters are process wide: they are exact when one job runs at a
+ * time (not in batch mode with -j). Passing a NULL StegoStats to any of
+ * these functions does nothing, so the stages are instrumented without
+ * checks at every call site.
+ *
+ * An encode also fills in quality, the distortion of the stego image
+ * against its cover (quality.h), in the same pass as the embed.
+ */
+
+typedef enum
+{
+    STEGO_STAGE_OPEN,        // open_files, open_files_for_decode, mapping the files
+    STEGO_STAGE_CAPACITY,    // check_capacity: BMP headers, secret size, header layout
+    STEGO_STAGE_COPY_HEADER, // copy_bmp_header
+    STEGO_STAGE_CLONE,       // Cloning the cover for -i
+    STEGO_STAGE_EMBED,       // Magic string, header and secret data (one fused pass)
+    STEGO_STAGE_COPY_TAIL,   // copy_remaining_img_data
+    STEGO_STAGE_MAGIC,       // decode_magic_string
+    STEGO_STAGE_HEADER,      // Extension size, extension and file size (and the magic string when mapped)
+    STEGO_STAGE_EXTRACT,     // decode_secret_file_data
+    STEGO_STAGE_COUNT
+} StegoStage;
+
+typedef struct _StageStats
+{
+    uint64_t calls;         // Times the stage ran
+    double seconds;         // Wall time
+    uint64_t bytes_read;    // Read through system calls or from memory
+    uint64_t bytes_written; // Written through system calls or to memory
+    uint64_t syscalls;      // Read and write class system calls, 0 where /proc/self/io is missing
+} StageStats;
+
+/* A sample of the clock and the I/O counters */
+typedef struct _StatsSample
+{
+    double seconds;
+    uint64_t rchar, wchar, syscalls;
+} StatsSample;
+
+typedef struct _StegoStats
+{
+    StageStats stage[STEGO_STAGE_COUNT];
+    StatsSample mark; // Taken by stats_begin
+    StegoQuality quality; // Distortion of an encode, quality.channels is 0 until the embed starts
+} StegoStats;
+
+/* Start timing a stage */
+void stats_begin(StegoStats *stats);
+
+/* Charge everything since stats_begin to stage, passes status through */
+Status stats_end(StegoStats *stats, StegoStage stage, Status status);
+
+/* Time one call as a stage: if (STATS_STAGE(stats, STEGO_STAGE_OPEN, open_files(encInfo)) == e_failure) */
+#define STATS_STAGE(stats, stage, call) (stats_begin(stats), stats_end((stats), (stage), (call)))
+
+/* Add bytes moved without system calls (mapped files, memory) to stage */
+void stats_add_bytes(StegoStats *stats, StegoStage stage, uint64_t read, uint64_t written);
+
+/* Name of a stage in the JSON dump */
+const char *stats_stage_name(StegoStage stage);
+
+/* Write the stages that ran as one JSON object */
+void stats_print_json(const StegoStats *stats, const char *op, Status status, FILE *out);
+
+#endif
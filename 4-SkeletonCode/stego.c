@@ -0,0 +1,1071 @@
+#include <string.h>
+#include "common.h"
+#include "stego.h"
+#include "stego_header.h"
+#include "lsb.h"
+#include "parallel.h"
+#include "scatter.h"
+#include "crc32c.h"
+#include "quality.h"
+
+#define SCATTER_PREFETCH 8 // Tiles the keyed kernels prefetch ahead
+#define VERIFY_BUFFER 3072 // Bytes a verifying extract decodes at a time, a multiple of 8 * bits for every bits
+
+/* CRC32C of a payload whose chunks are checksummed on several workers */
+typedef struct
+{
+    uint64_t size; // Payload bytes
+    uint32_t crc;  // XOR of the shares of the chunks done so far, the payload's CRC once all are in
+} PayloadCrc;
+
+/* Source and destination of a chunked embed into the payload region */
+typedef struct
+{
+    const char *secret;      // Payload bytes
+    const char *src;         // Cover bytes of the payload region
+    char *dest;              // Stego bytes of the payload region
+    int bits;                // Payload bits per cover byte
+    const LsbKernel *kernel; // lsb_kernel(bits)
+    PayloadCrc *crc;         // Checksum of the payload, NULL without STEGO_FLAG_CRC
+    StegoQuality *quality;   // Distortion counters, NULL without stats
+    uint64_t region_offset;  // Where dest starts in the pixel array
+} EmbedTask;
+
+/* Payload and payload region of a chunked keyed embed or extract */
+typedef struct
+{
+    char *payload;           // Payload bytes (read by the embed, written by the extract)
+    char *region;            // Image bytes of the payload region
+    int bits;                // Payload bits per image byte
+    const LsbKernel *kernel; // lsb_kernel(bits)
+    const Scatter *scatter;  // Where each payload tile goes
+    PayloadCrc *crc;         // Checksum of the payload, NULL without STEGO_FLAG_CRC
+    StegoQuality *quality;   // Distortion counters of an embed, NULL without stats
+    uint64_t region_offset;  // Where region starts in the pixel array
+} ScatterTask;
+
+/* Source and destination of a chunked extract from the payload region */
+typedef struct
+{
+    char *output;            // Decoded payload bytes, NULL to only check the CRC
+    const char *pixel;       // Stego bytes of the payload region
+    int bits;                // Payload bits per image byte
+    const LsbKernel *kernel; // lsb_kernel(bits)
+    PayloadCrc *crc;         // Checksum of the payload, NULL without STEGO_FLAG_CRC
+} ExtractTask;
+
+/* Position of the header reader in an in-memory stego image */
+typedef struct
+{
+    const char *pos;
+    const char *end;
+    int truncated; // Set when a field runs past the end of the image
+} MemoryReader;
+
+static Status fail(StegoError *err, StegoError code)
+{
+    if (err != NULL)
+    {
+        *err = code;
+    }
+    return code == STEGO_OK ? e_success : e_failure;
+}
+
+static const char *option_magic(const StegoOptions *opts)
+{
+    return opts != NULL && opts->magic != NULL ? opts->magic : MAGIC_STRING;
+}
+
+static int option_bits(const StegoOptions *opts)
+{
+    return opts != NULL && opts->bits != 0 ? opts->bits : 1;
+}
+
+static int option_threads(const StegoOptions *opts)
+{
+    return opts != NULL && opts->nthreads > 1 ? opts->nthreads : 1;
+}
+
+static StegoStats *option_stats(const StegoOptions *opts)
+{
+    return opts != NULL ? opts->stats : NULL;
+}
+
+static const char *option_key(const StegoOptions *opts)
+{
+    return opts != NULL ? opts->key : NULL;
+}
+
+/*
+ * Function: region_tiles
+ * ------------------------
+ * Whole tiles between the end of the header and the end of the pixel
+ * array (or of the buffer, if it stops first). Encoder and decoder see the
+ * same image, so they agree on the permutation domain.
+ */
+static uint64_t region_tiles(const BmpInfo *bmp, size_t len, size_t data_offset)
+{
+    uint64_t end = len - bmp->pixel_offset < bmp->pixel_bytes ? len - bmp->pixel_offset : bmp->pixel_bytes;
+    uint64_t start = data_offset - bmp->pixel_offset;
+    return end > start ? (end - start) / SCATTER_TILE : 0;
+}
+
+/* Payload bytes one tile holds */
+static size_t tile_payload(int bits)
+{
+    return SCATTER_TILE / 8 * bits;
+}
+
+/*
+ * Function: crc_add
+ * -------------------
+ * Folds the CRC of payload bytes [begin, end) into the payload's CRC. The
+ * share of a chunk only depends on how many bytes follow it, so workers
+ * add theirs in any order.
+ */
+static void crc_add(PayloadCrc *crc, uint32_t chunk_crc, size_t end)
+{
+    __atomic_fetch_xor(&crc->crc, crc32c_shift(chunk_crc, crc->size - end), __ATOMIC_RELAXED);
+}
+
+/* End of the bytes a chunk ending at end embeds: with a CRC the payload's last partial group of bits bytes is left to embed_trailer() */
+static size_t embed_end(const PayloadCrc *crc, size_t end, int bits)
+{
+    return crc != NULL && end == crc->size ? end - end % bits : end;
+}
+
+/*
+ * Function: option_quality
+ * --------------------------
+ * The distortion counters of an encode, set up for the cover's pixel
+ * array, or NULL when nothing is measured.
+ */
+static StegoQuality *option_quality(const StegoOptions *opts, const BmpInfo *bmp)
+{
+    StegoStats *stats = option_stats(opts);
+
+    if (stats == NULL)
+    {
+        return NULL;
+    }
+    quality_init(&stats->quality, bmp);
+    return &stats->quality;
+}
+
+/* Counters the embed of a single thread adds to directly, NULL without stats */
+static QualityCounts *quality_total(StegoQuality *quality)
+{
+    return quality != NULL ? &quality->total : NULL;
+}
+
+/*
+ * Function: embed_chunk
+ * -----------------------
+ * parallel_task_fn copying payload bytes [begin, end) worth of cover bytes
+ * into the output (unless it is encoded in place) and embedding them there.
+ * With stats the chunk's distortion is counted on the stack and merged
+ * once at the end.
+ */
+static void embed_chunk(void *arg, size_t begin, size_t end)
+{
+    EmbedTask *task = arg;
+    size_t offset = begin * 8 / task->bits; // Chunks start on a multiple of bits, so this is exact
+    size_t length = lsb_image_bytes(end - begin, task->bits);
+    if (task->dest != task->src)
+    {
+        memcpy(task->dest + offset, task->src + offset, length);
+    }
+    size_t n = embed_end(task->crc, end, task->bits) - begin;
+    if (task->quality == NULL)
+    {
+        task->kernel->encode(task->secret + begin, n, task->dest + offset);
+    }
+    else
+    {
+        QualityCounts counts;
+        memset(&counts, 0, sizeof(counts));
+        quality_embed(task->quality, &counts, task->bits, task->secret + begin, n, task->dest + offset, task->region_offset + offset);
+        quality_merge(task->quality, &counts);
+    }
+    if (task->crc != NULL)
+    {
+        crc_add(task->crc, crc32c(0, task->secret + begin, end - begin), end);
+    }
+}
+
+/*
+ * Function: extract_chunk
+ * -------------------------
+ * parallel_task_fn decoding payload bytes [begin, end). Without an output
+ * buffer the bytes pass through a small one on the stack, so only the CRC
+ * is worked out.
+ */
+static void extract_chunk(void *arg, size_t begin, size_t end)
+{
+    ExtractTask *task = arg;
+    char buffer[VERIFY_BUFFER];
+    uint32_t crc = 0;
+
+    if (task->output != NULL)
+    {
+        task->kernel->decode(task->output + begin, end - begin, task->pixel + begin * 8 / task->bits);
+        crc = task->crc != NULL ? crc32c(0, task->output + begin, end - begin) : 0;
+    }
+    else
+    {
+        for (size_t from = begin; from < end; from += VERIFY_BUFFER)
+        {
+            size_t n = end - from < VERIFY_BUFFER ? end - from : VERIFY_BUFFER;
+            task->kernel->decode(buffer, n, task->pixel + from * 8 / task->bits);
+            crc = crc32c(crc, buffer, n);
+        }
+    }
+    if (task->crc != NULL)
+    {
+        crc_add(task->crc, crc, end);
+    }
+}
+
+/*
+ * Function: scatter_embed_range
+ * -------------------------------
+ * Embeds data, payload bytes [begin, end) (begin a multiple of bits), into
+ * the image tiles the walk picks. The payload is read in order and every
+ * tile is a single cache line written once; the next SCATTER_PREFETCH
+ * tiles are prefetched to hide the scattered stores. The distortion is
+ * added to counts unless it is NULL.
+ */
+static void scatter_embed_range(const ScatterTask *task, const char *data, size_t begin, size_t end, QualityCounts *counts)
+{
+    size_t per_tile = tile_payload(task->bits);
+    uint64_t count = (end + per_tile - 1) / per_tile - begin / per_tile;
+    ScatterWalk walk, ahead;
+
+    scatter_walk_init(&walk, task->scatter, begin / per_tile);
+    scatter_walk_init(&ahead, task->scatter, begin / per_tile);
+    for (uint64_t i = 0; i < SCATTER_PREFETCH && i < count; i++)
+    {
+        __builtin_prefetch(task->region + scatter_walk_next(&ahead) * SCATTER_TILE, 1);
+    }
+    for (size_t i = 0, from = begin; i < count; i++)
+    {
+        if (i + SCATTER_PREFETCH < count)
+        {
+            __builtin_prefetch(task->region + scatter_walk_next(&ahead) * SCATTER_TILE, 1);
+        }
+        size_t in_tile = from % per_tile;
+        size_t n = end - from < per_tile - in_tile ? end - from : per_tile - in_tile;
+        char *image = task->region + scatter_walk_next(&walk) * SCATTER_TILE + in_tile * 8 / task->bits;
+        if (counts == NULL)
+        {
+            task->kernel->encode(data + (from - begin), n, image);
+        }
+        else
+        {
+            quality_embed(task->quality, counts, task->bits, data + (from - begin), n, image, task->region_offset + (image - task->region));
+        }
+        from += n;
+    }
+}
+
+/*
+ * Function: scatter_extract_range
+ * ---------------------------------
+ * Decodes payload bytes [begin, end) (begin a multiple of bits) from their
+ * tiles into out, the reverse of scatter_embed_range().
+ */
+static void scatter_extract_range(const ScatterTask *task, char *out, size_t begin, size_t end)
+{
+    size_t per_tile = tile_payload(task->bits);
+    uint64_t count = (end + per_tile - 1) / per_tile - begin / per_tile;
+    ScatterWalk walk, ahead;
+
+    scatter_walk_init(&walk, task->scatter, begin / per_tile);
+    scatter_walk_init(&ahead, task->scatter, begin / per_tile);
+    for (uint64_t i = 0; i < SCATTER_PREFETCH && i < count; i++)
+    {
+        __builtin_prefetch(task->region + scatter_walk_next(&ahead) * SCATTER_TILE, 0);
+    }
+    for (size_t i = 0, from = begin; i < count; i++)
+    {
+        if (i + SCATTER_PREFETCH < count)
+        {
+            __builtin_prefetch(task->region + scatter_walk_next(&ahead) * SCATTER_TILE, 0);
+        }
+        size_t in_tile = from % per_tile;
+        size_t n = end - from < per_tile - in_tile ? end - from : per_tile - in_tile;
+        const char *image = task->region + scatter_walk_next(&walk) * SCATTER_TILE + in_tile * 8 / task->bits;
+        task->kernel->decode(out + (from - begin), n, image);
+        from += n;
+    }
+}
+
+/* parallel_task_fn embedding payload bytes [begin, end) of a keyed payload, counting the distortion like embed_chunk() */
+static void scatter_embed_chunk(void *arg, size_t begin, size_t end)
+{
+    ScatterTask *task = arg;
+    size_t stop = embed_end(task->crc, end, task->bits);
+
+    if (task->quality == NULL)
+    {
+        scatter_embed_range(task, task->payload + begin, begin, stop, NULL);
+    }
+    else
+    {
+        QualityCounts counts;
+        memset(&counts, 0, sizeof(counts));
+        scatter_embed_range(task, task->payload + begin, begin, stop, &counts);
+        quality_merge(task->quality, &counts);
+    }
+    if (task->crc != NULL)
+    {
+        crc_add(task->crc, crc32c(0, task->payload + begin, end - begin), end);
+    }
+}
+
+/* parallel_task_fn decoding payload bytes [begin, end) of a keyed payload, like extract_chunk() */
+static void scatter_extract_chunk(void *arg, size_t begin, size_t end)
+{
+    ScatterTask *task = arg;
+    char buffer[VERIFY_BUFFER];
+    uint32_t crc = 0;
+
+    if (task->payload != NULL)
+    {
+        scatter_extract_range(task, task->payload + begin, begin, end);
+        crc = task->crc != NULL ? crc32c(0, task->payload + begin, end - begin) : 0;
+    }
+    else
+    {
+        for (size_t from = begin; from < end; from += VERIFY_BUFFER)
+        {
+            size_t n = end - from < VERIFY_BUFFER ? end - from : VERIFY_BUFFER;
+            scatter_extract_range(task, buffer, from, from + n);
+            crc = crc32c(crc, buffer, n);
+        }
+    }
+    if (task->crc != NULL)
+    {
+        crc_add(task->crc, crc, end);
+    }
+}
+
+/*
+ * Function: embed_trailer
+ * -------------------------
+ * Embeds the CRC right after the payload. With k bits per image byte the
+ * payload may end inside an image byte, so the chunks leave its last
+ * partial group of k bytes out (embed_end) and it is embedded here
+ * together with the CRC, which puts the trailer exactly where the
+ * payload's bit stream stops and never embeds an image byte twice.
+ * Exactly one of plain and keyed is the task the payload was embedded
+ * with.
+ */
+static void embed_trailer(const char *payload, size_t payload_len, uint32_t crc, const EmbedTask *plain, const ScatterTask *keyed)
+{
+    char tail[LSB_MAX_BITS - 1 + STEGO_CRC_SIZE];
+    int bits = keyed != NULL ? keyed->bits : plain->bits;
+    size_t start = payload_len - payload_len % bits;
+    size_t n = payload_len - start;
+
+    memcpy(tail, payload + start, n);
+    stego_header_pack_crc(crc, tail + n);
+    if (keyed != NULL)
+    {
+        scatter_embed_range(keyed, tail, start, payload_len + STEGO_CRC_SIZE, quality_total(keyed->quality));
+    }
+    else
+    {
+        size_t at = start * 8 / bits;
+        quality_embed(plain->quality, quality_total(plain->quality), bits, tail, n + STEGO_CRC_SIZE, plain->dest + at, plain->region_offset + at);
+    }
+}
+
+/* Reads the CRC embed_trailer() wrote */
+static uint32_t read_trailer(uint64_t payload_size, int bits, const char *region, const ScatterTask *keyed)
+{
+    char tail[LSB_MAX_BITS - 1 + STEGO_CRC_SIZE];
+    size_t start = payload_size - payload_size % bits;
+    size_t n = payload_size - start;
+
+    if (keyed != NULL)
+    {
+        scatter_extract_range(keyed, tail, start, payload_size + STEGO_CRC_SIZE);
+    }
+    else
+    {
+        decode_lsb_bits_to_bytes(tail, n + STEGO_CRC_SIZE, region + start * 8 / bits, bits);
+    }
+    return stego_header_unpack_crc(tail + n);
+}
+
+/*
+ * Function: read_header_from_memory
+ * -----------------------------------
+ * header_read_fn decoding the next n header bytes from an in-memory stego
+ * image, refusing to read past its end.
+ */
+static Status read_header_from_memory(void *ctx, char *data, size_t n)
+{
+    MemoryReader *reader = ctx;
+
+    if ((size_t)(reader->end - reader->pos) / 8 < n)
+    {
+        reader->truncated = 1;
+        return e_failure;
+    }
+    decode_lsb_to_bytes(data, n, reader->pos);
+    reader->pos += n * 8;
+    return e_success;
+}
+
+/*
+ * Function: stego_cover_bytes
+ * -----------------------------
+ * Pixel array bytes a cover needs for the header and payload hdr
+ * describes, after the magic string: the sequential layout packs them,
+ * a scattered payload takes whole blocks of whole tiles.
+ */
+uint64_t stego_cover_bytes(const StegoHeader *hdr, const char *magic)
+{
+    uint64_t header_bytes = (strlen(magic) + stego_header_size(hdr)) * 8;
+    uint64_t stream = stego_header_stream_size(hdr);
+
+    if (hdr->flags & STEGO_FLAG_KEYED)
+    {
+        uint64_t per_tile = tile_payload(hdr->bits);
+        uint64_t blocks = ((stream + per_tile - 1) / per_tile + SCATTER_BLOCK_TILES - 1) / SCATTER_BLOCK_TILES;
+        return header_bytes + blocks * SCATTER_BLOCK_TILES * SCATTER_TILE;
+    }
+    return header_bytes + lsb_image_bytes(stream, hdr->bits);
+}
+
+/*
+ * Function: stego_check_capacity
+ * --------------------------------
+ * Works out the header for a payload and checks that the cover holds it:
+ * the pixel array described by the BMP descriptor and the buffer itself
+ * must both be large enough for the header and the payload.
+ *
+ * Parameters:
+ * --------------
+ *   - const char *cover, size_t cover_len: The cover BMP image.
+ *   - uint64_t payload_len: Size of the payload in bytes.
+ *   - const char *extn: Extension recorded for the payload, including the dot.
+ *   - const StegoOptions *opts: Options, NULL for the defaults.
+ *   - StegoHeader *hdr: Filled with the header stego_encode() would write.
+ *   - StegoError *err: Error code on failure, may be NULL.
+ *
+ * Returns:
+ * -----------
+ *   - Status: e_success if the payload fits, e_failure otherwise.
+ */
+Status stego_check_capacity(const char *cover, size_t cover_len, uint64_t payload_len, const char *extn,
+                            const StegoOptions *opts, StegoHeader *hdr, StegoError *err)
+{
+    const char *magic = option_magic(opts);
+
+    if ((cover == NULL && cover_len > 0) || extn == NULL || strlen(magic) > MAX_MAGIC_STRING ||
+        stego_header_init(hdr, extn, payload_len, option_bits(opts), opts != NULL && opts->force_v2) == e_failure)
+    {
+        return fail(err, STEGO_ERR_ARGS);
+    }
+    if (opts != NULL && opts->shard != NULL)
+    {
+        if (opts->shard->index >= opts->shard->count)
+        {
+            return fail(err, STEGO_ERR_ARGS);
+        }
+        stego_header_set_shard(hdr, opts->shard);
+    }
+    if (option_key(opts) != NULL)
+    {
+        stego_header_set_keyed(hdr);
+    }
+    if (opts != NULL && opts->checksum)
+    {
+        stego_header_set_crc(hdr);
+    }
+    BmpInfo bmp;
+    if (bmp_parse(cover, cover_len, &bmp) == e_failure)
+    {
+        return fail(err, STEGO_ERR_NOT_BMP);
+    }
+
+    // Same rule as check_capacity, plus a check that the buffer really holds those bytes
+    uint64_t header_bytes = (strlen(magic) + stego_header_size(hdr)) * 8;
+    uint64_t needed = header_bytes + lsb_image_bytes(stego_header_stream_size(hdr), hdr->bits);
+    if (bmp.pixel_bytes < needed || cover_len < bmp.pixel_offset || cover_len - bmp.pixel_offset < needed)
+    {
+        return fail(err, STEGO_ERR_CAPACITY);
+    }
+
+    // A scattered payload takes whole tiles of whole blocks
+    if (hdr->flags & STEGO_FLAG_KEYED)
+    {
+        Scatter scatter;
+        uint64_t per_tile = tile_payload(hdr->bits);
+        scatter_init(&scatter, option_key(opts), region_tiles(&bmp, cover_len, bmp.pixel_offset + header_bytes));
+        if (scatter_capacity(&scatter) < (stego_header_stream_size(hdr) + per_tile - 1) / per_tile)
+        {
+            return fail(err, STEGO_ERR_CAPACITY);
+        }
+    }
+    return fail(err, STEGO_OK);
+}
+
+/*
+ * Function: encode_scattered
+ * ----------------------------
+ * The keyed half of stego_encode(): the payload tiles land all over the
+ * pixel array, so the whole cover is copied first and the tiles are then
+ * embedded into the copy, opts->nthreads workers at a time.
+ */
+static Status encode_scattered(const char *cover, size_t cover_len, const char *payload, size_t payload_len,
+                               const BmpInfo *bmp, const StegoHeader *hdr, const char *header, size_t header_length,
+                               const StegoOptions *opts, StegoQuality *quality, char *out, StegoError *err)
+{
+    StegoStats *stats = option_stats(opts);
+    size_t data_offset = bmp->pixel_offset + header_length * 8;
+    Scatter scatter;
+
+    if (out != cover)
+    {
+        stats_begin(stats);
+        memcpy(out, cover, cover_len);
+        stats_add_bytes(stats, STEGO_STAGE_CLONE, cover_len, cover_len);
+        stats_end(stats, STEGO_STAGE_CLONE, e_success);
+    }
+    stats_begin(stats);
+    quality_embed(quality, quality_total(quality), 1, header, header_length, out + bmp->pixel_offset, 0);
+
+    scatter_init(&scatter, option_key(opts), region_tiles(bmp, cover_len, data_offset));
+    PayloadCrc crc = {payload_len, 0};
+    ScatterTask task = {(char *)payload, out + data_offset, hdr->bits, lsb_kernel(hdr->bits), &scatter, hdr->flags & STEGO_FLAG_CRC ? &crc : NULL,
+                        quality, header_length * 8};
+    size_t per_tile = tile_payload(hdr->bits);
+    size_t grain = PARALLEL_GRAIN - PARALLEL_GRAIN % per_tile; // Keep every chunk on a tile boundary
+    if (parallel_for(payload_len, grain, option_threads(opts), scatter_embed_chunk, &task) == e_failure)
+    {
+        stats_end(stats, STEGO_STAGE_EMBED, e_failure);
+        return fail(err, STEGO_ERR_THREADS);
+    }
+    if (task.crc != NULL)
+    {
+        embed_trailer(payload, payload_len, crc.crc, NULL, &task);
+    }
+    stats_end(stats, STEGO_STAGE_EMBED, e_success);
+    stats_add_bytes(stats, STEGO_STAGE_EMBED, payload_len, header_length * 8 + lsb_image_bytes(stego_header_stream_size(hdr), hdr->bits));
+    return fail(err, STEGO_OK);
+}
+
+/*
+ * Function: stego_encode
+ * ------------------------
+ * Writes the cover image with the magic string, the header and the payload
+ * embedded after the BMP header to out. Everything past the payload is
+ * copied unchanged. With opts->nthreads > 1 the payload region is split
+ * across that many workers. With opts->key the payload is scattered over
+ * the rest of the pixel array in tiles instead (scatter.h).
+ *
+ * Parameters:
+ * --------------
+ *   - const char *cover, size_t cover_len: The cover BMP image.
+ *   - const char *payload, size_t payload_len: The data to hide.
+ *   - const char *extn: Extension recorded for the payload, including the dot.
+ *   - const StegoOptions *opts: Options, NULL for the defaults.
+ *   - char *out, size_t out_len: Destination, at least cover_len bytes. May
+ *     be the cover itself to encode in place.
+ *   - StegoError *err: Error code on failure, may be NULL.
+ *
+ * Returns:
+ * -----------
+ *   - Status: e_success with cover_len bytes written to out,
+ *             e_failure otherwise.
+ */
+Status stego_encode(const char *cover, size_t cover_len, const char *payload, size_t payload_len, const char *extn,
+                    const StegoOptions *opts, char *out, size_t out_len, StegoError *err)
+{
+    StegoHeader hdr;
+    BmpInfo bmp;
+    char header[MAX_MAGIC_STRING + STEGO_MAX_HEADER];
+    StegoStats *stats = option_stats(opts);
+
+    if (out == NULL || (payload == NULL && payload_len > 0))
+    {
+        return fail(err, STEGO_ERR_ARGS);
+    }
+    if (STATS_STAGE(stats, STEGO_STAGE_CAPACITY, stego_check_capacity(cover, cover_len, payload_len, extn, opts, &hdr, err)) == e_failure)
+    {
+        return e_failure;
+    }
+    if (out_len < cover_len)
+    {
+        return fail(err, STEGO_ERR_BUFFER);
+    }
+    bmp_parse(cover, cover_len, &bmp); // Already validated by stego_check_capacity
+    StegoQuality *quality = option_quality(opts, &bmp);
+
+    // The BMP headers and the stego header region are copied first and then embedded in place
+    size_t header_length = stego_header_pack(&hdr, option_magic(opts), header);
+    size_t data_offset = bmp.pixel_offset + header_length * 8;
+    size_t tail = data_offset + lsb_image_bytes(stego_header_stream_size(&hdr), hdr.bits);
+    if (hdr.flags & STEGO_FLAG_KEYED)
+    {
+        return encode_scattered(cover, cover_len, payload, payload_len, &bmp, &hdr, header, header_length, opts, quality, out, err);
+    }
+    if (out != cover)
+    {
+        stats_begin(stats);
+        memcpy(out, cover, data_offset);
+        stats_add_bytes(stats, STEGO_STAGE_COPY_HEADER, data_offset, data_offset);
+        stats_end(stats, STEGO_STAGE_COPY_HEADER, e_success);
+    }
+    stats_begin(stats);
+    quality_embed(quality, quality_total(quality), 1, header, header_length, out + bmp.pixel_offset, 0);
+
+    // The payload region is copied and embedded chunk by chunk, the CRC is worked out on the way
+    PayloadCrc crc = {payload_len, 0};
+    EmbedTask task = {payload, cover + data_offset, out + data_offset, hdr.bits, lsb_kernel(hdr.bits), hdr.flags & STEGO_FLAG_CRC ? &crc : NULL,
+                      quality, header_length * 8};
+    size_t grain = PARALLEL_GRAIN - PARALLEL_GRAIN % hdr.bits; // Keep every chunk on a cover byte boundary
+    if (parallel_for(payload_len, grain, option_threads(opts), embed_chunk, &task) == e_failure)
+    {
+        stats_end(stats, STEGO_STAGE_EMBED, e_failure);
+        return fail(err, STEGO_ERR_THREADS);
+    }
+    if (task.crc != NULL)
+    {
+        size_t end = data_offset + lsb_image_bytes(payload_len, hdr.bits);
+        if (out != cover)
+        {
+            memcpy(out + end, cover + end, tail - end);
+        }
+        embed_trailer(payload, payload_len, crc.crc, &task, NULL);
+    }
+    stats_end(stats, STEGO_STAGE_EMBED, e_success);
+    stats_add_bytes(stats, STEGO_STAGE_EMBED, payload_len + (tail - data_offset), tail - bmp.pixel_offset);
+
+    // Left over data is copied as is
+    if (out != cover)
+    {
+        stats_begin(stats);
+        memcpy(out + tail, cover + tail, cover_len - tail);
+        stats_add_bytes(stats, STEGO_STAGE_COPY_TAIL, cover_len - tail, cover_len - tail);
+        stats_end(stats, STEGO_STAGE_COPY_TAIL, e_success);
+    }
+    return fail(err, STEGO_OK);
+}
+
+/*
+ * Function: stego_probe
+ * -----------------------
+ * Checks the magic string of an image and decodes the header after it,
+ * touching nothing beyond the header region. Meant for scanning many
+ * images: the caller only needs to read the first STEGO_PROBE_SIZE bytes
+ * of each, and it is up to the caller to check that the payload of
+ * hdr->payload_size bytes is really there.
+ *
+ * Parameters:
+ * --------------
+ *   - const char *image, size_t len: The start of the image, or all of it.
+ *   - const StegoOptions *opts: Options (only magic is used), NULL for the defaults.
+ *   - StegoHeader *hdr: Filled with the decoded header.
+ *   - size_t *payload_offset: Offset of the payload region, may be NULL.
+ *   - StegoError *err: Error code on failure, may be NULL.
+ *
+ * Returns:
+ * -----------
+ *   - Status: e_success if a valid header was found, e_failure otherwise.
+ */
+Status stego_probe(const char *image, size_t len, const StegoOptions *opts,
+                   StegoHeader *hdr, size_t *payload_offset, StegoError *err)
+{
+    const char *magic = option_magic(opts);
+    size_t magic_length = strlen(magic);
+    char decoded[MAX_MAGIC_STRING];
+    BmpInfo bmp;
+
+    if ((image == NULL && len > 0) || hdr == NULL || magic_length > MAX_MAGIC_STRING)
+    {
+        return fail(err, STEGO_ERR_ARGS);
+    }
+    if (bmp_parse(image, len, &bmp) == e_failure)
+    {
+        return fail(err, STEGO_ERR_NOT_BMP);
+    }
+    if (len < bmp.pixel_offset)
+    {
+        return fail(err, STEGO_ERR_TRUNCATED);
+    }
+
+    const char *pixel = image + bmp.pixel_offset; // Skip the BMP headers
+    const char *end = image + len;
+    if ((size_t)(end - pixel) / 8 < magic_length)
+    {
+        return fail(err, STEGO_ERR_TRUNCATED);
+    }
+    decode_lsb_to_bytes(decoded, magic_length, pixel);
+    if (memcmp(decoded, magic, magic_length) != 0)
+    {
+        return fail(err, STEGO_ERR_MAGIC);
+    }
+
+    // Version 1 or 2 header, decoded straight from the buffer
+    MemoryReader reader = {pixel + magic_length * 8, end, 0};
+    if (stego_header_read(hdr, read_header_from_memory, &reader) == e_failure)
+    {
+        return fail(err, reader.truncated ? STEGO_ERR_TRUNCATED : STEGO_ERR_HEADER);
+    }
+    if (payload_offset != NULL)
+    {
+        *payload_offset = reader.pos - image;
+    }
+    return fail(err, STEGO_OK);
+}
+
+/*
+ * Function: stego_check_payload
+ * -------------------------------
+ * Checks the sizes of a decoded header before anything is extracted, in
+ * O(1): a header that claims more than the pixel array left after it can
+ * hold is corrupt, whatever the file size, and a valid one may still be
+ * in an image that was cut short.
+ *
+ * Parameters:
+ * --------------
+ *   - const BmpInfo *bmp: The parsed BMP headers of the image.
+ *   - const StegoHeader *hdr: The decoded header.
+ *   - uint64_t payload_offset: Where the payload region starts in the image.
+ *   - uint64_t image_len: Bytes the image really has, UINT64_MAX if unknown (a pipe).
+ *   - StegoError *err: STEGO_ERR_HEADER or STEGO_ERR_TRUNCATED on failure, may be NULL.
+ *
+ * Returns:
+ * -----------
+ *   - Status: e_success if the payload and its trailer are all there,
+ *             e_failure otherwise.
+ */
+Status stego_check_payload(const BmpInfo *bmp, const StegoHeader *hdr, uint64_t payload_offset, uint64_t image_len, StegoError *err)
+{
+    uint64_t used = payload_offset - bmp->pixel_offset; // Magic string and header
+
+    if (payload_offset < bmp->pixel_offset || used > bmp->pixel_bytes || stego_header_fits(hdr, bmp->pixel_bytes - used) == e_failure)
+    {
+        return fail(err, STEGO_ERR_HEADER);
+    }
+    if (image_len < payload_offset || stego_header_fits(hdr, image_len - payload_offset) == e_failure)
+    {
+        return fail(err, STEGO_ERR_TRUNCATED);
+    }
+    return fail(err, STEGO_OK);
+}
+
+/*
+ * Function: stego_decode_header
+ * -------------------------------
+ * stego_probe() on a whole stego image, plus a check that the image holds
+ * the whole payload (stego_check_payload).
+ *
+ * Parameters:
+ * --------------
+ *   - const char *stego, size_t stego_len: The stego BMP image.
+ *   - const StegoOptions *opts: Options (only magic is used), NULL for the defaults.
+ *   - StegoHeader *hdr: Filled with the decoded header.
+ *   - size_t *payload_offset: Offset of the payload region in stego, may be NULL.
+ *   - StegoError *err: Error code on failure, may be NULL.
+ *
+ * Returns:
+ * -----------
+ *   - Status: e_success if a valid header was found, e_failure otherwise.
+ */
+Status stego_decode_header(const char *stego, size_t stego_len, const StegoOptions *opts,
+                           StegoHeader *hdr, size_t *payload_offset, StegoError *err)
+{
+    size_t offset;
+
+    if (stego_probe(stego, stego_len, opts, hdr, &offset, err) == e_failure)
+    {
+        return e_failure;
+    }
+    BmpInfo bmp;
+    bmp_parse(stego, stego_len, &bmp); // Already validated by stego_probe
+    if (stego_check_payload(&bmp, hdr, offset, stego_len, err) == e_failure)
+    {
+        return e_failure;
+    }
+    if (payload_offset != NULL)
+    {
+        *payload_offset = offset;
+    }
+    return fail(err, STEGO_OK);
+}
+
+/*
+ * Function: extract_payload
+ * ---------------------------
+ * stego_decode() and stego_verify(): extracts the payload into out, or
+ * with verify set only checks it, and compares the CRC worked out on the
+ * way with the trailer of a STEGO_FLAG_CRC payload.
+ */
+static Status extract_payload(const char *stego, size_t stego_len, const StegoOptions *opts, char *out, size_t out_len,
+                              int verify, StegoHeader *hdr, StegoError *err)
+{
+    StegoHeader local;
+    size_t offset;
+    StegoStats *stats = option_stats(opts);
+
+    if (hdr == NULL)
+    {
+        hdr = &local;
+    }
+    if (STATS_STAGE(stats, STEGO_STAGE_HEADER, stego_decode_header(stego, stego_len, opts, hdr, &offset, err)) == e_failure)
+    {
+        return e_failure;
+    }
+    stats_add_bytes(stats, STEGO_STAGE_HEADER, offset, 0);
+    if ((hdr->flags & STEGO_FLAG_KEYED) != 0 && option_key(opts) == NULL)
+    {
+        return fail(err, STEGO_ERR_KEY);
+    }
+    if (verify)
+    {
+        if (!(hdr->flags & STEGO_FLAG_CRC))
+        {
+            return fail(err, STEGO_ERR_NO_CHECKSUM);
+        }
+        out = NULL; // Chunks decode through a buffer on the stack
+    }
+    else if (out_len < hdr->payload_size || (out == NULL && hdr->payload_size > 0))
+    {
+        return fail(err, STEGO_ERR_BUFFER);
+    }
+
+    PayloadCrc crc = {hdr->payload_size, 0};
+    PayloadCrc *check = hdr->flags & STEGO_FLAG_CRC ? &crc : NULL;
+    const char *region = stego + offset;
+    Status status;
+    uint32_t expected = 0;
+    stats_begin(stats);
+    if (hdr->flags & STEGO_FLAG_KEYED)
+    {
+        Scatter scatter;
+        BmpInfo bmp;
+        bmp_parse(stego, stego_len, &bmp); // Already validated by stego_decode_header
+        scatter_init(&scatter, option_key(opts), region_tiles(&bmp, stego_len, offset));
+        ScatterTask task = {out, (char *)region, hdr->bits, lsb_kernel(hdr->bits), &scatter, check, NULL, 0};
+        size_t per_tile = tile_payload(hdr->bits);
+        size_t grain = PARALLEL_GRAIN - PARALLEL_GRAIN % per_tile;
+        if (scatter_capacity(&scatter) < (stego_header_stream_size(hdr) + per_tile - 1) / per_tile)
+        {
+            stats_end(stats, STEGO_STAGE_EXTRACT, e_failure);
+            return fail(err, STEGO_ERR_TRUNCATED);
+        }
+        status = parallel_for(hdr->payload_size, grain, option_threads(opts), scatter_extract_chunk, &task);
+        expected = check != NULL ? read_trailer(hdr->payload_size, hdr->bits, region, &task) : 0;
+    }
+    else
+    {
+        ExtractTask task = {out, region, hdr->bits, lsb_kernel(hdr->bits), check};
+        size_t grain = PARALLEL_GRAIN - PARALLEL_GRAIN % hdr->bits; // Keep every chunk on an image byte boundary
+        status = parallel_for(hdr->payload_size, grain, option_threads(opts), extract_chunk, &task);
+        expected = check != NULL ? read_trailer(hdr->payload_size, hdr->bits, region, NULL) : 0;
+    }
+    if (stats_end(stats, STEGO_STAGE_EXTRACT, status) == e_failure)
+    {
+        return fail(err, STEGO_ERR_THREADS);
+    }
+    stats_add_bytes(stats, STEGO_STAGE_EXTRACT, lsb_image_bytes(stego_header_stream_size(hdr), hdr->bits), verify ? 0 : hdr->payload_size);
+    if (check != NULL && crc.crc != expected)
+    {
+        return fail(err, STEGO_ERR_CHECKSUM);
+    }
+    return fail(err, STEGO_OK);
+}
+
+/*
+ * Function: stego_decode
+ * ------------------------
+ * Extracts the payload of a stego image. The header can be read first with
+ * stego_decode_header() to size the output buffer. A keyed payload needs
+ * the key it was embedded with in opts->key. A payload with a CRC is
+ * checked in the same pass.
+ *
+ * Parameters:
+ * --------------
+ *   - const char *stego, size_t stego_len: The stego BMP image.
+ *   - const StegoOptions *opts: Options, NULL for the defaults.
+ *   - char *out, size_t out_len: Destination, at least the payload size.
+ *   - StegoHeader *hdr: Filled with the decoded header, may be NULL.
+ *   - StegoError *err: Error code on failure, may be NULL.
+ *
+ * Returns:
+ * -----------
+ *   - Status: e_success with hdr->payload_size bytes written to out,
+ *             e_failure otherwise (STEGO_ERR_CHECKSUM, with the bytes
+ *             written, if they do not match their CRC).
+ */
+Status stego_decode(const char *stego, size_t stego_len, const StegoOptions *opts,
+                    char *out, size_t out_len, StegoHeader *hdr, StegoError *err)
+{
+    return extract_payload(stego, stego_len, opts, out, out_len, 0, hdr, err);
+}
+
+/*
+ * Function: stego_verify
+ * ------------------------
+ * Checks the payload of a stego image against its CRC without storing it
+ * anywhere: every worker decodes through a small buffer on its stack.
+ *
+ * Returns:
+ * -----------
+ *   - Status: e_success if the payload matches its CRC, e_failure
+ *             otherwise (STEGO_ERR_CHECKSUM on a mismatch,
+ *             STEGO_ERR_NO_CHECKSUM if the payload has no CRC).
+ */
+Status stego_verify(const char *stego, size_t stego_len, const StegoOptions *opts, StegoHeader *hdr, StegoError *err)
+{
+    return extract_payload(stego, stego_len, opts, NULL, 0, 1, hdr, err);
+}
+
+/*
+ * Function: decode_group
+ * ------------------------
+ * Copies payload bytes [from, to) of one group of bits payload bytes (the
+ * 8 image bytes starting at a multiple of bits) to out. Only the bytes of
+ * the group that are part of the payload are decoded.
+ */
+static void decode_group(const char *pixel, const StegoHeader *hdr, uint64_t from, uint64_t to, char *out)
+{
+    char group[LSB_MAX_BITS];
+    uint64_t start = from - from % hdr->bits;
+    size_t n = hdr->payload_size - start < (uint64_t)hdr->bits ? (size_t)(hdr->payload_size - start) : (size_t)hdr->bits;
+
+    decode_lsb_bits_to_bytes(group, n, pixel + start / hdr->bits * 8, hdr->bits);
+    memcpy(out, group + (from - start), to - from);
+}
+
+/*
+ * Function: stego_decode_range
+ * ------------------------------
+ * Extracts one byte range of the payload. Payload byte i lives at a fixed
+ * place after the header (8 * i / bits image bytes in), so only the header
+ * and the image bytes of the range are read. With k > 1 bits per image
+ * byte, a range that does not start or end on a multiple of k bytes
+ * decodes the partial group at either end on its own; the aligned middle
+ * is split across opts->nthreads workers like stego_decode(). The CRC of
+ * a STEGO_FLAG_CRC payload covers all of it, so a range is not checked.
+ *
+ * Parameters:
+ * --------------
+ *   - const char *stego, size_t stego_len: The stego BMP image.
+ *   - const StegoOptions *opts: Options, NULL for the defaults.
+ *   - uint64_t offset, size_t len: The range, in payload bytes.
+ *   - char *out: Destination of len bytes.
+ *   - StegoHeader *hdr: Filled with the decoded header, may be NULL.
+ *   - StegoError *err: Error code on failure, may be NULL.
+ *
+ * Returns:
+ * -----------
+ *   - Status: e_success with len bytes written to out, e_failure otherwise
+ *             (STEGO_ERR_RANGE if the range is not inside the payload or
+ *             the payload is compressed, keyed or sealed).
+ */
+Status stego_decode_range(const char *stego, size_t stego_len, const StegoOptions *opts, uint64_t offset, size_t len,
+                          char *out, StegoHeader *hdr, StegoError *err)
+{
+    StegoHeader local;
+    size_t data_offset;
+    StegoStats *stats = option_stats(opts);
+
+    if (hdr == NULL)
+    {
+        hdr = &local;
+    }
+    if (STATS_STAGE(stats, STEGO_STAGE_HEADER, stego_decode_header(stego, stego_len, opts, hdr, &data_offset, err)) == e_failure)
+    {
+        return e_failure;
+    }
+    stats_add_bytes(stats, STEGO_STAGE_HEADER, data_offset, 0);
+    if ((hdr->flags & (STEGO_FLAG_LZ | STEGO_FLAG_KEYED | STEGO_FLAG_AEAD)) || offset > hdr->payload_size || len > hdr->payload_size - offset)
+    {
+        return fail(err, STEGO_ERR_RANGE);
+    }
+    if (out == NULL && len > 0)
+    {
+        return fail(err, STEGO_ERR_BUFFER);
+    }
+
+    const char *pixel = stego + data_offset;
+    uint64_t end = offset + len;
+    uint64_t first = (offset + hdr->bits - 1) / hdr->bits * hdr->bits; // First group boundary in the range
+    uint64_t last = end / hdr->bits * hdr->bits;                       // Last one
+    stats_begin(stats);
+    if (first >= last)
+    {
+        // No whole group: the range sits in one or two partial groups
+        uint64_t split = first < end ? first : end;
+        if (offset < split)
+        {
+            decode_group(pixel, hdr, offset, split, out);
+        }
+        if (split < end)
+        {
+            decode_group(pixel, hdr, split, end, out + (split - offset));
+        }
+    }
+    else
+    {
+        if (offset < first)
+        {
+            decode_group(pixel, hdr, offset, first, out);
+        }
+        ExtractTask task = {out + (first - offset), pixel + first / hdr->bits * 8, hdr->bits, lsb_kernel(hdr->bits), NULL};
+        size_t grain = PARALLEL_GRAIN - PARALLEL_GRAIN % hdr->bits;
+        if (parallel_for(last - first, grain, option_threads(opts), extract_chunk, &task) == e_failure)
+        {
+            stats_end(stats, STEGO_STAGE_EXTRACT, e_failure);
+            return fail(err, STEGO_ERR_THREADS);
+        }
+        if (last < end)
+        {
+            decode_group(pixel, hdr, last, end, out + (last - offset));
+        }
+    }
+    stats_end(stats, STEGO_STAGE_EXTRACT, e_success);
+    stats_add_bytes(stats, STEGO_STAGE_EXTRACT, lsb_image_bytes(end, hdr->bits) - offset * 8 / hdr->bits, len);
+    return fail(err, STEGO_OK);
+}
+
+const char *stego_strerror(StegoError err)
+{
+    switch (err)
+    {
+    case STEGO_OK:
+        return "Success";
+    case STEGO_ERR_ARGS:
+        return "Invalid argument";
+    case STEGO_ERR_NOT_BMP:
+        return "Not a supported BMP image (24 or 32 bits per pixel, uncompressed)";
+    case STEGO_ERR_CAPACITY:
+        return "Cover image does not have the capacity for the payload";
+    case STEGO_ERR_BUFFER:
+        return "Output buffer is too small";
+    case STEGO_ERR_MAGIC:
+        return "The decoded magic string does not match the input magic string";
+    case STEGO_ERR_HEADER:
+        return "Invalid or unsupported stego header";
+    case STEGO_ERR_TRUNCATED:
+        return "Stego image is truncated";
+    case STEGO_ERR_THREADS:
+        return "Unable to start the worker threads";
+    case STEGO_ERR_RANGE:
+        return "Byte range is outside the payload or the payload is compressed, keyed or sealed";
+    case STEGO_ERR_KEY:
+        return "The payload is keyed, a key is needed to decode it";
+    case STEGO_ERR_CHECKSUM:
+        return "Payload checksum mismatch, the stego image is damaged";
+    case STEGO_ERR_NO_CHECKSUM:
+        return "The payload carries no checksum";
+    }
+    return "Unknown error";
+}
@@ -0,0 +1,92 @@
+#ifndef STEGO_H
+#define STEGO_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "common.h"
+#include "types.h"
+#include "bmp.h"
+#include "stego_header.h"
+#include "stats.h"
+
+/*
+ * libstego
+ * --------
+ * In-memory encoding and decoding of whole BMP images. The caller owns
+ * every buffer and nothing is printed: a failure returns e_failure and, if
+ * err is not NULL, a StegoError telling what went wrong. Link stego.c,
+ * stego_header.c, lsb.c, bmp.c, stats.c, quality.c, scatter.c, crc32c.c
+ * and parallel.c (with -pthread) to use it without the command line tool. The
+ * tool's mapped mode (-m / -j) is built on it.
+ */
+
+/* Leading image bytes that hold the BMP headers and the largest magic string and header, all stego_probe() reads */
+#define STEGO_PROBE_SIZE (BMP_MAX_HEADER + (MAX_MAGIC_STRING + STEGO_MAX_HEADER) * 8)
+
+typedef enum
+{
+    STEGO_OK,
+    STEGO_ERR_ARGS,      // NULL buffer, extension or magic string too long, bits out of range
+    STEGO_ERR_NOT_BMP,   // Not a BMP image bmp_parse() accepts
+    STEGO_ERR_CAPACITY,  // Cover too small for the payload
+    STEGO_ERR_BUFFER,    // Output buffer too small
+    STEGO_ERR_MAGIC,     // Magic string not found
+    STEGO_ERR_HEADER,    // Corrupt header or unsupported features
+    STEGO_ERR_TRUNCATED, // Image ends inside the header or the payload
+    STEGO_ERR_THREADS,   // Workers for the payload region could not be started
+    STEGO_ERR_RANGE,     // Byte range outside the payload, or a compressed, keyed or sealed payload
+    STEGO_ERR_KEY,       // Keyed payload and no key given
+    STEGO_ERR_CHECKSUM,  // Payload does not match its CRC
+    STEGO_ERR_NO_CHECKSUM // stego_verify() on a payload without a CRC
+} StegoError;
+
+/* Encode / decode options, a NULL pointer means all defaults */
+typedef struct _StegoOptions
+{
+    const char *magic; // Signature written first, MAGIC_STRING when NULL
+    int bits;          // Payload bits per cover byte, 1 .. LSB_MAX_BITS, 0 means 1
+    int force_v2;      // Write the version 2 header even when version 1 would do
+    int nthreads;      // Workers for the payload region, 0 or 1 uses the calling thread only
+    StegoStats *stats; // Per-stage time and bytes are added here when not NULL
+    const StegoShard *shard; // Record the payload as this shard of a larger one, NULL for a whole payload
+    const char *key;   // Scatter the payload with this key (scatter.h), NULL for the sequential layout
+    int checksum;      // Embed a CRC32C of the payload after it (STEGO_FLAG_CRC)
+} StegoOptions;
+
+/* Pixel array bytes a cover needs to hold the header and payload of hdr behind magic */
+uint64_t stego_cover_bytes(const StegoHeader *hdr, const char *magic);
+
+/* Check that the cover can hold payload_len bytes, fills in the header that would be written */
+Status stego_check_capacity(const char *cover, size_t cover_len, uint64_t payload_len, const char *extn,
+                            const StegoOptions *opts, StegoHeader *hdr, StegoError *err);
+
+/* Write cover with the payload embedded to out (out_len >= cover_len, out may be cover) */
+Status stego_encode(const char *cover, size_t cover_len, const char *payload, size_t payload_len, const char *extn,
+                    const StegoOptions *opts, char *out, size_t out_len, StegoError *err);
+
+/* Check the magic string and read the header from the first STEGO_PROBE_SIZE (or len) bytes only */
+Status stego_probe(const char *image, size_t len, const StegoOptions *opts,
+                   StegoHeader *hdr, size_t *payload_offset, StegoError *err);
+
+/* Check the sizes of hdr against the pixel array (STEGO_ERR_HEADER) and an image of image_len bytes (STEGO_ERR_TRUNCATED) */
+Status stego_check_payload(const BmpInfo *bmp, const StegoHeader *hdr, uint64_t payload_offset, uint64_t image_len, StegoError *err);
+
+/* stego_probe() plus a check that the whole payload is present, *payload_offset is where it starts */
+Status stego_decode_header(const char *stego, size_t stego_len, const StegoOptions *opts,
+                           StegoHeader *hdr, size_t *payload_offset, StegoError *err);
+
+/* Extract the payload into out (out_len >= hdr->payload_size), hdr may be NULL. A STEGO_FLAG_LZ payload comes out as lz.h frames, a STEGO_FLAG_AEAD one sealed */
+Status stego_decode(const char *stego, size_t stego_len, const StegoOptions *opts,
+                    char *out, size_t out_len, StegoHeader *hdr, StegoError *err);
+
+/* Check a STEGO_FLAG_CRC payload against its CRC without writing it anywhere, hdr may be NULL */
+Status stego_verify(const char *stego, size_t stego_len, const StegoOptions *opts, StegoHeader *hdr, StegoError *err);
+
+/* Extract payload bytes [offset, offset + len) into out (len bytes) without touching the rest, hdr may be NULL */
+Status stego_decode_range(const char *stego, size_t stego_len, const StegoOptions *opts, uint64_t offset, size_t len,
+                          char *out, StegoHeader *hdr, StegoError *err);
+
+/* Description of an error code */
+const char *stego_strerror(StegoError err);
+
+#endif
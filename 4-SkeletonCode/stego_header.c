@@ -0,0 +1,362 @@
+#include <string.h>
+#include "stego_header.h"
+#include "lsb.h"
+#include "lz.h"
+
+static void put_be32(char *out, uint32_t v)
+{
+    out[0] = (char)(v >> 24);
+    out[1] = (char)(v >> 16);
+    out[2] = (char)(v >> 8);
+    out[3] = (char)v;
+}
+
+static void put_be64(char *out, uint64_t v)
+{
+    put_be32(out, (uint32_t)(v >> 32));
+    put_be32(out + 4, (uint32_t)v);
+}
+
+static uint32_t get_be32(const char *in)
+{
+    const unsigned char *p = (const unsigned char *)in;
+    return (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 | (uint32_t)p[2] << 8 | p[3];
+}
+
+static uint64_t get_be64(const char *in)
+{
+    return (uint64_t)get_be32(in) << 32 | get_be32(in + 4);
+}
+
+/*
+ * Function: stego_header_init
+ * -----------------------------
+ * Fills in the header describing a payload.
+ *
+ * Parameters:
+ * --------------
+ *   - StegoHeader *hdr: Header to fill in.
+ *   - const char *extn: Extension of the secret file, including the dot.
+ *   - uint64_t payload_size: Size of the secret data in bytes.
+ *   - int bits: Payload bits per image byte, anything but 1 needs version 2.
+ *   - int force_v2: Write version 2 even if version 1 could hold the payload.
+ *
+ * Returns:
+ * -----------
+ *   - Status: e_success, or e_failure if the extension is too long or bits
+ *             is out of range.
+ */
+Status stego_header_init(StegoHeader *hdr, const char *extn, uint64_t payload_size, int bits, int force_v2)
+{
+    memset(hdr, 0, sizeof(*hdr));
+    hdr->extn_size = strlen(extn);
+    if (hdr->extn_size > STEGO_MAX_EXTN)
+    {
+        return e_failure;
+    }
+    memcpy(hdr->extn, extn, hdr->extn_size + 1);
+    if (bits < 1 || bits > LSB_MAX_BITS)
+    {
+        return e_failure;
+    }
+    hdr->payload_size = payload_size;
+    hdr->raw_size = payload_size;
+    hdr->bits = bits;
+    hdr->flags = (uint32_t)(bits - 1);
+    hdr->version = (force_v2 || hdr->flags != 0 || payload_size > STEGO_V1_MAX_PAYLOAD) ? 2 : 1;
+    return e_success;
+}
+
+/*
+ * Function: stego_header_set_lz
+ * -------------------------------
+ * Records that the payload_size bytes of payload decompress to raw_size
+ * bytes. Only version 2 has the flag and the raw size field.
+ */
+void stego_header_set_lz(StegoHeader *hdr, uint64_t raw_size)
+{
+    hdr->flags |= STEGO_FLAG_LZ;
+    hdr->raw_size = raw_size;
+    hdr->version = 2;
+}
+
+/*
+ * Function: stego_header_set_shard
+ * ----------------------------------
+ * Records where the payload belongs in the larger one it was cut from.
+ */
+void stego_header_set_shard(StegoHeader *hdr, const StegoShard *shard)
+{
+    hdr->flags |= STEGO_FLAG_SHARD;
+    hdr->shard = *shard;
+    hdr->version = 2;
+}
+
+/*
+ * Function: stego_header_set_keyed
+ * ----------------------------------
+ * Records that the payload tiles are scattered. No extra field: the
+ * layout follows from the key and the size of the pixel array.
+ */
+void stego_header_set_keyed(StegoHeader *hdr)
+{
+    hdr->flags |= STEGO_FLAG_KEYED;
+    hdr->version = 2;
+}
+
+/*
+ * Function: stego_header_set_aead
+ * ---------------------------------
+ * Records that the payload is sealed. The nonce is part of the sealed
+ * payload, not of the header.
+ */
+void stego_header_set_aead(StegoHeader *hdr)
+{
+    hdr->flags |= STEGO_FLAG_AEAD;
+    hdr->version = 2;
+}
+
+/*
+ * Function: stego_header_set_crc
+ * --------------------------------
+ * Records that a CRC32C of the payload is embedded right after it.
+ */
+void stego_header_set_crc(StegoHeader *hdr)
+{
+    hdr->flags |= STEGO_FLAG_CRC;
+    hdr->version = 2;
+}
+
+uint64_t stego_header_stream_size(const StegoHeader *hdr)
+{
+    return hdr->payload_size + (hdr->flags & STEGO_FLAG_CRC ? STEGO_CRC_SIZE : 0);
+}
+
+/*
+ * Function: stego_header_fits
+ * -----------------------------
+ * Checks a decoded size against the image before anything is extracted:
+ * a header that claims more than the pixel array left after it can hold
+ * is corrupt, however many bytes the file really has.
+ *
+ * Returns:
+ * -----------
+ *   - Status: e_success if the payload and its trailer fit, e_failure otherwise.
+ */
+Status stego_header_fits(const StegoHeader *hdr, uint64_t image_bytes)
+{
+    return stego_header_stream_size(hdr) <= lsb_payload_capacity(image_bytes, hdr->bits) ? e_success : e_failure;
+}
+
+void stego_header_pack_crc(uint32_t crc, char *out)
+{
+    put_be32(out, crc);
+}
+
+uint32_t stego_header_unpack_crc(const char *in)
+{
+    return get_be32(in);
+}
+
+/*
+ * Function: stego_header_size
+ * -----------------------------
+ * Returns the number of header bytes that follow the magic string.
+ */
+size_t stego_header_size(const StegoHeader *hdr)
+{
+    if (hdr->version == 1)
+    {
+        return 4 + hdr->extn_size + 4;
+    }
+    return 4 + 4 + 4 + hdr->extn_size + 8 + (hdr->flags & STEGO_FLAG_LZ ? 8 : 0) + (hdr->flags & STEGO_FLAG_SHARD ? STEGO_SHARD_FIELDS : 0);
+}
+
+/*
+ * Function: stego_header_pack
+ * -----------------------------
+ * Serializes the magic string and the header into the byte string that
+ * gets embedded right after the BMP header.
+ *
+ * Parameters:
+ * --------------
+ *   - const StegoHeader *hdr: Header to serialize.
+ *   - const char *magic: Magic string written first.
+ *   - char *out: Destination, strlen(magic) + STEGO_MAX_HEADER bytes.
+ *
+ * Returns:
+ * -----------
+ *   - size_t: Number of bytes written to out.
+ */
+size_t stego_header_pack(const StegoHeader *hdr, const char *magic, char *out)
+{
+    size_t pos = strlen(magic);
+
+    memcpy(out, magic, pos);
+    if (hdr->version == 2)
+    {
+        put_be32(out + pos, STEGO_V2_MARKER);
+        put_be32(out + pos + 4, hdr->flags);
+        pos += 8;
+    }
+    put_be32(out + pos, hdr->extn_size);
+    pos += 4;
+    memcpy(out + pos, hdr->extn, hdr->extn_size);
+    pos += hdr->extn_size;
+    if (hdr->version == 2)
+    {
+        put_be64(out + pos, hdr->payload_size);
+        pos += 8;
+        if (hdr->flags & STEGO_FLAG_LZ)
+        {
+            put_be64(out + pos, hdr->raw_size);
+            pos += 8;
+        }
+        if (hdr->flags & STEGO_FLAG_SHARD)
+        {
+            put_be32(out + pos, hdr->shard.index);
+            put_be32(out + pos + 4, hdr->shard.count);
+            put_be64(out + pos + 8, hdr->shard.payload_id);
+            put_be64(out + pos + 16, hdr->shard.offset);
+            pos += STEGO_SHARD_FIELDS;
+        }
+    }
+    else
+    {
+        put_be32(out + pos, (uint32_t)hdr->payload_size);
+        pos += 4;
+    }
+    return pos;
+}
+
+/*
+ * Function: stego_header_read_extn_size
+ * ---------------------------------------
+ * Reads the word after the magic string. A version 1 header stores the
+ * extension size there; the version 2 marker is followed by the flags and
+ * then the extension size.
+ *
+ * Returns:
+ * -----------
+ *   - Status: e_success, or e_failure on a read error or an extension size
+ *             no valid header can have.
+ */
+Status stego_header_read_extn_size(StegoHeader *hdr, header_read_fn read, void *ctx)
+{
+    char word[4];
+
+    memset(hdr, 0, sizeof(*hdr));
+    if (read(ctx, word, 4) == e_failure)
+    {
+        return e_failure;
+    }
+    hdr->version = 1;
+    hdr->bits = 1;
+    if (get_be32(word) == STEGO_V2_MARKER)
+    {
+        char fields[8];
+        if (read(ctx, fields, 8) == e_failure)
+        {
+            return e_failure;
+        }
+        hdr->version = 2;
+        hdr->flags = get_be32(fields);
+        if (hdr->flags & ~STEGO_KNOWN_FLAGS)
+        {
+            return e_failure;
+        }
+        hdr->bits = (hdr->flags & STEGO_FLAG_BITS_MASK) + 1;
+        memcpy(word, fields + 4, 4);
+    }
+
+    hdr->extn_size = get_be32(word);
+    if (hdr->extn_size > STEGO_MAX_EXTN)
+    {
+        return e_failure;
+    }
+    return e_success;
+}
+
+/*
+ * Function: stego_header_read_extn
+ * ----------------------------------
+ * Reads the extension, whose size was read by stego_header_read_extn_size.
+ * It is appended to the output file name, so one with a '/' (which would
+ * put the output in another directory) or a NUL is rejected.
+ */
+Status stego_header_read_extn(StegoHeader *hdr, header_read_fn read, void *ctx)
+{
+    if (read(ctx, hdr->extn, hdr->extn_size) == e_failure)
+    {
+        return e_failure;
+    }
+    hdr->extn[hdr->extn_size] = '\0';
+    if (strlen(hdr->extn) != hdr->extn_size || strchr(hdr->extn, '/') != NULL)
+    {
+        return e_failure;
+    }
+    return e_success;
+}
+
+/*
+ * Function: stego_header_read_size
+ * ----------------------------------
+ * Reads the payload size: 32 bits in version 1, 64 bits in version 2,
+ * followed by the 64-bit raw size of a compressed payload and the shard
+ * fields of a shard.
+ */
+Status stego_header_read_size(StegoHeader *hdr, header_read_fn read, void *ctx)
+{
+    char size[16 + STEGO_SHARD_FIELDS];
+    int lz = (hdr->flags & STEGO_FLAG_LZ) != 0;
+    int shard = (hdr->flags & STEGO_FLAG_SHARD) != 0;
+
+    if (read(ctx, size, hdr->version == 2 ? 8 + lz * 8 + shard * STEGO_SHARD_FIELDS : 4) == e_failure)
+    {
+        return e_failure;
+    }
+    hdr->payload_size = hdr->version == 2 ? get_be64(size) : get_be32(size);
+    hdr->raw_size = lz ? get_be64(size + 8) : hdr->payload_size;
+    if (hdr->version == 1 && hdr->payload_size > STEGO_V1_MAX_PAYLOAD) // Was a negative int in version 1
+    {
+        return e_failure;
+    }
+    // Every frame has a length word and holds at most LZ_BLOCK_SIZE bytes, so no output is sized from a raw size the frames cannot reach
+    if (lz && hdr->raw_size / LZ_BLOCK_SIZE + (hdr->raw_size % LZ_BLOCK_SIZE != 0) > hdr->payload_size / 4)
+    {
+        return e_failure;
+    }
+    if ((hdr->flags & STEGO_FLAG_CRC) && hdr->payload_size > UINT64_MAX - STEGO_CRC_SIZE)
+    {
+        return e_failure;
+    }
+    if (shard)
+    {
+        const char *fields = size + 8 + lz * 8;
+        hdr->shard.index = get_be32(fields);
+        hdr->shard.count = get_be32(fields + 4);
+        hdr->shard.payload_id = get_be64(fields + 8);
+        hdr->shard.offset = get_be64(fields + 16);
+        if (hdr->shard.index >= hdr->shard.count)
+        {
+            return e_failure;
+        }
+    }
+    return e_success;
+}
+
+/*
+ * Function: stego_header_read
+ * -----------------------------
+ * Reads the whole header that follows the magic string.
+ */
+Status stego_header_read(StegoHeader *hdr, header_read_fn read, void *ctx)
+{
+    if (stego_header_read_extn_size(hdr, read, ctx) == e_failure ||
+        stego_header_read_extn(hdr, read, ctx) == e_failure ||
+        stego_header_read_size(hdr, read, ctx) == e_failure)
+    {
+        return e_failure;
+    }
+    return e_success;
+}
@@ -0,0 +1,142 @@
+#ifndef STEGO_HEADER_H
+#define STEGO_HEADER_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "types.h"
+
+/*
+ * Layout of the data hidden after the BMP header
+ * ----------------------------------------------
+ * Every field is embedded 1 bit per image byte, most significant bit first,
+ * so the header is simply a byte string:
+ *
+ *   Version 1 (original):  magic | extn size (4) | extn | payload size (4)
+ *   Version 2 (64-bit):    magic | marker (4) | flags (4) | extn size (4) | extn
+ *                          | payload size (8) [| raw size (8)] [| shard (24)]
+ *
+ * The version 1 extension size is a small positive number, the version 2
+ * marker has the top bit set, which is how a decoder tells them apart.
+ * Version 2 is written when the payload does not fit the 31-bit size field
+ * of version 1, when a feature needs a flag, or when asked for with --v2.
+ *
+ * The header itself always uses 1 bit per image byte. The payload uses the
+ * number of bits per image byte recorded in the flags (--bits k).
+ *
+ * With STEGO_FLAG_LZ the payload is the compressed frame stream of lz.h,
+ * payload size counts the embedded (compressed) bytes and the raw size
+ * field that follows it the size of the secret once decompressed.
+ *
+ * With STEGO_FLAG_SHARD the image carries one slice of a payload split
+ * across several covers: shard index (4) | shard count (4) | payload id (8)
+ * | offset of the slice in the payload (8).
+ *
+ * With STEGO_FLAG_KEYED the payload is not stored right after the header
+ * but scattered over the rest of the pixel array in tiles (scatter.h). The
+ * key is not stored, the flag only tells a decoder that it needs one.
+ *
+ * With STEGO_FLAG_CRC the payload is followed by a CRC32C (4, crc32c.h) of
+ * the payload bytes as embedded, at the payload's bits per image byte and
+ * in the same layout, as if the payload were 4 bytes longer. It goes last
+ * so an encoder can compute it in the embedding pass and a decoder check
+ * it in the extraction pass.
+ *
+ * With STEGO_FLAG_AEAD the payload is the secret sealed with
+ * ChaCha20-Poly1305 in segments (aead.h), after compression with
+ * STEGO_FLAG_LZ. Payload size counts the sealed bytes, a CRC covers them
+ * as embedded. The key is not stored.
+ */
+
+#define STEGO_V2_MARKER 0x80000002u // Top bit set: never a valid version 1 extension size
+#define STEGO_MAX_EXTN 4             // Longest extension, including the dot
+#define STEGO_V1_MAX_PAYLOAD 0x7FFFFFFFull
+#define STEGO_SHARD_FIELDS (4 + 4 + 8 + 8)
+#define STEGO_CRC_SIZE 4 // Trailer after the payload
+#define STEGO_MAX_HEADER (4 + 4 + 4 + STEGO_MAX_EXTN + 8 + 8 + STEGO_SHARD_FIELDS) // Longest header after the magic string
+
+/* Version 2 flags */
+#define STEGO_FLAG_BITS_MASK 0x3u // Payload bits per image byte minus one
+#define STEGO_FLAG_LZ 0x4u        // Payload is compressed (lz.h), the raw size follows the payload size
+#define STEGO_FLAG_SHARD 0x8u     // Payload is one shard of a larger one, the shard fields follow
+#define STEGO_FLAG_KEYED 0x10u    // Payload tiles are scattered with a key (scatter.h)
+#define STEGO_FLAG_CRC 0x20u      // A CRC32C of the payload follows it
+#define STEGO_FLAG_AEAD 0x40u     // Payload is sealed (aead.h)
+#define STEGO_KNOWN_FLAGS (STEGO_FLAG_BITS_MASK | STEGO_FLAG_LZ | STEGO_FLAG_SHARD | STEGO_FLAG_KEYED | STEGO_FLAG_CRC | STEGO_FLAG_AEAD)
+
+/* Where a shard belongs in the payload it was cut from */
+typedef struct _StegoShard
+{
+    uint32_t index;      // 0 .. count - 1
+    uint32_t count;      // Shards the payload was split into
+    uint64_t payload_id; // Same in every shard of one payload
+    uint64_t offset;     // Offset of this shard's bytes in the payload
+} StegoShard;
+
+/* Decoded header fields */
+typedef struct _StegoHeader
+{
+    int version;                    // 1 or 2
+    uint32_t flags;                 // Version 2 feature flags, 0 for version 1
+    uint32_t extn_size;             // Length of the extension
+    char extn[STEGO_MAX_EXTN + 1];  // Extension of the secret file, NUL terminated
+    uint64_t payload_size;          // Size of the secret data in bytes, as embedded
+    uint64_t raw_size;              // Size once decompressed, payload_size without STEGO_FLAG_LZ
+    int bits;                       // Payload bits per image byte, from the flags
+    StegoShard shard;               // With STEGO_FLAG_SHARD only
+} StegoHeader;
+
+/*
+ * None of these functions print anything, a failure is reported to the
+ * caller only. Readers may print their own I/O errors.
+ */
+
+/* Decode the next n header bytes into data, wherever they are stored */
+typedef Status (*header_read_fn)(void *ctx, char *data, size_t n);
+
+/* Fill in a header for a payload, picking the oldest version that can describe it */
+Status stego_header_init(StegoHeader *hdr, const char *extn, uint64_t payload_size, int bits, int force_v2);
+
+/* Mark the payload as compressed from raw_size bytes, switches to version 2 */
+void stego_header_set_lz(StegoHeader *hdr, uint64_t raw_size);
+
+/* Mark the payload as one shard of a larger one, switches to version 2 */
+void stego_header_set_shard(StegoHeader *hdr, const StegoShard *shard);
+
+/* Mark the payload as scattered with a key, switches to version 2 */
+void stego_header_set_keyed(StegoHeader *hdr);
+
+/* Mark the payload as sealed, switches to version 2 */
+void stego_header_set_aead(StegoHeader *hdr);
+
+/* Append a CRC32C trailer to the payload, switches to version 2 */
+void stego_header_set_crc(StegoHeader *hdr);
+
+/* Bytes embedded after the header: the payload and its trailer, if any */
+uint64_t stego_header_stream_size(const StegoHeader *hdr);
+
+/* Check that the bytes embedded after a decoded header fit in the image_bytes image bytes that follow it */
+Status stego_header_fits(const StegoHeader *hdr, uint64_t image_bytes);
+
+/* Serialize / parse the STEGO_CRC_SIZE trailer bytes */
+void stego_header_pack_crc(uint32_t crc, char *out);
+uint32_t stego_header_unpack_crc(const char *in);
+
+/* Number of header bytes after the magic string */
+size_t stego_header_size(const StegoHeader *hdr);
+
+/* Serialize magic + header into out (at least strlen(magic) + STEGO_MAX_HEADER bytes), returns the length */
+size_t stego_header_pack(const StegoHeader *hdr, const char *magic, char *out);
+
+/* Read the version marker / flags and the extension size */
+Status stego_header_read_extn_size(StegoHeader *hdr, header_read_fn read, void *ctx);
+
+/* Read the extension */
+Status stego_header_read_extn(StegoHeader *hdr, header_read_fn read, void *ctx);
+
+/* Read the payload size */
+Status stego_header_read_size(StegoHeader *hdr, header_read_fn read, void *ctx);
+
+/* Read everything after the magic string */
+Status stego_header_read(StegoHeader *hdr, header_read_fn read, void *ctx);
+
+#endif
@@ -1,15 +1,26 @@
 #include <stdio.h>
-#include <string.h>
+#include "common.h"
 #include "encode.h"
 #include "decode.h"
-#include "decode.h"
+#include "batch.h"
+#include "probe.h"
+#include "shard.h"
+#include "spool.h"
+#include "cover_index.h"
 #include "types.h"
 
 int main(int argc, char *argv[])
 {
-     // Structs for encoding and decoding information
+     // Structs for encoding and decoding information, with their block buffers
     EncodeInfo encInfo;
     DecodeInfo decInfo;
+    _Alignas(ARENA_ALIGN) static char encode_arena[ENCODE_ARENA_SIZE(MAX_SECRET_BUF_SIZE)];
+    _Alignas(ARENA_ALIGN) static char decode_arena[DECODE_ARENA_SIZE(MAX_DECODE_BUF_SIZE)];
+    if (encode_info_init(&encInfo, encode_arena, sizeof(encode_arena), MAX_SECRET_BUF_SIZE) == e_failure ||
+        decode_info_init(&decInfo, decode_arena, sizeof(decode_arena), MAX_DECODE_BUF_SIZE) == e_failure)
+    {
+        return e_failure;
+    }
     if (argc > 1) // Check if command line arguments are provided
     {
          // Determine the operation type based on the first argument
@@ -21,7 +32,13 @@ int main(int argc, char *argv[])
                 return e_failure;
             }
              // Perform the encoding operation
-            do_encoding(&encInfo);
+            Status status = do_encoding(&encInfo);
+            close_files(&encInfo);
+            if (encInfo.show_stats)
+            {
+                stats_print_json(&encInfo.stats, "encode", status, stderr);
+            }
+            return status;
         }
         else if (check_operation_type(argv[1]) == e_decode)
         {
@@ -31,7 +48,43 @@ int main(int argc, char *argv[])
                 return e_failure;
             }
             // Perform the decoding operation
-            do_decoding(&decInfo);
+            Status status = do_decoding(&decInfo);
+            close_files_for_decode(&decInfo);
+            if (decInfo.show_stats)
+            {
+                stats_print_json(&decInfo.stats, "decode", status, stderr);
+            }
+            return status; // With --verify the exit status is its verdict
+        }
+        else if (check_operation_type(argv[1]) == e_batch)
+        {
+            // Run every job of the manifest
+            return do_batch(argc, argv);
+        }
+        else if (check_operation_type(argv[1]) == e_probe)
+        {
+            // Report which images carry a payload, reading only their headers
+            return do_probe(argc, argv);
+        }
+        else if (check_operation_type(argv[1]) == e_shard_encode)
+        {
+            // Split the secret across several covers
+            return do_shard_encode(argc, argv);
+        }
+        else if (check_operation_type(argv[1]) == e_shard_decode)
+        {
+            // Put a payload back together from its shards
+            return do_shard_decode(argc, argv);
+        }
+        else if (check_operation_type(argv[1]) == e_spool)
+        {
+            // Serve the job files dropped into a spool directory
+            return do_spool(argc, argv);
+        }
+        else if (check_operation_type(argv[1]) == e_index)
+        {
+            // Index a cover library by capacity for --cover-index
+            return do_index_build(argc, argv);
         }
         else
         {
@@ -40,38 +93,38 @@ int main(int argc, char *argv[])
     }
     else
     {
-        printf("Encoding: ./lsb_steg -e <.bmp file> <.txt file> [output file]\n");
-        printf("Decoding: ./lsb_steg -d <.bmp file> [output file]\n");
+        printf(ENCODE_USAGE);
+        printf(DECODE_USAGE);
+        printf(BATCH_USAGE);
+        printf(PROBE_USAGE);
+        printf(SHARD_USAGE);
+        printf(SPOOL_USAGE);
+        printf(COVER_INDEX_USAGE);
+        printf("Options:\n");
+        printf("  -m, --mmap    Memory map the files instead of using stdio\n");
+        printf("  -i, --in-place Encode: clone the cover and rewrite only the payload region,\n");
+        printf("                the cover itself is patched when it is also the output\n");
+        printf("  -j, --jobs N  Split the payload across N threads (implies -m),\n");
+        printf("                in batch, probe and shard mode run N jobs at a time, in spool mode start N workers\n");
+        printf("  -k, --key K   Encode and decode: scatter the payload over the whole image with key K (implies -m)\n");
+        printf("  -s, --magic S Decode, probe and shard decode: expect magic string S instead of prompting\n");
+        printf("  -a, --auto    Decode: expect the built-in magic string, no prompt\n");
+        printf("  -x, --extn E  Encode: extension to record for the secret (default %s for stdin)\n", DEFAULT_STREAM_EXTN);
+        printf("  --secret-size N  Encode: size of a secret streamed on stdin, avoids buffering it\n");
+        printf("  --bits k      Encode: hide k (1-4) payload bits in every cover byte, k > 1 needs 8/k times less cover\n");
+        printf("  --v2          Encode: write the 64-bit header even when the payload is small\n");
+        printf("  -z, --compress Encode: compress the secret before hiding it, decoding decompresses it\n");
+        printf("  --range O:L   Decode: extract only payload bytes O .. O+L-1, reading just their image bytes\n");
+        printf("  --checksum    Encode and shard encode: add a CRC32C of the payload, checked when it is decoded\n");
+        printf("  --verify      Decode: check the payload against its checksum without writing it\n");
+        printf("  --encrypt     Encode: seal the secret with ChaCha20-Poly1305 as it is embedded, decoding opens it\n");
+        printf("  --key-file F  Encode and decode: key of --encrypt, 32 bytes or 64 hex digits (default $%s)\n", AEAD_KEY_ENV);
+        printf("  --queue N     Spool: job files queued for the workers before the watcher waits (default %d)\n", SPOOL_DEFAULT_QUEUE);
+        printf("  --cover-index F Encode: pick the smallest cover of index F (see --index-build) that holds the secret\n");
+        printf("  --stats       Time every stage and print its bytes and system calls as JSON on stderr,\n");
+        printf("                an encode adds PSNR / MSE, flipped bits and histogram deltas per channel\n");
+        printf("  A file name of - reads the image or secret from stdin, or writes to stdout\n");
     }
 
     return 0;
 }
-
-/* 
- * Function:
- * ------------
- *           check_operation_type
- *           it  Determines the operation type based on the command line argument
- * Parameters:
- * -------------
- *           command line argument as input for encode '-e' and for decode '-d'
- * Returns:
- * ------------
- *          returns e_encode for '-e', e_decode for '-d', and e_unsupported for invalid input
- */
-OperationType check_operation_type(char *argv)
-{
-    // Compare the input argument with the expected operation types
-    if (strcmp(argv, "-e") == 0)
-    {
-        return e_encode;// Return e_encode for encoding operation
-    }
-    else if (strcmp(argv, "-d") == 0)
-    {
-        return e_decode;// Return e_decode for decoding operation
-    }
-    else
-    {
-        return e_unsupported;// Return e_unsupported for invalid input
-    }
-}
@@ -1,6 +1,8 @@
 #ifndef TYPES_H
 #define TYPES_H
 
+#include <stdint.h>
+
 /* User defined types */
 typedef unsigned int uint;
 
@@ -15,6 +17,12 @@ typedef enum
 {
     e_encode,
     e_decode,
+    e_batch,
+    e_probe,
+    e_shard_encode,
+    e_shard_decode,
+    e_spool,
+    e_index,
     e_unsupported
 } OperationType;
 